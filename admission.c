@@ -0,0 +1,183 @@
+#include "admission.h"
+#include "config.h"
+#include "document.h"
+#include "header.h"
+#include "response.h"
+#include "settings.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static atomic_int active_connections = 0;
+static atomic_ulong shed_connections = 0;
+static atomic_ulong dropped_connections = 0;
+static atomic_ulong shed_requests = 0;
+static int inflight_requests = 0;
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_cond;
+static unsigned char *unavailable_response = NULL;
+static size_t unavailable_size = 0;
+
+/**
+ * @brief Prepares the responses used to shed load.
+ *
+ * The `503 Service Unavailable` response is serialized once at startup, so
+ * turning a client away under overload costs a single `write` and no
+ * allocation. It carries a `retry-after` of RETRY_AFTER seconds and closes the
+ * connection. It has no `date` header, since a preserialized date would be
+ * stale. Requests wait for a slot on CLOCK_MONOTONIC, so a jump of the wall
+ * clock neither sheds them early nor keeps them queued.
+ *
+ * @return 0 on success, or -1 if the response could not be built.
+ */
+int init_admission() {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&inflight_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  document_t *document = create_response(SERVICE_UNAVAILABLE, NULL);
+  if (!document) {
+    return -1;
+  }
+  set_header_item(document->header, "connection", "close");
+  set_header_item(document->header, "retry-after", RETRY_AFTER);
+  remove_header_item(document->header, "keep-alive");
+  remove_header_item(document->header, "date");
+  unavailable_response = serialize_document(document, &unavailable_size);
+  destroy_document(document);
+  return unavailable_response ? 0 : -1;
+}
+
+/**
+ * @brief Writes the admission counters.
+ *
+ * @param out The stream to write to.
+ */
+void write_admission_stats(FILE *out) {
+  pthread_mutex_lock(&inflight_lock);
+  int inflight = inflight_requests;
+  pthread_mutex_unlock(&inflight_lock);
+  fprintf(out, "connections_active %d\n", atomic_load(&active_connections));
+  fprintf(out, "connections_shed %lu\n", atomic_load(&shed_connections));
+  fprintf(out, "connections_dropped %lu\n",
+          atomic_load(&dropped_connections));
+  fprintf(out, "requests_inflight %d\n", inflight);
+  fprintf(out, "requests_shed %lu\n", atomic_load(&shed_requests));
+}
+
+/**
+ * @brief Decides whether a newly accepted connection may be served.
+ *
+ * Up to `max_connections` connections are served concurrently. Beyond that
+ * the client is sent the preserialized `503` straight from the accept loop and
+ * the socket is closed without starting a thread. Beyond
+ * `hard_max_connections` the socket is closed without writing anything. An
+ * admitted connection must be given back with release_connection() once it is
+ * closed.
+ *
+ * @param connfd The accepted socket file descriptor.
+ * @return True if the connection was admitted, false if it was turned away and
+ * closed.
+ */
+bool admit_connection(int connfd) {
+  const settings_t *settings = get_settings();
+  int active = atomic_fetch_add(&active_connections, 1) + 1;
+  if (active <= settings->max_connections) {
+    return true;
+  }
+  atomic_fetch_sub(&active_connections, 1);
+  if (active <= settings->hard_max_connections) {
+    atomic_fetch_add(&shed_connections, 1);
+    if (write(connfd, unavailable_response, unavailable_size) < 0) {
+      perror("write");
+    }
+  } else {
+    atomic_fetch_add(&dropped_connections, 1);
+  }
+  close(connfd);
+  return false;
+}
+
+/**
+ * @brief Gives back the slot of a closed connection.
+ */
+void release_connection() { atomic_fetch_sub(&active_connections, 1); }
+
+/**
+ * @brief Returns the number of connections currently open.
+ */
+int count_connections() { return atomic_load(&active_connections); }
+
+/**
+ * @brief Waits for one of the `max_inflight_requests` request slots.
+ *
+ * A request that cannot get a slot within `max_queue_ms` milliseconds of
+ * `queued_at` is shed instead of served late, so that under overload the
+ * latency of the requests that are served stays bounded. A request that
+ * already waited that long before getting here is shed right away.
+ *
+ * @param queued_at The time the request was read, on CLOCK_MONOTONIC.
+ * @return True if a slot was acquired, false if the request should be shed.
+ */
+bool acquire_request_slot(const struct timespec *queued_at) {
+  const settings_t *settings = get_settings();
+  struct timespec deadline = *queued_at;
+  deadline.tv_sec += settings->max_queue_ms / 1000;
+  deadline.tv_nsec += (settings->max_queue_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_nsec -= 1000000000L;
+    deadline.tv_sec++;
+  }
+  bool acquired = true;
+  pthread_mutex_lock(&inflight_lock);
+  while (inflight_requests >= settings->max_inflight_requests) {
+    if (pthread_cond_timedwait(&inflight_cond, &inflight_lock, &deadline) !=
+        0) {
+      acquired = inflight_requests < settings->max_inflight_requests;
+      break;
+    }
+  }
+  if (acquired) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    acquired =
+        now.tv_sec < deadline.tv_sec ||
+        (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec);
+  }
+  if (acquired) {
+    inflight_requests++;
+  }
+  pthread_mutex_unlock(&inflight_lock);
+  if (!acquired) {
+    atomic_fetch_add(&shed_requests, 1);
+  }
+  return acquired;
+}
+
+/**
+ * @brief Gives back a request slot and wakes up one waiting request.
+ */
+void release_request_slot() {
+  pthread_mutex_lock(&inflight_lock);
+  inflight_requests--;
+  pthread_cond_signal(&inflight_cond);
+  pthread_mutex_unlock(&inflight_lock);
+}
+
+/**
+ * @brief Sends the preserialized `503 Service Unavailable` on a connection.
+ *
+ * The response closes the connection, so the connection is marked as not
+ * reusable.
+ *
+ * @param conn The connection to send the response on.
+ * @return 0 on success, or -1 on error.
+ */
+int send_unavailable(connection_t *conn) {
+  conn->keep_alive = false;
+  return write_to_conn(conn, unavailable_response, unavailable_size);
+}
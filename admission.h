@@ -0,0 +1,16 @@
+#ifndef ADMISSION
+#define ADMISSION
+#include "connection.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+int init_admission();
+bool admit_connection(int connfd);
+void release_connection();
+int count_connections();
+bool acquire_request_slot(const struct timespec *queued_at);
+void release_request_slot();
+int send_unavailable(connection_t *conn);
+void write_admission_stats(FILE *out);
+#endif // !ADMISSION
@@ -1,20 +1,31 @@
 #include "body.h"
+#include "bundle.h"
+#include "cache.h"
+#include "capture.h"
 #include "config.h"
+#include "header.h"
+#include "html.h"
+#include "iopool.h"
 #include "response.h"
+#include "shmcache.h"
+#include "slab.h"
 #include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /**
  * @brief Parses a raw HTTP body into an internal representation.
  *
  * This function takes in a raw HTTP body and parses it into the internal
  * representation of the body, which is a struct containing the data and size
- * of the body. The memory for the body is allocated using malloc() and should
- * be freed by the caller using free(). If there is an error parsing the body,
- * this function returns NULL.
+ * of the body. The body should be freed by the caller using destroy_body(). If
+ * there is an error parsing the body, this function returns NULL.
  *
  * @param raw_body Pointer to the raw HTTP body.
  * @param size Size of the raw HTTP body in bytes.
@@ -22,58 +33,224 @@
  * there was an error parsing the body.
  */
 body_t *parse_body(unsigned char *raw_body, size_t size) {
-  body_t *body = malloc(sizeof(body_t));
+  body_t *body = allocate_object(SLAB_BODY);
   if (body == NULL) {
     return NULL;
   }
   body->data = malloc(size + 1);
   if (body->data == NULL) {
-    free(body);
+    free_object(SLAB_BODY, body);
     return NULL;
   }
   body->size = size;
+  body->fd = -1;
+  body->mapped = false;
+  body->mtime = 0;
+  body->shared = NULL;
+  body->bundle = NULL;
   memcpy(body->data, raw_body, body->size);
   return body;
 }
 
+typedef struct file_probe {
+  bool open_file;
+  size_t stream_threshold;
+  int fd;
+  struct stat st;
+  int error;
+  char path[];
+} file_probe_t;
+
+static void run_probe(void *arg) {
+  file_probe_t *probe = arg;
+  int result;
+  if (probe->open_file) {
+    probe->fd = open(probe->path, O_RDONLY | O_CLOEXEC);
+    result = probe->fd < 0 ? -1 : fstat(probe->fd, &probe->st);
+  } else {
+    result = stat(probe->path, &probe->st);
+  }
+  probe->error = result < 0 ? errno : S_ISREG(probe->st.st_mode) ? 0 : EISDIR;
+  bool streamed = probe->error == 0 &&
+                  (size_t)probe->st.st_size > probe->stream_threshold;
+  if (probe->fd >= 0 && !streamed) {
+    close(probe->fd);
+    probe->fd = -1;
+  } else if (probe->fd >= 0) {
+    posix_fadvise(probe->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(probe->fd, 0, STREAM_READAHEAD, POSIX_FADV_WILLNEED);
+  }
+}
+
+static void discard_probe(void *arg) {
+  file_probe_t *probe = arg;
+  if (probe->fd >= 0) {
+    close(probe->fd);
+  }
+  free(probe);
+}
+
 /**
- * @brief Creates a new body object from the given target.
+ * @brief Stats a file, or opens it if it is to be streamed, on the I/O pool.
  *
- * This function creates a new body object from the given target, which can be
-either a file path or a string. If th the target is a file path, the function
-will read the contents of the file and return it as a body object. If the ta
-target is a string, the function will simply copy the string into a new body
-object.
+ * The connection thread waits for it at most `io_timeout`, as it does for the
+ * read of a cache miss, so a stalled disk cannot hold it in `open` or `stat`.
+ *
+ * @param path The path of the file.
+ * @param open_file Whether to open the file. Only a file larger than
+ * `stream_threshold` is kept open, and `fd` is set to -1 for the others.
+ * @param fd Receives the open file descriptor. May be NULL without
+ * `open_file`.
+ * @param st Receives the status of the file.
+ * @return 0 on success, or -1 with `errno` set to ETIMEDOUT or EAGAIN if the
+ * pool did not get to it in time, or to why the path is not a regular file.
+ */
+static int probe_file(const char *path, bool open_file, int *fd,
+                      struct stat *st) {
+  file_probe_t *probe = malloc(sizeof(file_probe_t) + strlen(path) + 1);
+  if (!probe) {
+    return -1;
+  }
+  probe->open_file = open_file;
+  probe->stream_threshold = get_settings()->stream_threshold;
+  probe->fd = -1;
+  strcpy(probe->path, path);
+  if (!call_io(run_probe, discard_probe, probe)) {
+    return -1;
+  }
+  int error = probe->error;
+  if (fd) {
+    *fd = probe->fd;
+  }
+  *st = probe->st;
+  free(probe);
+  errno = error;
+  return error ? -1 : 0;
+}
+
+/**
+ * @brief Opens the file at a target as a body, with or without its contents.
  *
- * @param target The target to create a body from. Can be either a file path or
-a string.
- * @return A new body object containing the contents of the given target.
+ * Without `with_data` a copy out of the shared cache leaves the contents out,
+ * and the body never has data.
  */
-body_t *create_body(const char *target) {
-  body_t *body = malloc(sizeof(body_t));
+static body_t *open_body(const char *target, bool with_data) {
+  char *path = resolve_file_path(target);
+  if (!path) {
+    return NULL;
+  }
+  int fd;
+  struct stat st;
+  if (probe_file(path, true, &fd, &st) < 0) {
+    int error = errno;
+    free(path);
+    errno = error;
+    return NULL;
+  }
+  body_t *body = allocate_object(SLAB_BODY);
   if (!body) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(path);
     return NULL;
   }
-  unsigned char *data = fetch_body((char *)target);
-  if (!data) {
+  body->fd = -1;
+  body->data = NULL;
+  body->mapped = false;
+  body->size = st.st_size;
+  body->mtime = st.st_mtime;
+  body->shared = NULL;
+  body->bundle = NULL;
+  if (fd >= 0) {
+    body->fd = fd;
+    free(path);
+    return body;
+  }
+  body->shared = lookup_cache(path, st.st_mtime, st.st_size);
+  if (!body->shared) {
+    body->shared = lookup_shared_cache(path, st.st_mtime, st.st_size,
+                                       with_data);
+  }
+  if (!body->shared) {
+    body->shared = load_shared_file(path, st.st_mtime);
+  }
+  int error = errno;
+  free(path);
+  if (!body->shared) {
+    free_object(SLAB_BODY, body);
+    errno = error;
     return NULL;
   }
-  char *out;
-  if (is_image_file((char *)target, &out)) {
-    body->size = file_size((char *)target);
+  body->data = with_data ? body->shared->data : NULL;
+  body->size = body->shared->size;
+  return body;
+}
 
-  } else {
-    size_t size = 0;
-    while (data[size++] != '\0') {
-    }
-    body->size = size - 1;
+/**
+ * @brief Creates a new body object from the given target.
+ *
+ * This function creates a new body object from the file at the given target,
+resolving directories to their index file. Files up to `stream_threshold` bytes
+are served from the content cache, or in prefork mode from the cache shared
+by the worker processes, when it holds the current version. Otherwise they are
+read into memory, with concurrent requests for the same file sharing a single
+read and buffer. Larger files are not read at all: the body
+keeps an open file descriptor instead and the data is streamed from the file
+when the response is sent, so the memory used does not depend on the size of
+the file.
+ *
+ * @param target The translated target of the file to create a body from.
+ * @return A new body object for the given target, or NULL if the target does
+not name a readable file, with `errno` set to ETIMEDOUT or EAGAIN if the file
+could not be read in time.
+ */
+body_t *create_body(const char *target) { return open_body(target, true); }
+
+/**
+ * @brief Creates a body that describes a file without its contents.
+ *
+ * The file is only stat'ed, never opened, so the body has the size and
+ * modification time of the file but no data. A document with such a body is
+ * sent as its header alone, with the `content-length` the file would have.
+ * This is how HEAD requests are answered. HTML files that `fingerprint`
+ * rewrites are the exception: their length is only known once they are
+ * loaded, so they are loaded, or found in the caches, and their data left
+ * out.
+ *
+ * @param target The translated target of the file to describe.
+ * @return A new body object for the given target, or NULL if the target does
+ * not name a regular file, with `errno` set to ETIMEDOUT or EAGAIN if it
+ * could not be stat'ed in time.
+ */
+body_t *stat_body(const char *target) {
+  char *path = resolve_file_path(target);
+  if (!path) {
+    return NULL;
+  }
+  struct stat st;
+  int result = probe_file(path, false, NULL, &st);
+  int error = errno;
+  bool rewritten = get_settings()->fingerprint && is_html_path(path);
+  free(path);
+  if (result < 0) {
+    errno = error;
+    return NULL;
+  }
+  if (rewritten && (size_t)st.st_size <= get_settings()->stream_threshold) {
+    return open_body(target, false);
   }
-  body->data = malloc(body->size);
-  memcpy(body->data, data, body->size);
-  if (!body->data) {
-    free(body);
+  body_t *body = allocate_object(SLAB_BODY);
+  if (!body) {
     return NULL;
   }
+  body->fd = -1;
+  body->data = NULL;
+  body->mapped = false;
+  body->size = st.st_size;
+  body->mtime = st.st_mtime;
+  body->shared = NULL;
+  body->bundle = NULL;
   return body;
 }
 
@@ -81,7 +258,8 @@ body_t *create_body(const char *target) {
  * @brief Destroys a body and its associated data.
  *
  * The function destroys the given body and releases any memory allocated for
- * its data.
+ * its data. Mapped data belongs to the mapping and is left alone, and shared
+ * data is only freed with its last reference.
  *
  * @param body A pointer to the body to be destroyed. If NULL, the function does
  * nothing.
@@ -90,10 +268,17 @@ void destroy_body(body_t *body) {
   if (!body) {
     return;
   }
-  if (body->data) {
+  if (body->shared) {
+    release_shared_file(body->shared);
+  } else if (body->bundle) {
+    release_bundle(body->bundle);
+  } else if (body->data && !body->mapped) {
     free(body->data);
   }
-  free(body);
+  if (body->fd >= 0) {
+    close(body->fd);
+  }
+  free_object(SLAB_BODY, body);
 }
 
 /**
@@ -106,3 +291,303 @@ void destroy_body(body_t *body) {
  * @return A pointer to the serialized data.
  */
 unsigned char *serialize_body(body_t *body) { return body->data; }
+
+/**
+ * @brief Creates a stream over a request body that has not been read yet.
+ *
+ * The body is left in the socket and the connection buffer until a handler
+ * asks for it with read_body_stream(), so a request never costs more memory
+ * than the fixed connection buffer, whatever its declared length.
+ *
+ * @param conn The connection the body arrives on.
+ * @param size The declared length of the body in bytes.
+ * @param expect_continue Whether the client sent `Expect: 100-continue` and
+ * waits for permission before sending the body.
+ * @return A new body stream, or NULL if the allocation failed.
+ */
+body_stream_t *create_body_stream(connection_t *conn, size_t size,
+                                  bool expect_continue) {
+  body_stream_t *stream = calloc(1, sizeof(body_stream_t));
+  if (!stream) {
+    return NULL;
+  }
+  stream->conn = conn;
+  stream->size = size;
+  stream->remaining = size;
+  stream->max_size = conn->settings->max_body_size;
+  stream->expect_continue = expect_continue;
+  return stream;
+}
+
+/**
+ * @brief Creates a stream over a request body sent with chunked
+ * transfer-encoding.
+ *
+ * The length of a chunked body is not known up front; `max_body_size`, or
+ * the stream's `max_size` if the caller changes it, is enforced while the
+ * chunk sizes are decoded instead.
+ *
+ * @param conn The connection the body arrives on.
+ * @param expect_continue Whether the client sent `Expect: 100-continue` and
+ * waits for permission before sending the body.
+ * @return A new body stream, or NULL if the allocation failed.
+ */
+body_stream_t *create_chunked_body_stream(connection_t *conn,
+                                          bool expect_continue) {
+  body_stream_t *stream = create_body_stream(conn, 0, expect_continue);
+  if (!stream) {
+    return NULL;
+  }
+  stream->chunked = true;
+  stream->chunk_state = CHUNK_SIZE;
+  return stream;
+}
+
+/**
+ * @brief Accepts the upload of a streamed body.
+ *
+ * If the client is waiting on `Expect: 100-continue`, the interim
+ * `100 Continue` response is sent now. Handlers that do not want the body never
+ * call this, so such clients are answered with the final response without
+ * uploading anything.
+ *
+ * @param stream The body stream to accept.
+ * @return 0 on success, -1 if the interim response could not be written.
+ */
+int accept_body_stream(body_stream_t *stream) {
+  if (stream->accepted) {
+    return 0;
+  }
+  stream->accepted = true;
+  if (!stream->expect_continue) {
+    return 0;
+  }
+  const char *interim = VERSION SP "100" SP "Continue" CRLF CRLF;
+  return write_to_conn(stream->conn, (unsigned char *)interim,
+                       strlen(interim));
+}
+
+static void capture_bytes(body_stream_t *stream, const unsigned char *data,
+                          size_t size) {
+  if (!stream->capture_header) {
+    return;
+  }
+  unsigned char *tmp =
+      realloc(stream->capture_body, stream->capture_body_size + size);
+  if (!tmp) {
+    return;
+  }
+  memcpy(tmp + stream->capture_body_size, data, size);
+  stream->capture_body = tmp;
+  stream->capture_body_size += size;
+}
+
+static int next_byte(body_stream_t *stream) {
+  connection_t *conn = stream->conn;
+  if (conn->start == conn->end) {
+    arm_timer(&conn->timer, conn->settings->body_timeout);
+    ssize_t n = fill_connection(conn);
+    cancel_timer(&conn->timer);
+    if (n <= 0) {
+      return -1;
+    }
+  }
+  unsigned char c = conn->buffer[conn->start++];
+  capture_bytes(stream, &c, 1);
+  return c;
+}
+
+static int hex_digit(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/**
+ * @brief Consumes chunked framing until chunk data or the end of the body.
+ *
+ * The decoder is an incremental state machine over the bytes in the
+ * connection buffer: it reads the chunk size line (ignoring extensions), the
+ * line break after the chunk data and the trailer section, one byte at a time
+ * and only as far as needed. Chunk data itself is never copied here; it is
+ * left for read_body_stream() to hand to the caller.
+ *
+ * @param stream The chunked body stream.
+ * @return 0 once the stream is at chunk data or done, or -1 on malformed
+ * framing, an oversized body, or end of stream. An oversized body also sets
+ * the stream's `too_large`, so the caller can answer with `413`.
+ */
+static int read_chunk_framing(body_stream_t *stream) {
+  while (stream->chunk_state != CHUNK_DATA &&
+         stream->chunk_state != CHUNK_DONE) {
+    int c = next_byte(stream);
+    if (c < 0) {
+      return -1;
+    }
+    switch (stream->chunk_state) {
+    case CHUNK_SIZE:
+      if (hex_digit(c) >= 0) {
+        stream->remaining = stream->remaining * 16 + hex_digit(c);
+        stream->chunk_line_length++;
+        if (stream->received + stream->remaining > stream->max_size) {
+          stream->too_large = true;
+          return -1;
+        }
+        break;
+      }
+      if (stream->chunk_line_length == 0) {
+        return -1;
+      }
+      if (c == ';' || c == ' ' || c == '\t') {
+        stream->chunk_state = CHUNK_EXTENSION;
+        break;
+      }
+      if (c == '\r') {
+        break;
+      }
+      if (c != '\n') {
+        return -1;
+      }
+    // fallthrough
+    case CHUNK_EXTENSION:
+      if (c != '\n') {
+        break;
+      }
+      stream->chunk_line_length = 0;
+      stream->chunk_state = stream->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+      break;
+    case CHUNK_DATA_END:
+      if (c == '\r') {
+        break;
+      }
+      if (c != '\n') {
+        return -1;
+      }
+      stream->chunk_state = CHUNK_SIZE;
+      break;
+    case CHUNK_TRAILER:
+      if (c == '\r') {
+        break;
+      }
+      if (c != '\n') {
+        stream->chunk_line_length++;
+        break;
+      }
+      if (stream->chunk_line_length == 0) {
+        stream->chunk_state = CHUNK_DONE;
+      }
+      stream->chunk_line_length = 0;
+      break;
+    case CHUNK_DATA:
+    case CHUNK_DONE:
+      break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Reads the next chunk of a streamed body.
+ *
+ * At most `count` bytes are returned per call, and the socket is only read when
+ * the handler asks for more, so a handler that falls behind pauses the upload
+ * through TCP flow control. The upload is accepted implicitly on the first
+ * read. Chunked bodies are decoded on the fly, so the caller only ever sees
+ * the body data. Every wait on the socket is bounded by the connection's
+ * `body_timeout`; time spent in the handler between reads is not.
+ *
+ * @param stream The body stream to read from.
+ * @param buf The buffer to read into.
+ * @param count The maximum number of bytes to read.
+ * @return The number of bytes read, 0 once the whole body has been read, or -1
+ * on error or if the client closed the connection early.
+ */
+ssize_t read_body_stream(body_stream_t *stream, unsigned char *buf,
+                         size_t count) {
+  if (!stream->chunked && stream->remaining == 0) {
+    return 0;
+  }
+  if (accept_body_stream(stream) < 0) {
+    return -1;
+  }
+  if (stream->chunked) {
+    if (read_chunk_framing(stream) < 0) {
+      return -1;
+    }
+    if (stream->chunk_state == CHUNK_DONE) {
+      return 0;
+    }
+  }
+  if (count > stream->remaining) {
+    count = stream->remaining;
+  }
+  connection_t *conn = stream->conn;
+  bool blocking = conn->start == conn->end;
+  if (blocking) {
+    arm_timer(&conn->timer, conn->settings->body_timeout);
+  }
+  ssize_t n = read_connection(conn, buf, count);
+  if (blocking) {
+    cancel_timer(&conn->timer);
+  }
+  if (n <= 0) {
+    return -1;
+  }
+  stream->remaining -= n;
+  stream->received += n;
+  if (stream->chunked && stream->remaining == 0) {
+    stream->chunk_state = CHUNK_DATA_END;
+  }
+  capture_bytes(stream, buf, n);
+  return n;
+}
+
+/**
+ * @brief Reads and discards the rest of a streamed body.
+ *
+ * A client that is still waiting on `100 Continue` has not sent anything, so
+ * nothing is read in that case.
+ *
+ * @param stream The body stream to drain.
+ * @return 0 on success, -1 if the body could not be read.
+ */
+int drain_body_stream(body_stream_t *stream) {
+  if (stream->expect_continue && !stream->accepted) {
+    return 0;
+  }
+  unsigned char buffer[BUFFER_SIZE];
+  ssize_t n;
+  while ((n = read_body_stream(stream, buffer, sizeof(buffer))) > 0) {
+  }
+  return n;
+}
+
+/**
+ * @brief Destroys a body stream.
+ *
+ * When request capture is enabled, the captured request is written out here,
+ * once the handler is done with the body.
+ *
+ * @param stream The body stream to destroy. If NULL, the function does
+ * nothing.
+ */
+void destroy_body_stream(body_stream_t *stream) {
+  if (!stream) {
+    return;
+  }
+  if (stream->capture_header) {
+    capture_request(stream->conn->fd, stream->capture_header,
+                    stream->capture_header_size, stream->capture_body,
+                    stream->capture_body_size);
+    free(stream->capture_header);
+    free(stream->capture_body);
+  }
+  free(stream);
+}
@@ -1,4 +1,8 @@
+#include "connection.h"
+#include "flight.h"
+#include <stdbool.h>
 #include <stdlib.h>
+#include <time.h>
 
 #ifndef BODY
 #define BODY
@@ -6,11 +10,53 @@
 typedef struct body {
   size_t size;
   unsigned char *data;
+  int fd;
+  bool mapped;
+  time_t mtime;
+  shared_file_t *shared;
+  struct bundle *bundle;
 } body_t;
 
+typedef enum CHUNK_STATE {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_DATA,
+  CHUNK_DATA_END,
+  CHUNK_TRAILER,
+  CHUNK_DONE
+} CHUNK_STATE_T;
+
+typedef struct body_stream {
+  connection_t *conn;
+  size_t size;
+  size_t remaining;
+  size_t received;
+  size_t max_size;
+  bool too_large;
+  bool chunked;
+  CHUNK_STATE_T chunk_state;
+  size_t chunk_line_length;
+  bool expect_continue;
+  bool accepted;
+  unsigned char *capture_header;
+  size_t capture_header_size;
+  unsigned char *capture_body;
+  size_t capture_body_size;
+} body_stream_t;
+
 body_t *parse_body(unsigned char *raw_body, size_t size);
 body_t *create_body(const char *target);
+body_t *stat_body(const char *target);
 unsigned char *serialize_body(body_t *body);
 void destroy_body(body_t *body);
+body_stream_t *create_body_stream(connection_t *conn, size_t size,
+                                  bool expect_continue);
+body_stream_t *create_chunked_body_stream(connection_t *conn,
+                                          bool expect_continue);
+int accept_body_stream(body_stream_t *stream);
+ssize_t read_body_stream(body_stream_t *stream, unsigned char *buf,
+                         size_t count);
+int drain_body_stream(body_stream_t *stream);
+void destroy_body_stream(body_stream_t *stream);
 
 #endif // !BODY
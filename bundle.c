@@ -0,0 +1,654 @@
+#define _GNU_SOURCE
+#include "bundle.h"
+#include "config.h"
+#include "header.h"
+#include "response.h"
+#include "settings.h"
+#include "slab.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+static _Atomic(bundle_t *) current_bundle = NULL;
+static _Atomic(const settings_t *) bundle_settings = NULL;
+static pthread_mutex_t bundle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int compare_packed_files(const void *a, const void *b) {
+  return strcmp(((const packed_file_t *)a)->path,
+                ((const packed_file_t *)b)->path);
+}
+
+/**
+ * @brief Adds every regular file below `directory` to `files`.
+ *
+ * @param directory The directory on disk.
+ * @param prefix The request path of the directory, without a trailing slash.
+ * @return 0 on success, or -1 on error.
+ */
+static int collect_files(const char *directory, const char *prefix,
+                         packed_file_t **files, size_t *count) {
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    perror(directory);
+    return -1;
+  }
+  int result = 0;
+  struct dirent *entry;
+  while (result == 0 && (entry = readdir(dir))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char *source = NULL;
+    char *path = NULL;
+    struct stat st;
+    if (asprintf(&source, "%s/%s", directory, entry->d_name) < 0 ||
+        asprintf(&path, "%s/%s", prefix, entry->d_name) < 0 ||
+        stat(source, &st) < 0) {
+      perror(entry->d_name);
+      result = -1;
+    } else if (S_ISDIR(st.st_mode)) {
+      result = collect_files(source, path, files, count);
+    } else if (S_ISREG(st.st_mode)) {
+      packed_file_t *tmp = realloc(*files, (*count + 1) * sizeof(**files));
+      if (!tmp) {
+        result = -1;
+      } else {
+        *files = tmp;
+        memset(&tmp[*count], 0, sizeof(**files));
+        tmp[*count].path = path;
+        tmp[*count].source = source;
+        tmp[*count].mtime = st.st_mtime;
+        (*count)++;
+        continue;
+      }
+    }
+    free(source);
+    free(path);
+  }
+  closedir(dir);
+  return result;
+}
+
+#ifdef WITH_ZLIB
+static unsigned char *gzip_data(const unsigned char *data, size_t size,
+                                size_t *gzip_size) {
+  z_stream stream = {0};
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+  size_t bound = deflateBound(&stream, size);
+  unsigned char *gzip = malloc(bound);
+  if (gzip) {
+    stream.next_in = (unsigned char *)data;
+    stream.avail_in = size;
+    stream.next_out = gzip;
+    stream.avail_out = bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+      free(gzip);
+      gzip = NULL;
+    }
+  }
+  *gzip_size = stream.total_out;
+  deflateEnd(&stream);
+  return gzip;
+}
+#endif
+
+/**
+ * @brief Loads a file and precomputes everything its response needs.
+ *
+ * The ETag is the FNV-1a hash of the contents, so it only changes when the
+ * contents do. When built with WITH_ZLIB, a gzip variant is kept if it is
+ * smaller than the file.
+ */
+static int prepare_packed_file(packed_file_t *file) {
+  file->data = load_file(file->source, &file->size);
+  if (!file->data) {
+    perror(file->source);
+    return -1;
+  }
+  file->content_type = get_content_type(file->source);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < file->size; i++) {
+    hash = (hash ^ file->data[i]) * 0x100000001b3ULL;
+  }
+  snprintf(file->etag, sizeof(file->etag), "\"%016llx\"",
+           (unsigned long long)hash);
+#ifdef WITH_ZLIB
+  file->gzip = gzip_data(file->data, file->size, &file->gzip_size);
+  if (file->gzip && file->gzip_size >= file->size) {
+    free(file->gzip);
+    file->gzip = NULL;
+    file->gzip_size = 0;
+  }
+#endif
+  return 0;
+}
+
+static size_t align_offset(size_t offset) {
+  return (offset + BUNDLE_ALIGNMENT - 1) / BUNDLE_ALIGNMENT * BUNDLE_ALIGNMENT;
+}
+
+static int write_at(FILE *out, size_t *position, size_t offset,
+                    const void *data, size_t size) {
+  static const unsigned char zeros[BUNDLE_ALIGNMENT] = {0};
+  while (*position < offset) {
+    size_t padding = offset - *position < sizeof(zeros)
+                         ? offset - *position
+                         : sizeof(zeros);
+    if (fwrite(zeros, 1, padding, out) != padding) {
+      return -1;
+    }
+    *position += padding;
+  }
+  if (size > 0 && fwrite(data, 1, size, out) != size) {
+    return -1;
+  }
+  *position += size;
+  return 0;
+}
+
+/**
+ * @brief Writes the bundle for `files`, sorted by path.
+ *
+ * The header and the index come first, followed by the NUL-terminated paths,
+ * content types and ETags, and then every body and gzip variant starting on
+ * its own BUNDLE_ALIGNMENT boundary, so each of them can be sent straight from
+ * the page cache.
+ */
+static int write_bundle(FILE *out, packed_file_t *files, size_t count) {
+  bundle_entry_t *entries = calloc(count ? count : 1, sizeof(bundle_entry_t));
+  if (!entries) {
+    return -1;
+  }
+  size_t offset = sizeof(bundle_header_t) + count * sizeof(bundle_entry_t);
+  for (size_t i = 0; i < count; i++) {
+    entries[i].path_offset = offset;
+    offset += strlen(files[i].path) + 1;
+    if (files[i].content_type) {
+      entries[i].content_type_offset = offset;
+      offset += strlen(files[i].content_type) + 1;
+    }
+    entries[i].etag_offset = offset;
+    offset += strlen(files[i].etag) + 1;
+    entries[i].mtime = files[i].mtime;
+  }
+  for (size_t i = 0; i < count; i++) {
+    offset = align_offset(offset);
+    entries[i].body_offset = offset;
+    entries[i].body_size = files[i].size;
+    offset += files[i].size;
+    if (files[i].gzip) {
+      offset = align_offset(offset);
+      entries[i].gzip_offset = offset;
+      entries[i].gzip_size = files[i].gzip_size;
+      offset += files[i].gzip_size;
+    }
+  }
+  bundle_header_t header = {0};
+  memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+  header.version = BUNDLE_VERSION;
+  header.count = count;
+  header.size = offset;
+  header.entries_offset = sizeof(bundle_header_t);
+  size_t position = 0;
+  int result = write_at(out, &position, 0, &header, sizeof(header));
+  if (result == 0) {
+    result = write_at(out, &position, position, entries,
+                      count * sizeof(bundle_entry_t));
+  }
+  for (size_t i = 0; result == 0 && i < count; i++) {
+    const packed_file_t *file = &files[i];
+    result = write_at(out, &position, position, file->path,
+                      strlen(file->path) + 1);
+    if (result == 0 && file->content_type) {
+      result = write_at(out, &position, position, file->content_type,
+                        strlen(file->content_type) + 1);
+    }
+    if (result == 0) {
+      result = write_at(out, &position, position, file->etag,
+                        strlen(file->etag) + 1);
+    }
+  }
+  for (size_t i = 0; result == 0 && i < count; i++) {
+    result = write_at(out, &position, entries[i].body_offset, files[i].data,
+                      files[i].size);
+    if (result == 0 && files[i].gzip) {
+      result = write_at(out, &position, entries[i].gzip_offset, files[i].gzip,
+                        files[i].gzip_size);
+    }
+  }
+  free(entries);
+  return result;
+}
+
+/**
+ * @brief Loads every file below `directory` for packing, sorted by path.
+ *
+ * Each file is read into memory with its content type, ETag and, when built
+ * with WITH_ZLIB, its gzip variant. This is shared by the `pack` and `embed`
+ * commands. The files must be released with destroy_packed_files(), also
+ * when an error occurred.
+ *
+ * @param directory The directory to load.
+ * @param files Receives the loaded files.
+ * @param count Receives the number of loaded files.
+ * @return 0 on success, or -1 on error.
+ */
+int load_packed_files(const char *directory, packed_file_t **files,
+                      size_t *count) {
+  *files = NULL;
+  *count = 0;
+  int result = collect_files(directory, "", files, count);
+  for (size_t i = 0; result == 0 && i < *count; i++) {
+    result = prepare_packed_file(&(*files)[i]);
+  }
+  if (result == 0 && *count > 0) {
+    qsort(*files, *count, sizeof(**files), compare_packed_files);
+  }
+  return result;
+}
+
+/**
+ * @brief Releases files loaded by load_packed_files().
+ */
+void destroy_packed_files(packed_file_t *files, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    free(files[i].path);
+    free(files[i].source);
+    free(files[i].content_type);
+    free(files[i].data);
+    free(files[i].gzip);
+  }
+  free(files);
+}
+
+/**
+ * @brief Packs a directory into a bundle file.
+ *
+ * Usage: `pack <bundle> [directory]`, where the directory defaults to
+ * TARGET_DIRECTORY. The bundle is written next to its final name and renamed
+ * into place, so a server reloading it never sees a partial file.
+ *
+ * @param argc The number of arguments after the `pack` command.
+ * @param argv The arguments after the `pack` command.
+ * @return EXIT_SUCCESS if the bundle was written, EXIT_FAILURE otherwise.
+ */
+int pack_bundle(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: pack <bundle> [directory]\n");
+    return EXIT_FAILURE;
+  }
+  const char *directory = argc > 1 ? argv[1] : TARGET_DIRECTORY;
+  packed_file_t *files = NULL;
+  size_t count = 0;
+  int result = load_packed_files(directory, &files, &count);
+  char *temporary = NULL;
+  if (result == 0 && asprintf(&temporary, "%s.tmp", argv[0]) < 0) {
+    temporary = NULL;
+    result = -1;
+  }
+  if (result == 0) {
+    FILE *out = fopen(temporary, "wb");
+    result = out ? write_bundle(out, files, count) : -1;
+    if (out && (fflush(out) != 0 || fsync(fileno(out)) < 0)) {
+      result = -1;
+    }
+    if (out && fclose(out) != 0) {
+      result = -1;
+    }
+    if (result == 0 && rename(temporary, argv[0]) < 0) {
+      result = -1;
+    }
+    if (result < 0) {
+      perror(argv[0]);
+      unlink(temporary);
+    }
+  }
+  size_t bytes = 0;
+  size_t variants = 0;
+  for (size_t i = 0; i < count; i++) {
+    bytes += files[i].size;
+    variants += files[i].gzip != NULL;
+  }
+  destroy_packed_files(files, count);
+  free(temporary);
+  if (result < 0) {
+    return EXIT_FAILURE;
+  }
+  printf("packed %zu files (%zu bytes, %zu gzip variants) from %s into %s\n",
+         count, bytes, variants, directory, argv[0]);
+  return EXIT_SUCCESS;
+}
+
+static bool valid_string(const unsigned char *data, size_t size,
+                         uint64_t offset) {
+  return offset < size && memchr(data + offset, '\0', size - offset);
+}
+
+static bool valid_range(size_t size, uint64_t offset, uint64_t length) {
+  return length <= size && offset <= size - length;
+}
+
+/**
+ * @brief Checks that a mapped bundle is complete and consistent.
+ *
+ * Every offset is checked against the size of the file and the paths must be
+ * strictly sorted, so lookups never read outside the mapping.
+ */
+static bool validate_bundle(const bundle_t *bundle) {
+  const bundle_header_t *header = (const bundle_header_t *)bundle->data;
+  if (bundle->size < sizeof(bundle_header_t) ||
+      memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != BUNDLE_VERSION || header->size != bundle->size ||
+      header->entries_offset % sizeof(uint64_t) != 0 ||
+      header->count > bundle->size / sizeof(bundle_entry_t) ||
+      !valid_range(bundle->size, header->entries_offset,
+                   header->count * sizeof(bundle_entry_t))) {
+    return false;
+  }
+  const bundle_entry_t *entries =
+      (const bundle_entry_t *)(bundle->data + header->entries_offset);
+  for (uint32_t i = 0; i < header->count; i++) {
+    const bundle_entry_t *entry = &entries[i];
+    if (!valid_string(bundle->data, bundle->size, entry->path_offset) ||
+        !valid_string(bundle->data, bundle->size, entry->etag_offset) ||
+        (entry->content_type_offset &&
+         !valid_string(bundle->data, bundle->size,
+                       entry->content_type_offset)) ||
+        !valid_range(bundle->size, entry->body_offset, entry->body_size) ||
+        !valid_range(bundle->size, entry->gzip_offset, entry->gzip_size)) {
+      return false;
+    }
+    if (i > 0 && strcmp((const char *)bundle->data + entries[i - 1].path_offset,
+                        (const char *)bundle->data + entry->path_offset) >= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bundle_t *map_bundle(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "bundle: %s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  if (st.st_size == 0) {
+    fprintf(stderr, "bundle: %s: not a valid bundle\n", path);
+    close(fd);
+    return NULL;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "bundle: %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  bundle_t *bundle = malloc(sizeof(bundle_t));
+  if (!bundle) {
+    munmap(data, st.st_size);
+    return NULL;
+  }
+  bundle->data = data;
+  bundle->size = st.st_size;
+  atomic_init(&bundle->references, 1);
+  bundle->device = st.st_dev;
+  bundle->inode = st.st_ino;
+  bundle->mtime = st.st_mtime;
+  if (!validate_bundle(bundle)) {
+    fprintf(stderr, "bundle: %s: not a valid bundle\n", path);
+    munmap(data, st.st_size);
+    free(bundle);
+    return NULL;
+  }
+  const bundle_header_t *header = data;
+  bundle->entries =
+      (const bundle_entry_t *)(bundle->data + header->entries_offset);
+  bundle->count = header->count;
+  madvise(data, st.st_size, MADV_WILLNEED);
+  printf("bundle: %s, %u files, %zu bytes\n", path, bundle->count,
+         bundle->size);
+  return bundle;
+}
+
+/**
+ * @brief Maps the bundle named by `bundle_file`, if any.
+ *
+ * @return 0 on success or if no bundle is configured, or -1 if the bundle
+ * cannot be used.
+ */
+int init_bundle() {
+  const settings_t *settings = get_settings();
+  if (settings->bundle_file[0] != '\0' && !get_bundle()) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Checks whether `bundle` is still the file at `path`.
+ */
+static bool is_bundle_current(const bundle_t *bundle, const char *path) {
+  struct stat st;
+  return bundle && stat(path, &st) == 0 && st.st_dev == bundle->device &&
+         st.st_ino == bundle->inode && st.st_mtime == bundle->mtime;
+}
+
+static void *run_retirement(void *arg) {
+  sleep(BUNDLE_RETIRE_DELAY);
+  release_bundle(arg);
+  return NULL;
+}
+
+/**
+ * @brief Drops the reference the server holds to a bundle that was replaced,
+ * after BUNDLE_RETIRE_DELAY seconds.
+ *
+ * A request thread may have read the old bundle from `current_bundle` just
+ * before it was swapped, and not yet taken a reference for its response. The
+ * delay gives it time to, so the last reference is never dropped under it.
+ * The bundle is unmapped once every response pointing into it is gone.
+ */
+static void retire_bundle(bundle_t *bundle) {
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, run_retirement, bundle) != 0) {
+    perror("bundle: retire");
+    return;
+  }
+  pthread_detach(tid);
+}
+
+/**
+ * @brief Maps the bundle again if `bundle_file` names another file than the
+ * one in use. Must be called with `bundle_lock` held.
+ */
+static void refresh_bundle(const settings_t *settings) {
+  bundle_t *old = atomic_load(&current_bundle);
+  bundle_t *bundle = NULL;
+  if (settings->bundle_file[0] != '\0') {
+    if (is_bundle_current(old, settings->bundle_file)) {
+      bundle = old;
+    } else {
+      bundle = map_bundle(settings->bundle_file);
+      if (!bundle) {
+        bundle = old;
+      }
+    }
+  }
+  atomic_store(&current_bundle, bundle);
+  atomic_store(&bundle_settings, settings);
+  if (old && old != bundle) {
+    retire_bundle(old);
+  }
+}
+
+/**
+ * @brief Returns the bundle currently served, or NULL to serve from disk.
+ *
+ * The bundle is checked whenever the settings are reloaded, so a deploy
+ * renames a new bundle over the old one and sends `SIGHUP`. It is only mapped
+ * again if the file's device, inode or modification time changed, and if the
+ * new bundle cannot be mapped, the old one stays in use. Only the first
+ * request after a reload takes `bundle_lock`; every other one just reads the
+ * current bundle. The bundle stays valid for BUNDLE_RETIRE_DELAY seconds
+ * after it is replaced, so a response must take its own reference right
+ * away, as create_bundle_response() does.
+ *
+ * @return The bundle, or NULL if `bundle_file` is empty.
+ */
+bundle_t *get_bundle() {
+  const settings_t *settings = get_settings();
+  if (atomic_load(&bundle_settings) != settings) {
+    pthread_mutex_lock(&bundle_lock);
+    if (atomic_load(&bundle_settings) != settings) {
+      refresh_bundle(settings);
+    }
+    pthread_mutex_unlock(&bundle_lock);
+  }
+  return atomic_load(&current_bundle);
+}
+
+/**
+ * @brief Gives back a reference to a bundle, unmapping the bundle if it was
+ * the last one.
+ *
+ * @param bundle The bundle, or NULL.
+ */
+void release_bundle(bundle_t *bundle) {
+  if (bundle && atomic_fetch_sub(&bundle->references, 1) == 1) {
+    munmap((void *)bundle->data, bundle->size);
+    free(bundle);
+  }
+}
+
+/**
+ * @brief Looks up a request path in the bundle with a binary search.
+ *
+ * @param bundle The bundle to search.
+ * @param path The request path, such as `/style.css`.
+ * @return The entry for the path, or NULL if there is none.
+ */
+const bundle_entry_t *find_bundle_entry(const bundle_t *bundle,
+                                        const char *path) {
+  uint32_t low = 0;
+  uint32_t high = bundle->count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    const bundle_entry_t *entry = &bundle->entries[middle];
+    int cmp = strcmp(path, (const char *)bundle->data + entry->path_offset);
+    if (cmp == 0) {
+      return entry;
+    }
+    if (cmp < 0) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Creates the response for a request target from the bundle.
+ *
+ * This is the bundle counterpart of create_file_response(): targets ending in
+ * a slash resolve to `default_index`, and missing files get `page_404`. The
+ * body points into the mapping, so nothing is opened, read or copied, and
+ * holds a reference to the bundle until it is destroyed. The gzip variant has
+ * an ETag of its own, since it is a different representation. For HEAD
+ * requests the body is left out, but its size is still reported.
+ *
+ * @param bundle The bundle to serve from.
+ * @param target The request target.
+ * @param gzip Whether the client accepts a gzip variant.
+ * @param head Whether to leave out the body.
+ * @return The response document, or NULL if an error occurred.
+ */
+document_t *create_bundle_response(bundle_t *bundle, const char *target,
+                                   bool gzip, bool head) {
+  const settings_t *settings = get_settings();
+  char *path = resolve_file_path(target);
+  if (!path) {
+    return NULL;
+  }
+  const bundle_entry_t *entry = find_bundle_entry(bundle, path);
+  free(path);
+  RESPONSE_CODE_T code = OK;
+  if (!entry) {
+    code = NOT_FOUND;
+    entry = find_bundle_entry(bundle, settings->page_404);
+  }
+  body_t *body = NULL;
+  bool compressed = false;
+  if (entry) {
+    body = allocate_object(SLAB_BODY);
+    if (!body) {
+      return NULL;
+    }
+    compressed = gzip && entry->gzip_size > 0;
+    body->data = head ? NULL
+                      : (unsigned char *)bundle->data +
+                            (compressed ? entry->gzip_offset
+                                        : entry->body_offset);
+    body->size = compressed ? entry->gzip_size : entry->body_size;
+    body->fd = -1;
+    body->mapped = !head;
+    body->mtime = entry->mtime;
+    body->shared = NULL;
+    body->bundle = bundle;
+    atomic_fetch_add(&bundle->references, 1);
+  }
+  header_t *header = create_default_header();
+  header->type = RESPONSE;
+  header->response_line = create_response_line(code, VERSION);
+  document_t *document = create_document(header, body, RESPONSE);
+  if (!document) {
+    destroy_header(header);
+    destroy_body(body);
+    return NULL;
+  }
+  if (!entry) {
+    attach_header(header, create_header_item("content-length", "0"));
+    return document;
+  }
+  if (entry->content_type_offset) {
+    attach_header(header, create_header_item(
+                              "content-type", (char *)bundle->data +
+                                                  entry->content_type_offset));
+  }
+  if (code == OK) {
+    const char *etag = (const char *)bundle->data + entry->etag_offset;
+    char variant[64];
+    if (compressed) {
+      snprintf(variant, sizeof(variant), "%.*s-gzip\"",
+               (int)strlen(etag) - 1, etag);
+      etag = variant;
+    }
+    attach_validators(header, etag, entry->mtime);
+  }
+  if (entry->gzip_size > 0) {
+    attach_header(header, create_header_item("vary", "accept-encoding"));
+  }
+  if (compressed) {
+    attach_header(header, create_header_item("content-encoding", "gzip"));
+  }
+  return document;
+}
@@ -0,0 +1,66 @@
+#ifndef BUNDLE
+#define BUNDLE
+#include "document.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BUNDLE_MAGIC "KRBUNDLE"
+#define BUNDLE_VERSION 1
+
+typedef struct bundle_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t size;
+  uint64_t entries_offset;
+} bundle_header_t;
+
+typedef struct bundle_entry {
+  uint64_t path_offset;
+  uint64_t content_type_offset;
+  uint64_t etag_offset;
+  uint64_t body_offset;
+  uint64_t body_size;
+  uint64_t gzip_offset;
+  uint64_t gzip_size;
+  int64_t mtime;
+} bundle_entry_t;
+
+typedef struct packed_file {
+  char *path;
+  char *source;
+  char *content_type;
+  char etag[20];
+  unsigned char *data;
+  size_t size;
+  unsigned char *gzip;
+  size_t gzip_size;
+  int64_t mtime;
+} packed_file_t;
+
+typedef struct bundle {
+  const unsigned char *data;
+  size_t size;
+  const bundle_entry_t *entries;
+  uint32_t count;
+  atomic_int references;
+  dev_t device;
+  ino_t inode;
+  int64_t mtime;
+} bundle_t;
+
+int load_packed_files(const char *directory, packed_file_t **files,
+                      size_t *count);
+void destroy_packed_files(packed_file_t *files, size_t count);
+int pack_bundle(int argc, char *argv[]);
+int init_bundle();
+bundle_t *get_bundle();
+void release_bundle(bundle_t *bundle);
+const bundle_entry_t *find_bundle_entry(const bundle_t *bundle,
+                                        const char *path);
+document_t *create_bundle_response(bundle_t *bundle, const char *target,
+                                   bool gzip, bool head);
+#endif // !BUNDLE
@@ -0,0 +1,410 @@
+#include "cache.h"
+#include "config.h"
+#include "fingerprint.h"
+#include "settings.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum CACHE_SEGMENT {
+  CACHE_WINDOW,
+  CACHE_PROBATION,
+  CACHE_PROTECTED,
+  CACHE_SEGMENTS
+} CACHE_SEGMENT_T;
+
+typedef struct cache_entry {
+  char *key;
+  uint64_t hash;
+  time_t mtime;
+  shared_file_t *file;
+  size_t cost;
+  CACHE_SEGMENT_T segment;
+  struct cache_entry *prev;
+  struct cache_entry *next;
+  struct cache_entry *chain;
+} cache_entry_t;
+
+typedef struct cache_list {
+  cache_entry_t *head;
+  cache_entry_t *tail;
+  size_t bytes;
+} cache_list_t;
+
+typedef struct cache_shard {
+  pthread_mutex_t lock;
+  cache_entry_t *buckets[CACHE_BUCKETS];
+  cache_list_t segments[CACHE_SEGMENTS];
+  uint8_t sketch[CACHE_SKETCH_DEPTH][CACHE_SKETCH_WIDTH];
+  uint32_t samples;
+  size_t budget;
+} cache_shard_t;
+
+static cache_shard_t *shards = NULL;
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static atomic_ulong cache_hits = 0;
+static atomic_ulong cache_misses = 0;
+static atomic_ulong cache_admissions = 0;
+static atomic_ulong cache_rejections = 0;
+static atomic_ulong cache_evictions = 0;
+static atomic_size_t cache_bytes = 0;
+
+/**
+ * @brief Allocates the shards, splitting `cache_size` evenly between them.
+ *
+ * A `cache_size` of 0 leaves the cache disabled, and so does prefork mode,
+ * where the cache shared by the worker processes takes its place.
+ */
+static void init_shards() {
+  size_t size = get_settings()->cache_size;
+  if (size == 0 || get_settings()->processes > 0) {
+    return;
+  }
+  cache_shard_t *tmp = calloc(CACHE_SHARDS, sizeof(cache_shard_t));
+  if (!tmp) {
+    return;
+  }
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    pthread_mutex_init(&tmp[i].lock, NULL);
+    tmp[i].budget = size / CACHE_SHARDS;
+  }
+  shards = tmp;
+  printf("cache: %zu bytes in %d shards\n", size, CACHE_SHARDS);
+}
+
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash = (hash ^ *p) * 0x100000001b3ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static size_t sketch_index(uint64_t hash, int row) {
+  return (size_t)((hash + row * ((hash >> 32) | 1)) % CACHE_SKETCH_WIDTH);
+}
+
+/**
+ * @brief Counts one access to a key in the shard's count-min sketch.
+ *
+ * Only the smallest counters are incremented, which keeps the estimate of
+ * keys that share counters with hot keys low. The counters saturate at 15,
+ * and all of them are halved every CACHE_SKETCH_SAMPLES accesses, so past
+ * popularity fades and a new hot set can take over.
+ */
+static void record_access(cache_shard_t *shard, uint64_t hash) {
+  uint8_t minimum = UINT8_MAX;
+  for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+    uint8_t count = shard->sketch[row][sketch_index(hash, row)];
+    minimum = count < minimum ? count : minimum;
+  }
+  if (minimum < 15) {
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+      uint8_t *count = &shard->sketch[row][sketch_index(hash, row)];
+      if (*count == minimum) {
+        (*count)++;
+      }
+    }
+  }
+  if (++shard->samples >= CACHE_SKETCH_SAMPLES) {
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+      for (int i = 0; i < CACHE_SKETCH_WIDTH; i++) {
+        shard->sketch[row][i] >>= 1;
+      }
+    }
+    shard->samples = 0;
+  }
+}
+
+static uint8_t estimate_frequency(const cache_shard_t *shard, uint64_t hash) {
+  uint8_t minimum = UINT8_MAX;
+  for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+    uint8_t count = shard->sketch[row][sketch_index(hash, row)];
+    minimum = count < minimum ? count : minimum;
+  }
+  return minimum;
+}
+
+static void push_entry(cache_shard_t *shard, cache_entry_t *entry,
+                       CACHE_SEGMENT_T segment) {
+  cache_list_t *list = &shard->segments[segment];
+  entry->segment = segment;
+  entry->prev = NULL;
+  entry->next = list->head;
+  if (list->head) {
+    list->head->prev = entry;
+  } else {
+    list->tail = entry;
+  }
+  list->head = entry;
+  list->bytes += entry->cost;
+}
+
+static void unlink_entry(cache_shard_t *shard, cache_entry_t *entry) {
+  cache_list_t *list = &shard->segments[entry->segment];
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    list->head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    list->tail = entry->prev;
+  }
+  list->bytes -= entry->cost;
+}
+
+static cache_entry_t **find_entry(cache_shard_t *shard, const char *key,
+                                  uint64_t hash) {
+  cache_entry_t **link = &shard->buckets[hash % CACHE_BUCKETS];
+  while (*link && ((*link)->hash != hash || strcmp((*link)->key, key) != 0)) {
+    link = &(*link)->chain;
+  }
+  return link;
+}
+
+static void discard_entry(cache_shard_t *shard, cache_entry_t *entry) {
+  cache_entry_t **link = find_entry(shard, entry->key, entry->hash);
+  *link = entry->chain;
+  atomic_fetch_sub(&cache_bytes, entry->cost);
+  release_shared_file(entry->file);
+  free(entry->key);
+  free(entry);
+}
+
+static void remove_entry(cache_shard_t *shard, cache_entry_t *entry) {
+  unlink_entry(shard, entry);
+  discard_entry(shard, entry);
+}
+
+static void evict_entry(cache_shard_t *shard, cache_entry_t *entry) {
+  remove_entry(shard, entry);
+  atomic_fetch_add(&cache_evictions, 1);
+}
+
+static size_t window_budget(const cache_shard_t *shard) {
+  return shard->budget * CACHE_WINDOW_PERCENT / 100;
+}
+
+static size_t protected_budget(const cache_shard_t *shard) {
+  return (shard->budget - window_budget(shard)) * CACHE_PROTECTED_PERCENT /
+         100;
+}
+
+/**
+ * @brief Moves an entry that was hit to the front of its segment.
+ *
+ * A hit in probation promotes the entry to the protected segment, and
+ * protected entries that no longer fit are demoted back to probation.
+ */
+static void touch_entry(cache_shard_t *shard, cache_entry_t *entry) {
+  CACHE_SEGMENT_T segment =
+      entry->segment == CACHE_WINDOW ? CACHE_WINDOW : CACHE_PROTECTED;
+  unlink_entry(shard, entry);
+  push_entry(shard, entry, segment);
+  cache_list_t *protected = &shard->segments[CACHE_PROTECTED];
+  while (protected->bytes > protected_budget(shard) &&
+         protected->tail != entry) {
+    cache_entry_t *demoted = protected->tail;
+    unlink_entry(shard, demoted);
+    push_entry(shard, demoted, CACHE_PROBATION);
+  }
+}
+
+/**
+ * @brief Moves entries that fall out of the window into the main segments.
+ *
+ * This is the TinyLFU admission filter: while the main segments are full, an
+ * entry leaving the window only displaces the least recently used main entry
+ * if the sketch has seen it more often. Otherwise the window entry is
+ * dropped, so a scan that touches every file once cannot flush the files that
+ * are actually popular.
+ */
+static void drain_window(cache_shard_t *shard) {
+  cache_list_t *window = &shard->segments[CACHE_WINDOW];
+  size_t main_budget = shard->budget - window_budget(shard);
+  while (window->bytes > window_budget(shard)) {
+    cache_entry_t *candidate = window->tail;
+    unlink_entry(shard, candidate);
+    bool admitted = candidate->cost <= main_budget;
+    uint8_t frequency = estimate_frequency(shard, candidate->hash);
+    while (admitted && shard->segments[CACHE_PROBATION].bytes +
+                               shard->segments[CACHE_PROTECTED].bytes +
+                               candidate->cost >
+                           main_budget) {
+      cache_entry_t *victim = shard->segments[CACHE_PROBATION].tail;
+      if (!victim) {
+        victim = shard->segments[CACHE_PROTECTED].tail;
+      }
+      if (frequency <= estimate_frequency(shard, victim->hash)) {
+        admitted = false;
+      } else {
+        evict_entry(shard, victim);
+      }
+    }
+    if (admitted) {
+      push_entry(shard, candidate, CACHE_PROBATION);
+      atomic_fetch_add(&cache_admissions, 1);
+    } else {
+      discard_entry(shard, candidate);
+      atomic_fetch_add(&cache_rejections, 1);
+    }
+  }
+}
+
+static cache_shard_t *get_shard(uint64_t hash) {
+  pthread_once(&shards_once, init_shards);
+  return shards ? &shards[(hash >> 32) % CACHE_SHARDS] : NULL;
+}
+
+/**
+ * @brief Looks up a file in the content cache.
+ *
+ * The file is only returned if it still has the given modification time and
+ * size; an entry for an older version is dropped. So is a rewritten HTML file
+ * whose fingerprinted assets changed, which is checked outside the lock since
+ * it stats them. Every lookup, hit or miss, is counted in the frequency sketch
+ * that decides admission. Only the shard the path hashes to is locked.
+ *
+ * @param path The path of the file.
+ * @param mtime The current modification time of the file.
+ * @param size The current size of the file.
+ * @return A new reference to the cached file, or NULL on a miss.
+ */
+shared_file_t *lookup_cache(const char *path, time_t mtime, size_t size) {
+  uint64_t hash = hash_key(path);
+  cache_shard_t *shard = get_shard(hash);
+  if (!shard) {
+    return NULL;
+  }
+  pthread_mutex_lock(&shard->lock);
+  record_access(shard, hash);
+  cache_entry_t *entry = *find_entry(shard, path, hash);
+  if (entry && (entry->mtime != mtime || entry->file->source_size != size)) {
+    remove_entry(shard, entry);
+    entry = NULL;
+  }
+  shared_file_t *file = NULL;
+  if (entry) {
+    touch_entry(shard, entry);
+    file = retain_shared_file(entry->file);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  if (file && !check_fingerprints(file)) {
+    pthread_mutex_lock(&shard->lock);
+    entry = *find_entry(shard, path, hash);
+    if (entry && entry->file == file) {
+      remove_entry(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    release_shared_file(file);
+    file = NULL;
+  }
+  atomic_fetch_add(file ? &cache_hits : &cache_misses, 1);
+  return file;
+}
+
+/**
+ * @brief Offers a freshly loaded file to the content cache.
+ *
+ * The file enters the small admission window and competes for a place in the
+ * main segments once it leaves the window. Each entry is charged its data,
+ * key and bookkeeping against the shard's share of `cache_size`, and the
+ * shard never holds more than that. The cache takes its own reference to the
+ * file.
+ *
+ * @param path The path of the file.
+ * @param mtime The modification time the file was loaded at.
+ * @param file The loaded file.
+ */
+void insert_cache(const char *path, time_t mtime, shared_file_t *file) {
+  uint64_t hash = hash_key(path);
+  cache_shard_t *shard = get_shard(hash);
+  if (!shard) {
+    return;
+  }
+  size_t cost = sizeof(cache_entry_t) + sizeof(shared_file_t) +
+                strlen(path) + 1 + file->size +
+                (file->links ? strlen(file->links) + 1 : 0);
+  if (cost > shard->budget - window_budget(shard)) {
+    atomic_fetch_add(&cache_rejections, 1);
+    return;
+  }
+  cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+  char *key = strdup(path);
+  if (!entry || !key) {
+    free(entry);
+    free(key);
+    return;
+  }
+  pthread_mutex_lock(&shard->lock);
+  cache_entry_t **link = find_entry(shard, path, hash);
+  if (*link) {
+    pthread_mutex_unlock(&shard->lock);
+    free(entry);
+    free(key);
+    return;
+  }
+  entry->key = key;
+  entry->hash = hash;
+  entry->mtime = mtime;
+  entry->file = retain_shared_file(file);
+  entry->cost = cost;
+  *link = entry;
+  push_entry(shard, entry, CACHE_WINDOW);
+  atomic_fetch_add(&cache_bytes, cost);
+  drain_window(shard);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Lists the paths held by the content cache, most valuable first.
+ *
+ * Protected entries come first, then probation and then the window, each from
+ * the most to the least recently used.
+ *
+ * @param keys The array receiving copies of the paths, which the caller frees.
+ * @param max The capacity of `keys`.
+ * @return The number of paths listed.
+ */
+size_t list_cache_keys(char **keys, size_t max) {
+  static const CACHE_SEGMENT_T order[] = {CACHE_PROTECTED, CACHE_PROBATION,
+                                          CACHE_WINDOW};
+  size_t count = 0;
+  if (!get_shard(0)) {
+    return 0;
+  }
+  for (int i = 0; i < CACHE_SEGMENTS; i++) {
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+      pthread_mutex_lock(&shards[s].lock);
+      cache_entry_t *entry = shards[s].segments[order[i]].head;
+      for (; entry && count < max; entry = entry->next) {
+        keys[count] = strdup(entry->key);
+        count += keys[count] != NULL;
+      }
+      pthread_mutex_unlock(&shards[s].lock);
+    }
+  }
+  return count;
+}
+
+/**
+ * @brief Writes the content cache counters.
+ *
+ * @param out The stream to write to.
+ */
+void write_cache_stats(FILE *out) {
+  fprintf(out, "cache_hits %lu\n", atomic_load(&cache_hits));
+  fprintf(out, "cache_misses %lu\n", atomic_load(&cache_misses));
+  fprintf(out, "cache_admissions %lu\n", atomic_load(&cache_admissions));
+  fprintf(out, "cache_rejections %lu\n", atomic_load(&cache_rejections));
+  fprintf(out, "cache_evictions %lu\n", atomic_load(&cache_evictions));
+  fprintf(out, "cache_bytes %zu\n", atomic_load(&cache_bytes));
+}
@@ -0,0 +1,11 @@
+#ifndef CACHE
+#define CACHE
+#include "flight.h"
+#include <stdio.h>
+#include <time.h>
+
+shared_file_t *lookup_cache(const char *path, time_t mtime, size_t size);
+void insert_cache(const char *path, time_t mtime, shared_file_t *file);
+size_t list_cache_keys(char **keys, size_t max);
+void write_cache_stats(FILE *out);
+#endif // !CACHE
@@ -0,0 +1,154 @@
+#include "capture.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static FILE *capture_file = NULL;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec capture_start;
+static time_t capture_last_flush = 0;
+
+static uint64_t elapsed_us(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000 +
+         (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static size_t escape_json(char *out, const unsigned char *in, size_t size) {
+  static const char hex[] = "0123456789abcdef";
+  size_t len = 0;
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = in[i];
+    switch (c) {
+    case '"':
+      out[len++] = '\\';
+      out[len++] = '"';
+      break;
+    case '\\':
+      out[len++] = '\\';
+      out[len++] = '\\';
+      break;
+    case '\r':
+      out[len++] = '\\';
+      out[len++] = 'r';
+      break;
+    case '\n':
+      out[len++] = '\\';
+      out[len++] = 'n';
+      break;
+    case '\t':
+      out[len++] = '\\';
+      out[len++] = 't';
+      break;
+    default:
+      if (c < 0x20 || c >= 0x7f) {
+        memcpy(out + len, "\\u00", 4);
+        len += 4;
+        out[len++] = hex[c >> 4];
+        out[len++] = hex[c & 0xf];
+      } else {
+        out[len++] = c;
+      }
+    }
+  }
+  return len;
+}
+
+/**
+ * @brief Opens the capture log and starts recording incoming requests.
+ *
+ * Every request read afterwards is appended to `path` as one JSON object per
+ * line, holding the arrival time in microseconds since the capture started,
+ * the connection id and the raw request bytes. The file is opened in append
+ * mode so several runs can be collected into the same log.
+ *
+ * @param path The path of the JSONL file to append to.
+ * @return 0 on success, -1 if the file could not be opened.
+ */
+int capture_open(const char *path) {
+  FILE *file = fopen(path, "a");
+  if (!file) {
+    perror("capture");
+    return -1;
+  }
+  setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+  pthread_mutex_lock(&capture_lock);
+  clock_gettime(CLOCK_MONOTONIC, &capture_start);
+  capture_last_flush = time(NULL);
+  capture_file = file;
+  pthread_mutex_unlock(&capture_lock);
+  printf("Capturing requests to %s\n", path);
+  return 0;
+}
+
+/**
+ * @brief Appends a raw request to the capture log.
+ *
+ * The record is escaped outside of the lock and written with a single buffered
+ * `fwrite`, so concurrent connections only serialize on the copy into the
+ * stdio buffer. The buffer is flushed to disk at most once per
+ * CAPTURE_FLUSH_INTERVAL seconds. Does nothing unless capture_open() has been
+ * called.
+ *
+ * @param connfd The connection the request arrived on.
+ * @param header The complete header block, including the terminating blank
+ * line.
+ * @param header_size The size of the header block in bytes.
+ * @param body The request body, or NULL if there is none.
+ * @param body_size The size of the body in bytes.
+ */
+void capture_request(int connfd, const unsigned char *header,
+                     size_t header_size, const unsigned char *body,
+                     size_t body_size) {
+  if (!capture_file) {
+    return;
+  }
+  uint64_t t = elapsed_us(&capture_start);
+  char *line = malloc(64 + (header_size + body_size) * 6);
+  if (!line) {
+    return;
+  }
+  size_t len = snprintf(line, 64, "{\"t\":%llu,\"conn\":%d,\"raw\":\"",
+                        (unsigned long long)t, connfd);
+  len += escape_json(line + len, header, header_size);
+  if (body) {
+    len += escape_json(line + len, body, body_size);
+  }
+  memcpy(line + len, "\"}\n", 3);
+  len += 3;
+  pthread_mutex_lock(&capture_lock);
+  if (capture_file) {
+    fwrite(line, 1, len, capture_file);
+    time_t now = time(NULL);
+    if (now - capture_last_flush >= CAPTURE_FLUSH_INTERVAL) {
+      fflush(capture_file);
+      capture_last_flush = now;
+    }
+  }
+  pthread_mutex_unlock(&capture_lock);
+  free(line);
+}
+
+/**
+ * @brief Checks whether requests are being captured.
+ *
+ * @return True if capture_open() has been called and the log is still open.
+ */
+bool capture_enabled() { return capture_file != NULL; }
+
+/**
+ * @brief Flushes and closes the capture log.
+ */
+void capture_close() {
+  pthread_mutex_lock(&capture_lock);
+  if (capture_file) {
+    fclose(capture_file);
+    capture_file = NULL;
+  }
+  pthread_mutex_unlock(&capture_lock);
+}
@@ -0,0 +1,12 @@
+#ifndef CAPTURE_LOG
+#define CAPTURE_LOG
+#include <stdbool.h>
+#include <stddef.h>
+
+int capture_open(const char *path);
+void capture_request(int connfd, const unsigned char *header,
+                     size_t header_size, const unsigned char *body,
+                     size_t body_size);
+bool capture_enabled();
+void capture_close();
+#endif // !CAPTURE_LOG
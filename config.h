@@ -2,6 +2,48 @@
 #define CONFIG
 
 #define BUFFER_SIZE 1024
+#define CONNECTION_BUFFER_SIZE 16384
+#define MAX_BODY_SIZE 8388608
+#define MAX_HEADER_SIZE 65536
+#define STREAM_THRESHOLD 1048576
+#define STREAM_CHUNK_SIZE 65536
+#define FLIGHT_SHARDS 64
+#define CACHE_SIZE 67108864
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256
+#define CACHE_WINDOW_PERCENT 1
+#define CACHE_PROTECTED_PERCENT 80
+#define IO_THREADS 4
+#define IO_TIMEOUT 10000
+#define IO_QUEUE_MAX 1024
+#define PRELOAD_HINTS 1
+#define PRELOAD_MAX_LINKS 16
+#define PRELOAD_MAX_URL 512
+#define HTML_MAX_REFERENCES 256
+#define FINGERPRINT_ASSETS 0
+#define FINGERPRINT_DIGITS 12
+#define FINGERPRINT_SLOTS 4096
+#define FINGERPRINT_LOCKS 64
+#define FINGERPRINT_CHECK_MS 1000
+#define FINGERPRINT_READ_SIZE 65536
+#define FINGERPRINT_CACHE_CONTROL "public, max-age=31536000, immutable"
+#define PREWARM 0
+#define PREWARM_WAIT 0
+#define PREWARM_THREADS 4
+#define PREWARM_FILE ""
+#define PREWARM_MAX_PATHS 4096
+#define CACHE_SKETCH_DEPTH 4
+#define CACHE_SKETCH_WIDTH 1024
+#define CACHE_SKETCH_SAMPLES 10240
+#define SHARED_CACHE_SIZE 67108864
+#define SHARED_CACHE_SLOTS 4096
+#define SHARED_CACHE_PROBES 8
+#define SHARED_CACHE_PATH_SIZE 256
+#define SHARED_CACHE_MAX_SHARE 8
+#define SLAB_BATCH 32
+#define SLAB_THREAD_OBJECTS 64
+#define STREAM_READAHEAD 2097152
+
 #ifdef PROD
 #define PORT 80
 #endif
@@ -11,6 +53,59 @@
 #define TARGET_DIRECTORY "target"
 #define DEFAULT_INDEX "index.htm"
 #define PAGE_404 "/404.htm"
+#define BUNDLE_FILE ""
+#define BUNDLE_ALIGNMENT 4096
+#define BUNDLE_RETIRE_DELAY 5
+#define EMBED_MAX_SEED 1000000
 #define VERSION "HTTP/1.1"
+#define CAPTURE_FILE ""
+#define TIMER_TICK_MS 100
+#define HEADER_TIMEOUT 10000
+#define BODY_TIMEOUT 10000
+#define WRITE_TIMEOUT 10000
+#define KEEPALIVE_TIMEOUT 5000
+#define KEEPALIVE_MAX 997
+#define MAX_CONNECTIONS 1024
+#define HARD_MAX_CONNECTIONS 2048
+#define MAX_INFLIGHT_REQUESTS 256
+#define MAX_QUEUE_MS 1000
+#define RETRY_AFTER "1"
+#define RATE_LIMIT 0
+#define RATE_LIMIT_BURST 50
+#define RATE_LIMIT_MAX_BURST 1000000
+#define RATE_LIMIT_SLOTS 65536
+#define RATE_LIMIT_PROBES 8
+#define LISTEN_BACKLOG 1024
+#define WORKERS 1
+#define CPU_AFFINITY 0
+#define PROCESSES 0
+#define DRAIN_TIMEOUT 30000
+#define DRAIN_POLL_INTERVAL 50
+#define UPGRADE_TIMEOUT 10000
+#define UPGRADE_MAX_LISTENERS 64
+#define UPGRADE_SNAPSHOT_KEYS 4096
+#define UPGRADE_ENV "KR4NKEN_UPGRADE_FD"
+#define H2_MAX_STREAMS 100
+#define H2_HEADER_TABLE_SIZE 4096
+#define H2_FRAME_SIZE 16384
+#define H2_READ_BURST 16
+#define PROXY_ROUTES ""
+#define STATS_PATH ""
+#define UPSTREAM_POOL_SIZE 32
+#define UPSTREAM_TIMEOUT 10000
+#define UPSTREAM_IDLE_TIMEOUT 30000
+#define UPSTREAM_COOLDOWN 5000
+#define ACCEPT_BATCH 64
+#define ACCEPT_BACKOFF_MS 10
+#define SOCKET_DEFER_ACCEPT 10
+#define SOCKET_FASTOPEN_QUEUE 256
+#define SOCKET_SNDBUF 0
+#define SOCKET_RCVBUF 0
+#define SOCKET_NODELAY 1
+#define SOCKET_CORK 1
+#define CAPTURE_BUFFER_SIZE 65536
+
+#define CAPTURE_FLUSH_INTERVAL 1
+#define REPLAY_THREADS 64
 
 #endif // CONFIG
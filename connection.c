@@ -0,0 +1,315 @@
+#include "connection.h"
+#include "config.h"
+#include "header.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * @brief Creates a new connection around an accepted socket.
+ *
+ * The connection keeps the settings in effect when it was accepted for its
+ * whole lifetime, so a reload never changes limits under a running request.
+ * It owns a fixed-size read buffer of `connection_buffer_size` bytes.
+ * Everything read from the socket passes through this buffer, so the memory
+ * used per connection does not depend on the size of the requests. With
+ * `nodelay`, Nagle's algorithm is turned off on the socket, so small responses
+ * go out without waiting for the previous segment to be acknowledged.
+ *
+ * @param fd The accepted socket file descriptor.
+ * @return A new connection, or NULL if the allocation failed.
+ */
+connection_t *create_connection(int fd) {
+  const settings_t *settings = get_settings();
+  connection_t *conn =
+      malloc(sizeof(connection_t) + settings->connection_buffer_size);
+  if (!conn) {
+    return NULL;
+  }
+  conn->fd = fd;
+  conn->worker = 0;
+  conn->peer = 0;
+  conn->settings = settings;
+  conn->capacity = settings->connection_buffer_size;
+  conn->start = 0;
+  conn->end = 0;
+  conn->keep_alive = true;
+  conn->requests = 0;
+  init_timer(&conn->timer, fd);
+  if (settings->nodelay) {
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  }
+  return conn;
+}
+
+/**
+ * @brief Corks or uncorks a connection.
+ *
+ * While corked, the kernel only sends full segments, so a response header
+ * written ahead of a `sendfile` body shares its packets with the body.
+ * Uncorking flushes whatever is left. Does nothing unless `cork` is set.
+ *
+ * @param conn The open connection.
+ * @param corked True to cork the connection, false to uncork it.
+ */
+void cork_connection(connection_t *conn, bool corked) {
+  if (conn->settings->cork) {
+    int opt = corked;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+  }
+}
+
+/**
+ * @brief Reads more data from the socket into the connection buffer.
+ *
+ * Unconsumed bytes are first moved to the front of the buffer, then a single
+ * `read` fills as much of the remaining space as the socket has available.
+ *
+ * @param conn The connection to fill.
+ * @return The number of bytes read, 0 on end of stream, or a negative value on
+ * error or when the buffer is already full.
+ */
+ssize_t fill_connection(connection_t *conn) {
+  if (conn->start > 0) {
+    memmove(conn->buffer, conn->buffer + conn->start, conn->end - conn->start);
+    conn->end -= conn->start;
+    conn->start = 0;
+  }
+  if (conn->end == conn->capacity) {
+    return -1;
+  }
+  ssize_t n =
+      read(conn->fd, conn->buffer + conn->end, conn->capacity - conn->end);
+  if (n > 0) {
+    conn->end += n;
+  }
+  return n;
+}
+
+/**
+ * @brief Reads up to `count` bytes from the connection.
+ *
+ * Buffered bytes are returned first. When the buffer is empty and the caller
+ * asks for at least a full buffer, the data is read straight into `buf` to
+ * avoid an extra copy. The socket is only read when the caller asks for more
+ * data, so a slow consumer leaves the bytes in the kernel and TCP flow control
+ * throttles the peer.
+ *
+ * @param conn The connection to read from.
+ * @param buf The buffer to read into.
+ * @param count The maximum number of bytes to read.
+ * @return The number of bytes read, 0 on end of stream, or a negative value on
+ * error.
+ */
+ssize_t read_connection(connection_t *conn, unsigned char *buf, size_t count) {
+  if (conn->start == conn->end) {
+    conn->start = 0;
+    conn->end = 0;
+    if (count >= conn->capacity) {
+      return read(conn->fd, buf, count);
+    }
+    ssize_t n = fill_connection(conn);
+    if (n <= 0) {
+      return n;
+    }
+  }
+  size_t available = conn->end - conn->start;
+  size_t to_copy = available < count ? available : count;
+  memcpy(buf, conn->buffer + conn->start, to_copy);
+  conn->start += to_copy;
+  return to_copy;
+}
+
+/**
+ * @brief Write data to an open connection.
+ *
+ * This function writes data to an open connection. It takes a buffer of
+unsigned char chars and a length in bytes as input, and returns -1 on error or
+0 if all of the data was written. The write stall timer is re-armed whenever
+the peer accepts more data, so a client that stops reading is dropped after
+`write_timeout` milliseconds without progress. A failed write marks the
+connection as not reusable.
+ *
+ * @param conn The open connection.
+ * @param data The buffer containing the data to write.
+ * @param length The length of the data buffer in bytes.
+ * @return 0 on success, or -1 on error.
+ */
+int write_to_conn(connection_t *conn, unsigned char *data, size_t length) {
+  size_t remaining = length;
+  size_t idx = 0;
+  while (remaining > 0) {
+    arm_timer(&conn->timer, conn->settings->write_timeout);
+    ssize_t n = write(conn->fd, data + idx, remaining);
+    if (n <= 0) {
+      perror("write");
+      cancel_timer(&conn->timer);
+      conn->keep_alive = false;
+      return -1;
+    }
+    idx += n;
+    remaining -= n;
+  }
+  cancel_timer(&conn->timer);
+  return 0;
+}
+
+/**
+ * @brief Streams `size` bytes of an open file to a connection.
+ *
+ * The file is sent in STREAM_CHUNK_SIZE pieces with `sendfile`, so the data
+ * goes from the page cache to the socket without passing through user space.
+ * If the file or socket does not support `sendfile`, the pieces are `pread`
+ * into one reusable buffer instead. Either way the memory used does not grow
+ * with the file. A `POSIX_FADV_WILLNEED` hint is issued for every
+ * STREAM_READAHEAD window ahead of the data being sent.
+ *
+ * @param conn The open connection.
+ * @param fd The file descriptor of the file to send.
+ * @param size The number of bytes to send from the start of the file.
+ * @return 0 on success, or -1 on error.
+ */
+int write_file_to_conn(connection_t *conn, int fd, size_t size) {
+  unsigned char buffer[STREAM_CHUNK_SIZE];
+  off_t offset = 0;
+  off_t next_hint = STREAM_READAHEAD;
+  bool use_sendfile = true;
+  while ((size_t)offset < size) {
+    if (offset >= next_hint) {
+      posix_fadvise(fd, next_hint, STREAM_READAHEAD, POSIX_FADV_WILLNEED);
+      next_hint += STREAM_READAHEAD;
+    }
+    size_t to_send = size - offset < STREAM_CHUNK_SIZE ? size - offset
+                                                       : STREAM_CHUNK_SIZE;
+    if (use_sendfile) {
+      arm_timer(&conn->timer, conn->settings->write_timeout);
+      ssize_t n = sendfile(conn->fd, fd, &offset, to_send);
+      if (n > 0) {
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        use_sendfile = false;
+        continue;
+      }
+      perror("sendfile");
+      cancel_timer(&conn->timer);
+      conn->keep_alive = false;
+      return -1;
+    }
+    ssize_t n = pread(fd, buffer, to_send, offset);
+    if (n <= 0) {
+      perror("pread");
+      conn->keep_alive = false;
+      return -1;
+    }
+    if (write_to_conn(conn, buffer, n) < 0) {
+      return -1;
+    }
+    offset += n;
+  }
+  cancel_timer(&conn->timer);
+  return 0;
+}
+
+/**
+ * @brief Writes a list of buffers to a connection with `writev`.
+ *
+ * Partial writes are resumed where they stopped, so the buffers are sent
+ * completely and in order without being copied together first. The entries
+ * of `iov` are modified. On error the connection is marked as not reusable.
+ *
+ * @param conn The open connection.
+ * @param iov The buffers to write.
+ * @param count The number of buffers.
+ * @return 0 on success, or -1 on error.
+ */
+int write_iov_to_conn(connection_t *conn, struct iovec *iov, int count) {
+  size_t remaining = 0;
+  for (int i = 0; i < count; i++) {
+    remaining += iov[i].iov_len;
+  }
+  int iov_index = 0;
+  while (remaining > 0) {
+    arm_timer(&conn->timer, conn->settings->write_timeout);
+    ssize_t n = writev(conn->fd, iov + iov_index, count - iov_index);
+    if (n <= 0) {
+      perror("writev");
+      cancel_timer(&conn->timer);
+      conn->keep_alive = false;
+      return -1;
+    }
+    remaining -= n;
+    while (iov_index < count && (size_t)n >= iov[iov_index].iov_len) {
+      n -= iov[iov_index].iov_len;
+      iov_index++;
+    }
+    if (iov_index < count) {
+      iov[iov_index].iov_base = (char *)iov[iov_index].iov_base + n;
+      iov[iov_index].iov_len -= n;
+    }
+  }
+  cancel_timer(&conn->timer);
+  return 0;
+}
+
+/**
+ * @brief Writes one chunk of a chunked response body.
+ *
+ * The chunk size line, the data and the closing line break are written with a
+ * single `writev`, so streaming a response costs one system call per chunk
+ * and no copy of the data. Empty chunks are skipped, since a zero-length chunk
+ * would terminate the body; use write_last_chunk() for that.
+ *
+ * @param conn The open connection.
+ * @param data The chunk data.
+ * @param size The size of the chunk data in bytes.
+ * @return 0 on success, or -1 on error.
+ */
+int write_chunk(connection_t *conn, const unsigned char *data, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  char size_line[32];
+  int size_line_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+  struct iovec iov[3] = {{size_line, size_line_len},
+                         {(void *)data, size},
+                         {CRLF, 2}};
+  return write_iov_to_conn(conn, iov, 3);
+}
+
+/**
+ * @brief Terminates a chunked response body.
+ *
+ * @param conn The open connection.
+ * @return 0 on success, or -1 on error.
+ */
+int write_last_chunk(connection_t *conn) {
+  return write_to_conn(conn, (unsigned char *)"0" CRLF CRLF, 5);
+}
+
+/**
+ * @brief Destroys a connection and closes its socket.
+ *
+ * @param conn The connection to destroy. If NULL, the function does nothing.
+ */
+void destroy_connection(connection_t *conn) {
+  if (!conn) {
+    return;
+  }
+  cancel_timer(&conn->timer);
+  close(conn->fd);
+  free(conn);
+}
@@ -0,0 +1,37 @@
+#ifndef CONNECTION
+#define CONNECTION
+#include "settings.h"
+#include "timer.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+typedef struct connection {
+  int fd;
+  int worker;
+  uint32_t peer;
+  const settings_t *settings;
+  size_t capacity;
+  size_t start;
+  size_t end;
+  bool keep_alive;
+  int requests;
+  struct timespec received;
+  wheel_timer_t timer;
+  unsigned char buffer[];
+} connection_t;
+
+connection_t *create_connection(int fd);
+void cork_connection(connection_t *conn, bool corked);
+ssize_t fill_connection(connection_t *conn);
+ssize_t read_connection(connection_t *conn, unsigned char *buf, size_t count);
+int write_to_conn(connection_t *conn, unsigned char *data, size_t length);
+int write_file_to_conn(connection_t *conn, int fd, size_t size);
+int write_iov_to_conn(connection_t *conn, struct iovec *iov, int count);
+int write_chunk(connection_t *conn, const unsigned char *data, size_t size);
+int write_last_chunk(connection_t *conn);
+void destroy_connection(connection_t *conn);
+#endif // !CONNECTION
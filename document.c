@@ -1,10 +1,14 @@
 #include "document.h"
 #include "config.h"
+#include "connection.h"
 #include "header.h"
+#include "slab.h"
 #include "utils.h"
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 /**
  * @brief Creates a new document with the given header and body.
@@ -26,19 +30,21 @@ document_t *create_document(header_t *header, body_t *body,
     header->response_line = create_response_line(OK, VERSION);
     header->type = type;
   }
-  document_t *document = malloc(sizeof(document_t));
+  document_t *document = allocate_object(SLAB_DOCUMENT);
   if (document == NULL) {
     return NULL;
   }
   document->header = header;
+  document->body_stream = NULL;
   if (!body) {
     document->body = NULL;
     return document;
   }
   document->body = body;
+  char content_length[32];
+  snprintf(content_length, sizeof(content_length), "%zu", body->size);
   attach_header(document->header,
-                create_header_item("content-length",
-                                   size_t_to_string(document->body->size)));
+                create_header_item("content-length", content_length));
   return document;
 }
 
@@ -46,7 +52,8 @@ document_t *create_document(header_t *header, body_t *body,
  * @brief Serializes a document object into a byte array.
  *
  * The serialized data includes the header and the body of the document, if it
- * is not empty.
+ * is not empty and held in memory. The returned buffer is NUL-terminated, but
+ * the terminator is not counted in `size`.
  *
  * @param document Pointer to the document object to serialize.
  * @param size Pointer to a variable that will hold the size of the serialized
@@ -57,20 +64,71 @@ unsigned char *serialize_document(document_t *document, size_t *size) {
   unsigned char *header = serialize_header(document->header);
   size_t header_len = strlen((char *)header);
   size_t total_len = header_len + 1; // +1 for '\0'
-  if (document->body) {
+  bool in_memory = document->body && document->body->data;
+  if (in_memory) {
     total_len += document->body->size;
   }
   unsigned char *output = malloc(total_len);
-  if (!output)
+  if (!output) {
+    free(header);
     return NULL;
+  }
   memcpy(output, header, header_len);
-  if (document->body)
+  if (in_memory)
     memcpy(output + header_len, document->body->data, document->body->size);
-  *size = total_len;
+  free(header);
+  *size = total_len - 1;
   output[total_len - 1] = '\0';
   return output;
 }
 
+/**
+ * @brief Sends a document over a connection.
+ *
+ * The header and an in-memory body, whether it was read, is shared with a
+ * cache or is mapped, are written together with `writev` straight from where
+ * they live, so the body is never copied. A body backed by a file is streamed
+ * from the file after the header, so large files are never held in memory;
+ * the connection is corked meanwhile so the header goes out in the same
+ * packets as the start of the body. If the connection will not be reused
+ * after this response, its `connection` header is changed to `close`.
+ *
+ * @param document The document to send.
+ * @param conn The connection to send the document on.
+ * @return 0 on success, or -1 on error.
+ */
+int send_document(document_t *document, connection_t *conn) {
+  if (!conn->keep_alive) {
+    set_header_item(document->header, "connection", "close");
+    remove_header_item(document->header, "keep-alive");
+  }
+  body_t *body = document->body;
+  bool from_file = body && body->fd >= 0;
+  unsigned char *header = serialize_header(document->header);
+  if (!header) {
+    return -1;
+  }
+  struct iovec iov[2] = {{header, strlen((char *)header)}, {NULL, 0}};
+  int count = 1;
+  if (body && body->data && !from_file) {
+    iov[1].iov_base = body->data;
+    iov[1].iov_len = body->size;
+    count = 2;
+  }
+  if (from_file) {
+    cork_connection(conn, true);
+  }
+  int result = write_iov_to_conn(conn, iov, count);
+  free(header);
+  if (result == 0 && from_file) {
+    result = write_file_to_conn(conn, body->fd, body->size);
+  }
+  if (from_file) {
+    cork_connection(conn, false);
+  }
+  return result;
+}
+
 /**
  * @brief Destroys a document and its components.
  *
@@ -90,5 +148,6 @@ void destroy_document(document_t *document) {
   if (document->body) {
     destroy_body(document->body);
   }
-  free(document);
+  destroy_body_stream(document->body_stream);
+  free_object(SLAB_DOCUMENT, document);
 }
@@ -7,11 +7,13 @@
 typedef struct document {
   header_t *header;
   body_t *body;
+  body_stream_t *body_stream;
 } document_t;
 
 document_t *create_document(header_t *header, body_t *body,
                             DOCUMENT_TYPE_T type);
 unsigned char *serialize_document(document_t *document, size_t *size);
+int send_document(document_t *document, connection_t *conn);
 void destroy_document(document_t *document);
 
 #endif // !DOCUMENT
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+#include "embed.h"
+#include "bundle.h"
+#include "config.h"
+#include "header.h"
+#include "response.h"
+#include "settings.h"
+#include "slab.h"
+#include "utils.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @brief Hashes a request path for the embedded asset table.
+ *
+ * This is FNV-1a with the seed folded into the offset basis, followed by a
+ * final avalanche so that the low bits used to index the table depend on
+ * every byte of the path.
+ */
+static uint32_t hash_asset_path(const char *path, uint32_t seed) {
+  uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+  for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+    hash = (hash ^ *p) * 0x100000001b3ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return (uint32_t)hash;
+}
+
+/**
+ * @brief Moves the paths of one bucket to free slots of the table.
+ *
+ * Seeds are tried in order until every path of the bucket hashes to a slot
+ * that is free and not taken by another path of the same bucket.
+ *
+ * @return The seed, or 0 if none up to EMBED_MAX_SEED works.
+ */
+static uint32_t place_bucket(const packed_file_t *files, const size_t *members,
+                             size_t count, uint32_t mask, int32_t *slots,
+                             uint32_t *chosen) {
+  for (uint32_t seed = 1; seed < EMBED_MAX_SEED; seed++) {
+    size_t placed = 0;
+    while (placed < count) {
+      uint32_t slot = hash_asset_path(files[members[placed]].path, seed) & mask;
+      bool taken = slots[slot] >= 0;
+      for (size_t i = 0; !taken && i < placed; i++) {
+        taken = chosen[i] == slot;
+      }
+      if (taken) {
+        break;
+      }
+      chosen[placed++] = slot;
+    }
+    if (placed == count) {
+      for (size_t i = 0; i < count; i++) {
+        slots[chosen[i]] = (int32_t)members[i];
+      }
+      return seed;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Builds a perfect hash over the paths of `files`.
+ *
+ * The paths are first hashed with seed 0 into `table_size` buckets. Starting
+ * with the fullest, every bucket then gets the first seed that moves all of
+ * its paths to free slots, so a lookup is two hashes and one string
+ * comparison and never probes.
+ *
+ * @param files The files, sorted by path.
+ * @param count The number of files.
+ * @param table_size The number of buckets and slots, a power of two.
+ * @param seeds Receives the seed of every bucket.
+ * @param slots Receives the file index of every slot, or -1 if it is empty.
+ * @return 0 on success, or -1 if no perfect hash was found.
+ */
+static int build_perfect_hash(const packed_file_t *files, size_t count,
+                              uint32_t table_size, uint32_t *seeds,
+                              int32_t *slots) {
+  uint32_t mask = table_size - 1;
+  uint32_t *buckets = malloc((count ? count : 1) * sizeof(uint32_t));
+  uint32_t *sizes = calloc(table_size, sizeof(uint32_t));
+  size_t *members = malloc((count ? count : 1) * sizeof(size_t));
+  uint32_t *chosen = malloc((count ? count : 1) * sizeof(uint32_t));
+  int result = buckets && sizes && members && chosen ? 0 : -1;
+  uint32_t largest = 0;
+  for (size_t i = 0; result == 0 && i < count; i++) {
+    buckets[i] = hash_asset_path(files[i].path, 0) & mask;
+    if (++sizes[buckets[i]] > largest) {
+      largest = sizes[buckets[i]];
+    }
+  }
+  for (uint32_t i = 0; i < table_size; i++) {
+    seeds[i] = 0;
+    slots[i] = -1;
+  }
+  for (uint32_t size = largest; result == 0 && size > 0; size--) {
+    for (uint32_t bucket = 0; result == 0 && bucket < table_size; bucket++) {
+      if (sizes[bucket] != size) {
+        continue;
+      }
+      size_t n = 0;
+      for (size_t i = 0; i < count; i++) {
+        if (buckets[i] == bucket) {
+          members[n++] = i;
+        }
+      }
+      seeds[bucket] = place_bucket(files, members, n, mask, slots, chosen);
+      if (seeds[bucket] == 0) {
+        result = -1;
+      }
+    }
+  }
+  free(buckets);
+  free(sizes);
+  free(members);
+  free(chosen);
+  return result;
+}
+
+/**
+ * @brief Writes a string as a C string literal, or `NULL`.
+ */
+static void write_c_string(FILE *out, const char *s) {
+  if (!s) {
+    fputs("NULL", out);
+    return;
+  }
+  fputc('"', out);
+  for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      fprintf(out, "\\%c", *p);
+    } else if (*p < 0x20 || *p >= 0x7f || *p == '?') {
+      fprintf(out, "\\%03o", *p);
+    } else {
+      fputc(*p, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void write_c_bytes(FILE *out, const unsigned char *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    fprintf(out, "%s0x%02x,", i % 12 == 0 ? "\n    " : " ", data[i]);
+  }
+}
+
+/**
+ * @brief Writes one prebuilt response of an asset as a byte array.
+ *
+ * The array holds the status line and every header that does not depend on
+ * the connection, immediately followed by the body. Only the date and the
+ * connection headers are left for send_embedded_asset() to fill in.
+ *
+ * @param out The generated source file.
+ * @param name The name of the array.
+ * @param file The file the response is for.
+ * @param gzip Whether to write the gzip variant.
+ * @param head_size Receives the size of the status line and headers.
+ * @return 0 on success, or -1 on error.
+ */
+static int write_embedded_response(FILE *out, const char *name,
+                                   const packed_file_t *file, bool gzip,
+                                   size_t *head_size) {
+  char *head = NULL;
+  size_t size = 0;
+  FILE *stream = open_memstream(&head, &size);
+  if (!stream) {
+    return -1;
+  }
+  fprintf(stream, "%s 200 OK\r\n", VERSION);
+  fprintf(stream, "server: kr4nkenserver\r\nserver-version: 0.1alpha\r\n");
+  if (file->content_type) {
+    fprintf(stream, "content-type: %s\r\n", file->content_type);
+  }
+  fprintf(stream, "content-length: %zu\r\n",
+          gzip ? file->gzip_size : file->size);
+  if (gzip) {
+    fprintf(stream, "etag: %.*s-gzip\"\r\n", (int)strlen(file->etag) - 1,
+            file->etag);
+  } else {
+    fprintf(stream, "etag: %s\r\n", file->etag);
+  }
+  char date[HTTP_DATE_SIZE];
+  format_http_date(file->mtime, date, sizeof(date));
+  fprintf(stream, "last-modified: %s\r\n", date);
+  if (file->gzip) {
+    fprintf(stream, "vary: accept-encoding\r\n");
+  }
+  if (gzip) {
+    fprintf(stream, "content-encoding: gzip\r\n");
+  }
+  if (fclose(stream) != 0) {
+    free(head);
+    return -1;
+  }
+  fprintf(out, "static const unsigned char %s[] = {", name);
+  write_c_bytes(out, (unsigned char *)head, size);
+  write_c_bytes(out, gzip ? file->gzip : file->data,
+                gzip ? file->gzip_size : file->size);
+  fprintf(out, "\n};\n\n");
+  free(head);
+  *head_size = size;
+  return 0;
+}
+
+/**
+ * @brief Writes the C source that embeds `files` into the server.
+ */
+static int write_embedded_source(FILE *out, const char *directory,
+                                 const packed_file_t *files, size_t count,
+                                 uint32_t table_size, const uint32_t *seeds,
+                                 const int32_t *slots) {
+  size_t *heads = calloc(count ? count * 2 : 1, sizeof(size_t));
+  if (!heads) {
+    return -1;
+  }
+  fprintf(out, "/* Generated by `kr4nkenserver embed` from %s. Do not edit. "
+               "*/\n", directory);
+  fprintf(out, "#ifdef EMBED_ASSETS\n#include \"embed.h\"\n\n");
+  int result = 0;
+  for (size_t i = 0; result == 0 && i < count; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "asset_%zu", i);
+    result = write_embedded_response(out, name, &files[i], false,
+                                     &heads[i * 2]);
+    if (result == 0 && files[i].gzip) {
+      snprintf(name, sizeof(name), "asset_%zu_gzip", i);
+      result = write_embedded_response(out, name, &files[i], true,
+                                       &heads[i * 2 + 1]);
+    }
+  }
+  fprintf(out, "const embedded_asset_t embedded_assets[] = {\n");
+  for (size_t i = 0; result == 0 && i < count; i++) {
+    const packed_file_t *file = &files[i];
+    fprintf(out, "    {");
+    write_c_string(out, file->path);
+    fprintf(out, ",\n     ");
+    write_c_string(out, file->content_type);
+    fprintf(out, ",\n     ");
+    write_c_string(out, file->etag);
+    fprintf(out, ",\n     %lldLL,\n     {asset_%zu, %zu, %zu},\n",
+            (long long)file->mtime, i, heads[i * 2], file->size);
+    if (file->gzip) {
+      fprintf(out, "     {asset_%zu_gzip, %zu, %zu}},\n", i, heads[i * 2 + 1],
+              file->gzip_size);
+    } else {
+      fprintf(out, "     {NULL, 0, 0}},\n");
+    }
+  }
+  if (count == 0) {
+    fprintf(out, "    {NULL},\n");
+  }
+  fprintf(out, "};\n\nconst size_t embedded_asset_count = %zu;\n", count);
+  fprintf(out, "const uint32_t embedded_asset_table_size = %u;\n", table_size);
+  fprintf(out, "const uint32_t embedded_asset_seeds[] = {");
+  for (uint32_t i = 0; i < table_size; i++) {
+    fprintf(out, "%s%u,", i % 8 == 0 ? "\n    " : " ", seeds[i]);
+  }
+  fprintf(out, "\n};\nconst int32_t embedded_asset_slots[] = {");
+  for (uint32_t i = 0; i < table_size; i++) {
+    fprintf(out, "%s%d,", i % 8 == 0 ? "\n    " : " ", slots[i]);
+  }
+  fprintf(out, "\n};\n#endif // EMBED_ASSETS\n");
+  free(heads);
+  return result;
+}
+
+/**
+ * @brief Generates the C source that compiles a directory into the server.
+ *
+ * Usage: `embed <source> [directory]`, where the directory defaults to
+ * TARGET_DIRECTORY. Every file becomes a read-only array that holds its
+ * complete `200 OK` response, plus one for its gzip variant when built with
+ * WITH_ZLIB, and the paths are indexed by a perfect hash. Building the server
+ * with `-DEMBED_ASSETS` and the generated source serves these files without
+ * touching the file system. Like a bundle, the source is written next to its
+ * final name and renamed into place.
+ *
+ * @param argc The number of arguments after the `embed` command.
+ * @param argv The arguments after the `embed` command.
+ * @return EXIT_SUCCESS if the source was written, EXIT_FAILURE otherwise.
+ */
+int embed_assets(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: embed <source> [directory]\n");
+    return EXIT_FAILURE;
+  }
+  const char *directory = argc > 1 ? argv[1] : TARGET_DIRECTORY;
+  packed_file_t *files = NULL;
+  size_t count = 0;
+  int result = load_packed_files(directory, &files, &count);
+  uint32_t table_size = 1;
+  while (result == 0 && table_size < count * 2) {
+    table_size *= 2;
+  }
+  uint32_t *seeds = malloc(table_size * sizeof(uint32_t));
+  int32_t *slots = malloc(table_size * sizeof(int32_t));
+  if (result == 0 && (!seeds || !slots)) {
+    result = -1;
+  }
+  if (result == 0 &&
+      build_perfect_hash(files, count, table_size, seeds, slots) < 0) {
+    fprintf(stderr, "embed: no perfect hash found for %zu files\n", count);
+    result = -1;
+  }
+  char *temporary = NULL;
+  if (result == 0 && asprintf(&temporary, "%s.tmp", argv[0]) < 0) {
+    temporary = NULL;
+    result = -1;
+  }
+  if (result == 0) {
+    FILE *out = fopen(temporary, "w");
+    result = out ? write_embedded_source(out, directory, files, count,
+                                         table_size, seeds, slots)
+                 : -1;
+    if (out && fclose(out) != 0) {
+      result = -1;
+    }
+    if (result == 0 && rename(temporary, argv[0]) < 0) {
+      result = -1;
+    }
+    if (result < 0) {
+      perror(argv[0]);
+      unlink(temporary);
+    }
+  }
+  destroy_packed_files(files, count);
+  free(seeds);
+  free(slots);
+  free(temporary);
+  if (result < 0) {
+    return EXIT_FAILURE;
+  }
+  printf("embedded %zu files from %s into %s\n", count, directory, argv[0]);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Looks up a request target among the embedded assets.
+ *
+ * Targets ending in a slash resolve to `default_index`, as they do on disk.
+ * The path is composed on the stack, so a lookup never allocates.
+ *
+ * @param target The request target.
+ * @return The asset, or NULL if the target is not embedded or the server was
+ * built without EMBED_ASSETS.
+ */
+const embedded_asset_t *find_embedded_asset(const char *target) {
+#ifdef EMBED_ASSETS
+  char path[PATH_MAX];
+  size_t length = strlen(target);
+  if (length > 0 && target[length - 1] == '/') {
+    int n = snprintf(path, sizeof(path), "%s%s", target,
+                     get_settings()->default_index);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+      return NULL;
+    }
+    target = path;
+  }
+  uint32_t mask = embedded_asset_table_size - 1;
+  uint32_t bucket = hash_asset_path(target, 0) & mask;
+  uint32_t slot =
+      hash_asset_path(target, embedded_asset_seeds[bucket]) & mask;
+  int32_t index = embedded_asset_slots[slot];
+  if (index < 0 || strcmp(embedded_assets[index].path, target) != 0) {
+    return NULL;
+  }
+  return &embedded_assets[index];
+#else
+  (void)target;
+  return NULL;
+#endif
+}
+
+/**
+ * @brief Sends the prebuilt response of an embedded asset.
+ *
+ * The head and the body are written straight from the read-only arrays, so
+ * nothing is allocated or copied. A HEAD request gets the same head without
+ * the body.
+ *
+ * @param asset The asset to send.
+ * @param conn The connection to send the response on.
+ * @param gzip Whether the client accepts a gzip-encoded body.
+ * @param head Whether to leave out the body.
+ * @return 0 on success, or -1 on error.
+ */
+int send_embedded_asset(const embedded_asset_t *asset, connection_t *conn,
+                        bool gzip, bool head) {
+  const embedded_response_t *response =
+      gzip && asset->gzip.data ? &asset->gzip : &asset->identity;
+  return send_prebuilt_response(conn, response->data, response->head_size,
+                                response->data + response->head_size,
+                                head ? 0 : response->body_size);
+}
+
+/**
+ * @brief Creates a response document for an embedded asset.
+ *
+ * This is used where a document is needed rather than raw bytes, such as for
+ * HTTP/2 streams. The body points into the embedded array, so it is not
+ * copied.
+ *
+ * @param asset The asset to respond with.
+ * @param gzip Whether the client accepts a gzip-encoded body.
+ * @param head Whether to leave out the body.
+ * @return The response document, or NULL if an error occurred.
+ */
+document_t *create_embedded_response(const embedded_asset_t *asset, bool gzip,
+                                     bool head) {
+  bool compressed = gzip && asset->gzip.data;
+  const embedded_response_t *response =
+      compressed ? &asset->gzip : &asset->identity;
+  body_t *body = allocate_object(SLAB_BODY);
+  if (!body) {
+    return NULL;
+  }
+  body->data =
+      head ? NULL : (unsigned char *)response->data + response->head_size;
+  body->size = response->body_size;
+  body->fd = -1;
+  body->mapped = !head;
+  body->mtime = asset->mtime;
+  body->shared = NULL;
+  body->bundle = NULL;
+  document_t *document = create_response(OK, body);
+  if (!document) {
+    destroy_body(body);
+    return NULL;
+  }
+  if (asset->content_type) {
+    attach_header(document->header,
+                  create_header_item("content-type",
+                                     (char *)asset->content_type));
+  }
+  char etag[64];
+  snprintf(etag, sizeof(etag), compressed ? "%.*s-gzip\"" : "%.*s",
+           (int)strlen(asset->etag) - (compressed ? 1 : 0), asset->etag);
+  attach_validators(document->header, etag, asset->mtime);
+  if (asset->gzip.data) {
+    attach_header(document->header,
+                  create_header_item("vary", "accept-encoding"));
+  }
+  if (compressed) {
+    attach_header(document->header,
+                  create_header_item("content-encoding", "gzip"));
+  }
+  return document;
+}
@@ -0,0 +1,38 @@
+#ifndef EMBED
+#define EMBED
+#include "connection.h"
+#include "document.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct embedded_response {
+  const unsigned char *data;
+  size_t head_size;
+  size_t body_size;
+} embedded_response_t;
+
+typedef struct embedded_asset {
+  const char *path;
+  const char *content_type;
+  const char *etag;
+  int64_t mtime;
+  embedded_response_t identity;
+  embedded_response_t gzip;
+} embedded_asset_t;
+
+#ifdef EMBED_ASSETS
+extern const embedded_asset_t embedded_assets[];
+extern const size_t embedded_asset_count;
+extern const uint32_t embedded_asset_seeds[];
+extern const int32_t embedded_asset_slots[];
+extern const uint32_t embedded_asset_table_size;
+#endif
+
+int embed_assets(int argc, char *argv[]);
+const embedded_asset_t *find_embedded_asset(const char *target);
+int send_embedded_asset(const embedded_asset_t *asset, connection_t *conn,
+                        bool gzip, bool head);
+document_t *create_embedded_response(const embedded_asset_t *asset, bool gzip,
+                                     bool head);
+#endif // !EMBED
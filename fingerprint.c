@@ -0,0 +1,496 @@
+#define _GNU_SOURCE
+#include "fingerprint.h"
+#include "config.h"
+#include "html.h"
+#include "iopool.h"
+#include "settings.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct digest_slot {
+  char *path;
+  time_t mtime;
+  off_t size;
+  uint64_t digest;
+  uint64_t checked;
+} digest_slot_t;
+
+typedef struct digest_check {
+  bool found;
+  uint64_t digest;
+  char path[];
+} digest_check_t;
+
+typedef struct output_buffer {
+  unsigned char *data;
+  size_t length;
+  size_t capacity;
+} output_buffer_t;
+
+static digest_slot_t digests[FINGERPRINT_SLOTS];
+static pthread_mutex_t digest_locks[FINGERPRINT_LOCKS];
+static pthread_once_t digest_locks_once = PTHREAD_ONCE_INIT;
+static atomic_ulong digest_reads = 0;
+static atomic_ulong rewritten_files = 0;
+static atomic_ulong stale_files = 0;
+
+static uint64_t hash_bytes(uint64_t hash, const unsigned char *data,
+                           size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * @brief Hashes the contents of a file, reading it in fixed-size blocks.
+ *
+ * @return The FNV-1a hash truncated to FINGERPRINT_DIGITS hex digits, or 0 if
+ * the file cannot be read.
+ */
+static uint64_t hash_file(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  unsigned char *block = malloc(FINGERPRINT_READ_SIZE);
+  if (fd < 0 || !block) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(block);
+    return 0;
+  }
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  ssize_t length;
+  while ((length = read(fd, block, FINGERPRINT_READ_SIZE)) > 0) {
+    hash = hash_bytes(hash, block, length);
+  }
+  close(fd);
+  free(block);
+  atomic_fetch_add(&digest_reads, 1);
+  if (length < 0) {
+    return 0;
+  }
+  return (hash >> (64 - 4 * FINGERPRINT_DIGITS)) | 1;
+}
+
+static void init_digest_locks() {
+  for (int i = 0; i < FINGERPRINT_LOCKS; i++) {
+    pthread_mutex_init(&digest_locks[i], NULL);
+  }
+}
+
+static uint64_t now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static digest_slot_t *find_digest_slot(const char *path,
+                                       pthread_mutex_t **lock) {
+  size_t index = hash_bytes(0xcbf29ce484222325ULL,
+                            (const unsigned char *)path, strlen(path)) %
+                 FINGERPRINT_SLOTS;
+  *lock = &digest_locks[index % FINGERPRINT_LOCKS];
+  return &digests[index];
+}
+
+/**
+ * @brief Stats a file and reads its digest again if it changed since it was
+ * last hashed. Runs on the I/O pool.
+ */
+static void run_digest_check(void *arg) {
+  digest_check_t *check = arg;
+  pthread_mutex_t *lock;
+  digest_slot_t *slot = find_digest_slot(check->path, &lock);
+  struct stat st;
+  check->found = false;
+  if (stat(check->path, &st) < 0 || !S_ISREG(st.st_mode)) {
+    return;
+  }
+  uint64_t now = now_ms();
+  pthread_mutex_lock(lock);
+  if (slot->path && strcmp(slot->path, check->path) == 0 &&
+      slot->mtime == st.st_mtime && slot->size == st.st_size) {
+    slot->checked = now;
+    check->digest = slot->digest;
+    check->found = true;
+    pthread_mutex_unlock(lock);
+    return;
+  }
+  pthread_mutex_unlock(lock);
+  uint64_t hash = hash_file(check->path);
+  char *key = strdup(check->path);
+  if (hash == 0 || !key) {
+    free(key);
+    return;
+  }
+  pthread_mutex_lock(lock);
+  free(slot->path);
+  slot->path = key;
+  slot->mtime = st.st_mtime;
+  slot->size = st.st_size;
+  slot->digest = hash;
+  slot->checked = now;
+  pthread_mutex_unlock(lock);
+  check->digest = hash;
+  check->found = true;
+}
+
+/**
+ * @brief Gets the content digest of a file.
+ *
+ * Digests are kept in a fixed table keyed by path and checked against the
+ * modification time and size of the file, so a file is only read again once
+ * it changes. A digest checked less than FINGERPRINT_CHECK_MS milliseconds
+ * ago is trusted without calling `stat`, so serving a cached document does
+ * not stat every asset it references on every request; that is no coarser
+ * than the one second resolution of the modification time. The `stat`, and
+ * the read of a changed file, are done on the I/O pool with call_io(). The
+ * table is direct mapped: a path evicts whichever path held its slot before.
+ * Its slots are guarded by FINGERPRINT_LOCKS striped locks, none of which is
+ * held while a file is stat'ed or read.
+ *
+ * @param path The path of the file.
+ * @param digest Receives the digest.
+ * @return True on success, false if the path does not name a readable regular
+ * file, or with `errno` set to ETIMEDOUT or EAGAIN if it could not be checked
+ * in time.
+ */
+bool get_asset_digest(const char *path, uint64_t *digest) {
+  pthread_mutex_t *lock;
+  digest_slot_t *slot = find_digest_slot(path, &lock);
+  uint64_t now = now_ms();
+  pthread_once(&digest_locks_once, init_digest_locks);
+  pthread_mutex_lock(lock);
+  bool fresh = slot->path && strcmp(slot->path, path) == 0 &&
+               now - slot->checked < FINGERPRINT_CHECK_MS;
+  *digest = slot->digest;
+  pthread_mutex_unlock(lock);
+  if (fresh) {
+    return true;
+  }
+  digest_check_t *check = malloc(sizeof(digest_check_t) + strlen(path) + 1);
+  if (!check) {
+    return false;
+  }
+  strcpy(check->path, path);
+  if (!call_io(run_digest_check, free, check)) {
+    return false;
+  }
+  bool found = check->found;
+  *digest = check->digest;
+  free(check);
+  if (!found) {
+    errno = ENOENT;
+  }
+  return found;
+}
+
+static bool append_output(output_buffer_t *out, const void *data,
+                          size_t length) {
+  if (out->length + length > out->capacity) {
+    size_t capacity = (out->length + length) * 2;
+    unsigned char *tmp = realloc(out->data, capacity + 1);
+    if (!tmp) {
+      return false;
+    }
+    out->data = tmp;
+    out->capacity = capacity;
+  }
+  memcpy(out->data + out->length, data, length);
+  out->length += length;
+  return true;
+}
+
+/**
+ * @brief Finds where a fingerprint goes in a URL: before the extension of its
+ * last segment, or at its end if it has none.
+ */
+static size_t find_fingerprint_offset(const char *url, size_t length) {
+  size_t segment = length;
+  while (segment > 0 && url[segment - 1] != '/') {
+    segment--;
+  }
+  for (size_t i = length; i > segment + 1; i--) {
+    if (url[i - 1] == '.') {
+      return i - 1;
+    }
+  }
+  return length;
+}
+
+/**
+ * @brief Resolves a reference in an HTML file to the path of the file it
+ * names, or NULL if it does not name a local static file.
+ *
+ * References with a query or fragment, or that climb out of their directory,
+ * are left alone, as are other HTML files: they are not served as immutable.
+ */
+static char *resolve_asset(const char *directory, const char *url,
+                           size_t length) {
+  if (!is_local_url(url, length) || memchr(url, '?', length) ||
+      memchr(url, '#', length) || memmem(url, length, "..", 2)) {
+    return NULL;
+  }
+  const char *prefix = url[0] == '/' ? "" : directory;
+  size_t size = strlen(prefix) + length + 1;
+  char *target = malloc(size);
+  if (!target) {
+    return NULL;
+  }
+  snprintf(target, size, "%s%.*s", prefix, (int)length, url);
+  char *path = is_html_path(target) ? NULL : translate_target(target);
+  free(target);
+  return path;
+}
+
+/**
+ * @brief Splits the fingerprint off the last segment of a URL.
+ *
+ * Recognizes `name.<digest>.ext` and `name.<digest>`, where the digest is
+ * FINGERPRINT_DIGITS lowercase hex digits.
+ *
+ * @return The URL without its fingerprint, or NULL if it has none.
+ */
+static char *strip_fingerprint(const char *url, size_t length,
+                               uint64_t *digest) {
+  size_t extension = find_fingerprint_offset(url, length);
+  size_t forms[] = {extension, length};
+  for (int i = 0; i < 2; i++) {
+    size_t end = forms[i];
+    if (end < FINGERPRINT_DIGITS + 2) {
+      continue;
+    }
+    size_t start = end - FINGERPRINT_DIGITS;
+    if (url[start - 1] != '.' || url[start - 2] == '/') {
+      continue;
+    }
+    uint64_t value = 0;
+    size_t j = start;
+    for (; j < end && strchr("0123456789abcdef", url[j]); j++) {
+      value = value << 4 | (url[j] <= '9' ? url[j] - '0' : url[j] - 'a' + 10);
+    }
+    char *stripped = j == end ? malloc(length - FINGERPRINT_DIGITS) : NULL;
+    if (!stripped) {
+      continue;
+    }
+    memcpy(stripped, url, start - 1);
+    memcpy(stripped + start - 1, url + end, length - end);
+    stripped[length - FINGERPRINT_DIGITS - 1] = '\0';
+    *digest = value;
+    return stripped;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Rewrites the references an HTML file makes to static files to their
+ * fingerprinted URLs.
+ *
+ * Called when a file is loaded into memory, before it is cached, so the
+ * rewrite is paid once per load. Every stylesheet, script, image, icon and
+ * preload that names a file under `target_directory` gets the content digest
+ * of that file inserted before its extension, `app.css` becoming
+ * `app.<digest>.css`, and is otherwise left as written. Those URLs are served
+ * as immutable, so a client never asks for an unchanged asset again. The
+ * file's size is replaced with the size of the rewritten document; its
+ * `source_size` still matches the file on disk.
+ *
+ * @param path The path of the file.
+ * @param file The loaded file. Does nothing unless it is HTML and
+ * `fingerprint` is on.
+ */
+void rewrite_fingerprints(const char *path, shared_file_t *file) {
+  if (!get_settings()->fingerprint || !is_html_path(path)) {
+    return;
+  }
+  char *directory = get_url_directory(path);
+  html_reference_t references[HTML_MAX_REFERENCES];
+  size_t count = directory ? find_html_references(file->data, file->size,
+                                                  references,
+                                                  HTML_MAX_REFERENCES)
+                           : 0;
+  output_buffer_t out = {0};
+  const char *copied = (const char *)file->data;
+  bool failed = false;
+  for (size_t i = 0; i < count && !failed; i++) {
+    html_reference_t *reference = &references[i];
+    char *asset = resolve_asset(directory, reference->url, reference->length);
+    uint64_t digest;
+    if (!asset || !get_asset_digest(asset, &digest)) {
+      free(asset);
+      continue;
+    }
+    free(asset);
+    size_t offset = find_fingerprint_offset(reference->url, reference->length);
+    char fingerprint[FINGERPRINT_DIGITS + 2];
+    snprintf(fingerprint, sizeof(fingerprint), ".%0*llx", FINGERPRINT_DIGITS,
+             (unsigned long long)digest);
+    failed = !append_output(&out, copied, reference->url + offset - copied) ||
+             !append_output(&out, fingerprint, FINGERPRINT_DIGITS + 1);
+    copied = reference->url + offset;
+  }
+  free(directory);
+  if (!out.data) {
+    return;
+  }
+  const char *end = (const char *)file->data + file->size;
+  if (failed || !append_output(&out, copied, end - copied)) {
+    free(out.data);
+    return;
+  }
+  out.data[out.length] = '\0';
+  free(file->data);
+  file->data = out.data;
+  file->size = out.length;
+  atomic_fetch_add(&rewritten_files, 1);
+  collect_fingerprints(path, file);
+}
+
+/**
+ * @brief Records the fingerprinted URLs an HTML document references.
+ *
+ * The digest of every asset a document was rewritten with is kept with it,
+ * so a cached copy can be checked with check_fingerprints() before it is
+ * served, and all of them are folded into the document's `version`, which its
+ * ETag carries. A copy from the shared cache only has the rewritten text, so
+ * the assets are read back from the URLs in it.
+ *
+ * @param path The path of the file.
+ * @param file The file, already rewritten by rewrite_fingerprints().
+ */
+void collect_fingerprints(const char *path, shared_file_t *file) {
+  if (!get_settings()->fingerprint || !is_html_path(path)) {
+    return;
+  }
+  char *directory = get_url_directory(path);
+  html_reference_t references[HTML_MAX_REFERENCES];
+  size_t count = directory ? find_html_references(file->data, file->size,
+                                                  references,
+                                                  HTML_MAX_REFERENCES)
+                           : 0;
+  fingerprint_asset_t *assets =
+      count > 0 ? calloc(count, sizeof(fingerprint_asset_t)) : NULL;
+  size_t found = 0;
+  uint64_t version = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; assets && i < count; i++) {
+    uint64_t digest, current;
+    char *url = strip_fingerprint(references[i].url, references[i].length,
+                                  &digest);
+    char *asset = url ? resolve_asset(directory, url, strlen(url)) : NULL;
+    free(url);
+    if (!asset || !get_asset_digest(asset, &current)) {
+      free(asset);
+      continue;
+    }
+    assets[found].path = asset;
+    assets[found].digest = digest;
+    version = hash_bytes(version, (const unsigned char *)&digest,
+                         sizeof(digest));
+    found++;
+  }
+  free(directory);
+  if (found == 0) {
+    free(assets);
+    return;
+  }
+  file->assets = assets;
+  file->asset_count = found;
+  file->version = version;
+}
+
+/**
+ * @brief Checks that the assets an HTML document was rewritten with are
+ * unchanged.
+ *
+ * An asset that cannot be checked within `io_timeout` is taken to be
+ * unchanged, so a stalled disk does not evict the cached document.
+ *
+ * @param file The file.
+ * @return True if every asset still has the digest its URL carries, false if
+ * the document must be loaded and rewritten again.
+ */
+bool check_fingerprints(const shared_file_t *file) {
+  for (size_t i = 0; i < file->asset_count; i++) {
+    uint64_t digest;
+    bool found = get_asset_digest(file->assets[i].path, &digest);
+    if (!found && (errno == ETIMEDOUT || errno == EAGAIN)) {
+      continue;
+    }
+    if (!found || digest != file->assets[i].digest) {
+      atomic_fetch_add(&stale_files, 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Frees the assets recorded with a file.
+ */
+void free_fingerprints(shared_file_t *file) {
+  for (size_t i = 0; i < file->asset_count; i++) {
+    free(file->assets[i].path);
+  }
+  free(file->assets);
+}
+
+/**
+ * @brief Translates a request target that may carry a fingerprint.
+ *
+ * A fingerprinted target is served from the file without its fingerprint.
+ * The response is only immutable if the fingerprint is the file's current
+ * digest; a stale one, from a page cached before the asset changed, gets the
+ * current file without the promise. A target whose unfingerprinted file does
+ * not exist is taken literally, so files whose names happen to look
+ * fingerprinted are still served. If the digest cannot be checked within
+ * `io_timeout`, the file without the fingerprint is served, but not as
+ * immutable.
+ *
+ * @param target The request target.
+ * @param immutable Receives whether the response may be cached forever.
+ * @return The translated target, as translate_target() returns it.
+ */
+char *translate_fingerprinted_target(const char *target, bool *immutable) {
+  *immutable = false;
+  uint64_t digest = 0;
+  char *stripped = get_settings()->fingerprint
+                       ? strip_fingerprint(target, strlen(target), &digest)
+                       : NULL;
+  if (!stripped) {
+    return translate_target(target);
+  }
+  char *translated = translate_target(stripped);
+  free(stripped);
+  uint64_t current;
+  if (translated && get_asset_digest(translated, &current)) {
+    *immutable = current == digest;
+    return translated;
+  }
+  if (translated && (errno == ETIMEDOUT || errno == EAGAIN)) {
+    return translated;
+  }
+  free(translated);
+  return translate_target(target);
+}
+
+/**
+ * @brief Writes the fingerprinting counters.
+ *
+ * @param out The stream to write to.
+ */
+void write_fingerprint_stats(FILE *out) {
+  if (!get_settings()->fingerprint) {
+    return;
+  }
+  fprintf(out, "fingerprint_digest_reads %lu\n", atomic_load(&digest_reads));
+  fprintf(out, "fingerprint_rewrites %lu\n", atomic_load(&rewritten_files));
+  fprintf(out, "fingerprint_stale %lu\n", atomic_load(&stale_files));
+}
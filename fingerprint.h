@@ -0,0 +1,20 @@
+#ifndef FINGERPRINT
+#define FINGERPRINT
+#include "flight.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct fingerprint_asset {
+  char *path;
+  uint64_t digest;
+} fingerprint_asset_t;
+
+bool get_asset_digest(const char *path, uint64_t *digest);
+void rewrite_fingerprints(const char *path, shared_file_t *file);
+void collect_fingerprints(const char *path, shared_file_t *file);
+bool check_fingerprints(const shared_file_t *file);
+void free_fingerprints(shared_file_t *file);
+char *translate_fingerprinted_target(const char *target, bool *immutable);
+void write_fingerprint_stats(FILE *out);
+#endif // !FINGERPRINT
@@ -0,0 +1,268 @@
+#include "flight.h"
+#include "cache.h"
+#include "config.h"
+#include "fingerprint.h"
+#include "hints.h"
+#include "iopool.h"
+#include "settings.h"
+#include "shmcache.h"
+#include "utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct flight {
+  char *key;
+  time_t mtime;
+  shared_file_t *result;
+  int error;
+  bool done;
+  int waiters;
+  pthread_cond_t landed;
+  io_job_t job;
+  struct flight *next;
+} flight_t;
+
+typedef struct flight_shard {
+  pthread_mutex_t lock;
+  flight_t *flights;
+} flight_shard_t;
+
+static flight_shard_t shards[FLIGHT_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static atomic_ulong file_loads = 0;
+static atomic_ulong coalesced_loads = 0;
+static atomic_ulong timed_out_loads = 0;
+
+static void init_shards() {
+  for (int i = 0; i < FLIGHT_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    shards[i].flights = NULL;
+  }
+}
+
+static flight_shard_t *get_shard(const char *key) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash = (hash ^ *p) * 0x100000001b3ULL;
+  }
+  return &shards[hash % FLIGHT_SHARDS];
+}
+
+static void unlink_flight(flight_shard_t *shard, flight_t *flight) {
+  for (flight_t **link = &shard->flights; *link; link = &(*link)->next) {
+    if (*link == flight) {
+      *link = flight->next;
+      return;
+    }
+  }
+}
+
+static void destroy_flight(flight_t *flight) {
+  release_shared_file(flight->result);
+  pthread_cond_destroy(&flight->landed);
+  free(flight->key);
+  free(flight);
+}
+
+/**
+ * @brief Reads a file into a new shared file, listing the subresources to
+ * preload if it is an HTML file.
+ */
+static shared_file_t *read_shared_file(const char *path) {
+  shared_file_t *file = malloc(sizeof(shared_file_t));
+  if (!file) {
+    return NULL;
+  }
+  file->data = load_file(path, &file->size);
+  if (!file->data) {
+    free(file);
+    return NULL;
+  }
+  file->source_size = file->size;
+  file->assets = NULL;
+  file->asset_count = 0;
+  file->version = 0;
+  rewrite_fingerprints(path, file);
+  file->links = scan_preload_links(path, file->data, file->size);
+  atomic_init(&file->refs, 1);
+  atomic_fetch_add(&file_loads, 1);
+  return file;
+}
+
+static void cache_file(const char *path, time_t mtime, shared_file_t *file) {
+  if (file) {
+    insert_cache(path, mtime, file);
+    store_shared_cache(path, mtime, file);
+  }
+}
+
+/**
+ * @brief Reads the file of a flight and hands it to the callers waiting for
+ * it.
+ *
+ * The file is put in the caches before the flight lands, so it is cached
+ * even if every caller gave up waiting. The last caller to leave frees the
+ * flight, or this function does if none is left.
+ */
+static void land_flight(flight_t *flight, int error) {
+  shared_file_t *file = error ? NULL : read_shared_file(flight->key);
+  cache_file(flight->key, flight->mtime, file);
+  flight_shard_t *shard = get_shard(flight->key);
+  pthread_mutex_lock(&shard->lock);
+  unlink_flight(shard, flight);
+  flight->result = file;
+  flight->error = error ? error : file ? 0 : ENOENT;
+  flight->done = true;
+  pthread_cond_broadcast(&flight->landed);
+  bool orphaned = flight->waiters == 0;
+  pthread_mutex_unlock(&shard->lock);
+  if (orphaned) {
+    destroy_flight(flight);
+  }
+}
+
+static void run_flight(void *arg) { land_flight(arg, 0); }
+
+/**
+ * @brief Starts the read of a flight.
+ *
+ * The read is handed to the I/O pool when it runs. Without a pool it is done
+ * right away by the calling thread. When the pool's queue is full, the flight
+ * lands at once with EAGAIN.
+ */
+static void launch_flight(flight_t *flight) {
+  flight->job.run = run_flight;
+  flight->job.arg = flight;
+  if (submit_io(&flight->job)) {
+    return;
+  }
+  land_flight(flight, is_io_pool_running() ? EAGAIN : 0);
+}
+
+/**
+ * @brief Loads a file into memory, sharing the load with concurrent callers.
+ *
+ * Loads are keyed by path. The first caller for a path starts a read of the
+ * file; callers that ask for the same path while that read is in flight wait
+ * for it and get the same buffer instead of reading the file again. This
+ * turns a burst of requests for a file that is not in memory, such as right
+ * after a deploy, into a single read. The file read is put in the content
+ * cache and the shared cache. Every caller gets its own reference and must
+ * give it back with release_shared_file().
+ *
+ * The reads are done by the I/O pool when it runs, and callers wait for them
+ * for at most `io_timeout`, so a stalled disk never holds a connection
+ * thread for longer. A read that outlasts its callers still completes and
+ * fills the caches.
+ *
+ * @param path The path of the file.
+ * @param mtime The modification time of the file, to cache it under.
+ * @return The file's contents, or NULL with `errno` set to ETIMEDOUT if the
+ * read took longer than `io_timeout`, to EAGAIN if the I/O pool was too busy
+ * to take it, or to another error if it could not be read.
+ */
+shared_file_t *load_shared_file(const char *path, time_t mtime) {
+  pthread_once(&shards_once, init_shards);
+  flight_shard_t *shard = get_shard(path);
+  pthread_mutex_lock(&shard->lock);
+  flight_t *flight = shard->flights;
+  while (flight && strcmp(flight->key, path) != 0) {
+    flight = flight->next;
+  }
+  if (flight) {
+    flight->waiters++;
+    atomic_fetch_add(&coalesced_loads, 1);
+  } else {
+    flight = calloc(1, sizeof(flight_t));
+    char *key = strdup(path);
+    if (!flight || !key) {
+      free(flight);
+      free(key);
+      pthread_mutex_unlock(&shard->lock);
+      shared_file_t *file = read_shared_file(path);
+      cache_file(path, mtime, file);
+      return file;
+    }
+    flight->key = key;
+    flight->mtime = mtime;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flight->landed, &attr);
+    pthread_condattr_destroy(&attr);
+    flight->next = shard->flights;
+    shard->flights = flight;
+    flight->waiters++;
+    pthread_mutex_unlock(&shard->lock);
+    launch_flight(flight);
+    pthread_mutex_lock(&shard->lock);
+  }
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  long timeout = get_settings()->io_timeout;
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += timeout % 1000 * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_nsec -= 1000000000L;
+    deadline.tv_sec++;
+  }
+  int waited = 0;
+  while (!flight->done && waited != ETIMEDOUT) {
+    waited = pthread_cond_timedwait(&flight->landed, &shard->lock, &deadline);
+  }
+  shared_file_t *file =
+      flight->result ? retain_shared_file(flight->result) : NULL;
+  int error = flight->done ? flight->error : ETIMEDOUT;
+  bool last = --flight->waiters == 0 && flight->done;
+  pthread_mutex_unlock(&shard->lock);
+  if (last) {
+    destroy_flight(flight);
+  }
+  if (error == ETIMEDOUT) {
+    atomic_fetch_add(&timed_out_loads, 1);
+  }
+  errno = error;
+  return file;
+}
+
+/**
+ * @brief Takes another reference to a shared file.
+ *
+ * @return The file.
+ */
+shared_file_t *retain_shared_file(shared_file_t *file) {
+  atomic_fetch_add(&file->refs, 1);
+  return file;
+}
+
+/**
+ * @brief Gives back a reference to a shared file, freeing it with the last.
+ *
+ * @param file The file. If NULL, the function does nothing.
+ */
+void release_shared_file(shared_file_t *file) {
+  if (!file || atomic_fetch_sub(&file->refs, 1) != 1) {
+    return;
+  }
+  free(file->data);
+  free(file->links);
+  free_fingerprints(file);
+  free(file);
+}
+
+/**
+ * @brief Writes the number of file reads, of loads that shared one and of
+ * loads given up on.
+ *
+ * @param out The stream to write to.
+ */
+void write_flight_stats(FILE *out) {
+  fprintf(out, "file_loads %lu\n", atomic_load(&file_loads));
+  fprintf(out, "file_loads_coalesced %lu\n", atomic_load(&coalesced_loads));
+  fprintf(out, "file_loads_timed_out %lu\n", atomic_load(&timed_out_loads));
+}
@@ -0,0 +1,24 @@
+#ifndef FLIGHT
+#define FLIGHT
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct shared_file {
+  unsigned char *data;
+  size_t size;
+  size_t source_size;
+  char *links;
+  struct fingerprint_asset *assets;
+  size_t asset_count;
+  uint64_t version;
+  atomic_int refs;
+} shared_file_t;
+
+shared_file_t *load_shared_file(const char *path, time_t mtime);
+shared_file_t *retain_shared_file(shared_file_t *file);
+void release_shared_file(shared_file_t *file);
+void write_flight_stats(FILE *out);
+#endif // !FLIGHT
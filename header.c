@@ -1,10 +1,13 @@
 #include "header.h"
 #include "config.h"
+#include "settings.h"
+#include "slab.h"
 #include "utils.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 const char *RESPONSE_CODE_STRINGS[] = {
     [CONTINUE] = "Continue",
@@ -106,6 +109,8 @@ const char *get_method_string(REQUEST_METHOD_T method) {
     return "TRACE";
   case DELETE:
     return "DELETE";
+  case UNKNOWN_METHOD:
+    return "UNKNOWN";
   }
 }
 
@@ -126,30 +131,43 @@ const char *get_response_code_string(RESPONSE_CODE_T code) {
   return RESPONSE_CODE_STRINGS[code];
 }
 
-static header_request_line_t *parse_request_line(unsigned char *raw_header) {
-  header_request_line_t *request_line = malloc(sizeof(header_request_line_t));
-  int raw_header_index = 0;
-  while (raw_header[raw_header_index++] != ' ') {
-  }
-  char *method = calloc(raw_header_index + 1, 1);
-  strncpy(method, (char *)raw_header, raw_header_index - 1);
+/**
+ * @brief Gets the method a method name stands for.
+ *
+ * @param method The method name, such as `GET`.
+ * @return The method, or UNKNOWN_METHOD if the name is not one the server
+ * knows.
+ */
+REQUEST_METHOD_T parse_method(const char *method) {
   if (strcmp(method, "GET") == 0) {
-    request_line->method = GET;
+    return GET;
   } else if (strcmp(method, "POST") == 0) {
-    request_line->method = POST;
+    return POST;
   } else if (strcmp(method, "PUT") == 0) {
-    request_line->method = PUT;
+    return PUT;
   } else if (strcmp(method, "OPTIONS") == 0) {
-    request_line->method = OPTIONS;
+    return OPTIONS;
   } else if (strcmp(method, "HEAD") == 0) {
-    request_line->method = HEAD;
+    return HEAD;
   } else if (strcmp(method, "CONNECT") == 0) {
-    request_line->method = CONNECT;
+    return CONNECT;
   } else if (strcmp(method, "TRACE") == 0) {
-    request_line->method = TRACE;
+    return TRACE;
   } else if (strcmp(method, "DELETE") == 0) {
-    request_line->method = DELETE;
+    return DELETE;
   }
+  return UNKNOWN_METHOD;
+}
+
+static header_request_line_t *parse_request_line(unsigned char *raw_header) {
+  header_request_line_t *request_line = allocate_object(SLAB_REQUEST_LINE);
+  int raw_header_index = 0;
+  while (raw_header[raw_header_index++] != ' ') {
+  }
+  char *method = calloc(raw_header_index + 1, 1);
+  strncpy(method, (char *)raw_header, raw_header_index - 1);
+  request_line->method = parse_method(method);
+  free(method);
   int target_start = raw_header_index;
   while (raw_header[raw_header_index++] != ' ') {
   }
@@ -159,7 +177,7 @@ static header_request_line_t *parse_request_line(unsigned char *raw_header) {
   int protocol_start = raw_header_index;
   while (raw_header[raw_header_index++] != '\n') {
   }
-  request_line->version = calloc(raw_header_index - protocol_start - 2, 1);
+  request_line->version = calloc(raw_header_index - protocol_start - 1, 1);
   strncpy(request_line->version, (char *)raw_header + protocol_start,
           raw_header_index - 2 - protocol_start);
   return request_line;
@@ -175,6 +193,90 @@ static int find_header_count(unsigned char *raw_header) {
   return count - 1;
 }
 
+static void destroy_header_item(header_item_t *item) {
+  free(item->key);
+  free(item->value);
+  free_object(SLAB_HEADER_ITEM, item);
+}
+
+/**
+ * @brief Makes room for at least `count` items in a header.
+ *
+ * Headers start with HEADER_INLINE_ITEMS slots inside the header itself, which
+ * is enough for most requests and every response the server builds. Past that
+ * the items move to the heap, and the capacity doubles each time it runs out.
+ */
+static int reserve_header_items(header_t *header, int count) {
+  if (count <= header->capacity) {
+    return 0;
+  }
+  int capacity = header->capacity * 2 > count ? header->capacity * 2 : count;
+  header_item_t **items = header->items == header->inline_items
+                              ? malloc(capacity * sizeof(header_item_t *))
+                              : realloc(header->items,
+                                        capacity * sizeof(header_item_t *));
+  if (!items) {
+    return -1;
+  }
+  if (header->items == header->inline_items) {
+    memcpy(items, header->inline_items,
+           header->count * sizeof(header_item_t *));
+  }
+  header->items = items;
+  header->capacity = capacity;
+  return 0;
+}
+
+static header_t *allocate_header(DOCUMENT_TYPE_T type, int count) {
+  header_t *header = allocate_object(SLAB_HEADER);
+  if (!header) {
+    return NULL;
+  }
+  header->type = type;
+  header->count = 0;
+  header->capacity = HEADER_INLINE_ITEMS;
+  header->items = header->inline_items;
+  header->request_line = NULL;
+  header->response_line = NULL;
+  if (reserve_header_items(header, count) < 0) {
+    free_object(SLAB_HEADER, header);
+    return NULL;
+  }
+  return header;
+}
+
+/**
+ * @brief Creates the header of a request that did not arrive as HTTP/1.x
+ * text, such as an HTTP/2 stream.
+ *
+ * Items attached to it must have upper-case names, like the ones
+ * parse_header() produces.
+ *
+ * @param method The request method.
+ * @param target The request target.
+ * @param version The protocol version, such as `HTTP/2.0`.
+ * @return The header, or NULL if memory ran out.
+ */
+header_t *create_request_header(REQUEST_METHOD_T method, const char *target,
+                                const char *version) {
+  header_t *header = allocate_header(REQUEST, 1);
+  header_request_line_t *request_line = allocate_object(SLAB_REQUEST_LINE);
+  if (!header || !request_line) {
+    free_object(SLAB_HEADER, header);
+    free_object(SLAB_REQUEST_LINE, request_line);
+    return NULL;
+  }
+  request_line->method = method;
+  request_line->target = strdup(target);
+  request_line->version = strdup(version);
+  header->request_line = request_line;
+  if (!request_line->target || !request_line->version) {
+    destroy_header(header);
+    return NULL;
+  }
+  return header;
+}
+
 /**
  * @brief Finds a header item in the given header by its name.
  *
@@ -207,15 +309,61 @@ pointer to the header list and a pointer to the header item to be attached.
  * @return Nothing.
  */
 void attach_header(header_t *header, header_item_t *item) {
-  header->items =
-      realloc(header->items, (header->count + 1) * sizeof(header_item_t *));
-  if (!header->items) {
+  if (reserve_header_items(header, header->count + 1) < 0) {
     return;
   }
   header->items[header->count] = item;
   header->count++;
 }
 
+/**
+ * @brief Sets the value of a header item, attaching it if it is missing.
+ *
+ * If an item with the given key already exists, its value is replaced by a
+ * copy of `value`. Otherwise a new item is created and attached to the end of
+ * the header list.
+ *
+ * @param header A pointer to the header list.
+ * @param key The key of the header item to set.
+ * @param value The new value for the header item.
+ */
+void set_header_item(header_t *header, char *key, char *value) {
+  header_item_t *item = get_header_item(header, key);
+  if (!item) {
+    attach_header(header, create_header_item(key, value));
+    return;
+  }
+  char *copy = strdup(value);
+  if (!copy) {
+    return;
+  }
+  free(item->value);
+  item->value = copy;
+}
+
+/**
+ * @brief Removes a header item from the header list.
+ *
+ * The item with the given key is destroyed and the items after it are moved
+ * up. Nothing happens if there is no such item.
+ *
+ * @param header A pointer to the header list.
+ * @param key The key of the header item to remove.
+ */
+void remove_header_item(header_t *header, char *key) {
+  for (int i = 0; i < header->count; i++) {
+    if (strcmp(header->items[i]->key, key) != 0) {
+      continue;
+    }
+    destroy_header_item(header->items[i]);
+    for (int x = i + 1; x < header->count; x++) {
+      header->items[x - 1] = header->items[x];
+    }
+    header->count--;
+    return;
+  }
+}
+
 /**
  * @brief Creates a new header item with the given key and value.
  *
@@ -229,16 +377,14 @@ returns.
 error occurs.
  */
 header_item_t *create_header_item(char *key, char *value) {
-  header_item_t *item = malloc(sizeof(header_item_t));
+  header_item_t *item = allocate_object(SLAB_HEADER_ITEM);
   if (!item) {
     return NULL;
   }
   item->key = strdup(key);
   item->value = strdup(value);
   if (!item->value || !item->key) {
-    free(item->key);
-    free(item->value);
-    free(item);
+    destroy_header_item(item);
     return NULL;
   }
   return item;
@@ -249,22 +395,29 @@ header_item_t *create_header_item(char *key, char *value) {
  *
  * This function creates a default HTTP header that includes essential headers
 such as "Connection", "Date", "Server", and "K "Keep-Alive". The "Connection"
-header is set to "keep-alive" and the "Keep-Alive" header is set to
-"timeout=5, max=997".
+header is set to "keep-alive" and the "Keep-Alive" header advertises the
+`keepalive_timeout` and `keepalive_max` limits the server enforces.
  *
  * @return A pointer to a `header_t` structure containing the default HTTP
 header.
  */
 header_t *create_default_header() {
-  header_t *header = malloc(sizeof(header_t));
-  header->request_line = NULL;
+  const settings_t *settings = get_settings();
+  char keep_alive[64];
+  snprintf(keep_alive, sizeof(keep_alive), "timeout=%d, max=%d",
+           settings->keepalive_timeout / 1000, settings->keepalive_max);
+  char date[HTTP_DATE_SIZE];
+  format_http_date(time(NULL), date, sizeof(date));
+  header_t *header = allocate_header(RESPONSE, 5);
+  if (!header) {
+    return NULL;
+  }
   header->count = 5;
-  header->items = malloc(header->count * sizeof(header_item_t *));
   header->items[0] = create_header_item("connection", "keep-alive");
-  header->items[1] = create_header_item("date", get_time());
+  header->items[1] = create_header_item("date", date);
   header->items[2] = create_header_item("server", "kr4nkenserver");
   header->items[3] = create_header_item("server-version", "0.1alpha");
-  header->items[4] = create_header_item("keep-alive", "timeout=5, max=997");
+  header->items[4] = create_header_item("keep-alive", keep_alive);
   return header;
 }
 
@@ -311,7 +464,7 @@ unsigned char *serialize_header(header_t *header) {
     APPEND(header->request_line->target);
     APPEND(SP);
     APPEND(header->request_line->version);
-    APPEND(LF);
+    APPEND(CRLF);
   } else if (header->type == RESPONSE) {
     APPEND(header->response_line->version);
     APPEND(SP);
@@ -320,13 +473,13 @@ unsigned char *serialize_header(header_t *header) {
     APPEND(code);
     APPEND(SP);
     APPEND(get_response_code_string(header->response_line->code));
-    APPEND(LF);
+    APPEND(CRLF);
   }
   for (int i = 0; i < header->count; i++) {
     APPEND(header->items[i]->key);
     APPEND(": ");
     APPEND(header->items[i]->value);
-    APPEND(LF);
+    APPEND(CRLF);
   }
   APPEND(CRLF);
 #undef APPEND
@@ -345,14 +498,13 @@ unsigned char *serialize_header(header_t *header) {
  */
 header_response_line_t *create_response_line(RESPONSE_CODE_T code,
                                              char *version) {
-  header_response_line_t *response_line =
-      malloc(sizeof(header_response_line_t));
+  header_response_line_t *response_line = allocate_object(SLAB_RESPONSE_LINE);
   if (!response_line) {
     return NULL;
   }
   response_line->version = malloc(strlen(version) + 1);
   if (!response_line->version) {
-    free(response_line);
+    free_object(SLAB_RESPONSE_LINE, response_line);
     return NULL;
   }
   strcpy(response_line->version, version);
@@ -370,16 +522,12 @@ static void combine_duplicate_header_items(header_t *header) {
         continue;
       }
       if (strcmp(header->items[i]->key, header->items[x]->key) == 0) {
-        strcat(header->items[i]->value, ", ");
         char *value_separator = str_join(header->items[i]->value, ", ");
-        char *new_value =
-            str_join(header->items[i]->value, header->items[x]->value);
+        char *new_value = str_join(value_separator, header->items[x]->value);
         free(value_separator);
         free(header->items[i]->value);
         header->items[i]->value = new_value;
-        free(header->items[x]->key);
-        free(header->items[x]->value);
-        free(header->items[x]);
+        destroy_header_item(header->items[x]);
         header->items[x] = NULL;
       }
     }
@@ -405,15 +553,18 @@ static void combine_duplicate_header_items(header_t *header) {
  * @return The parsed header struct.
  */
 header_t *parse_header(unsigned char *raw_header) {
-  header_t *header = malloc(sizeof(header_t));
-  header->count = find_header_count(raw_header);
-  header->items = malloc(header->count * sizeof(header_item_t *));
+  int count = find_header_count(raw_header);
+  header_t *header = allocate_header(REQUEST, count);
+  if (!header) {
+    return NULL;
+  }
+  header->count = count;
   header->request_line = parse_request_line(raw_header);
   int raw_header_index = 0;
   while (raw_header[raw_header_index++] != '\n') {
   }
   for (int i = 0; i < header->count; i++) {
-    header->items[i] = malloc(sizeof(header_item_t));
+    header->items[i] = allocate_object(SLAB_HEADER_ITEM);
     int end = 0;
     int divider = 0;
     while (raw_header[raw_header_index + end] != '\r') {
@@ -422,15 +573,21 @@ header_t *parse_header(unsigned char *raw_header) {
       }
       end++;
     }
+    int value_start = divider + 1;
+    while (value_start < end &&
+           (raw_header[raw_header_index + value_start] == ' ' ||
+            raw_header[raw_header_index + value_start] == '\t')) {
+      value_start++;
+    }
     header->items[i]->key = malloc(divider + 1);
-    header->items[i]->value = malloc(end - divider);
+    header->items[i]->value = malloc(end - value_start + 1);
 
     memcpy(header->items[i]->key, raw_header + raw_header_index, divider);
     header->items[i]->key[divider] = '\0';
     str_to_upper(header->items[i]->key);
-    memcpy(header->items[i]->value, raw_header + raw_header_index + divider + 1,
-           end - divider - 1);
-    header->items[i]->value[end - divider - 1] = '\0';
+    memcpy(header->items[i]->value, raw_header + raw_header_index + value_start,
+           end - value_start);
+    header->items[i]->value[end - value_start] = '\0';
     raw_header_index += end + 2;
   }
   combine_duplicate_header_items(header);
@@ -453,22 +610,20 @@ void destroy_header(header_t *header) {
         free(header->request_line->target);
       }
       free(header->request_line->version);
-      free(header->request_line);
+      free_object(SLAB_REQUEST_LINE, header->request_line);
     }
   }
   if (header->type == RESPONSE) {
-    if (header->request_line) {
+    if (header->response_line) {
       free(header->response_line->version);
-      free(header->response_line);
+      free_object(SLAB_RESPONSE_LINE, header->response_line);
     }
   }
   for (int i = 0; i < header->count; i++) {
-    free(header->items[i]->key);
-    if (header->items[i]->value) {
-      free(header->items[i]->value);
-    }
-    free(header->items[i]);
+    destroy_header_item(header->items[i]);
+  }
+  if (header->items != header->inline_items) {
+    free(header->items);
   }
-  free(header->items);
-  free(header);
+  free_object(SLAB_HEADER, header);
 }
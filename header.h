@@ -14,9 +14,13 @@ typedef enum REQUEST_METHOD {
   PUT,
   DELETE,
   TRACE,
-  CONNECT
+  CONNECT,
+  UNKNOWN_METHOD
 } REQUEST_METHOD_T;
 
+#define METHOD_COUNT UNKNOWN_METHOD
+#define HEADER_INLINE_ITEMS 16
+
 typedef enum RESPONSE_CODE {
   CONTINUE = 100,
   SWITCHING_PROCTOLS = 101,
@@ -101,19 +105,27 @@ typedef struct header_response_line {
 
 typedef struct header {
   int count;
+  int capacity;
   DOCUMENT_TYPE_T type;
   header_request_line_t *request_line;
   header_response_line_t *response_line;
   header_item_t **items;
+  header_item_t *inline_items[HEADER_INLINE_ITEMS];
 } header_t;
 
 header_t *parse_header(unsigned char *raw_header);
 header_item_t *get_header_item(header_t *header, char *name);
 header_item_t *create_header_item(char *key, char *value);
 header_t *create_default_header();
+header_t *create_request_header(REQUEST_METHOD_T method, const char *target,
+                                const char *version);
 unsigned char *serialize_header(header_t *header);
+const char *get_method_string(REQUEST_METHOD_T method);
+REQUEST_METHOD_T parse_method(const char *method);
 const char *get_response_code_string(RESPONSE_CODE_T code);
 void attach_header(header_t *header, header_item_t *item);
+void set_header_item(header_t *header, char *key, char *value);
+void remove_header_item(header_t *header, char *key);
 header_response_line_t *create_response_line(RESPONSE_CODE_T code,
                                              char *version);
 void destroy_header(header_t *header);
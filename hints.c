@@ -0,0 +1,119 @@
+#include "hints.h"
+#include "config.h"
+#include "html.h"
+#include "settings.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct preload_list {
+  char *value;
+  size_t length;
+  size_t capacity;
+  int count;
+} preload_list_t;
+
+/**
+ * @brief Checks that a URL is a same-origin path short enough to preload.
+ */
+static bool is_preloadable(const char *url, size_t length) {
+  return length <= PRELOAD_MAX_URL && is_local_url(url, length);
+}
+
+static void add_preload(preload_list_t *list, const char *directory,
+                        const char *url, size_t length, const char *as) {
+  if (list->count >= PRELOAD_MAX_LINKS || !is_preloadable(url, length)) {
+    return;
+  }
+  const char *prefix = url[0] == '/' ? "" : directory;
+  size_t target_size = strlen(prefix) + length + 3;
+  char *target = malloc(target_size);
+  if (!target) {
+    return;
+  }
+  snprintf(target, target_size, "<%s%.*s>", prefix, (int)length, url);
+  if (list->value && strstr(list->value, target)) {
+    free(target);
+    return;
+  }
+  size_t needed = list->length + target_size + strlen(as) + 24;
+  if (needed > list->capacity) {
+    char *tmp = realloc(list->value, needed * 2);
+    if (!tmp) {
+      free(target);
+      return;
+    }
+    list->value = tmp;
+    list->capacity = needed * 2;
+  }
+  list->length += snprintf(list->value + list->length,
+                           list->capacity - list->length,
+                           "%s%s; rel=preload; as=%s",
+                           list->count > 0 ? ", " : "", target, as);
+  list->count++;
+  free(target);
+}
+
+/**
+ * @brief Lists the subresources an HTML file references, as the value of a
+ * `link` header.
+ *
+ * Called when a file is loaded into memory, so the scan is paid once per load
+ * rather than per request. Stylesheets, scripts and images are listed in the
+ * order they appear in, up to PRELOAD_MAX_LINKS of them. Only same-origin
+ * paths are listed; relative ones are resolved against the URL of the file.
+ *
+ * @param path The path of the file, used to recognize HTML files and resolve
+ * relative references.
+ * @param data The contents of the file.
+ * @param size The size of the contents.
+ * @return The `link` header value, or NULL if the file is not HTML, references
+ * nothing to preload, or `early_hints` is off.
+ */
+char *scan_preload_links(const char *path, const unsigned char *data,
+                         size_t size) {
+  if (!get_settings()->early_hints || !is_html_path(path)) {
+    return NULL;
+  }
+  char *directory = get_url_directory(path);
+  if (!directory) {
+    return NULL;
+  }
+  html_reference_t references[HTML_MAX_REFERENCES];
+  size_t count = find_html_references(data, size, references,
+                                      HTML_MAX_REFERENCES);
+  preload_list_t list = {0};
+  for (size_t i = 0; i < count && list.count < PRELOAD_MAX_LINKS; i++) {
+    if (references[i].as) {
+      add_preload(&list, directory, references[i].url, references[i].length,
+                  references[i].as);
+    }
+  }
+  free(directory);
+  return list.value;
+}
+
+/**
+ * @brief Sends a `103 Early Hints` interim response ahead of the final one.
+ *
+ * The client can start fetching the listed subresources while the final
+ * response is still being sent. Interim responses are only understood by
+ * HTTP/1.1 clients, so callers must not send one to an HTTP/1.0 client.
+ *
+ * @param conn The connection to send the interim response on.
+ * @param links The value of the `link` header.
+ * @return 0 on success, or -1 on error.
+ */
+int send_early_hints(connection_t *conn, const char *links) {
+  size_t size = strlen(links) + 48;
+  char *response = malloc(size);
+  if (!response) {
+    return -1;
+  }
+  int length = snprintf(response, size,
+                        "HTTP/1.1 103 Early Hints\r\nlink: %s\r\n\r\n", links);
+  int result = write_to_conn(conn, (unsigned char *)response, length);
+  free(response);
+  return result;
+}
@@ -0,0 +1,9 @@
+#ifndef HINTS
+#define HINTS
+#include "connection.h"
+#include <stddef.h>
+
+char *scan_preload_links(const char *path, const unsigned char *data,
+                         size_t size);
+int send_early_hints(connection_t *conn, const char *links);
+#endif // !HINTS
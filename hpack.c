@@ -0,0 +1,542 @@
+#include "hpack.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATIC_TABLE_SIZE 61
+#define ENTRY_OVERHEAD 32
+
+static const hpack_field_t STATIC_TABLE[STATIC_TABLE_SIZE + 1] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const uint32_t HUFFMAN_CODES[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6,
+    0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea,
+    0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee, 0xfffffef,
+    0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3, 0xffffff4,
+    0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb, 0xf9,
+    0x7fb, 0xfa, 0x16, 0x17, 0x18, 0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21, 0x5d,
+    0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73, 0xfd,
+    0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22, 0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76, 0x2c,
+    0x8, 0x9, 0x2d, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd,
+    0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4,
+    0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd,
+    0x7fffde, 0xffffeb, 0x7fffdf, 0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0,
+    0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8,
+    0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde, 0x7fffea,
+    0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee,
+    0x7fffef, 0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5,
+    0x3fffe6, 0x7ffff1, 0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7,
+    0x7ffff2, 0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3, 0x3ffffe6,
+    0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2, 0x1fffe4, 0x1fffe5,
+    0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5, 0xfffec,
+    0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea,
+    0x7ffff4, 0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee,
+    0x7ffffef, 0x7fffff0, 0x3ffffee};
+
+static const uint8_t HUFFMAN_CODE_LENGTHS[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28,
+    28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28, 6, 10, 10, 12, 13, 6, 8,
+    11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6,
+    12, 10, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 8, 7, 8, 13, 19, 13, 14, 6, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6,
+    6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, 20, 22, 20, 20,
+    22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23,
+    23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21, 23, 22,
+    22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23,
+    22, 22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20,
+    21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27,
+    27, 27, 27, 28, 27, 27, 27, 27, 27, 26};
+
+static int16_t huffman_tree[256][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Builds the binary tree the Huffman decoder walks.
+ *
+ * Inner nodes hold the indices of their children, leaves the negated symbol
+ * plus one. A zero child marks a bit sequence that is not a valid code; the
+ * 30-bit EOS code is left out, so a string containing it fails to decode.
+ */
+static void build_huffman_tree() {
+  int16_t nodes = 1;
+  for (int symbol = 0; symbol < 256; symbol++) {
+    uint32_t code = HUFFMAN_CODES[symbol];
+    int node = 0;
+    for (int bit = HUFFMAN_CODE_LENGTHS[symbol] - 1; bit > 0; bit--) {
+      int branch = (code >> bit) & 1;
+      if (huffman_tree[node][branch] == 0) {
+        huffman_tree[node][branch] = nodes++;
+      }
+      node = huffman_tree[node][branch];
+    }
+    huffman_tree[node][code & 1] = -(symbol + 1);
+  }
+}
+
+static char *huffman_decode(const unsigned char *in, size_t length,
+                            size_t *out_length) {
+  pthread_once(&huffman_once, build_huffman_tree);
+  char *out = malloc(length * 8 / 5 + 1);
+  if (!out) {
+    return NULL;
+  }
+  size_t size = 0;
+  int node = 0;
+  int pending_bits = 0;
+  bool all_ones = true;
+  for (size_t i = 0; i < length; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      int branch = (in[i] >> bit) & 1;
+      int16_t next = huffman_tree[node][branch];
+      if (next == 0) {
+        free(out);
+        return NULL;
+      }
+      if (next < 0) {
+        out[size++] = (char)(-next - 1);
+        node = 0;
+        pending_bits = 0;
+        all_ones = true;
+        continue;
+      }
+      node = next;
+      pending_bits++;
+      all_ones = all_ones && branch;
+    }
+  }
+  if (pending_bits > 7 || !all_ones) {
+    free(out);
+    return NULL;
+  }
+  out[size] = '\0';
+  *out_length = size;
+  return out;
+}
+
+static int reserve_buffer(hpack_buffer_t *out, size_t length) {
+  if (out->size + length <= out->capacity) {
+    return 0;
+  }
+  size_t capacity = out->capacity ? out->capacity : 256;
+  while (capacity < out->size + length) {
+    capacity *= 2;
+  }
+  unsigned char *data = realloc(out->data, capacity);
+  if (!data) {
+    return -1;
+  }
+  out->data = data;
+  out->capacity = capacity;
+  return 0;
+}
+
+static int encode_integer(hpack_buffer_t *out, unsigned char first,
+                          int prefix_bits, size_t value) {
+  if (reserve_buffer(out, 1 + sizeof(size_t) * 8 / 7 + 1) < 0) {
+    return -1;
+  }
+  size_t limit = (1 << prefix_bits) - 1;
+  if (value < limit) {
+    out->data[out->size++] = first | value;
+    return 0;
+  }
+  out->data[out->size++] = first | limit;
+  value -= limit;
+  while (value >= 128) {
+    out->data[out->size++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out->data[out->size++] = value;
+  return 0;
+}
+
+static int decode_integer(const unsigned char *block, size_t size,
+                          size_t *pos, int prefix_bits, size_t *value) {
+  size_t limit = (1 << prefix_bits) - 1;
+  *value = block[(*pos)++] & limit;
+  if (*value < limit) {
+    return 0;
+  }
+  for (int shift = 0; shift < 28; shift += 7) {
+    if (*pos >= size) {
+      return -1;
+    }
+    unsigned char byte = block[(*pos)++];
+    *value += (size_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Encodes a string literal, Huffman coded if that makes it shorter.
+ */
+static int encode_string(hpack_buffer_t *out, const char *s) {
+  size_t length = strlen(s);
+  size_t bits = 0;
+  for (size_t i = 0; i < length; i++) {
+    bits += HUFFMAN_CODE_LENGTHS[(unsigned char)s[i]];
+  }
+  size_t huffman_length = (bits + 7) / 8;
+  if (huffman_length >= length) {
+    if (encode_integer(out, 0x00, 7, length) < 0 ||
+        reserve_buffer(out, length) < 0) {
+      return -1;
+    }
+    memcpy(out->data + out->size, s, length);
+    out->size += length;
+    return 0;
+  }
+  if (encode_integer(out, 0x80, 7, huffman_length) < 0 ||
+      reserve_buffer(out, huffman_length) < 0) {
+    return -1;
+  }
+  uint64_t accumulator = 0;
+  int pending = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char symbol = s[i];
+    accumulator = accumulator << HUFFMAN_CODE_LENGTHS[symbol] |
+                  HUFFMAN_CODES[symbol];
+    pending += HUFFMAN_CODE_LENGTHS[symbol];
+    while (pending >= 8) {
+      pending -= 8;
+      out->data[out->size++] = accumulator >> pending;
+    }
+  }
+  if (pending > 0) {
+    out->data[out->size++] =
+        (accumulator << (8 - pending)) | (0xff >> pending);
+  }
+  return 0;
+}
+
+static char *decode_string(const unsigned char *block, size_t size,
+                           size_t *pos) {
+  if (*pos >= size) {
+    return NULL;
+  }
+  bool huffman = block[*pos] & 0x80;
+  size_t length;
+  if (decode_integer(block, size, pos, 7, &length) < 0 ||
+      length > size - *pos) {
+    return NULL;
+  }
+  const unsigned char *data = block + *pos;
+  *pos += length;
+  char *s;
+  size_t decoded_length = length;
+  if (huffman) {
+    s = huffman_decode(data, length, &decoded_length);
+  } else {
+    s = malloc(length + 1);
+    if (s) {
+      memcpy(s, data, length);
+      s[length] = '\0';
+    }
+  }
+  if (s && memchr(s, '\0', decoded_length)) {
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+/**
+ * @brief Initializes an HPACK dynamic table.
+ *
+ * @param table The table to initialize.
+ * @param limit The largest table size the peer may choose, as advertised in
+ * `SETTINGS_HEADER_TABLE_SIZE`.
+ * @return 0 on success, or -1 if the allocation failed.
+ */
+int init_hpack_table(hpack_table_t *table, size_t limit) {
+  table->capacity = limit / ENTRY_OVERHEAD + 1;
+  table->entries = calloc(table->capacity, sizeof(hpack_entry_t));
+  table->head = 0;
+  table->count = 0;
+  table->size = 0;
+  table->max_size = limit;
+  table->limit = limit;
+  return table->entries ? 0 : -1;
+}
+
+static void evict_entries(hpack_table_t *table, size_t max_size) {
+  while (table->count > 0 && table->size > max_size) {
+    hpack_entry_t *entry =
+        &table->entries[(table->head + table->count - 1) % table->capacity];
+    table->size -= entry->size;
+    free(entry->name);
+    free(entry->value);
+    table->count--;
+  }
+}
+
+/**
+ * @brief Destroys an HPACK dynamic table and its entries.
+ *
+ * @param table The table to destroy.
+ */
+void destroy_hpack_table(hpack_table_t *table) {
+  evict_entries(table, 0);
+  free(table->entries);
+  table->entries = NULL;
+}
+
+static void add_entry(hpack_table_t *table, char *name, char *value) {
+  size_t size = strlen(name) + strlen(value) + ENTRY_OVERHEAD;
+  if (size > table->max_size) {
+    evict_entries(table, 0);
+    free(name);
+    free(value);
+    return;
+  }
+  evict_entries(table, table->max_size - size);
+  table->head = (table->head + table->capacity - 1) % table->capacity;
+  table->entries[table->head].name = name;
+  table->entries[table->head].value = value;
+  table->entries[table->head].size = size;
+  table->size += size;
+  table->count++;
+}
+
+/**
+ * @brief Looks up a field by its HPACK index.
+ *
+ * Indices up to STATIC_TABLE_SIZE name the static table and are resolved
+ * without touching the dynamic table; higher ones count from the newest
+ * dynamic entry.
+ */
+static const hpack_field_t *lookup_field(hpack_table_t *table, size_t index,
+                                         hpack_field_t *field) {
+  if (index == 0) {
+    return NULL;
+  }
+  if (index <= STATIC_TABLE_SIZE) {
+    return &STATIC_TABLE[index];
+  }
+  index -= STATIC_TABLE_SIZE + 1;
+  if (index >= table->count) {
+    return NULL;
+  }
+  hpack_entry_t *entry =
+      &table->entries[(table->head + index) % table->capacity];
+  field->name = entry->name;
+  field->value = entry->value;
+  return field;
+}
+
+/**
+ * @brief Decodes an HPACK header block.
+ *
+ * Every decoded field is passed to `callback` in order. The strings are only
+ * valid during the call. The dynamic table is updated as the block demands.
+ *
+ * @param table The decoder's dynamic table.
+ * @param block The header block.
+ * @param size The size of the header block in bytes.
+ * @param callback The function to pass every field to.
+ * @param context The first argument to `callback`.
+ * @return 0 on success, or -1 if the block is malformed or the callback
+ * failed.
+ */
+int hpack_decode(hpack_table_t *table, const unsigned char *block, size_t size,
+                 hpack_field_callback callback, void *context) {
+  size_t pos = 0;
+  bool fields_seen = false;
+  while (pos < size) {
+    unsigned char first = block[pos];
+    size_t index;
+    hpack_field_t field;
+    if (first & 0x80) {
+      const hpack_field_t *indexed;
+      if (decode_integer(block, size, &pos, 7, &index) < 0 ||
+          !(indexed = lookup_field(table, index, &field)) ||
+          callback(context, indexed->name, indexed->value) < 0) {
+        return -1;
+      }
+      fields_seen = true;
+      continue;
+    }
+    if ((first & 0xe0) == 0x20) {
+      if (fields_seen || decode_integer(block, size, &pos, 5, &index) < 0 ||
+          index > table->limit) {
+        return -1;
+      }
+      table->max_size = index;
+      evict_entries(table, index);
+      continue;
+    }
+    bool incremental = first & 0x40;
+    if (decode_integer(block, size, &pos, incremental ? 6 : 4, &index) < 0) {
+      return -1;
+    }
+    char *name;
+    if (index) {
+      const hpack_field_t *indexed = lookup_field(table, index, &field);
+      name = indexed ? strdup(indexed->name) : NULL;
+    } else {
+      name = decode_string(block, size, &pos);
+    }
+    char *value = name ? decode_string(block, size, &pos) : NULL;
+    if (!value || callback(context, name, value) < 0) {
+      free(name);
+      free(value);
+      return -1;
+    }
+    fields_seen = true;
+    if (incremental) {
+      add_entry(table, name, value);
+    } else {
+      free(name);
+      free(value);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Encodes a `:status` pseudo-header field.
+ *
+ * The status codes that have a static table entry are encoded as a single
+ * byte.
+ *
+ * @param out The buffer to append to.
+ * @param code The response status code.
+ * @return 0 on success, or -1 if the allocation failed.
+ */
+int hpack_encode_status(hpack_buffer_t *out, int code) {
+  switch (code) {
+  case 200:
+    return encode_integer(out, 0x80, 7, 8);
+  case 204:
+    return encode_integer(out, 0x80, 7, 9);
+  case 206:
+    return encode_integer(out, 0x80, 7, 10);
+  case 304:
+    return encode_integer(out, 0x80, 7, 11);
+  case 400:
+    return encode_integer(out, 0x80, 7, 12);
+  case 404:
+    return encode_integer(out, 0x80, 7, 13);
+  case 500:
+    return encode_integer(out, 0x80, 7, 14);
+  }
+  char value[16];
+  snprintf(value, sizeof(value), "%d", code);
+  if (encode_integer(out, 0x00, 4, 8) < 0) {
+    return -1;
+  }
+  return encode_string(out, value);
+}
+
+/**
+ * @brief Encodes a header field.
+ *
+ * A field found in the static table is encoded by its index; otherwise it is
+ * encoded as a literal that is not added to the dynamic table, naming the
+ * static entry when only the name matches. The encoder never uses the
+ * dynamic table, so it keeps no state between header blocks.
+ *
+ * @param out The buffer to append to.
+ * @param name The lowercase field name.
+ * @param value The field value.
+ * @return 0 on success, or -1 if the allocation failed.
+ */
+int hpack_encode_field(hpack_buffer_t *out, const char *name,
+                       const char *value) {
+  size_t name_index = 0;
+  for (size_t index = 1; index <= STATIC_TABLE_SIZE; index++) {
+    if (strcmp(STATIC_TABLE[index].name, name) != 0) {
+      continue;
+    }
+    if (strcmp(STATIC_TABLE[index].value, value) == 0) {
+      return encode_integer(out, 0x80, 7, index);
+    }
+    if (!name_index) {
+      name_index = index;
+    }
+  }
+  if (encode_integer(out, 0x00, 4, name_index) < 0) {
+    return -1;
+  }
+  if (!name_index && encode_string(out, name) < 0) {
+    return -1;
+  }
+  return encode_string(out, value);
+}
@@ -0,0 +1,44 @@
+#ifndef HPACK
+#define HPACK
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct hpack_field {
+  const char *name;
+  const char *value;
+} hpack_field_t;
+
+typedef struct hpack_entry {
+  char *name;
+  char *value;
+  size_t size;
+} hpack_entry_t;
+
+typedef struct hpack_table {
+  hpack_entry_t *entries;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  size_t size;
+  size_t max_size;
+  size_t limit;
+} hpack_table_t;
+
+typedef struct hpack_buffer {
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+} hpack_buffer_t;
+
+typedef int (*hpack_field_callback)(void *context, const char *name,
+                                    const char *value);
+
+int init_hpack_table(hpack_table_t *table, size_t limit);
+void destroy_hpack_table(hpack_table_t *table);
+int hpack_decode(hpack_table_t *table, const unsigned char *block, size_t size,
+                 hpack_field_callback callback, void *context);
+int hpack_encode_status(hpack_buffer_t *out, int code);
+int hpack_encode_field(hpack_buffer_t *out, const char *name,
+                       const char *value);
+#endif // !HPACK
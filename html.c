@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#include "html.h"
+#include "settings.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * @brief Checks whether a path names an HTML file, by its extension.
+ */
+bool is_html_path(const char *path) {
+  const char *dot = strrchr(path, '.');
+  return dot && !strchr(dot, '/') &&
+         (strcasecmp(dot, ".htm") == 0 || strcasecmp(dot, ".html") == 0);
+}
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+/**
+ * @brief Finds the value of an attribute between a tag's name and its `>`.
+ *
+ * Handles double-quoted, single-quoted and unquoted values.
+ *
+ * @return The start of the value, with its length in `length`, or NULL if the
+ * tag has no such attribute.
+ */
+static const char *find_attribute(const char *p, const char *end,
+                                  const char *name, size_t *length) {
+  size_t name_length = strlen(name);
+  while (p < end) {
+    while (p < end && (is_space(*p) || *p == '/')) {
+      p++;
+    }
+    const char *attribute = p;
+    while (p < end && !is_space(*p) && *p != '=' && *p != '/') {
+      p++;
+    }
+    bool match = (size_t)(p - attribute) == name_length &&
+                 strncasecmp(attribute, name, name_length) == 0;
+    while (p < end && is_space(*p)) {
+      p++;
+    }
+    if (p == end || *p != '=') {
+      continue;
+    }
+    p++;
+    while (p < end && is_space(*p)) {
+      p++;
+    }
+    const char *value = p;
+    if (p < end && (*p == '"' || *p == '\'')) {
+      const char *quote = memchr(p + 1, *p, end - p - 1);
+      value = p + 1;
+      p = quote ? quote : end;
+    } else {
+      while (p < end && !is_space(*p)) {
+        p++;
+      }
+    }
+    if (match) {
+      *length = p - value;
+      return value;
+    }
+    p += p < end;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Finds the `>` that closes a tag, skipping over quoted values.
+ */
+static const char *find_tag_end(const char *p, const char *end) {
+  char quote = '\0';
+  for (; p < end; p++) {
+    if (quote) {
+      quote = *p == quote ? '\0' : quote;
+    } else if (*p == '"' || *p == '\'') {
+      quote = *p;
+    } else if (*p == '>') {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Checks that a URL is a same-origin path that can be put in a header
+ * as is.
+ */
+bool is_local_url(const char *url, size_t length) {
+  if (length == 0 || url[0] == '#' ||
+      (length > 1 && url[0] == '/' && url[1] == '/')) {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = url[i];
+    if (c <= ' ' || c >= 0x7f || strchr("\"'<>,;\\:", c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Gets the directory of the URL a file is served under, for resolving
+ * relative references in it.
+ */
+char *get_url_directory(const char *path) {
+  const char *root = get_settings()->target_directory;
+  size_t root_length = strlen(root);
+  const char *url =
+      strncmp(path, root, root_length) == 0 ? path + root_length : path;
+  const char *slash = strrchr(url, '/');
+  size_t length = slash ? (size_t)(slash - url) + 1 : 0;
+  char *directory = malloc(length + 2);
+  if (!directory) {
+    return NULL;
+  }
+  if (length == 0 || url[0] != '/') {
+    directory[0] = '/';
+    memcpy(directory + 1, url, length);
+    directory[length + 1] = '\0';
+  } else {
+    memcpy(directory, url, length);
+    directory[length] = '\0';
+  }
+  return directory;
+}
+
+/**
+ * @brief Gets the `rel` of a `link` tag reference, or NULL if it references
+ * nothing a page loads.
+ *
+ * Stylesheets are loaded with the page and get the `as` a preload of them
+ * takes. Icons and preloads are also loaded, but not necessarily before the
+ * page renders, so they get none.
+ */
+static const char *classify_link(const char *p, const char *end,
+                                 bool *loaded) {
+  size_t length = 0;
+  const char *rel = find_attribute(p, end, "rel", &length);
+  char value[32];
+  *loaded = false;
+  if (!rel || length >= sizeof(value)) {
+    return NULL;
+  }
+  memcpy(value, rel, length);
+  value[length] = '\0';
+  if (strcasestr(value, "stylesheet")) {
+    *loaded = true;
+    return "style";
+  }
+  *loaded = strcasestr(value, "icon") || strcasestr(value, "preload");
+  return NULL;
+}
+
+/**
+ * @brief Lists the subresources an HTML document references.
+ *
+ * Stylesheet, icon and preload links, scripts and images are listed in the
+ * order they appear in, with the URLs pointing into `data` as written, so
+ * relative ones are left unresolved. Stylesheets, scripts and images carry
+ * the `as` a preload of them would take; the rest carry NULL. Comments are
+ * skipped.
+ *
+ * @param data The document.
+ * @param size The size of the document.
+ * @param references The array receiving the references.
+ * @param max The capacity of `references`.
+ * @return The number of references found.
+ */
+size_t find_html_references(const unsigned char *data, size_t size,
+                            html_reference_t *references, size_t max) {
+  size_t count = 0;
+  const char *p = (const char *)data;
+  const char *end = p + size;
+  while (count < max && (p = memchr(p, '<', end - p))) {
+    p++;
+    if (end - p >= 3 && strncmp(p, "!--", 3) == 0) {
+      p = memmem(p, end - p, "-->", 3);
+      if (!p) {
+        break;
+      }
+      continue;
+    }
+    const char *close = find_tag_end(p, end);
+    if (!close) {
+      break;
+    }
+    const char *name = p;
+    while (p < close && !is_space(*p) && *p != '/') {
+      p++;
+    }
+    size_t name_length = p - name;
+    html_reference_t *reference = &references[count];
+    reference->url = NULL;
+    reference->as = NULL;
+    bool loaded = false;
+    if (name_length == 4 && strncasecmp(name, "link", 4) == 0) {
+      reference->as = classify_link(p, close, &loaded);
+      if (loaded) {
+        reference->url = find_attribute(p, close, "href", &reference->length);
+      }
+    } else if (name_length == 6 && strncasecmp(name, "script", 6) == 0) {
+      reference->as = "script";
+      reference->url = find_attribute(p, close, "src", &reference->length);
+    } else if (name_length == 3 && strncasecmp(name, "img", 3) == 0) {
+      reference->as = "image";
+      reference->url = find_attribute(p, close, "src", &reference->length);
+    }
+    count += reference->url != NULL;
+    p = close + 1;
+  }
+  return count;
+}
@@ -0,0 +1,17 @@
+#ifndef HTML
+#define HTML
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct html_reference {
+  const char *url;
+  size_t length;
+  const char *as;
+} html_reference_t;
+
+bool is_html_path(const char *path);
+bool is_local_url(const char *url, size_t length);
+char *get_url_directory(const char *path);
+size_t find_html_references(const unsigned char *data, size_t size,
+                            html_reference_t *references, size_t max);
+#endif // !HTML
@@ -0,0 +1,944 @@
+#include "http2.h"
+#include "admission.h"
+#include "config.h"
+#include "header.h"
+#include "hpack.h"
+#include "ratelimit.h"
+#include "response.h"
+#include "router.h"
+#include "utils.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_SIZE 24
+#define FRAME_HEADER_SIZE 9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+typedef enum FRAME_TYPE {
+  FRAME_DATA,
+  FRAME_HEADERS,
+  FRAME_PRIORITY,
+  FRAME_RST_STREAM,
+  FRAME_SETTINGS,
+  FRAME_PUSH_PROMISE,
+  FRAME_PING,
+  FRAME_GOAWAY,
+  FRAME_WINDOW_UPDATE,
+  FRAME_CONTINUATION
+} FRAME_TYPE_T;
+
+typedef enum SETTING_ID {
+  SETTINGS_HEADER_TABLE_SIZE = 1,
+  SETTINGS_ENABLE_PUSH = 2,
+  SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+  SETTINGS_INITIAL_WINDOW_SIZE = 4,
+  SETTINGS_MAX_FRAME_SIZE = 5,
+  SETTINGS_MAX_HEADER_LIST_SIZE = 6
+} SETTING_ID_T;
+
+typedef enum H2_ERROR {
+  H2_NO_ERROR = 0,
+  H2_PROTOCOL_ERROR = 1,
+  H2_INTERNAL_ERROR = 2,
+  H2_FLOW_CONTROL_ERROR = 3,
+  H2_FRAME_SIZE_ERROR = 6,
+  H2_REFUSED_STREAM = 7,
+  H2_COMPRESSION_ERROR = 9,
+  H2_ENHANCE_YOUR_CALM = 11,
+  H2_HTTP_1_1_REQUIRED = 13
+} H2_ERROR_T;
+
+static const char UPGRADE_RESPONSE[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                       "connection: Upgrade\r\n"
+                                       "upgrade: h2c\r\n\r\n";
+
+typedef struct h2_stream {
+  uint32_t id;
+  int64_t window;
+  document_t *response;
+  size_t offset;
+  bool headers_sent;
+  bool head_only;
+  bool remote_closed;
+  bool failed;
+  struct h2_stream *next;
+} h2_stream_t;
+
+typedef struct h2_request {
+  char *method;
+  char *path;
+  char *accept_encoding;
+} h2_request_t;
+
+typedef struct http2 {
+  connection_t *conn;
+  hpack_table_t decoder;
+  h2_stream_t *streams;
+  int stream_count;
+  uint32_t last_stream_id;
+  int64_t window;
+  int64_t initial_window;
+  bool goaway;
+  unsigned char *block;
+  size_t block_size;
+  uint32_t block_stream;
+  bool block_pending;
+  bool block_new_stream;
+  bool block_end_stream;
+  unsigned char frame[FRAME_HEADER_SIZE + H2_FRAME_SIZE];
+  unsigned char out[FRAME_HEADER_SIZE + H2_FRAME_SIZE];
+} http2_t;
+
+static uint32_t read_u32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void write_u32(unsigned char *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+/**
+ * @brief Writes a frame to the connection.
+ *
+ * The frame is assembled in the connection's output buffer. A payload that
+ * was already placed right after the frame header in that buffer is not
+ * copied again.
+ */
+static int write_frame(http2_t *h2, FRAME_TYPE_T type, uint8_t flags,
+                       uint32_t stream_id, const unsigned char *payload,
+                       size_t length) {
+  unsigned char *frame = h2->out;
+  frame[0] = length >> 16;
+  frame[1] = length >> 8;
+  frame[2] = length;
+  frame[3] = type;
+  frame[4] = flags;
+  write_u32(frame + 5, stream_id & MAX_WINDOW);
+  if (length > 0 && payload != frame + FRAME_HEADER_SIZE) {
+    memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+  }
+  return write_to_conn(h2->conn, frame, FRAME_HEADER_SIZE + length);
+}
+
+static int send_settings(http2_t *h2) {
+  unsigned char payload[18];
+  uint16_t ids[3] = {SETTINGS_MAX_CONCURRENT_STREAMS,
+                     SETTINGS_HEADER_TABLE_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE};
+  uint32_t values[3] = {H2_MAX_STREAMS, H2_HEADER_TABLE_SIZE,
+                        h2->conn->settings->max_header_size};
+  for (int i = 0; i < 3; i++) {
+    payload[i * 6] = ids[i] >> 8;
+    payload[i * 6 + 1] = ids[i];
+    write_u32(payload + i * 6 + 2, values[i]);
+  }
+  return write_frame(h2, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static int send_window_update(http2_t *h2, uint32_t stream_id,
+                              uint32_t increment) {
+  unsigned char payload[4];
+  write_u32(payload, increment);
+  return write_frame(h2, FRAME_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+static int send_rst_stream(http2_t *h2, uint32_t stream_id, H2_ERROR_T error) {
+  unsigned char payload[4];
+  write_u32(payload, error);
+  return write_frame(h2, FRAME_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+static int send_goaway(http2_t *h2, H2_ERROR_T error) {
+  unsigned char payload[8];
+  write_u32(payload, h2->last_stream_id);
+  write_u32(payload + 4, error);
+  return write_frame(h2, FRAME_GOAWAY, 0, 0, payload, 8);
+}
+
+static h2_stream_t *find_stream(http2_t *h2, uint32_t id) {
+  for (h2_stream_t *stream = h2->streams; stream; stream = stream->next) {
+    if (stream->id == id) {
+      return stream;
+    }
+  }
+  return NULL;
+}
+
+static void close_stream(http2_t *h2, h2_stream_t *stream) {
+  h2_stream_t **link = &h2->streams;
+  while (*link && *link != stream) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    *link = stream->next;
+  }
+  destroy_document(stream->response);
+  free(stream);
+  h2->stream_count--;
+}
+
+static document_t *create_refusal(RESPONSE_CODE_T code) {
+  document_t *response = create_response(code, NULL);
+  if (response) {
+    set_header_item(response->header, "retry-after", RETRY_AFTER);
+    set_header_item(response->header, "content-length", "0");
+  }
+  return response;
+}
+
+/**
+ * @brief Builds the response of a stream.
+ *
+ * Every stream is a request of its own, so each one but the first request of
+ * the connection, whose token was taken when it was accepted, takes a token
+ * from the client's bucket, and a client over its limit gets `429 Too Many
+ * Requests` on the stream. The response is then built holding one of the
+ * `max_inflight_requests` request slots, like an HTTP/1.1 request, and a
+ * stream that cannot get one within `max_queue_ms` gets `503 Service
+ * Unavailable`. The slot is given back once the response is built: sending
+ * it is paced by the client's flow control windows. The connection stays
+ * open for the streams after a refused one.
+ */
+static document_t *create_stream_response(http2_t *h2, document_t *request) {
+  connection_t *conn = h2->conn;
+  if (conn->requests++ > 0 && !acquire_token(conn->peer)) {
+    return create_refusal(TOO_MANY_REQUESTS);
+  }
+  struct timespec received;
+  clock_gettime(CLOCK_MONOTONIC, &received);
+  if (!acquire_request_slot(&received)) {
+    return create_refusal(SERVICE_UNAVAILABLE);
+  }
+  document_t *response = create_route_response(request);
+  int error = errno;
+  release_request_slot();
+  errno = error;
+  return response;
+}
+
+/**
+ * @brief Opens a stream and prepares its response.
+ *
+ * The request is routed exactly like on HTTP/1.1, and its response is built
+ * by the responder of its route. Routes that can only be served over
+ * HTTP/1.1, like proxy routes, reset the stream with HTTP_1_1_REQUIRED.
+ */
+static int open_stream(http2_t *h2, uint32_t id, document_t *request,
+                       bool remote_closed) {
+  bool head_only = request->header->request_line->method == HEAD;
+  errno = 0;
+  document_t *response = create_stream_response(h2, request);
+  if (!response && errno == EPROTONOSUPPORT) {
+    return send_rst_stream(h2, id, H2_HTTP_1_1_REQUIRED);
+  }
+  if (!response) {
+    response = create_response(INTERNAL_SERVER_ERROR, NULL);
+  }
+  h2_stream_t *stream = malloc(sizeof(h2_stream_t));
+  if (!stream || !response) {
+    free(stream);
+    destroy_document(response);
+    return send_rst_stream(h2, id, H2_INTERNAL_ERROR);
+  }
+  stream->id = id;
+  stream->window = h2->initial_window;
+  stream->response = response;
+  stream->offset = 0;
+  stream->headers_sent = false;
+  stream->head_only = head_only;
+  stream->remote_closed = remote_closed;
+  stream->failed = false;
+  stream->next = NULL;
+  h2_stream_t **link = &h2->streams;
+  while (*link) {
+    link = &(*link)->next;
+  }
+  *link = stream;
+  h2->stream_count++;
+  return 0;
+}
+
+static int collect_field(void *context, const char *name, const char *value) {
+  h2_request_t *request = context;
+  char **field = NULL;
+  if (strcmp(name, ":method") == 0) {
+    field = &request->method;
+  } else if (strcmp(name, ":path") == 0) {
+    field = &request->path;
+  } else if (strcmp(name, "accept-encoding") == 0) {
+    field = &request->accept_encoding;
+  }
+  if (field) {
+    free(*field);
+    *field = strdup(value);
+    if (!*field) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Creates the request document of a stream from its header fields.
+ */
+static document_t *create_stream_request(const h2_request_t *request) {
+  header_t *header = create_request_header(parse_method(request->method),
+                                           request->path, "HTTP/2.0");
+  if (!header) {
+    return NULL;
+  }
+  if (request->accept_encoding) {
+    attach_header(header, create_header_item("ACCEPT-ENCODING",
+                                             request->accept_encoding));
+  }
+  document_t *document = create_document(header, NULL, REQUEST);
+  if (!document) {
+    destroy_header(header);
+  }
+  return document;
+}
+
+/**
+ * @brief Decodes a complete header block and opens its stream.
+ *
+ * Every block must be decoded to keep the HPACK state in sync, even when the
+ * stream is then refused or the block carries trailers.
+ *
+ * @return 0, a negative value on I/O error, or a connection error code.
+ */
+static int finish_header_block(http2_t *h2) {
+  h2_request_t request = {NULL, NULL, NULL};
+  int decoded = hpack_decode(&h2->decoder, h2->block, h2->block_size,
+                             collect_field, &request);
+  free(h2->block);
+  h2->block = NULL;
+  h2->block_size = 0;
+  h2->block_pending = false;
+  int result = 0;
+  if (decoded < 0) {
+    result = H2_COMPRESSION_ERROR;
+  } else if (!h2->block_new_stream || h2->goaway) {
+    h2_stream_t *stream = find_stream(h2, h2->block_stream);
+    if (stream && h2->block_end_stream) {
+      stream->remote_closed = true;
+    }
+  } else if (h2->stream_count >= H2_MAX_STREAMS) {
+    result = send_rst_stream(h2, h2->block_stream, H2_REFUSED_STREAM);
+  } else if (!request.method || !request.path || request.path[0] != '/') {
+    result = send_rst_stream(h2, h2->block_stream, H2_PROTOCOL_ERROR);
+  } else {
+    document_t *document = create_stream_request(&request);
+    result = document ? open_stream(h2, h2->block_stream, document,
+                                    h2->block_end_stream)
+                      : send_rst_stream(h2, h2->block_stream,
+                                        H2_INTERNAL_ERROR);
+    destroy_document(document);
+  }
+  free(request.method);
+  free(request.path);
+  free(request.accept_encoding);
+  return result;
+}
+
+static int append_header_block(http2_t *h2, const unsigned char *fragment,
+                               size_t length, uint8_t flags) {
+  if (h2->block_size + length > h2->conn->settings->max_header_size) {
+    return H2_ENHANCE_YOUR_CALM;
+  }
+  unsigned char *block = realloc(h2->block, h2->block_size + length + 1);
+  if (!block) {
+    return H2_INTERNAL_ERROR;
+  }
+  memcpy(block + h2->block_size, fragment, length);
+  h2->block = block;
+  h2->block_size += length;
+  h2->block_pending = true;
+  if (flags & FLAG_END_HEADERS) {
+    return finish_header_block(h2);
+  }
+  return 0;
+}
+
+static int apply_settings(http2_t *h2, const unsigned char *payload,
+                          size_t length) {
+  for (size_t i = 0; i + 6 <= length; i += 6) {
+    uint16_t id = payload[i] << 8 | payload[i + 1];
+    uint32_t value = read_u32(payload + i + 2);
+    switch (id) {
+    case SETTINGS_ENABLE_PUSH:
+      if (value > 1) {
+        return H2_PROTOCOL_ERROR;
+      }
+      break;
+    case SETTINGS_INITIAL_WINDOW_SIZE:
+      if (value > MAX_WINDOW) {
+        return H2_FLOW_CONTROL_ERROR;
+      }
+      for (h2_stream_t *stream = h2->streams; stream; stream = stream->next) {
+        stream->window += (int64_t)value - h2->initial_window;
+        if (stream->window > MAX_WINDOW) {
+          return H2_FLOW_CONTROL_ERROR;
+        }
+      }
+      h2->initial_window = value;
+      break;
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (value < 16384 || value > 16777215) {
+        return H2_PROTOCOL_ERROR;
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+static int handle_window_update(http2_t *h2, uint32_t stream_id,
+                                uint32_t increment) {
+  if (stream_id == 0) {
+    if (increment == 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    h2->window += increment;
+    return h2->window > MAX_WINDOW ? H2_FLOW_CONTROL_ERROR : 0;
+  }
+  h2_stream_t *stream = find_stream(h2, stream_id);
+  if (!stream) {
+    return 0;
+  }
+  stream->window += increment;
+  if (increment == 0 || stream->window > MAX_WINDOW) {
+    close_stream(h2, stream);
+    return send_rst_stream(h2, stream_id, increment == 0
+                                              ? H2_PROTOCOL_ERROR
+                                              : H2_FLOW_CONTROL_ERROR);
+  }
+  return 0;
+}
+
+/**
+ * @brief Handles a received frame.
+ *
+ * Request bodies are not used, so DATA frames are discarded and their flow
+ * control credit is handed back to the peer right away.
+ *
+ * @return 0, a negative value on I/O error, or a connection error code.
+ */
+static int process_frame(http2_t *h2, FRAME_TYPE_T type, uint8_t flags,
+                         uint32_t stream_id, const unsigned char *payload,
+                         size_t length) {
+  if (h2->block_pending &&
+      (type != FRAME_CONTINUATION || stream_id != h2->block_stream)) {
+    return H2_PROTOCOL_ERROR;
+  }
+  switch (type) {
+  case FRAME_DATA: {
+    if (stream_id == 0 || stream_id > h2->last_stream_id) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if ((flags & FLAG_PADDED) && (length == 0 || payload[0] >= length)) {
+      return H2_PROTOCOL_ERROR;
+    }
+    h2_stream_t *stream = find_stream(h2, stream_id);
+    if (stream && (flags & FLAG_END_STREAM)) {
+      stream->remote_closed = true;
+    }
+    if (length == 0) {
+      return 0;
+    }
+    int result = send_window_update(h2, 0, length);
+    if (result == 0 && stream && !stream->remote_closed) {
+      result = send_window_update(h2, stream_id, length);
+    }
+    return result;
+  }
+  case FRAME_HEADERS: {
+    if (stream_id == 0 || stream_id % 2 == 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    size_t start = 0;
+    size_t padding = 0;
+    if (flags & FLAG_PADDED) {
+      if (length < 1) {
+        return H2_PROTOCOL_ERROR;
+      }
+      padding = payload[0];
+      start = 1;
+    }
+    if (flags & FLAG_PRIORITY) {
+      start += 5;
+    }
+    if (start + padding > length) {
+      return H2_PROTOCOL_ERROR;
+    }
+    h2->block_new_stream = stream_id > h2->last_stream_id;
+    if (h2->block_new_stream) {
+      h2->last_stream_id = stream_id;
+    }
+    h2->block_stream = stream_id;
+    h2->block_end_stream = flags & FLAG_END_STREAM;
+    return append_header_block(h2, payload + start, length - start - padding,
+                               flags);
+  }
+  case FRAME_CONTINUATION:
+    if (!h2->block_pending) {
+      return H2_PROTOCOL_ERROR;
+    }
+    return append_header_block(h2, payload, length, flags);
+  case FRAME_RST_STREAM: {
+    if (stream_id == 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if (length != 4) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    h2_stream_t *stream = find_stream(h2, stream_id);
+    if (stream) {
+      close_stream(h2, stream);
+    }
+    return 0;
+  }
+  case FRAME_SETTINGS: {
+    if (stream_id != 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if (flags & FLAG_ACK) {
+      return length == 0 ? 0 : H2_FRAME_SIZE_ERROR;
+    }
+    if (length % 6 != 0) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    int result = apply_settings(h2, payload, length);
+    if (result != 0) {
+      return result;
+    }
+    return write_frame(h2, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+  }
+  case FRAME_PUSH_PROMISE:
+    return H2_PROTOCOL_ERROR;
+  case FRAME_PING:
+    if (stream_id != 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if (length != 8) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    if (flags & FLAG_ACK) {
+      return 0;
+    }
+    return write_frame(h2, FRAME_PING, FLAG_ACK, 0, payload, 8);
+  case FRAME_GOAWAY:
+    h2->goaway = true;
+    return 0;
+  case FRAME_WINDOW_UPDATE:
+    if (length != 4) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    return handle_window_update(h2, stream_id, read_u32(payload) & MAX_WINDOW);
+  case FRAME_PRIORITY:
+  default:
+    return 0;
+  }
+}
+
+static int read_exact(connection_t *conn, unsigned char *buf, size_t count,
+                      int timeout) {
+  size_t received = 0;
+  while (received < count) {
+    bool blocking = conn->start == conn->end;
+    if (blocking) {
+      arm_timer(&conn->timer, timeout);
+    }
+    ssize_t n = read_connection(conn, buf + received, count - received);
+    if (blocking) {
+      cancel_timer(&conn->timer);
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    received += n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Reads and handles the next frame.
+ *
+ * While no stream is open, the connection may sit idle for
+ * `keepalive_timeout` milliseconds before the next frame; otherwise a frame
+ * header must arrive within `header_timeout` milliseconds.
+ *
+ * @return 0, a negative value on I/O error, or a connection error code.
+ */
+static int read_frame(http2_t *h2) {
+  connection_t *conn = h2->conn;
+  const settings_t *settings = conn->settings;
+  bool idle = h2->stream_count == 0 && !h2->block_pending;
+  unsigned char *frame = h2->frame;
+  if (read_exact(conn, frame, FRAME_HEADER_SIZE,
+                 idle ? settings->keepalive_timeout
+                      : settings->header_timeout) < 0) {
+    return -1;
+  }
+  size_t length = frame[0] << 16 | frame[1] << 8 | frame[2];
+  if (length > H2_FRAME_SIZE) {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  if (read_exact(conn, frame + FRAME_HEADER_SIZE, length,
+                 settings->body_timeout) < 0) {
+    return -1;
+  }
+  return process_frame(h2, frame[3], frame[4], read_u32(frame + 5) & MAX_WINDOW,
+                       frame + FRAME_HEADER_SIZE, length);
+}
+
+static size_t remaining_body(h2_stream_t *stream) {
+  body_t *body = stream->response->body;
+  if (stream->head_only || !body) {
+    return 0;
+  }
+  return body->size - stream->offset;
+}
+
+static bool stream_writable(http2_t *h2, h2_stream_t *stream) {
+  return !stream->headers_sent ||
+         (remaining_body(stream) > 0 && stream->window > 0 && h2->window > 0);
+}
+
+static bool has_writable_stream(http2_t *h2) {
+  for (h2_stream_t *stream = h2->streams; stream; stream = stream->next) {
+    if (stream_writable(h2, stream)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool is_hop_by_hop(const char *key) {
+  return strcmp(key, "connection") == 0 || strcmp(key, "keep-alive") == 0 ||
+         strcmp(key, "transfer-encoding") == 0 || strcmp(key, "upgrade") == 0;
+}
+
+/**
+ * @brief Sends the response header of a stream.
+ *
+ * The header items of the response document are encoded as they are, minus
+ * the connection-specific ones HTTP/2 forbids. A header block larger than a
+ * frame continues in CONTINUATION frames.
+ */
+static int send_headers(http2_t *h2, h2_stream_t *stream) {
+  header_t *header = stream->response->header;
+  hpack_buffer_t block = {NULL, 0, 0};
+  int result = hpack_encode_status(&block, header->response_line->code);
+  for (int i = 0; result == 0 && i < header->count; i++) {
+    if (!is_hop_by_hop(header->items[i]->key)) {
+      result = hpack_encode_field(&block, header->items[i]->key,
+                                  header->items[i]->value);
+    }
+  }
+  if (result < 0) {
+    free(block.data);
+    stream->failed = true;
+    return 0;
+  }
+  size_t offset = 0;
+  FRAME_TYPE_T type = FRAME_HEADERS;
+  uint8_t flags = remaining_body(stream) == 0 ? FLAG_END_STREAM : 0;
+  do {
+    size_t length = block.size - offset;
+    if (length > H2_FRAME_SIZE) {
+      length = H2_FRAME_SIZE;
+    } else {
+      flags |= FLAG_END_HEADERS;
+    }
+    result = write_frame(h2, type, flags, stream->id, block.data + offset,
+                         length);
+    offset += length;
+    type = FRAME_CONTINUATION;
+    flags = 0;
+  } while (result == 0 && offset < block.size);
+  free(block.data);
+  stream->headers_sent = true;
+  return result;
+}
+
+/**
+ * @brief Sends the next DATA frame of a stream.
+ *
+ * The frame is as large as the stream and connection windows and the frame
+ * size allow. A file-backed body is read straight into the output buffer.
+ */
+static int send_data(http2_t *h2, h2_stream_t *stream) {
+  body_t *body = stream->response->body;
+  size_t length = remaining_body(stream);
+  if ((int64_t)length > stream->window) {
+    length = stream->window;
+  }
+  if ((int64_t)length > h2->window) {
+    length = h2->window;
+  }
+  if (length > H2_FRAME_SIZE) {
+    length = H2_FRAME_SIZE;
+  }
+  unsigned char *payload = h2->out + FRAME_HEADER_SIZE;
+  if (body->fd >= 0) {
+    ssize_t n = pread(body->fd, payload, length, stream->offset);
+    if (n != (ssize_t)length) {
+      stream->failed = true;
+      return 0;
+    }
+  } else {
+    memcpy(payload, body->data + stream->offset, length);
+  }
+  stream->offset += length;
+  stream->window -= length;
+  h2->window -= length;
+  uint8_t flags = remaining_body(stream) == 0 ? FLAG_END_STREAM : 0;
+  return write_frame(h2, FRAME_DATA, flags, stream->id, payload, length);
+}
+
+/**
+ * @brief Writes one frame for every stream that can make progress.
+ *
+ * Streams take turns frame by frame, so a large file does not hold back the
+ * small ones requested next to it. A stream whose response is complete is
+ * closed; if the client is still sending its request body, it is told to stop
+ * with RST_STREAM(NO_ERROR). A stream whose response cannot be sent is reset.
+ */
+static int write_round(http2_t *h2) {
+  cork_connection(h2->conn, true);
+  int result = 0;
+  h2_stream_t *stream = h2->streams;
+  while (result == 0 && stream) {
+    h2_stream_t *next = stream->next;
+    if (stream_writable(h2, stream)) {
+      result = stream->headers_sent ? send_data(h2, stream)
+                                    : send_headers(h2, stream);
+    }
+    uint32_t id = stream->id;
+    if (result == 0 && stream->failed) {
+      close_stream(h2, stream);
+      result = send_rst_stream(h2, id, H2_INTERNAL_ERROR);
+    } else if (result == 0 && stream->headers_sent &&
+               remaining_body(stream) == 0) {
+      bool remote_closed = stream->remote_closed;
+      close_stream(h2, stream);
+      if (!remote_closed) {
+        result = send_rst_stream(h2, id, H2_NO_ERROR);
+      }
+    }
+    stream = next;
+  }
+  cork_connection(h2->conn, false);
+  return result;
+}
+
+static bool socket_readable(int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+static int base64url_value(char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  }
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 26;
+  }
+  if (c >= '0' && c <= '9') {
+    return c - '0' + 52;
+  }
+  if (c == '-' || c == '+') {
+    return 62;
+  }
+  if (c == '_' || c == '/') {
+    return 63;
+  }
+  return -1;
+}
+
+/**
+ * @brief Applies the settings a client sent in its `HTTP2-Settings` header.
+ *
+ * @return 0 on success, or a connection error code.
+ */
+static int apply_upgrade_settings(http2_t *h2, const char *encoded) {
+  unsigned char payload[H2_FRAME_SIZE];
+  size_t length = 0;
+  uint32_t bits = 0;
+  int pending = 0;
+  for (const char *c = encoded; *c && *c != '='; c++) {
+    int value = base64url_value(*c);
+    if (value < 0 || length >= sizeof(payload)) {
+      return H2_PROTOCOL_ERROR;
+    }
+    bits = bits << 6 | value;
+    pending += 6;
+    if (pending >= 8) {
+      pending -= 8;
+      payload[length++] = bits >> pending;
+    }
+  }
+  if (length % 6 != 0) {
+    return H2_PROTOCOL_ERROR;
+  }
+  return apply_settings(h2, payload, length);
+}
+
+/**
+ * @brief Checks whether a connection starts with the HTTP/2 client preface.
+ *
+ * Only as many bytes are read as are needed to tell an HTTP/2 preface from an
+ * HTTP/1.1 request line, and nothing is consumed, so either protocol can parse
+ * the connection afterwards.
+ *
+ * @param conn The connection to check.
+ * @return True if the client speaks HTTP/2 with prior knowledge.
+ */
+bool is_http2_preface(connection_t *conn) {
+  while (1) {
+    size_t available = conn->end - conn->start;
+    size_t count = available < PREFACE_SIZE ? available : PREFACE_SIZE;
+    if (memcmp(conn->buffer + conn->start, PREFACE, count) != 0) {
+      return false;
+    }
+    if (count == PREFACE_SIZE) {
+      return true;
+    }
+    arm_timer(&conn->timer, conn->settings->header_timeout);
+    ssize_t n = fill_connection(conn);
+    cancel_timer(&conn->timer);
+    if (n <= 0) {
+      return false;
+    }
+  }
+}
+
+static bool has_token(const char *list, const char *token) {
+  size_t length = strlen(token);
+  const char *p = list;
+  while (*p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') {
+      p++;
+    }
+    const char *end = p;
+    while (*end && *end != ',' && *end != ' ' && *end != '\t') {
+      end++;
+    }
+    if ((size_t)(end - p) == length && strncasecmp(p, token, length) == 0) {
+      return true;
+    }
+    p = end;
+  }
+  return false;
+}
+
+/**
+ * @brief Checks whether a request asks to upgrade the connection to h2c.
+ *
+ * Only requests that declare no body are upgraded. Others are served over
+ * HTTP/1.1 as if the `Upgrade` header was not there, which the protocol
+ * allows.
+ *
+ * @param request The request document.
+ * @return True if the connection should switch to HTTP/2.
+ */
+bool wants_h2c_upgrade(document_t *request) {
+  header_item_t *upgrade = get_header_item(request->header, "UPGRADE");
+  return upgrade && has_token(upgrade->value, "h2c") &&
+         get_header_item(request->header, "HTTP2-SETTINGS") &&
+         !get_header_item(request->header, "CONTENT-LENGTH") &&
+         !get_header_item(request->header, "TRANSFER-ENCODING") &&
+         strcmp(request->header->request_line->version, "HTTP/1.1") == 0;
+}
+
+/**
+ * @brief Serves a connection over cleartext HTTP/2.
+ *
+ * The connection is either opened with the HTTP/2 preface, or upgraded from
+ * HTTP/1.1 through `upgrade_request`, whose response is then sent on stream
+ * 1. Many requests are multiplexed over the one connection: frames are read
+ * whenever the client has sent some, and in between every open stream gets to
+ * send one frame per round, within the flow control windows the client
+ * grants. After H2_READ_BURST frames read in a row, a round is written before
+ * the next frame is read, so a client that never stops sending, be it pings,
+ * window updates or an upload, cannot hold back the responses. The connection
+ * is closed when this function returns.
+ *
+ * @param conn The connection to serve.
+ * @param upgrade_request The HTTP/1.1 request that asked for the upgrade, or
+ * NULL if the client sent the preface directly.
+ */
+void serve_http2(connection_t *conn, document_t *upgrade_request) {
+  conn->keep_alive = false;
+  http2_t *h2 = calloc(1, sizeof(http2_t));
+  if (!h2 || init_hpack_table(&h2->decoder, H2_HEADER_TABLE_SIZE) < 0) {
+    free(h2);
+    return;
+  }
+  h2->conn = conn;
+  h2->window = DEFAULT_WINDOW;
+  h2->initial_window = DEFAULT_WINDOW;
+  int result = 0;
+  if (upgrade_request) {
+    header_item_t *settings =
+        get_header_item(upgrade_request->header, "HTTP2-SETTINGS");
+    result = write_to_conn(conn, (unsigned char *)UPGRADE_RESPONSE,
+                           sizeof(UPGRADE_RESPONSE) - 1);
+    if (result == 0) {
+      result = apply_upgrade_settings(h2, settings->value);
+    }
+  }
+  if (result == 0) {
+    result = send_settings(h2);
+  }
+  unsigned char preface[PREFACE_SIZE];
+  if (result == 0 &&
+      (read_exact(conn, preface, PREFACE_SIZE,
+                  conn->settings->header_timeout) < 0 ||
+       memcmp(preface, PREFACE, PREFACE_SIZE) != 0)) {
+    result = -1;
+  }
+  if (result == 0 && upgrade_request) {
+    h2->last_stream_id = 1;
+    result = open_stream(h2, 1, upgrade_request, true);
+  }
+  int reads = 0;
+  while (result == 0 && !(h2->goaway && h2->stream_count == 0)) {
+    if (has_writable_stream(h2) &&
+        (reads >= H2_READ_BURST ||
+         (conn->start == conn->end && !socket_readable(conn->fd)))) {
+      result = write_round(h2);
+      reads = 0;
+    } else {
+      result = read_frame(h2);
+      reads++;
+    }
+  }
+  if (result > 0) {
+    send_goaway(h2, result);
+  }
+  while (h2->streams) {
+    close_stream(h2, h2->streams);
+  }
+  destroy_hpack_table(&h2->decoder);
+  free(h2->block);
+  free(h2);
+}
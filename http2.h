@@ -0,0 +1,10 @@
+#ifndef HTTP2
+#define HTTP2
+#include "connection.h"
+#include "document.h"
+#include <stdbool.h>
+
+bool is_http2_preface(connection_t *conn);
+bool wants_h2c_upgrade(document_t *request);
+void serve_http2(connection_t *conn, document_t *upgrade_request);
+#endif // !HTTP2
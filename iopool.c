@@ -0,0 +1,241 @@
+#include "iopool.h"
+#include "config.h"
+#include "settings.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct io_call {
+  io_job_t job;
+  void (*run)(void *arg);
+  void (*discard)(void *arg);
+  void *arg;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  bool done;
+  bool abandoned;
+} io_call_t;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static io_job_t *queue_head = NULL;
+static io_job_t *queue_tail = NULL;
+static int queue_length = 0;
+static atomic_int io_threads = 0;
+static atomic_int io_busy = 0;
+static atomic_ulong io_jobs = 0;
+static atomic_ulong io_rejected = 0;
+static atomic_ulong io_timeouts = 0;
+static __thread bool on_io_thread = false;
+
+static io_job_t *take_job() {
+  pthread_mutex_lock(&queue_lock);
+  while (!queue_head) {
+    pthread_cond_wait(&queue_ready, &queue_lock);
+  }
+  io_job_t *job = queue_head;
+  queue_head = job->next;
+  if (!queue_head) {
+    queue_tail = NULL;
+  }
+  queue_length--;
+  pthread_mutex_unlock(&queue_lock);
+  return job;
+}
+
+static void *run_io_thread(void *arg) {
+  (void)arg;
+  on_io_thread = true;
+  while (1) {
+    io_job_t *job = take_job();
+    atomic_fetch_add(&io_busy, 1);
+    job->run(job->arg);
+    atomic_fetch_sub(&io_busy, 1);
+    atomic_fetch_add(&io_jobs, 1);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Starts the threads that do the disk reads of cache misses, and the
+ * `open` and `stat` calls of the connection threads.
+ *
+ * With `io_threads` threads reading, a slow or stalled disk holds at most
+ * that many threads, however many connections ask for files that are not in
+ * memory; the connection threads wait for the reads with a deadline instead.
+ * With `io_threads` set to 0 no pool is started and files are read by the
+ * thread that asks for them. In prefork mode each worker process starts its
+ * own pool after it is forked.
+ *
+ * @return 0 on success, or -1 if no thread could be started.
+ */
+int start_io_pool() {
+  int threads = get_settings()->io_threads;
+  int started = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, run_io_thread, NULL) != 0) {
+      perror("io pool");
+      break;
+    }
+    pthread_detach(tid);
+    started++;
+  }
+  atomic_store(&io_threads, started);
+  return threads > 0 && started == 0 ? -1 : 0;
+}
+
+/**
+ * @brief Checks whether reads are done by the I/O pool.
+ */
+bool is_io_pool_running() { return atomic_load(&io_threads) > 0; }
+
+/**
+ * @brief Queues a job for the I/O pool.
+ *
+ * Jobs run in the order they were queued. The queue holds at most
+ * IO_QUEUE_MAX jobs: once the disk is that far behind, more reads would only
+ * wait longer, so the job is refused and the caller sheds the request.
+ *
+ * @param job The job. Must stay valid until it has run.
+ * @return True if the job was queued, false if the pool is not running or
+ * its queue is full.
+ */
+bool submit_io(io_job_t *job) {
+  if (!is_io_pool_running()) {
+    return false;
+  }
+  pthread_mutex_lock(&queue_lock);
+  if (queue_length >= IO_QUEUE_MAX) {
+    pthread_mutex_unlock(&queue_lock);
+    atomic_fetch_add(&io_rejected, 1);
+    return false;
+  }
+  job->next = NULL;
+  if (queue_tail) {
+    queue_tail->next = job;
+  } else {
+    queue_head = job;
+  }
+  queue_tail = job;
+  queue_length++;
+  pthread_cond_signal(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+  return true;
+}
+
+static void destroy_call(io_call_t *call) {
+  pthread_cond_destroy(&call->finished);
+  pthread_mutex_destroy(&call->lock);
+  free(call);
+}
+
+/**
+ * @brief Runs a call on an I/O thread, then hands its argument to the caller
+ * or, if the caller gave up waiting, to its discard function.
+ */
+static void finish_call(void *arg) {
+  io_call_t *call = arg;
+  call->run(call->arg);
+  pthread_mutex_lock(&call->lock);
+  call->done = true;
+  bool abandoned = call->abandoned;
+  pthread_cond_signal(&call->finished);
+  pthread_mutex_unlock(&call->lock);
+  if (abandoned) {
+    call->discard(call->arg);
+    destroy_call(call);
+  }
+}
+
+/**
+ * @brief Runs a blocking file system call on the I/O pool and waits for it.
+ *
+ * This is how a connection thread opens or stats a file, so that, like the
+ * reads of load_shared_file(), it waits at most `io_timeout` for a stalled
+ * disk. Without a pool, or on an I/O thread, `run` is called right away.
+ *
+ * @param run The function to call with `arg`.
+ * @param discard The function that frees `arg`, and whatever `run` left in
+ * it, when the caller does not get it back.
+ * @param arg The argument, which holds the inputs and receives the results.
+ * @return True once `run` has returned. False with `errno` set to ETIMEDOUT
+ * if it took longer than `io_timeout`, to EAGAIN if the pool was too busy to
+ * take it, or to ENOMEM; `arg` then belongs to `discard`.
+ */
+bool call_io(void (*run)(void *arg), void (*discard)(void *arg), void *arg) {
+  if (on_io_thread || !is_io_pool_running()) {
+    run(arg);
+    return true;
+  }
+  io_call_t *call = calloc(1, sizeof(io_call_t));
+  if (!call) {
+    discard(arg);
+    errno = ENOMEM;
+    return false;
+  }
+  call->job.run = finish_call;
+  call->job.arg = call;
+  call->run = run;
+  call->discard = discard;
+  call->arg = arg;
+  pthread_mutex_init(&call->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&call->finished, &attr);
+  pthread_condattr_destroy(&attr);
+  if (!submit_io(&call->job)) {
+    destroy_call(call);
+    discard(arg);
+    errno = EAGAIN;
+    return false;
+  }
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  long timeout = get_settings()->io_timeout;
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += timeout % 1000 * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_nsec -= 1000000000L;
+    deadline.tv_sec++;
+  }
+  pthread_mutex_lock(&call->lock);
+  int waited = 0;
+  while (!call->done && waited != ETIMEDOUT) {
+    waited = pthread_cond_timedwait(&call->finished, &call->lock, &deadline);
+  }
+  bool done = call->done;
+  call->abandoned = !done;
+  pthread_mutex_unlock(&call->lock);
+  if (!done) {
+    atomic_fetch_add(&io_timeouts, 1);
+    errno = ETIMEDOUT;
+    return false;
+  }
+  destroy_call(call);
+  return true;
+}
+
+/**
+ * @brief Writes the I/O pool counters.
+ *
+ * @param out The stream to write to.
+ */
+void write_io_stats(FILE *out) {
+  if (!is_io_pool_running()) {
+    return;
+  }
+  pthread_mutex_lock(&queue_lock);
+  int queued = queue_length;
+  pthread_mutex_unlock(&queue_lock);
+  fprintf(out, "io_threads %d\n", atomic_load(&io_threads));
+  fprintf(out, "io_busy %d\n", atomic_load(&io_busy));
+  fprintf(out, "io_queued %d\n", queued);
+  fprintf(out, "io_jobs %lu\n", atomic_load(&io_jobs));
+  fprintf(out, "io_rejected %lu\n", atomic_load(&io_rejected));
+  fprintf(out, "io_timeouts %lu\n", atomic_load(&io_timeouts));
+}
@@ -0,0 +1,17 @@
+#ifndef IOPOOL
+#define IOPOOL
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef struct io_job {
+  void (*run)(void *arg);
+  void *arg;
+  struct io_job *next;
+} io_job_t;
+
+int start_io_pool();
+bool is_io_pool_running();
+bool submit_io(io_job_t *job);
+bool call_io(void (*run)(void *arg), void (*discard)(void *arg), void *arg);
+void write_io_stats(FILE *out);
+#endif // !IOPOOL
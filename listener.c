@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include "listener.h"
+#include "config.h"
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * @brief Sets an integer socket option and reads back the value in effect.
+ *
+ * The kernel may round or scale the requested value, so the value read back is
+ * what gets reported. A value of 0 leaves the option at its default.
+ *
+ * @return The value in effect, or -1 if the option is not supported.
+ */
+static int apply_option(int sockfd, int level, int name, const char *label,
+                        int value) {
+  if (value > 0 &&
+      setsockopt(sockfd, level, name, &value, sizeof(value)) < 0) {
+    fprintf(stderr, "%s: %s\n", label, strerror(errno));
+  }
+  int applied = -1;
+  socklen_t length = sizeof(applied);
+  if (getsockopt(sockfd, level, name, &applied, &length) < 0) {
+    return -1;
+  }
+  return applied;
+}
+
+/**
+ * @brief Creates a non-blocking listening socket bound to `port`.
+ *
+ * `TCP_DEFER_ACCEPT` makes the kernel hold back a connection until its first
+ * data has arrived, so a worker never waits on a client that only connected.
+ * `TCP_FASTOPEN` lets returning clients send their request with the SYN.
+ * `SO_SNDBUF` and `SO_RCVBUF` are set on the listener, so accepted sockets
+ * inherit them and the receive window is scaled from the first packet. With
+ * `reuseport`, several listeners can bind the same port and the kernel spreads
+ * new connections across them. The values in effect are reported on startup.
+ *
+ * @param port The port to listen on.
+ * @param options The options to apply to the listening socket.
+ * @return The listening socket, or -1 on error.
+ */
+int create_listener(int port, const listener_options_t *options) {
+  int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sockfd < 0) {
+    perror("socket");
+    return -1;
+  }
+  int opt = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (options->reuseport &&
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+    perror("SO_REUSEPORT");
+    close(sockfd);
+    return -1;
+  }
+  int sndbuf = apply_option(sockfd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF",
+                            options->sndbuf);
+  int rcvbuf = apply_option(sockfd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF",
+                            options->rcvbuf);
+  int defer_accept = apply_option(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                                  "TCP_DEFER_ACCEPT", options->defer_accept);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port);
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    close(sockfd);
+    return -1;
+  }
+  int fastopen = apply_option(sockfd, IPPROTO_TCP, TCP_FASTOPEN,
+                              "TCP_FASTOPEN", options->fastopen_queue);
+  if (listen(sockfd, options->backlog) < 0) {
+    perror("listen");
+    close(sockfd);
+    return -1;
+  }
+  printf("listener: port %d, backlog %d, defer accept %ds, fastopen queue %d, "
+         "sndbuf %d, rcvbuf %d, reuseport %s\n",
+         port, options->backlog, defer_accept, fastopen, sndbuf, rcvbuf,
+         options->reuseport ? "on" : "off");
+  return sockfd;
+}
+
+/**
+ * @brief Prefers a listener for connections whose packets arrive on `cpu`.
+ *
+ * With `SO_INCOMING_CPU` set on every listener of a `SO_REUSEPORT` group, the
+ * kernel hands a new connection to the listener of the CPU that received it,
+ * so the connection is accepted and served where its packets are already in
+ * cache.
+ *
+ * @param sockfd The listening socket.
+ * @param cpu The CPU the listener's worker runs on.
+ * @return 0 on success, or -1 on error.
+ */
+int steer_listener(int sockfd, int cpu) {
+  if (setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+    perror("SO_INCOMING_CPU");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Accepts a batch of pending connections.
+ *
+ * Waits until the listening socket is readable, then accepts connections with
+ * `accept4` until the backlog is empty or `max` connections were accepted, so
+ * a burst of clients costs one wake-up. Accepted sockets are close-on-exec and
+ * stay blocking, since every connection is served by its own thread.
+ *
+ * @param sockfd The non-blocking listening socket.
+ * @param stopfd A descriptor that becomes readable when the accept loop should
+ * stop.
+ * @param fds The array receiving the accepted sockets.
+ * @param addrs The array receiving the peer addresses.
+ * @param max The capacity of `fds` and `addrs`.
+ * @return The number of accepted connections, possibly 0, or -1 once `stopfd`
+ * is readable.
+ */
+int accept_connections(int sockfd, int stopfd, int *fds,
+                       struct sockaddr_in *addrs, int max) {
+  struct pollfd pfds[2] = {{.fd = sockfd, .events = POLLIN},
+                           {.fd = stopfd, .events = POLLIN}};
+  if (poll(pfds, 2, -1) < 0) {
+    return 0;
+  }
+  if (pfds[1].revents) {
+    return -1;
+  }
+  int count = 0;
+  while (count < max) {
+    socklen_t addr_len = sizeof(addrs[count]);
+    int connfd = accept4(sockfd, (struct sockaddr *)&addrs[count], &addr_len,
+                         SOCK_CLOEXEC);
+    if (connfd >= 0) {
+      fds[count++] = connfd;
+      continue;
+    }
+    if (errno == EINTR || errno == ECONNABORTED) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("accept4");
+      if (count == 0) {
+        poll(NULL, 0, ACCEPT_BACKOFF_MS);
+      }
+    }
+    break;
+  }
+  return count;
+}
@@ -0,0 +1,19 @@
+#ifndef LISTENER
+#define LISTENER
+#include <netinet/in.h>
+#include <stdbool.h>
+
+typedef struct listener_options {
+  int backlog;
+  int defer_accept;
+  int fastopen_queue;
+  int sndbuf;
+  int rcvbuf;
+  bool reuseport;
+} listener_options_t;
+
+int create_listener(int port, const listener_options_t *options);
+int steer_listener(int sockfd, int cpu);
+int accept_connections(int sockfd, int stopfd, int *fds,
+                       struct sockaddr_in *addrs, int max);
+#endif // !LISTENER
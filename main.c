@@ -1,3 +1,25 @@
+#include "bundle.h"
+#include "embed.h"
+#include "replay.h"
 #include "server.h"
+#include "settings.h"
+#include "upgrade.h"
+#include <stdlib.h>
+#include <string.h>
 
-int main(int argc, char *argv[]) { return server(); }
+int main(int argc, char *argv[]) {
+  if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+    return replay(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "pack") == 0) {
+    return pack_bundle(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "embed") == 0) {
+    return embed_assets(argc - 2, argv + 2);
+  }
+  save_command_line(argv);
+  if (load_settings(argc - 1, argv + 1) < 0) {
+    return EXIT_FAILURE;
+  }
+  return server();
+}
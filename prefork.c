@@ -0,0 +1,210 @@
+#include "prefork.h"
+#include "config.h"
+#include "upgrade.h"
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct prefork_state {
+  atomic_int processes;
+  atomic_ulong restarts;
+} prefork_state_t;
+
+static prefork_state_t *state = NULL;
+static int process_index = -1;
+
+/**
+ * @brief Forks worker process `index`.
+ *
+ * The worker gets the signal mask the master had before it blocked the
+ * signals it waits for, and is sent `SIGTERM` if the master dies.
+ *
+ * @return The pid of the worker in the master, 0 in the worker, or -1 on
+ * error.
+ */
+static pid_t spawn_process(int index, const sigset_t *original) {
+  pid_t master = getpid();
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid > 0) {
+    printf("prefork: started worker %d (pid %d)\n", index, pid);
+    fflush(stdout);
+    return pid;
+  }
+  sigprocmask(SIG_SETMASK, original, NULL);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != master) {
+    _exit(EXIT_FAILURE);
+  }
+  process_index = index;
+  return 0;
+}
+
+static void signal_processes(pid_t *pids, int processes, int signal) {
+  for (int i = 0; i < processes; i++) {
+    if (pids[i] > 0) {
+      kill(pids[i], signal);
+    }
+  }
+}
+
+static int count_processes(const pid_t *pids, int processes) {
+  int count = 0;
+  for (int i = 0; i < processes; i++) {
+    count += pids[i] > 0;
+  }
+  return count;
+}
+
+/**
+ * @brief Stops the workers and waits for them.
+ *
+ * Waits for each worker by pid: after an upgrade the new server is a child of
+ * this process too, and must outlive it.
+ */
+static void stop_processes(pid_t *pids, int processes) {
+  signal_processes(pids, processes, SIGTERM);
+  for (int i = 0; i < processes; i++) {
+    if (pids[i] > 0) {
+      waitpid(pids[i], NULL, 0);
+    }
+  }
+}
+
+/**
+ * @brief Forks the worker processes and supervises them.
+ *
+ * Everything set up before the call, such as the listening sockets, the
+ * bundle and the shared cache, is inherited by the workers, so they share the
+ * listening sockets and the pages of the shared cache. Nothing may have
+ * started a thread yet. The master only waits for signals: a worker that
+ * exits is started again, after a second if it did not survive one, `SIGHUP`
+ * is passed on to the workers so they reload their settings, and `SIGTERM` or
+ * `SIGINT` stops them all. `SIGQUIT` stops them gracefully: each worker
+ * drains its connections and the master exits after the last one. `SIGUSR2`
+ * first hands the listening sockets to a new server, see upgrade_server().
+ *
+ * @param processes The number of worker processes.
+ * @return 0 in a worker process. The master only returns, with -1, if it
+ * cannot start the workers.
+ */
+int run_prefork(int processes) {
+  prefork_state_t *tmp =
+      mmap(NULL, sizeof(prefork_state_t), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  pid_t *pids = calloc(processes, sizeof(pid_t));
+  time_t *started = calloc(processes, sizeof(time_t));
+  if (tmp == MAP_FAILED || !pids || !started) {
+    perror("prefork");
+    return -1;
+  }
+  atomic_init(&tmp->processes, processes);
+  atomic_init(&tmp->restarts, 0);
+  state = tmp;
+  sigset_t signals;
+  sigset_t original;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGCHLD);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGQUIT);
+  sigaddset(&signals, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &signals, &original);
+  for (int i = 0; i < processes; i++) {
+    pids[i] = spawn_process(i, &original);
+    if (pids[i] == 0) {
+      return 0;
+    }
+    if (pids[i] < 0) {
+      stop_processes(pids, processes);
+      return -1;
+    }
+    started[i] = time(NULL);
+  }
+  bool stopping = false;
+  int received;
+  while (sigwait(&signals, &received) == 0) {
+    if (received == SIGHUP) {
+      signal_processes(pids, processes, SIGHUP);
+      continue;
+    }
+    if (received == SIGUSR2 || received == SIGQUIT) {
+      if (!stopping && (received == SIGQUIT || upgrade_server() == 0)) {
+        stopping = true;
+        signal_processes(pids, processes, SIGQUIT);
+      }
+      continue;
+    }
+    if (received != SIGCHLD) {
+      stop_processes(pids, processes);
+      exit(EXIT_SUCCESS);
+    }
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      int index = 0;
+      while (index < processes && pids[index] != pid) {
+        index++;
+      }
+      if (index == processes) {
+        continue;
+      }
+      if (stopping) {
+        pids[index] = 0;
+        continue;
+      }
+      if (WIFSIGNALED(status)) {
+        fprintf(stderr, "prefork: worker %d killed by signal %d\n", index,
+                WTERMSIG(status));
+      } else {
+        fprintf(stderr, "prefork: worker %d exited with status %d\n", index,
+                WEXITSTATUS(status));
+      }
+      if (time(NULL) - started[index] < 1) {
+        sleep(1);
+      }
+      atomic_fetch_add(&state->restarts, 1);
+      pids[index] = spawn_process(index, &original);
+      if (pids[index] == 0) {
+        return 0;
+      }
+      started[index] = time(NULL);
+    }
+    if (stopping && count_processes(pids, processes) == 0) {
+      exit(EXIT_SUCCESS);
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Returns the index of this worker process, or -1 outside prefork mode.
+ */
+int get_process_index() { return process_index; }
+
+/**
+ * @brief Writes the index of this worker process and the restart count.
+ *
+ * Nothing is written unless the server runs in prefork mode.
+ *
+ * @param out The stream to write to.
+ */
+void write_prefork_stats(FILE *out) {
+  if (!state) {
+    return;
+  }
+  fprintf(out, "process_index %d\n", process_index);
+  fprintf(out, "processes %d\n", atomic_load(&state->processes));
+  fprintf(out, "process_restarts %lu\n", atomic_load(&state->restarts));
+}
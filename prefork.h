@@ -0,0 +1,8 @@
+#ifndef PREFORK
+#define PREFORK
+#include <stdio.h>
+
+int run_prefork(int processes);
+int get_process_index();
+void write_prefork_stats(FILE *out);
+#endif // !PREFORK
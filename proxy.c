@@ -0,0 +1,767 @@
+#include "proxy.h"
+#include "body.h"
+#include "config.h"
+#include "header.h"
+#include "response.h"
+#include "router.h"
+#include "settings.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct idle_upstream {
+  connection_t *conn;
+  uint64_t since;
+} idle_upstream_t;
+
+typedef struct upstream_pool {
+  pthread_mutex_t lock;
+  idle_upstream_t *idle;
+  int count;
+} upstream_pool_t;
+
+struct upstream {
+  char *prefix;
+  size_t prefix_length;
+  char *address;
+  struct sockaddr_storage addr;
+  socklen_t addr_length;
+  _Atomic uint64_t unhealthy_until;
+  upstream_pool_t *pools;
+  int pool_count;
+  int pool_size;
+};
+
+static upstream_t *upstreams = NULL;
+static int upstream_count = 0;
+
+/* Headers that describe the client connection rather than the request. */
+static char *CLIENT_CONNECTION_HEADERS[] = {
+    "CONNECTION", "KEEP-ALIVE",        "PROXY-CONNECTION", "TE",
+    "TRAILER",    "TRANSFER-ENCODING", "UPGRADE",          "EXPECT",
+    "CONTENT-LENGTH"};
+
+/* Headers that describe the upstream connection rather than the response. */
+static const char *UPSTREAM_CONNECTION_HEADERS[] = {
+    "connection", "keep-alive",        "proxy-connection", "te",
+    "trailer",    "transfer-encoding", "upgrade",          "content-length"};
+
+static uint64_t now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Resolves the address of an upstream.
+ *
+ * `unix:PATH` names a Unix domain socket, anything else is `HOST:PORT`.
+ *
+ * @return 0 on success, or -1 if the address is invalid or does not resolve.
+ */
+static int resolve_upstream(upstream_t *upstream, const char *address) {
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un *addr = (struct sockaddr_un *)&upstream->addr;
+    const char *path = address + 5;
+    if (path[0] == '\0' || strlen(path) >= sizeof(addr->sun_path)) {
+      return -1;
+    }
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    upstream->addr_length = sizeof(struct sockaddr_un);
+    return 0;
+  }
+  const char *separator = strrchr(address, ':');
+  if (!separator || separator == address || separator[1] == '\0') {
+    return -1;
+  }
+  char *host = strndup(address, separator - address);
+  if (!host) {
+    return -1;
+  }
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  struct addrinfo *result = NULL;
+  int error = getaddrinfo(host, separator + 1, &hints, &result);
+  free(host);
+  if (error != 0) {
+    fprintf(stderr, "proxy: %s: %s\n", address, gai_strerror(error));
+    return -1;
+  }
+  memcpy(&upstream->addr, result->ai_addr, result->ai_addrlen);
+  upstream->addr_length = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+static int add_upstream(const char *prefix, const char *address,
+                        const settings_t *settings) {
+  upstream_t *tmp =
+      realloc(upstreams, (upstream_count + 1) * sizeof(upstream_t));
+  if (!tmp) {
+    return -1;
+  }
+  upstreams = tmp;
+  upstream_t *upstream = &upstreams[upstream_count];
+  memset(upstream, 0, sizeof(upstream_t));
+  if (prefix[0] != '/' || resolve_upstream(upstream, address) < 0) {
+    fprintf(stderr, "proxy: invalid route %s=%s\n", prefix, address);
+    return -1;
+  }
+  upstream->prefix = strdup(prefix);
+  upstream->prefix_length = strlen(prefix);
+  upstream->address = strdup(address);
+  upstream->pool_count = settings->workers;
+  upstream->pool_size = settings->upstream_pool_size;
+  upstream->pools = calloc(upstream->pool_count, sizeof(upstream_pool_t));
+  if (!upstream->prefix || !upstream->address || !upstream->pools) {
+    return -1;
+  }
+  for (int i = 0; i < upstream->pool_count; i++) {
+    pthread_mutex_init(&upstream->pools[i].lock, NULL);
+    upstream->pools[i].idle =
+        calloc(upstream->pool_size + 1, sizeof(idle_upstream_t));
+    if (!upstream->pools[i].idle) {
+      return -1;
+    }
+  }
+  atomic_init(&upstream->unhealthy_until, 0);
+  upstream_count++;
+  printf("proxy: %s -> %s, pool %d per worker\n", upstream->prefix,
+         upstream->address, upstream->pool_size);
+  return 0;
+}
+
+static void route_to_upstream(document_t *request, connection_t *conn,
+                              void *data) {
+  proxy_request(request, conn, data);
+}
+
+/**
+ * @brief Sets up the upstreams named in `proxy_routes`.
+ *
+ * `proxy_routes` is a list of `PREFIX=ADDRESS` pairs separated by spaces or
+ * commas, such as `/api=127.0.0.1:3000 /app=unix:/run/app.sock`. Every route
+ * gets one pool of idle upstream connections per worker, so workers never
+ * contend for each other's connections. Each prefix is added to the router
+ * for every method, so requests below it are forwarded whatever their method,
+ * and the longest prefix wins over shorter ones and the site itself.
+ *
+ * @return 0 on success, or -1 if a route is invalid.
+ */
+int init_proxy() {
+  const settings_t *settings = get_settings();
+  char *routes = strdup(settings->proxy_routes);
+  if (!routes) {
+    return -1;
+  }
+  int result = 0;
+  char *saveptr = NULL;
+  for (char *route = strtok_r(routes, " ,\t", &saveptr); route;
+       route = strtok_r(NULL, " ,\t", &saveptr)) {
+    char *separator = strchr(route, '=');
+    if (!separator) {
+      fprintf(stderr, "proxy: invalid route %s\n", route);
+      result = -1;
+      break;
+    }
+    *separator = '\0';
+    if (add_upstream(route, separator + 1, settings) < 0) {
+      result = -1;
+      break;
+    }
+  }
+  free(routes);
+  for (int i = 0; result == 0 && i < upstream_count; i++) {
+    for (int method = 0; result == 0 && method < METHOD_COUNT; method++) {
+      result = add_route(upstreams[i].prefix, method, route_to_upstream, NULL,
+                         &upstreams[i]);
+    }
+  }
+  return result;
+}
+
+static bool is_healthy(upstream_t *upstream) {
+  return now_ms() >= atomic_load(&upstream->unhealthy_until);
+}
+
+static void mark_unhealthy(upstream_t *upstream) {
+  int cooldown = get_settings()->upstream_cooldown;
+  atomic_store(&upstream->unhealthy_until, now_ms() + cooldown);
+  fprintf(stderr, "proxy: %s unreachable, failing fast for %d ms\n",
+          upstream->address, cooldown);
+}
+
+/**
+ * @brief Takes an idle connection to an upstream from the worker's pool.
+ *
+ * The most recently used connection is taken first. Connections idle for
+ * longer than `upstream_idle_timeout`, and connections the upstream has closed
+ * or sent unsolicited data on, are discarded.
+ *
+ * @return An idle connection, or NULL if the pool has none.
+ */
+static connection_t *take_idle_connection(upstream_t *upstream, int worker) {
+  upstream_pool_t *pool = &upstream->pools[worker % upstream->pool_count];
+  uint64_t idle_timeout = get_settings()->upstream_idle_timeout;
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == 0) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    idle_upstream_t idle = pool->idle[--pool->count];
+    pthread_mutex_unlock(&pool->lock);
+    char c;
+    if (now_ms() - idle.since < idle_timeout &&
+        recv(idle.conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return idle.conn;
+    }
+    destroy_connection(idle.conn);
+  }
+}
+
+/**
+ * @brief Returns an upstream connection to the worker's pool.
+ *
+ * Connections that cannot be reused, and connections beyond
+ * `upstream_pool_size`, are closed. Connections that expired while sitting at
+ * the bottom of the pool are closed on the way.
+ */
+static void release_upstream_connection(upstream_t *upstream, int worker,
+                                        connection_t *up, bool reusable) {
+  upstream_pool_t *pool = &upstream->pools[worker % upstream->pool_count];
+  uint64_t now = now_ms();
+  uint64_t idle_timeout = get_settings()->upstream_idle_timeout;
+  pthread_mutex_lock(&pool->lock);
+  while (pool->count > 0 && now - pool->idle[0].since >= idle_timeout) {
+    destroy_connection(pool->idle[0].conn);
+    pool->count--;
+    memmove(pool->idle, pool->idle + 1, pool->count * sizeof(idle_upstream_t));
+  }
+  if (reusable && pool->count < upstream->pool_size) {
+    pool->idle[pool->count].conn = up;
+    pool->idle[pool->count].since = now;
+    pool->count++;
+    up = NULL;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  destroy_connection(up);
+}
+
+/**
+ * @brief Opens a new connection to an upstream.
+ *
+ * The connect is bounded by `upstream_timeout`; on failure `errno` tells a
+ * timeout (`ETIMEDOUT`) from a refused or unreachable upstream.
+ *
+ * @return The new connection, or NULL on failure.
+ */
+static connection_t *connect_upstream(upstream_t *upstream) {
+  int fd = socket(upstream->addr.ss_family,
+                  SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (connect(fd, (struct sockaddr *)&upstream->addr, upstream->addr_length) <
+      0) {
+    int error = errno;
+    if (error == EINPROGRESS) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      int ready = poll(&pfd, 1, get_settings()->upstream_timeout);
+      socklen_t length = sizeof(error);
+      if (ready == 0) {
+        error = ETIMEDOUT;
+      } else if (ready < 0 ||
+                 getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+        error = errno;
+      }
+    }
+    if (error != 0) {
+      close(fd);
+      errno = error;
+      return NULL;
+    }
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  connection_t *up = create_connection(fd);
+  if (!up) {
+    close(fd);
+  }
+  return up;
+}
+
+static bool is_interim_response(const char *header) {
+  int code = 0;
+  return sscanf(header, "HTTP/%*d.%*d %3d", &code) == 1 && code >= 100 &&
+         code < 200 && code != SWITCHING_PROCTOLS;
+}
+
+static bool lists_token(const char *list, const char *token) {
+  size_t length = strlen(token);
+  while (list && *list) {
+    while (*list == ' ' || *list == '\t' || *list == ',') {
+      list++;
+    }
+    const char *end = list;
+    while (*end && *end != ',') {
+      end++;
+    }
+    const char *last = end;
+    while (last > list && (last[-1] == ' ' || last[-1] == '\t')) {
+      last--;
+    }
+    if ((size_t)(last - list) == length &&
+        strncasecmp(list, token, length) == 0) {
+      return true;
+    }
+    list = end;
+  }
+  return false;
+}
+
+/**
+ * @brief Rewrites a client request into the request sent upstream.
+ *
+ * Headers about the client connection are removed, including those the
+ * client lists in `connection`, the body framing is restated and the client
+ * address is appended to `x-forwarded-for`.
+ */
+static void prepare_upstream_request(document_t *request,
+                                     connection_t *conn) {
+  header_t *header = request->header;
+  header_item_t *connection = get_header_item(header, "CONNECTION");
+  if (connection) {
+    char *tokens = strdup(connection->value);
+    char *saveptr = NULL;
+    for (char *token = tokens ? strtok_r(tokens, ", \t", &saveptr) : NULL;
+         token; token = strtok_r(NULL, ", \t", &saveptr)) {
+      for (char *c = token; *c; c++) {
+        *c = toupper((unsigned char)*c);
+      }
+      remove_header_item(header, token);
+    }
+    free(tokens);
+  }
+  size_t count = sizeof(CLIENT_CONNECTION_HEADERS) / sizeof(char *);
+  for (size_t i = 0; i < count; i++) {
+    remove_header_item(header, CLIENT_CONNECTION_HEADERS[i]);
+  }
+  body_stream_t *body_stream = request->body_stream;
+  if (body_stream && body_stream->chunked) {
+    attach_header(header, create_header_item("TRANSFER-ENCODING", "chunked"));
+  } else if (body_stream) {
+    char *length = size_t_to_string(body_stream->size);
+    if (length) {
+      attach_header(header, create_header_item("CONTENT-LENGTH", length));
+      free(length);
+    }
+  }
+  struct sockaddr_storage peer;
+  socklen_t peer_length = sizeof(peer);
+  char address[INET6_ADDRSTRLEN] = "unknown";
+  if (getpeername(conn->fd, (struct sockaddr *)&peer, &peer_length) == 0) {
+    if (peer.ss_family == AF_INET) {
+      inet_ntop(AF_INET, &((struct sockaddr_in *)&peer)->sin_addr, address,
+                sizeof(address));
+    } else if (peer.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&peer)->sin6_addr, address,
+                sizeof(address));
+    }
+  }
+  header_item_t *forwarded = get_header_item(header, "X-FORWARDED-FOR");
+  if (forwarded) {
+    char *list = str_join(forwarded->value, ", ");
+    char *value = str_join(list, address);
+    set_header_item(header, "X-FORWARDED-FOR", value);
+    free(list);
+    free(value);
+  } else {
+    attach_header(header, create_header_item("X-FORWARDED-FOR", address));
+  }
+}
+
+/**
+ * @brief Sends the request and its body to the upstream.
+ *
+ * The body is relayed one buffer at a time as it is read from the client,
+ * re-chunked if the client sent it chunked.
+ *
+ * @return 0 on success, -1 if the upstream failed, or -2 if the client failed.
+ */
+static int send_upstream_request(document_t *request, connection_t *up,
+                                 const unsigned char *header,
+                                 size_t header_size) {
+  body_stream_t *body_stream = request->body_stream;
+  if (body_stream) {
+    cork_connection(up, true);
+  }
+  int result = write_to_conn(up, (unsigned char *)header, header_size);
+  if (result == 0 && body_stream) {
+    unsigned char buffer[STREAM_CHUNK_SIZE];
+    ssize_t n;
+    while ((n = read_body_stream(body_stream, buffer, sizeof(buffer))) > 0) {
+      if ((body_stream->chunked ? write_chunk(up, buffer, n)
+                                : write_to_conn(up, buffer, n)) < 0) {
+        result = -1;
+        break;
+      }
+    }
+    if (n < 0) {
+      result = -2;
+    } else if (result == 0 && body_stream->chunked) {
+      result = write_last_chunk(up);
+    }
+  }
+  if (body_stream) {
+    cork_connection(up, false);
+  }
+  return result;
+}
+
+/**
+ * @brief Reads a response header from the upstream.
+ *
+ * @param up The upstream connection.
+ * @param size Set to the number of header bytes read, even on failure.
+ * @return The NUL-terminated header, or NULL if the upstream failed or the
+ * header is larger than `max_header_size`.
+ */
+static char *read_response_header(connection_t *up, size_t *size) {
+  size_t capacity = BUFFER_SIZE;
+  size_t length = 0;
+  char *header = malloc(capacity);
+  *size = 0;
+  if (!header) {
+    return NULL;
+  }
+  while (length < 2 || header[length - 1] != '\n' ||
+         (header[length - 2] != '\n' &&
+          (length < 3 || header[length - 2] != '\r' ||
+           header[length - 3] != '\n'))) {
+    if (up->start == up->end && fill_connection(up) <= 0) {
+      free(header);
+      return NULL;
+    }
+    if (length + 1 == capacity) {
+      char *tmp = capacity < up->settings->max_header_size
+                      ? realloc(header, capacity * 2)
+                      : NULL;
+      if (!tmp) {
+        free(header);
+        return NULL;
+      }
+      header = tmp;
+      capacity *= 2;
+    }
+    header[length++] = up->buffer[up->start++];
+    *size = length;
+  }
+  header[length] = '\0';
+  return header;
+}
+
+/**
+ * @brief Splits the header lines after the status line into fields.
+ *
+ * The fields point into `header`, which is modified in place.
+ *
+ * @return The fields, or NULL on a malformed line or allocation failure.
+ */
+static header_item_t *split_response_header(char *header, int *count) {
+  int lines = 0;
+  for (char *c = header; *c; c++) {
+    lines += *c == '\n';
+  }
+  header_item_t *fields = calloc(lines, sizeof(header_item_t));
+  char *line = strchr(header, '\n');
+  *count = 0;
+  while (fields && line && *++line != '\r' && *line != '\n') {
+    char *end = strchr(line, '\n');
+    char *colon = strchr(line, ':');
+    if (!end || !colon || colon > end || colon == line) {
+      free(fields);
+      return NULL;
+    }
+    *colon = '\0';
+    *end = '\0';
+    if (end > line && end[-1] == '\r') {
+      end[-1] = '\0';
+    }
+    char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') {
+      value++;
+    }
+    fields[*count].key = line;
+    fields[*count].value = value;
+    (*count)++;
+    line = end;
+  }
+  return fields;
+}
+
+static const char *find_field(header_item_t *fields, int count,
+                              const char *name) {
+  for (int i = 0; i < count; i++) {
+    if (strcasecmp(fields[i].key, name) == 0) {
+      return fields[i].value;
+    }
+  }
+  return NULL;
+}
+
+static bool is_upstream_connection_header(const char *name,
+                                          const char *connection) {
+  size_t count = sizeof(UPSTREAM_CONNECTION_HEADERS) / sizeof(char *);
+  for (size_t i = 0; i < count; i++) {
+    if (strcasecmp(name, UPSTREAM_CONNECTION_HEADERS[i]) == 0) {
+      return true;
+    }
+  }
+  return lists_token(connection, name);
+}
+
+/**
+ * @brief Relays the upstream response to the client.
+ *
+ * The header is rewritten the same way as the request: headers about the
+ * upstream connection are dropped and the body framing is restated for the
+ * client. The body is streamed one buffer at a time. A chunked or
+ * close-delimited body is sent chunked to HTTP/1.1 clients and
+ * close-delimited to HTTP/1.0 clients.
+ *
+ * @param request The client request.
+ * @param conn The client connection.
+ * @param up The upstream connection, positioned after the response header.
+ * @param header The response header.
+ * @param reusable Set to whether the upstream connection can be reused.
+ * @return 0 on success, BAD_GATEWAY if the header is malformed and nothing
+ * was sent, or -1 if the response was cut short.
+ */
+static int relay_response(document_t *request, connection_t *conn,
+                          connection_t *up, char *header, bool *reusable) {
+  int major = 0;
+  int minor = 0;
+  int code = 0;
+  char *reason = header;
+  if (sscanf(header, "HTTP/%d.%d %3d", &major, &minor, &code) != 3 ||
+      code < 200 || code > 999) {
+    return BAD_GATEWAY;
+  }
+  reason = strchr(header, ' ') + 4;
+  reason += *reason == ' ';
+  char *reason_end = strchr(header, '\n');
+  int count = 0;
+  header_item_t *fields = split_response_header(header, &count);
+  if (!fields) {
+    return BAD_GATEWAY;
+  }
+  *reason_end = '\0';
+  if (reason_end > reason && reason_end[-1] == '\r') {
+    reason_end[-1] = '\0';
+  }
+  const char *connection = find_field(fields, count, "connection");
+  const char *transfer_encoding =
+      find_field(fields, count, "transfer-encoding");
+  const char *content_length = find_field(fields, count, "content-length");
+  bool no_body = request->header->request_line->method == HEAD ||
+                 code == NO_CONTENT || code == NOT_MODIFIED;
+  bool chunked = !no_body && lists_token(transfer_encoding, "chunked");
+  bool has_length = !no_body && !transfer_encoding && content_length;
+  size_t length = 0;
+  if (has_length && !parse_content_length(content_length, &length)) {
+    free(fields);
+    return BAD_GATEWAY;
+  }
+  bool until_close = !no_body && !chunked && !has_length;
+  bool client_chunked =
+      (chunked || until_close) &&
+      strcmp(request->header->request_line->version, "HTTP/1.1") == 0;
+  if ((chunked || until_close) && !client_chunked) {
+    conn->keep_alive = false;
+  }
+  char *output = NULL;
+  size_t output_size = 0;
+  FILE *out = open_memstream(&output, &output_size);
+  if (!out) {
+    free(fields);
+    return BAD_GATEWAY;
+  }
+  fprintf(out, "%s %d %s\r\n", VERSION, code, reason);
+  for (int i = 0; i < count; i++) {
+    if (!is_upstream_connection_header(fields[i].key, connection)) {
+      fprintf(out, "%s: %s\r\n", fields[i].key, fields[i].value);
+    }
+  }
+  if (content_length && !transfer_encoding) {
+    fprintf(out, "content-length: %s\r\n", content_length);
+  } else if (client_chunked) {
+    fprintf(out, "transfer-encoding: chunked\r\n");
+  }
+  fprintf(out, "connection: %s\r\n\r\n",
+          conn->keep_alive ? "keep-alive" : "close");
+  fclose(out);
+  free(fields);
+  body_stream_t *body = NULL;
+  if (has_length) {
+    body = create_body_stream(up, length, false);
+  } else if (chunked) {
+    body = create_chunked_body_stream(up, false);
+    if (body) {
+      /* Responses are not bound by max_body_size; this only keeps the chunk
+       * size arithmetic from overflowing. */
+      body->max_size = SIZE_MAX / 16;
+    }
+  }
+  cork_connection(conn, true);
+  int result = write_to_conn(conn, (unsigned char *)output, output_size);
+  free(output);
+  bool failed = result < 0 || (!no_body && !until_close && !body);
+  unsigned char buffer[STREAM_CHUNK_SIZE];
+  while (!failed && !no_body) {
+    ssize_t n;
+    if (body) {
+      n = read_body_stream(body, buffer, sizeof(buffer));
+    } else {
+      arm_timer(&up->timer, up->settings->upstream_timeout);
+      n = read_connection(up, buffer, sizeof(buffer));
+      cancel_timer(&up->timer);
+    }
+    if (n <= 0) {
+      failed = n < 0;
+      break;
+    }
+    if ((client_chunked ? write_chunk(conn, buffer, n)
+                        : write_to_conn(conn, buffer, n)) < 0) {
+      failed = true;
+    }
+  }
+  if (!failed && client_chunked) {
+    failed = write_last_chunk(conn) < 0;
+  }
+  cork_connection(conn, false);
+  destroy_body_stream(body);
+  if (failed) {
+    conn->keep_alive = false;
+    return -1;
+  }
+  *reusable = !until_close && (major > 1 || (major == 1 && minor >= 1)) &&
+              !lists_token(connection, "close") && up->start == up->end;
+  return 0;
+}
+
+static void send_gateway_error(connection_t *conn, RESPONSE_CODE_T code) {
+  document_t *response = create_response(code, NULL);
+  if (response) {
+    send_document(response, conn);
+    destroy_document(response);
+  }
+}
+
+/**
+ * @brief Forwards a request to an upstream and relays its response.
+ *
+ * The request is always sent upstream as HTTP/1.1. An idle pooled connection
+ * is used when the worker has one, a new connection is opened otherwise. A
+ * pooled connection the upstream closed before answering is retried once on a
+ * new connection when the request has no body.
+ * An upstream that cannot be connected to within `upstream_timeout` is marked
+ * unhealthy, and for `upstream_cooldown` milliseconds its requests are
+ * answered with `502 Bad Gateway` without trying it. A response header that
+ * does not arrive within `upstream_timeout` is answered with `504 Gateway
+ * Timeout`, but only fails that request. A chunked request body that grows
+ * past `max_body_size` while it is forwarded is answered with `413 Content
+ * Too Large` and the connection is closed.
+ *
+ * @param request The request document
+ * @param conn The connection the request arrived on
+ * @param upstream The upstream to forward the request to
+ */
+void proxy_request(document_t *request, connection_t *conn,
+                   upstream_t *upstream) {
+  if (!is_healthy(upstream)) {
+    send_gateway_error(conn, BAD_GATEWAY);
+    return;
+  }
+  prepare_upstream_request(request, conn);
+  header_request_line_t *request_line = request->header->request_line;
+  char *version = request_line->version;
+  request_line->version = VERSION;
+  unsigned char *header = serialize_header(request->header);
+  request_line->version = version;
+  if (!header) {
+    send_gateway_error(conn, INTERNAL_SERVER_ERROR);
+    return;
+  }
+  size_t header_size = strlen((char *)header);
+  bool may_retry = !request->body_stream;
+  while (1) {
+    connection_t *up = take_idle_connection(upstream, conn->worker);
+    bool reused = up != NULL;
+    if (!up) {
+      up = connect_upstream(upstream);
+    }
+    if (!up) {
+      bool timed_out = errno == ETIMEDOUT;
+      mark_unhealthy(upstream);
+      send_gateway_error(conn, timed_out ? GATEWAY_TIMEOUT : BAD_GATEWAY);
+      break;
+    }
+    int result = send_upstream_request(request, up, header, header_size);
+    if (result == -2) {
+      conn->keep_alive = false;
+      destroy_connection(up);
+      if (request->body_stream->too_large) {
+        send_gateway_error(conn, CONTENT_TOO_LARGE);
+      }
+      break;
+    }
+    size_t received = 0;
+    char *response = NULL;
+    if (result == 0) {
+      arm_timer(&up->timer, up->settings->upstream_timeout);
+      do {
+        free(response);
+        response = read_response_header(up, &received);
+      } while (response && is_interim_response(response));
+      cancel_timer(&up->timer);
+    }
+    if (!response) {
+      bool timed_out = up->timer.expired;
+      destroy_connection(up);
+      if (reused && may_retry && received == 0 && !timed_out) {
+        may_retry = false;
+        continue;
+      }
+      send_gateway_error(conn, timed_out ? GATEWAY_TIMEOUT : BAD_GATEWAY);
+      break;
+    }
+    bool reusable = false;
+    result = relay_response(request, conn, up, response, &reusable);
+    free(response);
+    if (result == BAD_GATEWAY) {
+      send_gateway_error(conn, BAD_GATEWAY);
+    }
+    release_upstream_connection(upstream, conn->worker, up, reusable);
+    break;
+  }
+  free(header);
+}
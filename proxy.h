@@ -0,0 +1,11 @@
+#ifndef PROXY
+#define PROXY
+#include "connection.h"
+#include "document.h"
+
+typedef struct upstream upstream_t;
+
+int init_proxy();
+void proxy_request(document_t *request, connection_t *conn,
+                   upstream_t *upstream);
+#endif // !PROXY
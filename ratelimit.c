@@ -0,0 +1,238 @@
+#include "ratelimit.h"
+#include "config.h"
+#include "document.h"
+#include "header.h"
+#include "response.h"
+#include "settings.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct rate_bucket {
+  atomic_uint_least64_t key;
+  atomic_uint_least64_t state;
+} rate_bucket_t;
+
+typedef struct rate_table {
+  atomic_ulong limited;
+  atomic_ulong evictions;
+  rate_bucket_t buckets[RATE_LIMIT_SLOTS];
+} rate_table_t;
+
+#define CLAIMED_KEY UINT64_MAX
+
+static rate_table_t *table = NULL;
+static unsigned char *limited_response = NULL;
+static size_t limited_size = 0;
+
+/**
+ * @brief Prepares the token bucket table and the `429` response.
+ *
+ * The table lives in shared memory created before any worker process is
+ * forked, so in prefork mode a client has one bucket however its connections
+ * are spread over the processes. Only the pages of the buckets in use are
+ * ever touched. The `429 Too Many Requests` response is serialized once, like
+ * the `503` of the admission control.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int init_rate_limits() {
+  rate_table_t *tmp = mmap(NULL, sizeof(rate_table_t), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (tmp == MAP_FAILED) {
+    perror("rate limits");
+    return -1;
+  }
+  document_t *document = create_response(TOO_MANY_REQUESTS, NULL);
+  if (!document) {
+    munmap(tmp, sizeof(rate_table_t));
+    return -1;
+  }
+  set_header_item(document->header, "connection", "close");
+  set_header_item(document->header, "retry-after", RETRY_AFTER);
+  remove_header_item(document->header, "keep-alive");
+  remove_header_item(document->header, "date");
+  limited_response = serialize_document(document, &limited_size);
+  destroy_document(document);
+  table = tmp;
+  return limited_response ? 0 : -1;
+}
+
+static uint32_t now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+static uint64_t pack_state(uint32_t time, uint32_t tokens) {
+  return (uint64_t)time << 32 | tokens;
+}
+
+/**
+ * @brief Hands a slot over to a client, filling its bucket before the slot
+ * is published under its key.
+ *
+ * The slot is first swapped from the key it had to CLAIMED_KEY, which no
+ * reader matches, so nobody can take a token from the bucket while it is
+ * being reset.
+ *
+ * @return True if the slot was claimed, false if its key changed meanwhile.
+ */
+static bool claim_bucket(rate_bucket_t *bucket, uint64_t expected,
+                         uint64_t key, uint64_t state) {
+  if (!atomic_compare_exchange_strong(&bucket->key, &expected,
+                                      CLAIMED_KEY)) {
+    return false;
+  }
+  atomic_store(&bucket->state, state);
+  atomic_store(&bucket->key, key);
+  return true;
+}
+
+/**
+ * @brief Finds the bucket of a client, claiming one if it has none.
+ *
+ * The table is open addressed with RATE_LIMIT_PROBES slots per address and
+ * claims slots with compare-and-swap, so it never takes a lock. A client
+ * without a bucket takes an empty slot or, if all are taken, the one refilled
+ * longest ago. When another client claims the slot first, the probe starts
+ * over. Buckets are never freed otherwise: a bucket idle long enough is full
+ * again, exactly like a new one, so the table needs no sweeping and its size
+ * stays fixed however many addresses a client sprays from.
+ */
+static rate_bucket_t *find_bucket(uint64_t key, uint32_t now,
+                                  uint32_t full) {
+  uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+  while (1) {
+    rate_bucket_t *stalest = NULL;
+    uint64_t stalest_key = 0;
+    uint32_t stalest_age = 0;
+    for (int probe = 0; probe < RATE_LIMIT_PROBES; probe++) {
+      rate_bucket_t *bucket =
+          &table->buckets[((hash >> 32) + probe) % RATE_LIMIT_SLOTS];
+      uint64_t current = atomic_load(&bucket->key);
+      if (current == key) {
+        return bucket;
+      }
+      if (current == 0) {
+        stalest = bucket;
+        stalest_key = 0;
+        break;
+      }
+      uint32_t age = now - (uint32_t)(atomic_load(&bucket->state) >> 32);
+      if (current != CLAIMED_KEY && (!stalest || age > stalest_age)) {
+        stalest = bucket;
+        stalest_key = current;
+        stalest_age = age;
+      }
+    }
+    if (stalest && claim_bucket(stalest, stalest_key, key,
+                                pack_state(now, full))) {
+      if (stalest_key != 0) {
+        atomic_fetch_add(&table->evictions, 1);
+      }
+      return stalest;
+    }
+  }
+}
+
+/**
+ * @brief Takes a token from the bucket of a client address.
+ *
+ * Every address gets a bucket of `rate_limit_burst` tokens that refills at
+ * `rate_limit` tokens per second. The refill is lazy: a bucket holds its
+ * token count, in thousandths, and the time it was last updated in a single
+ * word, and each request adds the tokens earned since then and takes one in
+ * one compare-and-swap. A request that finds no whole token leaves the
+ * bucket untouched, so the tokens it is earning are not lost. The key is
+ * checked again before every swap, so a bucket handed to another client in
+ * the meantime is never charged.
+ *
+ * @param addr The IPv4 address of the client, in network byte order.
+ * @return True if the request may be served or rate limiting is off, false if
+ * the client is over its limit.
+ */
+bool acquire_token(uint32_t addr) {
+  const settings_t *settings = get_settings();
+  if (!table || settings->rate_limit <= 0) {
+    return true;
+  }
+  uint32_t now = now_ms();
+  uint32_t full = (uint32_t)settings->rate_limit_burst * 1000;
+  uint64_t key = (uint64_t)addr | 1ULL << 32;
+  rate_bucket_t *bucket = find_bucket(key, now, full);
+  uint64_t state = atomic_load(&bucket->state);
+  while (1) {
+    if (atomic_load(&bucket->key) != key) {
+      bucket = find_bucket(key, now, full);
+      state = atomic_load(&bucket->state);
+      continue;
+    }
+    uint32_t elapsed = now - (uint32_t)(state >> 32);
+    uint64_t tokens =
+        (uint32_t)state + (uint64_t)elapsed * settings->rate_limit;
+    if (tokens > full) {
+      tokens = full;
+    }
+    if (tokens < 1000) {
+      atomic_fetch_add(&table->limited, 1);
+      return false;
+    }
+    if (atomic_compare_exchange_weak(&bucket->state, &state,
+                                     pack_state(now, tokens - 1000))) {
+      return true;
+    }
+  }
+}
+
+/**
+ * @brief Decides whether a newly accepted connection may be served.
+ *
+ * The connection's first request takes its token here, in the accept loop,
+ * so a client over its limit is sent the preserialized `429` and closed
+ * without starting a thread for it.
+ *
+ * @param connfd The accepted socket file descriptor.
+ * @param addr The IPv4 address of the client, in network byte order.
+ * @return True if the connection may be served, false if it was turned away
+ * and closed.
+ */
+bool admit_client(int connfd, uint32_t addr) {
+  if (acquire_token(addr)) {
+    return true;
+  }
+  if (write(connfd, limited_response, limited_size) < 0) {
+    perror("write");
+  }
+  close(connfd);
+  return false;
+}
+
+/**
+ * @brief Sends the preserialized `429 Too Many Requests` on a connection.
+ *
+ * The response closes the connection, so the connection is marked as not
+ * reusable.
+ *
+ * @param conn The connection to send the response on.
+ * @return 0 on success, or -1 on error.
+ */
+int send_too_many_requests(connection_t *conn) {
+  conn->keep_alive = false;
+  return write_to_conn(conn, limited_response, limited_size);
+}
+
+/**
+ * @brief Writes the rate limiting counters.
+ *
+ * @param out The stream to write to.
+ */
+void write_rate_limit_stats(FILE *out) {
+  if (!table) {
+    return;
+  }
+  fprintf(out, "rate_limited %lu\n", atomic_load(&table->limited));
+  fprintf(out, "rate_limit_evictions %lu\n", atomic_load(&table->evictions));
+}
@@ -0,0 +1,13 @@
+#ifndef RATELIMIT
+#define RATELIMIT
+#include "connection.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+int init_rate_limits();
+bool acquire_token(uint32_t addr);
+bool admit_client(int connfd, uint32_t addr);
+int send_too_many_requests(connection_t *conn);
+void write_rate_limit_stats(FILE *out);
+#endif // !RATELIMIT
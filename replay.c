@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include "replay.h"
+#include "config.h"
+#include <ctype.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct replay_entry {
+  uint64_t t;
+  int conn;
+  size_t line;
+  unsigned char *raw;
+  size_t size;
+  int status;
+  uint64_t latency_us;
+} replay_entry_t;
+
+typedef struct replay_group {
+  replay_entry_t *entries;
+  size_t count;
+} replay_group_t;
+
+static struct addrinfo *replay_addr = NULL;
+static replay_group_t *replay_groups = NULL;
+static size_t replay_group_count = 0;
+static size_t next_group = 0;
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t replay_start = 0;
+static uint64_t replay_origin = 0;
+static double replay_scale = 1.0;
+
+static uint64_t now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/**
+ * @brief Parses one line of a capture log into a replay entry.
+ *
+ * Only the fields written by capture_request() are understood: the arrival
+ * time `t`, the connection `conn` and the escaped raw request `raw`. The raw
+ * bytes are unescaped into a newly allocated buffer owned by the entry.
+ * Records without a connection get -1 and are replayed on connections of
+ * their own.
+ *
+ * @param line The JSON line to parse.
+ * @param entry The entry to fill in.
+ * @return 0 on success, -1 if the line is not a capture record.
+ */
+static int parse_entry(const char *line, replay_entry_t *entry) {
+  const char *t = strstr(line, "\"t\":");
+  const char *conn = strstr(line, "\"conn\":");
+  const char *raw = strstr(line, "\"raw\":\"");
+  if (!t || !raw) {
+    return -1;
+  }
+  entry->t = strtoull(t + 4, NULL, 10);
+  entry->conn = conn ? atoi(conn + 7) : -1;
+  raw += 7;
+  entry->raw = malloc(strlen(raw) + 1);
+  if (!entry->raw) {
+    return -1;
+  }
+  size_t len = 0;
+  while (*raw && *raw != '"') {
+    if (*raw != '\\') {
+      entry->raw[len++] = *raw++;
+      continue;
+    }
+    raw++;
+    switch (*raw) {
+    case 'r':
+      entry->raw[len++] = '\r';
+      break;
+    case 'n':
+      entry->raw[len++] = '\n';
+      break;
+    case 't':
+      entry->raw[len++] = '\t';
+      break;
+    case 'u':
+      for (int i = 1; i <= 4; i++) {
+        if (hex_value(raw[i]) < 0) {
+          free(entry->raw);
+          return -1;
+        }
+      }
+      entry->raw[len++] = hex_value(raw[3]) << 4 | hex_value(raw[4]);
+      raw += 4;
+      break;
+    case '\0':
+      free(entry->raw);
+      return -1;
+    default:
+      entry->raw[len++] = *raw;
+    }
+    raw++;
+  }
+  entry->size = len;
+  entry->status = 0;
+  entry->latency_us = 0;
+  return 0;
+}
+
+typedef struct replay_conn {
+  int fd;
+  size_t start;
+  size_t end;
+  char buffer[CONNECTION_BUFFER_SIZE];
+} replay_conn_t;
+
+static int fill_replay_conn(replay_conn_t *conn) {
+  if (conn->start == conn->end) {
+    conn->start = conn->end = 0;
+  } else if (conn->start > 0) {
+    memmove(conn->buffer, conn->buffer + conn->start, conn->end - conn->start);
+    conn->end -= conn->start;
+    conn->start = 0;
+  }
+  if (conn->end == sizeof(conn->buffer)) {
+    return -1;
+  }
+  ssize_t n = read(conn->fd, conn->buffer + conn->end,
+                   sizeof(conn->buffer) - conn->end);
+  if (n <= 0) {
+    return -1;
+  }
+  conn->end += n;
+  return 0;
+}
+
+/**
+ * @brief Reads one line of a response head, without its line ending.
+ *
+ * @return The line, NUL-terminated inside the buffer and valid until the next
+ * read, or NULL if the connection closed or the line does not fit the buffer.
+ */
+static char *read_replay_line(replay_conn_t *conn) {
+  char *newline;
+  while (!(newline = memchr(conn->buffer + conn->start, '\n',
+                            conn->end - conn->start))) {
+    if (fill_replay_conn(conn) < 0) {
+      return NULL;
+    }
+  }
+  char *line = conn->buffer + conn->start;
+  conn->start = newline - conn->buffer + 1;
+  *newline = '\0';
+  if (newline > line && newline[-1] == '\r') {
+    newline[-1] = '\0';
+  }
+  return line;
+}
+
+/**
+ * @brief Consumes `size` bytes of a response body.
+ */
+static int skip_replay_bytes(replay_conn_t *conn, size_t size) {
+  while (size > 0) {
+    if (conn->start == conn->end && fill_replay_conn(conn) < 0) {
+      return -1;
+    }
+    size_t available = conn->end - conn->start;
+    size_t count = available < size ? available : size;
+    conn->start += count;
+    size -= count;
+  }
+  return 0;
+}
+
+/**
+ * @brief Consumes a chunked response body, up to and including its trailer.
+ */
+static int skip_replay_chunks(replay_conn_t *conn) {
+  while (1) {
+    char *line = read_replay_line(conn);
+    char *end = NULL;
+    if (!line) {
+      return -1;
+    }
+    unsigned long long size = strtoull(line, &end, 16);
+    if (end == line) {
+      return -1;
+    }
+    if (size == 0) {
+      break;
+    }
+    if (skip_replay_bytes(conn, size) < 0 || !read_replay_line(conn)) {
+      return -1;
+    }
+  }
+  char *line;
+  while ((line = read_replay_line(conn)) && *line) {
+  }
+  return line ? 0 : -1;
+}
+
+static bool has_header_token(const char *value, const char *token) {
+  size_t length = strlen(token);
+  for (const char *p = value; (p = strcasestr(p, token)); p += length) {
+    bool starts = p == value || p[-1] == ' ' || p[-1] == ',' || p[-1] == '\t';
+    bool ends = p[length] == '\0' || p[length] == ' ' || p[length] == ',' ||
+                p[length] == '\t';
+    if (starts && ends) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Reads a complete response and returns its status.
+ *
+ * Interim `1xx` responses, such as `103 Early Hints`, are skipped, so the
+ * status and the framing are those of the final response. Its body is framed
+ * by the chunked encoding if it has one, by its `content-length` otherwise,
+ * and else by the server closing the connection. Responses to HEAD and `204`
+ * and `304` responses have no body.
+ *
+ * @param conn The connection to read from.
+ * @param head Whether the request was a HEAD request.
+ * @param closed Set if the connection cannot carry another request.
+ * @return The status of the final response, or -1 on error.
+ */
+static int read_replay_response(replay_conn_t *conn, bool head, bool *closed) {
+  int status = 0;
+  bool chunked = false;
+  bool has_length = false;
+  size_t length = 0;
+  *closed = false;
+  do {
+    char *line = read_replay_line(conn);
+    if (!line || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+      return -1;
+    }
+    while ((line = read_replay_line(conn)) && *line) {
+      char *value = strchr(line, ':');
+      if (!value) {
+        continue;
+      }
+      *value++ = '\0';
+      if (strcasecmp(line, "transfer-encoding") == 0) {
+        chunked = has_header_token(value, "chunked");
+      } else if (strcasecmp(line, "content-length") == 0) {
+        has_length = true;
+        length = strtoull(value, NULL, 10);
+      } else if (strcasecmp(line, "connection") == 0) {
+        *closed = has_header_token(value, "close");
+      }
+    }
+    if (!line) {
+      return -1;
+    }
+  } while (status >= 100 && status < 200 && status != 101);
+  if (head || status == 204 || status == 304) {
+    return status;
+  }
+  if (chunked) {
+    return skip_replay_chunks(conn) < 0 ? -1 : status;
+  }
+  if (has_length) {
+    return skip_replay_bytes(conn, length) < 0 ? -1 : status;
+  }
+  while (fill_replay_conn(conn) == 0) {
+    conn->start = conn->end;
+  }
+  *closed = true;
+  return status;
+}
+
+static bool is_replay_conn_open(replay_conn_t *conn) {
+  if (conn->fd < 0) {
+    return false;
+  }
+  struct pollfd pfd = {.fd = conn->fd, .events = POLLIN};
+  char byte;
+  return conn->start != conn->end || poll(&pfd, 1, 0) == 0 ||
+         recv(conn->fd, &byte, 1, MSG_PEEK) > 0;
+}
+
+static int open_replay_conn(replay_conn_t *conn) {
+  conn->start = conn->end = 0;
+  conn->fd = socket(replay_addr->ai_family, replay_addr->ai_socktype,
+                    replay_addr->ai_protocol);
+  if (conn->fd < 0) {
+    return -1;
+  }
+  if (connect(conn->fd, replay_addr->ai_addr, replay_addr->ai_addrlen) < 0) {
+    close(conn->fd);
+    conn->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void close_replay_conn(replay_conn_t *conn) {
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+}
+
+/**
+ * @brief Sends one recorded request and waits for the complete response.
+ *
+ * The request goes out on the connection of the requests before it, which is
+ * opened again if the server has closed it in the meantime.
+ */
+static void replay_request(replay_conn_t *conn, replay_entry_t *entry) {
+  uint64_t start = now_us();
+  if (!is_replay_conn_open(conn)) {
+    close_replay_conn(conn);
+    if (open_replay_conn(conn) < 0) {
+      return;
+    }
+  }
+  size_t sent = 0;
+  while (sent < entry->size) {
+    ssize_t n = write(conn->fd, entry->raw + sent, entry->size - sent);
+    if (n <= 0) {
+      close_replay_conn(conn);
+      return;
+    }
+    sent += n;
+  }
+  bool head = entry->size >= 5 && memcmp(entry->raw, "HEAD ", 5) == 0;
+  bool closed;
+  entry->status = read_replay_response(conn, head, &closed);
+  entry->latency_us = now_us() - start;
+  if (entry->status < 0 || closed) {
+    close_replay_conn(conn);
+  }
+}
+
+/**
+ * @brief Replays the requests of one recorded connection, in order.
+ *
+ * Each request is sent at its own offset from the start of the replay, once
+ * the response to the one before it has arrived.
+ */
+static void replay_group(replay_group_t *group, replay_conn_t *conn) {
+  conn->fd = -1;
+  for (size_t i = 0; i < group->count; i++) {
+    replay_entry_t *entry = &group->entries[i];
+    uint64_t due_us =
+        replay_start + (uint64_t)((entry->t - replay_origin) / replay_scale);
+    struct timespec due;
+    due.tv_sec = due_us / 1000000;
+    due.tv_nsec = due_us % 1000000 * 1000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+    replay_request(conn, entry);
+  }
+  close_replay_conn(conn);
+}
+
+static void *run_replay_worker(void *arg) {
+  (void)arg;
+  replay_conn_t *conn = malloc(sizeof(replay_conn_t));
+  if (!conn) {
+    return NULL;
+  }
+  while (1) {
+    pthread_mutex_lock(&group_lock);
+    size_t index = next_group++;
+    pthread_mutex_unlock(&group_lock);
+    if (index >= replay_group_count) {
+      break;
+    }
+    replay_group(&replay_groups[index], conn);
+  }
+  free(conn);
+  return NULL;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const replay_entry_t *x = a;
+  const replay_entry_t *y = b;
+  if (x->conn != y->conn) {
+    return (x->conn > y->conn) - (x->conn < y->conn);
+  }
+  if (x->t != y->t) {
+    return (x->t > y->t) - (x->t < y->t);
+  }
+  return (x->line > y->line) - (x->line < y->line);
+}
+
+static int compare_groups(const void *a, const void *b) {
+  uint64_t x = ((const replay_group_t *)a)->entries[0].t;
+  uint64_t y = ((const replay_group_t *)b)->entries[0].t;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Splits the entries, sorted by connection, into one group per
+ * connection, ordered by the time of their first request.
+ */
+static replay_group_t *group_entries(replay_entry_t *entries, size_t count,
+                                     size_t *group_count) {
+  replay_group_t *groups = malloc((count ? count : 1) * sizeof(*groups));
+  if (!groups) {
+    return NULL;
+  }
+  *group_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    replay_group_t *last = *group_count ? &groups[*group_count - 1] : NULL;
+    if (last && entries[i].conn >= 0 &&
+        last->entries[0].conn == entries[i].conn) {
+      last->count++;
+    } else {
+      groups[*group_count].entries = &entries[i];
+      groups[*group_count].count = 1;
+      (*group_count)++;
+    }
+  }
+  qsort(groups, *group_count, sizeof(*groups), compare_groups);
+  return groups;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void print_summary(replay_entry_t *entries, size_t count,
+                          uint64_t elapsed_us) {
+  uint64_t *latencies = malloc(count * sizeof(uint64_t));
+  size_t completed = 0;
+  size_t classes[6] = {0};
+  for (size_t i = 0; i < count; i++) {
+    if (entries[i].status <= 0) {
+      classes[0]++;
+      continue;
+    }
+    latencies[completed++] = entries[i].latency_us;
+    if (entries[i].status / 100 < 6) {
+      classes[entries[i].status / 100]++;
+    }
+  }
+  printf("replayed %zu requests in %.3fs (%.1f req/s)\n", count,
+         elapsed_us / 1e6, elapsed_us ? count * 1e6 / elapsed_us : 0.0);
+  printf("status: 1xx=%zu 2xx=%zu 3xx=%zu 4xx=%zu 5xx=%zu failed=%zu\n",
+         classes[1], classes[2], classes[3], classes[4], classes[5],
+         classes[0]);
+  if (completed) {
+    qsort(latencies, completed, sizeof(uint64_t), compare_u64);
+    printf("latency us: p50=%llu p90=%llu p99=%llu max=%llu\n",
+           (unsigned long long)latencies[completed * 50 / 100],
+           (unsigned long long)latencies[completed * 90 / 100],
+           (unsigned long long)latencies[completed * 99 / 100],
+           (unsigned long long)latencies[completed - 1]);
+  }
+  free(latencies);
+}
+
+/**
+ * @brief Replays a capture log against a running server.
+ *
+ * Usage: `replay <file> <host> <port> [scale]`. The requests recorded for one
+ * connection are replayed in order on one connection, so keep-alive sequences
+ * stay on a persistent connection; since the server reuses descriptors, a
+ * connection is opened again whenever the server closed it. Every request is
+ * sent at its original offset from the first request, divided by `scale` (2
+ * replays twice as fast, 0.5 at half speed), or once the response before it
+ * on its connection has arrived. At most REPLAY_THREADS connections are
+ * replayed at a time. The whole log is parsed up front so that parsing does
+ * not skew the schedule. A summary of status classes and latency percentiles
+ * is printed at the end.
+ *
+ * @param argc The number of arguments after the `replay` command.
+ * @param argv The arguments after the `replay` command.
+ * @return EXIT_SUCCESS if the log was replayed, or EXIT_FAILURE on error.
+ */
+int replay(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: replay <file> <host> <port> [scale]\n");
+    return EXIT_FAILURE;
+  }
+  double scale = argc > 3 ? strtod(argv[3], NULL) : 1.0;
+  if (scale <= 0) {
+    fprintf(stderr, "scale must be positive\n");
+    return EXIT_FAILURE;
+  }
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(argv[1], argv[2], &hints, &replay_addr) != 0) {
+    fprintf(stderr, "could not resolve %s:%s\n", argv[1], argv[2]);
+    return EXIT_FAILURE;
+  }
+  FILE *file = fopen(argv[0], "r");
+  if (!file) {
+    perror("replay");
+    freeaddrinfo(replay_addr);
+    return EXIT_FAILURE;
+  }
+  replay_entry_t *entries = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  while (getline(&line, &line_size, file) > 0) {
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      replay_entry_t *tmp = realloc(entries, capacity * sizeof(*entries));
+      if (!tmp) {
+        break;
+      }
+      entries = tmp;
+    }
+    entries[count].line = count;
+    if (parse_entry(line, &entries[count]) == 0) {
+      count++;
+    }
+  }
+  free(line);
+  fclose(file);
+  qsort(entries, count, sizeof(*entries), compare_entries);
+  replay_groups = group_entries(entries, count, &replay_group_count);
+  if (!replay_groups) {
+    fprintf(stderr, "replay: out of memory\n");
+    freeaddrinfo(replay_addr);
+    return EXIT_FAILURE;
+  }
+  replay_origin = UINT64_MAX;
+  for (size_t i = 0; i < count; i++) {
+    replay_origin = entries[i].t < replay_origin ? entries[i].t : replay_origin;
+  }
+  replay_scale = scale;
+  printf("replaying %zu requests on %zu connections at %.2fx\n", count,
+         replay_group_count, scale);
+  replay_start = now_us();
+  size_t thread_count = replay_group_count < REPLAY_THREADS
+                            ? replay_group_count
+                            : REPLAY_THREADS;
+  pthread_t threads[REPLAY_THREADS];
+  size_t started = 0;
+  while (started < thread_count &&
+         pthread_create(&threads[started], NULL, run_replay_worker, NULL) ==
+             0) {
+    started++;
+  }
+  if (started == 0) {
+    run_replay_worker(NULL);
+  }
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  print_summary(entries, count, now_us() - replay_start);
+  for (size_t i = 0; i < count; i++) {
+    free(entries[i].raw);
+  }
+  free(entries);
+  free(replay_groups);
+  freeaddrinfo(replay_addr);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,5 @@
+#ifndef REPLAY
+#define REPLAY
+
+int replay(int argc, char *argv[]);
+#endif // !REPLAY
@@ -1,9 +1,20 @@
+#include "bundle.h"
 #include "config.h"
+#include "connection.h"
 #include "document.h"
+#include "embed.h"
+#include "fingerprint.h"
 #include "header.h"
+#include "iopool.h"
+#include "settings.h"
 #include "utils.h"
+#include <errno.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 
 static document_t *create_OK_document(body_t *body) {
   header_t *header = create_default_header();
@@ -22,12 +33,27 @@ static document_t *create_INTERNAL_SERVER_ERROR_document() {
   return document;
 }
 
-static document_t *create_NOT_FOUND_document() {
+static document_t *create_status_document(RESPONSE_CODE_T code) {
+  header_t *header = create_default_header();
+  header->type = RESPONSE;
+  header->response_line = create_response_line(code, "HTTP/1.1");
+  document_t *document = create_document(header, NULL, RESPONSE);
+  attach_header(document->header, create_header_item("content-length", "0"));
+  return document;
+}
+
+static document_t *create_NOT_FOUND_document(bool head) {
   header_t *header = create_default_header();
   header->type = RESPONSE;
   header->response_line = create_response_line(NOT_FOUND, "HTTP/1.1");
-  body_t *body = create_body((const char *)PAGE_404);
+  const settings_t *settings = get_settings();
+  char *page = str_join(settings->target_directory, settings->page_404);
+  body_t *body = !page ? NULL : head ? stat_body(page) : create_body(page);
+  free(page);
   document_t *document = create_document(header, body, RESPONSE);
+  if (!body) {
+    attach_header(document->header, create_header_item("content-length", "0"));
+  }
   return document;
 }
 
@@ -43,7 +69,17 @@ document_t *create_response(RESPONSE_CODE_T code, body_t *body) {
   case OK:
     return create_OK_document(body);
   case NOT_FOUND:
-    return create_NOT_FOUND_document();
+    return create_NOT_FOUND_document(false);
+  case BAD_REQUEST:
+  case CONTENT_TOO_LARGE:
+  case EXPECTATION_FAILED:
+  case METHOD_NOT_ALLOWED:
+  case NOT_IMPLEMENTED:
+  case TOO_MANY_REQUESTS:
+  case BAD_GATEWAY:
+  case SERVICE_UNAVAILABLE:
+  case GATEWAY_TIMEOUT:
+    return create_status_document(code);
   case CONTINUE:
   case SWITCHING_PROCTOLS:
   case PROCESSING:
@@ -65,11 +101,9 @@ document_t *create_response(RESPONSE_CODE_T code, body_t *body) {
   case UNUSED:
   case TEMPORARY_REDIRECT:
   case PERMANENT_REDIRECT:
-  case BAD_REQUEST:
   case UNAUTHORIZED:
   case PAYMENT_REQUIRED:
   case FORBIDDEN:
-  case METHOD_NOT_ALLOWED:
   case NOT_ACCEPTABLE:
   case PROXY_AUHENTICAION_REQUIRED:
   case REQUEST_TIMEOUT:
@@ -77,10 +111,8 @@ document_t *create_response(RESPONSE_CODE_T code, body_t *body) {
   case GONE:
   case LENGTH_REQUIRED:
   case PRECONDITION_FAILED:
-  case CONTENT_TOO_LARGE:
   case URI_TOO_LONG:
   case UNSUPPORTED_MEDIA_TYPE:
-  case EXPECTATION_FAILED:
   case IM_A_TEAPOT:
   case MISDIRECTED_REQUEST:
   case UNPROCESSED_CONTENT:
@@ -89,13 +121,8 @@ document_t *create_response(RESPONSE_CODE_T code, body_t *body) {
   case TOO_EARLY:
   case UPGRADE_REQUIRED:
   case PRECONDITION_REQUIRED:
-  case TOO_MANY_REQUESTS:
   case REQUEST_HEADER_FIELDS_TOO_LARGE:
   case UNAVAILABLE_FOR_LEGAL_REASONS:
-  case NOT_IMPLEMENTED:
-  case BAD_GATEWAY:
-  case SERVICE_UNAVAILABLE:
-  case GATEWAY_TIMEOUT:
   case HTTP_VERSION_NOT_SUPPORTED:
   case VARIANT_ALSO_NEGOTIONATE:
   case INSUFFICIENT_STORAGE:
@@ -108,28 +135,244 @@ document_t *create_response(RESPONSE_CODE_T code, body_t *body) {
 }
 
 /**
- * @brief Fetches the contents of a web page and returns it as a string.
+ * @brief Attaches the validators of a representation to a response header.
  *
- * This function takes in a URL as input, fetches the contents of the web page,
-and returns it as a string. If the URL does n not point to an existing web page,
-it will return NULL.
+ * Every file response gets its `etag` and `last-modified` here, whether it
+ * comes from disk, a bundle or the embedded assets, and whether it answers a
+ * GET or a HEAD request, so both methods always report the same validators.
  *
- * @param target The URL of the web page to be fetched.
- * @return The contents of the web page as a string, or NULL if the URL does not
-point to an existing web page.
+ * @param header The response header.
+ * @param etag The entity tag, including its quotes.
+ * @param mtime The modification time, or 0 if it is unknown.
  */
-unsigned char *fetch_body(char *target) {
-  bool needs_malloc = false;
-  unsigned char *content;
-  if (target[strlen(target) - 1] == '/') {
-    char *target_root = str_join(target, "index.htm");
-    content = load_file(target_root);
-    free(target_root);
-  } else {
-    content = load_file(target);
+void attach_validators(header_t *header, const char *etag, time_t mtime) {
+  attach_header(header, create_header_item("etag", (char *)etag));
+  if (mtime > 0) {
+    char date[HTTP_DATE_SIZE];
+    format_http_date(mtime, date, sizeof(date));
+    attach_header(header, create_header_item("last-modified", date));
+  }
+}
+
+typedef struct content_type_probe {
+  char *content_type;
+  char path[];
+} content_type_probe_t;
+
+static void run_content_type_probe(void *arg) {
+  content_type_probe_t *probe = arg;
+  probe->content_type = get_content_type(probe->path);
+}
+
+static void discard_content_type_probe(void *arg) {
+  content_type_probe_t *probe = arg;
+  free(probe->content_type);
+  free(probe);
+}
+
+/**
+ * @brief Determines the content type of a file that is not in memory.
+ *
+ * The magic bytes are read on the I/O pool, since the file is opened for
+ * them. If that takes longer than `io_timeout`, the type is taken from the
+ * extension alone.
+ *
+ * @param path The path to the file.
+ * @return The content type, newly allocated, or NULL if it is not known.
+ */
+static char *sniff_content_type(char *path) {
+  content_type_probe_t *probe =
+      malloc(sizeof(content_type_probe_t) + strlen(path) + 1);
+  if (!probe) {
+    return NULL;
   }
-  if (content) {
-    return content;
+  probe->content_type = NULL;
+  strcpy(probe->path, path);
+  if (!call_io(run_content_type_probe, discard_content_type_probe, probe)) {
+    return get_data_content_type(path, NULL, 0);
+  }
+  char *content_type = probe->content_type;
+  free(probe);
+  return content_type;
+}
+
+/**
+ * @brief Creates the response for the file a request target names.
+ *
+ * The target is translated into a path in the target directory and resolved
+to the file to serve. The response is `200 Ok` with the file as body, or `404
+Not Found` if there is no such file. Its content type is derived from the
+file's magic bytes for images and from the extension otherwise, and the ETag
+of a file on disk from its modification time and size. Targets that are
+compiled in with EMBED_ASSETS are answered from memory first. Otherwise, when a
+bundle is configured, the response comes from the bundle instead and the
+target directory is not touched.
+ *
+ * For HEAD requests the file is only stat'ed: the response has the headers a
+ * GET request would get, including `content-length`, but no body. A file
+ * that could not be read within `io_timeout` gets `503 Service Unavailable`
+ * with a `retry-after` instead of a `404`.
+ *
+ * With `fingerprint`, a target carrying a content digest names the file
+ * without it, and the response is marked immutable if the digest is current.
+ * The ETag of an HTML file rewritten with digests also covers its assets.
+ *
+ * @param target The request target.
+ * @param gzip Whether the client accepts a gzip-encoded body.
+ * @param head Whether to leave out the body.
+ * @return The response document, or NULL if an error occurred.
+ */
+document_t *create_file_response(const char *target, bool gzip, bool head) {
+  const embedded_asset_t *asset = find_embedded_asset(target);
+  if (asset) {
+    return create_embedded_response(asset, gzip, head);
+  }
+  bundle_t *bundle = get_bundle();
+  if (bundle) {
+    return create_bundle_response(bundle, target, gzip, head);
+  }
+  bool immutable = false;
+  char *translated_target = translate_fingerprinted_target(target, &immutable);
+  if (!translated_target) {
+    return NULL;
+  }
+  errno = 0;
+  body_t *response_body = head ? stat_body(translated_target)
+                               : create_body(translated_target);
+  bool unavailable =
+      !response_body && (errno == ETIMEDOUT || errno == EAGAIN);
+  document_t *response_document =
+      response_body ? create_response(OK, response_body)
+      : unavailable ? create_response(SERVICE_UNAVAILABLE, NULL)
+                    : create_NOT_FOUND_document(head);
+  if (unavailable) {
+    set_header_item(response_document->header, "retry-after", RETRY_AFTER);
+  }
+  if (response_body) {
+    char etag[64];
+    uint64_t version = response_body->shared ? response_body->shared->version
+                                             : 0;
+    if (version) {
+      snprintf(etag, sizeof(etag), "\"%llx-%zx-%llx\"",
+               (unsigned long long)response_body->mtime, response_body->size,
+               (unsigned long long)version);
+    } else {
+      snprintf(etag, sizeof(etag), "\"%llx-%zx\"",
+               (unsigned long long)response_body->mtime, response_body->size);
+    }
+    attach_validators(response_document->header, etag,
+                      response_body->mtime);
+    if (immutable) {
+      attach_header(response_document->header,
+                    create_header_item("cache-control",
+                                       FINGERPRINT_CACHE_CONTROL));
+    }
+    if (response_body->shared && response_body->shared->links &&
+        get_settings()->early_hints) {
+      attach_header(response_document->header,
+                    create_header_item("link", response_body->shared->links));
+    }
+  }
+  shared_file_t *shared = response_body ? response_body->shared : NULL;
+  char *content_type =
+      shared && shared->data
+          ? get_data_content_type(translated_target, shared->data,
+                                  shared->size)
+      : response_body ? sniff_content_type(translated_target)
+                      : get_data_content_type(translated_target, NULL, 0);
+  if (content_type) {
+    attach_header(response_document->header,
+                  create_header_item("content-type", content_type));
+  }
+  free(content_type);
+  free(translated_target);
+  return response_document;
+}
+
+/**
+ * @brief Starts a response whose body is streamed with chunked encoding.
+ *
+ * The response header is written with `transfer-encoding: chunked` instead of
+ * a `content-length`, so the body does not have to be produced up front. The
+ * caller then sends the body with write_chunk() as it is generated and ends it
+ * with write_last_chunk(). The response document must not have a body.
+ *
+ * @param response The response document to send the header of.
+ * @param conn The connection to send the response on.
+ * @return 0 on success, or -1 on error.
+ */
+int send_chunked_response(document_t *response, connection_t *conn) {
+  set_header_item(response->header, "transfer-encoding", "chunked");
+  if (!conn->keep_alive) {
+    set_header_item(response->header, "connection", "close");
+    remove_header_item(response->header, "keep-alive");
+  }
+  unsigned char *header = serialize_header(response->header);
+  if (!header) {
+    return -1;
+  }
+  int result = write_to_conn(conn, header, strlen((char *)header));
+  free(header);
+  return result;
+}
+
+/**
+ * @brief Serializes the parts of a response that do not depend on the request.
+ *
+ * The `connection`, `keep-alive` and `date` headers are dropped, as is the
+ * blank line ending the header, so the result can be completed by
+ * send_prebuilt_response() for whichever connection it is sent on. The
+ * document's body is not included.
+ *
+ * @param response The response document. Its header is modified.
+ * @param size Receives the size of the serialized head.
+ * @return The serialized head, or NULL if an error occurred.
+ */
+unsigned char *prebuild_response(document_t *response, size_t *size) {
+  remove_header_item(response->header, "connection");
+  remove_header_item(response->header, "keep-alive");
+  remove_header_item(response->header, "date");
+  unsigned char *head = serialize_header(response->header);
+  if (!head) {
+    return NULL;
+  }
+  *size = strlen((char *)head) - 2;
+  return head;
+}
+
+/**
+ * @brief Sends a response whose head was serialized ahead of time.
+ *
+ * The `date` and connection headers and the blank line are appended to the
+ * prebuilt head, and everything goes out with the body in a single `writev`,
+ * so a prebuilt response costs one system call and no allocation.
+ *
+ * @param conn The connection to send the response on.
+ * @param head The status line and headers, without the blank line.
+ * @param head_size The size of the head.
+ * @param body The body, or NULL if there is none.
+ * @param body_size The size of the body.
+ * @return 0 on success, or -1 on error.
+ */
+int send_prebuilt_response(connection_t *conn, const unsigned char *head,
+                           size_t head_size, const unsigned char *body,
+                           size_t body_size) {
+  char date[HTTP_DATE_SIZE];
+  format_http_date(time(NULL), date, sizeof(date));
+  char tail[192];
+  int tail_size;
+  if (conn->keep_alive) {
+    tail_size = snprintf(tail, sizeof(tail),
+                         "date: %s\r\nconnection: keep-alive\r\n"
+                         "keep-alive: timeout=%d, max=%d\r\n\r\n",
+                         date, conn->settings->keepalive_timeout / 1000,
+                         conn->settings->keepalive_max);
+  } else {
+    tail_size = snprintf(tail, sizeof(tail),
+                         "date: %s\r\nconnection: close\r\n\r\n", date);
   }
-  return NULL;
+  struct iovec iov[3] = {{(void *)head, head_size},
+                         {tail, tail_size},
+                         {(void *)body, body ? body_size : 0}};
+  return write_iov_to_conn(conn, iov, 3);
 }
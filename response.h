@@ -2,7 +2,14 @@
 #define RESPONSE_DOC
 #include "document.h"
 #include <stdbool.h>
+#include <time.h>
 
 document_t *create_response(RESPONSE_CODE_T code, body_t *body);
-unsigned char *fetch_body(char *target);
+void attach_validators(header_t *header, const char *etag, time_t mtime);
+document_t *create_file_response(const char *target, bool gzip, bool head);
+int send_chunked_response(document_t *response, connection_t *conn);
+unsigned char *prebuild_response(document_t *response, size_t *size);
+int send_prebuilt_response(connection_t *conn, const unsigned char *head,
+                           size_t head_size, const unsigned char *body,
+                           size_t body_size);
 #endif // !RESPONSE
@@ -0,0 +1,350 @@
+#include "router.h"
+#include "response.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct route_node {
+  char *label;
+  size_t length;
+  route_t *route;
+  struct route_node **children;
+  int child_count;
+} route_node_t;
+
+static route_node_t root = {0};
+static route_t **routes = NULL;
+static int route_count = 0;
+static bool any_methods[METHOD_COUNT] = {false};
+static char allow_any[64] = "";
+static unsigned char *options_any = NULL;
+static size_t options_any_size = 0;
+
+static route_node_t *create_route_node(const char *label, size_t length) {
+  route_node_t *node = calloc(1, sizeof(route_node_t));
+  if (!node) {
+    return NULL;
+  }
+  node->label = strndup(label, length);
+  node->length = length;
+  if (!node->label) {
+    free(node);
+    return NULL;
+  }
+  return node;
+}
+
+static int add_child(route_node_t *node, route_node_t *child) {
+  route_node_t **tmp = realloc(node->children, (node->child_count + 1) *
+                                                   sizeof(route_node_t *));
+  if (!tmp) {
+    return -1;
+  }
+  node->children = tmp;
+  node->children[node->child_count++] = child;
+  return 0;
+}
+
+static route_node_t **find_child(const route_node_t *node, char first) {
+  for (int i = 0; i < node->child_count; i++) {
+    if (node->children[i]->label[0] == first) {
+      return &node->children[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Finds or creates the trie node for a prefix.
+ *
+ * Children of a node never share their first character, so a node whose label
+ * only partly matches the prefix is split at the point where they differ.
+ *
+ * @return The node, or NULL if memory ran out.
+ */
+static route_node_t *insert_route_node(const char *prefix) {
+  route_node_t *node = &root;
+  while (*prefix) {
+    route_node_t **slot = find_child(node, *prefix);
+    if (!slot) {
+      route_node_t *child = create_route_node(prefix, strlen(prefix));
+      if (!child || add_child(node, child) < 0) {
+        return NULL;
+      }
+      return child;
+    }
+    route_node_t *child = *slot;
+    size_t common = 0;
+    while (common < child->length && prefix[common] == child->label[common]) {
+      common++;
+    }
+    if (common < child->length) {
+      route_node_t *split = create_route_node(child->label, common);
+      char *rest = strdup(child->label + common);
+      if (!split || !rest || add_child(split, child) < 0) {
+        return NULL;
+      }
+      free(child->label);
+      child->label = rest;
+      child->length -= common;
+      *slot = split;
+      child = split;
+    }
+    prefix += common;
+    node = child;
+  }
+  return node;
+}
+
+static void list_methods(char *allow, const bool *allowed) {
+  allow[0] = '\0';
+  for (int method = 0; method < METHOD_COUNT; method++) {
+    if (allowed[method] || method == OPTIONS) {
+      if (allow[0] != '\0') {
+        strcat(allow, ", ");
+      }
+      strcat(allow, get_method_string(method));
+    }
+  }
+}
+
+static document_t *create_allow_response(RESPONSE_CODE_T code,
+                                         const char *allow) {
+  document_t *document = create_response(code, NULL);
+  if (document) {
+    set_header_item(document->header, "allow", (char *)allow);
+    set_header_item(document->header, "content-length", "0");
+  }
+  return document;
+}
+
+static unsigned char *prebuild_allow(RESPONSE_CODE_T code, const char *allow,
+                                     size_t *size) {
+  document_t *document = create_allow_response(code, allow);
+  if (!document) {
+    return NULL;
+  }
+  unsigned char *head = prebuild_response(document, size);
+  destroy_document(document);
+  return head;
+}
+
+/**
+ * @brief Prebuilds the `405 Method Not Allowed` and OPTIONS responses of a
+ * route.
+ *
+ * Their `allow` header lists the methods the route has handlers for, plus
+ * OPTIONS, which the router answers itself. The server-wide response to
+ * `OPTIONS *` is rebuilt as well, listing the methods of all routes.
+ */
+static int prebuild_allow_responses(route_t *route) {
+  bool allowed[METHOD_COUNT];
+  for (int method = 0; method < METHOD_COUNT; method++) {
+    allowed[method] = route->methods[method].handler != NULL;
+    any_methods[method] = any_methods[method] || allowed[method];
+  }
+  list_methods(route->allow, allowed);
+  list_methods(allow_any, any_methods);
+  size_t not_allowed_size = 0;
+  size_t options_size = 0;
+  size_t any_size = 0;
+  unsigned char *not_allowed =
+      prebuild_allow(METHOD_NOT_ALLOWED, route->allow, &not_allowed_size);
+  unsigned char *options = prebuild_allow(OK, route->allow, &options_size);
+  unsigned char *any = prebuild_allow(OK, allow_any, &any_size);
+  if (!not_allowed || !options || !any) {
+    free(not_allowed);
+    free(options);
+    free(any);
+    return -1;
+  }
+  free(route->not_allowed);
+  free(route->options);
+  free(options_any);
+  route->not_allowed = not_allowed;
+  route->not_allowed_size = not_allowed_size;
+  route->options = options;
+  route->options_size = options_size;
+  options_any = any;
+  options_any_size = any_size;
+  return 0;
+}
+
+/**
+ * @brief Registers the handler for one method of a route.
+ *
+ * A route covers every target that equals its prefix or continues it with a
+ * path segment or a query, so `/api` covers `/api/users` and `/api?x` but not
+ * `/apis`; a prefix ending in a slash covers everything below it. Routes must
+ * be added before the server starts accepting connections.
+ *
+ * A handler writes its response to the connection itself. Protocols that
+ * frame responses differently, such as HTTP/2, use the responder instead,
+ * which builds the same response as a document; a route without one can only
+ * be reached over HTTP/1.x.
+ *
+ * @param prefix The target prefix, starting with a slash.
+ * @param method The method to handle.
+ * @param handler The handler, called with `data` for every matching request.
+ * @param respond The responder, called with `data`, or NULL.
+ * @param data The value passed to the handler and the responder.
+ * @return 0 on success, or -1 on error.
+ */
+int add_route(const char *prefix, REQUEST_METHOD_T method,
+              route_handler_t handler, route_responder_t respond, void *data) {
+  if (prefix[0] != '/' || method >= METHOD_COUNT) {
+    fprintf(stderr, "router: invalid route %s\n", prefix);
+    return -1;
+  }
+  route_node_t *node = insert_route_node(prefix);
+  if (!node) {
+    return -1;
+  }
+  if (!node->route) {
+    route_t **tmp = realloc(routes, (route_count + 1) * sizeof(route_t *));
+    route_t *route = calloc(1, sizeof(route_t));
+    if (!tmp || !route) {
+      free(route);
+      return -1;
+    }
+    routes = tmp;
+    route->prefix = strdup(prefix);
+    atomic_init(&route->requests, 0);
+    routes[route_count++] = route;
+    node->route = route;
+  }
+  node->route->methods[method].handler = handler;
+  node->route->methods[method].respond = respond;
+  node->route->methods[method].data = data;
+  return prebuild_allow_responses(node->route);
+}
+
+/**
+ * @brief Finds the route a request target belongs to.
+ *
+ * The target is walked down the trie once, and the deepest route whose prefix
+ * ends on a segment boundary of the target wins.
+ *
+ * @param target The request target.
+ * @return The route, or NULL if no route covers the target.
+ */
+route_t *match_route(const char *target) {
+  const route_node_t *node = &root;
+  const char *rest = target;
+  route_t *match = NULL;
+  for (;;) {
+    if (node->route && (node->label[node->length - 1] == '/' ||
+                        *rest == '\0' || *rest == '/' || *rest == '?')) {
+      match = node->route;
+    }
+    route_node_t **child = *rest ? find_child(node, *rest) : NULL;
+    if (!child || strncmp(rest, (*child)->label, (*child)->length) != 0) {
+      return match;
+    }
+    rest += (*child)->length;
+    node = *child;
+  }
+}
+
+static void send_status(connection_t *conn, RESPONSE_CODE_T code) {
+  document_t *response = create_response(code, NULL);
+  if (response) {
+    send_document(response, conn);
+    destroy_document(response);
+  }
+}
+
+/**
+ * @brief Dispatches a request to the handler its route has for its method.
+ *
+ * Methods the server does not know are answered with `501 Not Implemented`,
+ * and targets no route covers with `404 Not Found`. OPTIONS requests the
+ * route has no handler for get its prebuilt `allow` list, as does `OPTIONS *`
+ * for the whole server, and other methods the route has no handler for get
+ * its prebuilt `405 Method Not Allowed`.
+ *
+ * @param request The request document
+ * @param conn The connection the request arrived on
+ */
+void dispatch_request(document_t *request, connection_t *conn) {
+  header_request_line_t *request_line = request->header->request_line;
+  if (request_line->method == UNKNOWN_METHOD) {
+    send_status(conn, NOT_IMPLEMENTED);
+    return;
+  }
+  if (request_line->method == OPTIONS &&
+      strcmp(request_line->target, "*") == 0 && options_any) {
+    send_prebuilt_response(conn, options_any, options_any_size, NULL, 0);
+    return;
+  }
+  route_t *route = match_route(request_line->target);
+  if (!route) {
+    send_status(conn, NOT_FOUND);
+    return;
+  }
+  atomic_fetch_add(&route->requests, 1);
+  route_method_t *method = &route->methods[request_line->method];
+  if (!method->handler && request_line->method == OPTIONS) {
+    send_prebuilt_response(conn, route->options, route->options_size, NULL,
+                           0);
+    return;
+  }
+  if (!method->handler) {
+    send_prebuilt_response(conn, route->not_allowed, route->not_allowed_size,
+                           NULL, 0);
+    return;
+  }
+  method->handler(request, conn, method->data);
+}
+
+/**
+ * @brief Builds the response dispatch_request() would send, as a document.
+ *
+ * Requests are routed the same way, and a route's `allow` list answers
+ * OPTIONS and methods it has no handler for, but the response is built by the
+ * responder of the route instead of being written to a connection.
+ *
+ * @param request The request document
+ * @return The response document, or NULL with `errno` set to EPROTONOSUPPORT
+ * if the route has a handler for the method but no responder, or to another
+ * error if the response could not be built.
+ */
+document_t *create_route_response(document_t *request) {
+  header_request_line_t *request_line = request->header->request_line;
+  if (request_line->method == UNKNOWN_METHOD) {
+    return create_response(NOT_IMPLEMENTED, NULL);
+  }
+  if (request_line->method == OPTIONS &&
+      strcmp(request_line->target, "*") == 0 && options_any) {
+    return create_allow_response(OK, allow_any);
+  }
+  route_t *route = match_route(request_line->target);
+  if (!route) {
+    return create_response(NOT_FOUND, NULL);
+  }
+  atomic_fetch_add(&route->requests, 1);
+  route_method_t *method = &route->methods[request_line->method];
+  if (!method->handler) {
+    return create_allow_response(
+        request_line->method == OPTIONS ? OK : METHOD_NOT_ALLOWED,
+        route->allow);
+  }
+  if (!method->respond) {
+    errno = EPROTONOSUPPORT;
+    return NULL;
+  }
+  return method->respond(request, method->data);
+}
+
+/**
+ * @brief Writes the number of requests dispatched to every route.
+ *
+ * @param out The stream to write to.
+ */
+void write_route_stats(FILE *out) {
+  for (int i = 0; i < route_count; i++) {
+    fprintf(out, "route_requests %s %lu\n", routes[i]->prefix,
+            atomic_load(&routes[i]->requests));
+  }
+}
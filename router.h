@@ -0,0 +1,36 @@
+#ifndef ROUTER
+#define ROUTER
+#include "connection.h"
+#include "document.h"
+#include "header.h"
+#include <stdatomic.h>
+#include <stdio.h>
+
+typedef void (*route_handler_t)(document_t *request, connection_t *conn,
+                                void *data);
+typedef document_t *(*route_responder_t)(document_t *request, void *data);
+
+typedef struct route_method {
+  route_handler_t handler;
+  route_responder_t respond;
+  void *data;
+} route_method_t;
+
+typedef struct route {
+  char *prefix;
+  route_method_t methods[METHOD_COUNT];
+  char allow[64];
+  unsigned char *not_allowed;
+  size_t not_allowed_size;
+  unsigned char *options;
+  size_t options_size;
+  atomic_ulong requests;
+} route_t;
+
+int add_route(const char *prefix, REQUEST_METHOD_T method,
+              route_handler_t handler, route_responder_t respond, void *data);
+route_t *match_route(const char *target);
+void dispatch_request(document_t *request, connection_t *conn);
+document_t *create_route_response(document_t *request);
+void write_route_stats(FILE *out);
+#endif // !ROUTER
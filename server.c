@@ -1,95 +1,106 @@
+#define _GNU_SOURCE
+#include "admission.h"
+#include "bundle.h"
+#include "cache.h"
+#include "capture.h"
 #include "config.h"
+#include "connection.h"
 #include "document.h"
+#include "embed.h"
+#include "fingerprint.h"
+#include "flight.h"
 #include "header.h"
+#include "hints.h"
+#include "http2.h"
+#include "iopool.h"
+#include "listener.h"
+#include "prefork.h"
+#include "proxy.h"
+#include "ratelimit.h"
 #include "response.h"
+#include "router.h"
+#include "settings.h"
+#include "shmcache.h"
+#include "timer.h"
+#include "upgrade.h"
 #include "utils.h"
+#include "warm.h"
 #include <arpa/inet.h>
-#include <asm-generic/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-/**
- * @brief Reads exactly `count` bytes from the file descriptor `fd` into the
-buffer `buf`.
- *
- * This function reads as many bytes as necessary to fill the entire buffer, or
-until an error occurs. It returns the total n number of bytes read.
- *
- * @param fd The file descriptor to read from.
- * @param buf The buffer to read into.
- * @param count The maximum number of bytes to read.
- * @return The total number of bytes read, or a negative value on error.
- */
-ssize_t read_full(int fd, unsigned char *buf, size_t count) {
-  size_t total_read = 0;
-  while (total_read < count) {
-    ssize_t n = read(fd, buf + total_read, count - total_read);
-    if (n <= 0)
-      return n;
-    total_read += n;
-  }
-  return total_read;
-}
+typedef struct worker {
+  int index;
+  int sockfd;
+  int pinned_cpu;
+  atomic_int cpu;
+  atomic_int node;
+  atomic_ulong connections;
+  atomic_ulong local_connections;
+} worker_t;
 
-/**
- * @brief Write data to an open connection.
- *
- * This function writes data to an open connection, starting at the given file
-descriptor. It takes a buffer of unsigned char chars and a length in bytes as
-input, and returns -1 on error or the number of bytes written if successful.
- *
- * @param connfd The file descriptor for the open connection.
- * @param data The buffer containing the data to write.
- * @param length The length of the data buffer in bytes.
- * @return The number of bytes written, or -1 on error.
- */
-int write_to_conn(int connfd, unsigned char *data, size_t length) {
-  size_t remaining = length;
-  size_t idx = 0;
-  while (remaining > 0) {
-    ssize_t to_write = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
-    ssize_t n = write(connfd, data + idx, to_write);
-    if (n <= 0) {
-      perror("write");
-      return -1;
-    }
-    idx += n;
-    remaining -= n;
-  }
-  return 0;
-}
+typedef struct client {
+  int fd;
+  int worker;
+  uint32_t peer;
+} client_t;
+
+static worker_t *workers = NULL;
+static int worker_count = 0;
 
 /**
- * @brief Reads an HTTP request from the given socket and returns a document
-object.
+ * @brief Reads an HTTP request header from the given connection and returns a
+document object.
  *
- * This function reads data from the socket until it receives a complete HTTP
-request. It then parses the request into its header and body parts, and returns
-a document object that represents the entire request.
+ * This function reads data from the connection until it receives a complete
+HTTP request header and parses it. The body is not read here: if the request
+declares one, the document gets a body stream that handlers read from, and any
+body bytes that arrived together with the header stay in the connection buffer.
  *
- * @param connfd The socket file descriptor.
+ * The whole header must arrive within `header_timeout` milliseconds of its
+first byte, and a persistent connection may sit idle for `keepalive_timeout`
+milliseconds before that, so a client that trickles in a header cannot hold the
+connection open. Headers larger than `max_header_size` bytes are refused.
+ *
+ * @param conn The connection to read from.
  * @return A document object representing the received HTTP request.
  */
-document_t *document_from_stream(int connfd) {
-  unsigned char buffer[BUFFER_SIZE];
+document_t *document_from_stream(connection_t *conn) {
   size_t raw_header_size = 0;
   unsigned char *raw_header = malloc(BUFFER_SIZE);
   char rollover[3] = {0};
-  ssize_t nread;
   int header_complete = 0;
-  size_t body_size = 0;
-  unsigned char *raw_body = NULL;
-  body_t *body = NULL;
   header_t *header = NULL;
-  document_t *document;
-  while (!header_complete && (nread = read(connfd, buffer, BUFFER_SIZE)) > 0) {
+  body_stream_t *body_stream = NULL;
+  const settings_t *settings = conn->settings;
+  bool idle = conn->requests > 0 && conn->start == conn->end;
+  arm_timer(&conn->timer,
+            idle ? settings->keepalive_timeout : settings->header_timeout);
+  while (!header_complete) {
+    if (conn->start == conn->end && fill_connection(conn) <= 0) {
+      break;
+    }
+    if (idle) {
+      arm_timer(&conn->timer, settings->header_timeout);
+      idle = false;
+    }
+    if (raw_header_size > settings->max_header_size) {
+      free(raw_header);
+      return NULL;
+    }
+    unsigned char *buffer = conn->buffer + conn->start;
+    size_t nread = conn->end - conn->start;
     void *tmp = realloc(raw_header, raw_header_size + nread + 1);
     if (!tmp) {
       free(raw_header);
@@ -97,7 +108,7 @@ document_t *document_from_stream(int connfd) {
     }
     raw_header = tmp;
     int header_end = -1;
-    for (int i = 0; i < nread; i++) {
+    for (size_t i = 0; i < nread; i++) {
       if (rollover[0] == '\r' && rollover[1] == '\n' && rollover[2] == '\r' &&
           buffer[i] == '\n') {
         header_end = i;
@@ -110,224 +121,676 @@ document_t *document_from_stream(int connfd) {
     if (header_end == -1) {
       memcpy(raw_header + raw_header_size, buffer, nread);
       raw_header_size += nread;
+      conn->start = conn->end;
     } else {
       memcpy(raw_header + raw_header_size, buffer, header_end);
       raw_header_size += header_end;
       raw_header[raw_header_size] = '\0';
+      conn->start += header_end + 1;
       header_complete = 1;
+      clock_gettime(CLOCK_MONOTONIC, &conn->received);
       if (strlen((const char *)raw_header) < 10) {
         free(raw_header);
         return NULL;
       }
       header = parse_header(raw_header);
       header_item_t *content_length = get_header_item(header, "CONTENT-LENGTH");
-      if (content_length) {
-        body_size = str_to_size_t(content_length->value);
-        raw_body = malloc(body_size + 1);
-        size_t remaining = nread - header_end - 1;
-        if (remaining > 0) {
-          size_t to_copy = remaining < body_size ? remaining : body_size;
-          memcpy(raw_body, buffer + header_end + 1, to_copy);
-        }
-        if (remaining < body_size) {
-          read_full(connfd, raw_body + remaining, body_size - remaining);
+      header_item_t *transfer_encoding =
+          get_header_item(header, "TRANSFER-ENCODING");
+      header_item_t *expect = get_header_item(header, "EXPECT");
+      bool expect_continue =
+          expect && strcasecmp(expect->value, "100-continue") == 0;
+      raw_header[raw_header_size] = '\n';
+      size_t length = 0;
+      if (transfer_encoding &&
+          strcasecmp(transfer_encoding->value, "chunked") == 0) {
+        body_stream = create_chunked_body_stream(conn, expect_continue);
+      } else if (content_length && !transfer_encoding &&
+                 parse_content_length(content_length->value, &length)) {
+        body_stream = create_body_stream(conn, length, expect_continue);
+      }
+      if (body_stream && capture_enabled()) {
+        body_stream->capture_header = malloc(raw_header_size + 1);
+        if (body_stream->capture_header) {
+          memcpy(body_stream->capture_header, raw_header, raw_header_size + 1);
+          body_stream->capture_header_size = raw_header_size + 1;
         }
-        body = parse_body(raw_body, body_size);
-        free(raw_body);
+      } else if (!body_stream) {
+        capture_request(conn->fd, raw_header, raw_header_size + 1, NULL, 0);
       }
     }
   }
+  cancel_timer(&conn->timer);
   free(raw_header);
-  return create_document(header, body, REQUEST);
+  document_t *document = create_document(header, NULL, REQUEST);
+  if (document) {
+    document->body_stream = body_stream;
+  }
+  return document;
 }
 
 /**
- * @brief Handle a GET request
+ * @brief Sends the response for the file a GET or HEAD request names.
  *
- * This function handles a GET request by translating the target URL into a file
-path, fetching the contents of that file, an and then creating a response
-document with the appropriate content type and sending it back to the client.
+ * Both methods build their headers the same way, so a HEAD response carries
+ * exactly the length, type and validators of the GET response, but the file
+ * is only stat'ed for HEAD and never read. Targets compiled in with
+ * EMBED_ASSETS are answered with their prebuilt response instead. An HTML
+ * file's response carries the subresources it references in a `link` header,
+ * and an HTTP/1.1 GET is sent the same header first in a `103 Early Hints`.
  *
  * @param request The request document
- * @param connfd The connection socket file descriptor
+ * @param conn The connection to respond on
+ * @param head Whether to leave out the body
  */
-void handle_GET(document_t *request, int connfd) {
-  char *translated_target =
-      translate_target(request->header->request_line->target);
-  body_t *response_body = create_body(translated_target);
+static void send_file_response(document_t *request, connection_t *conn,
+                               bool head) {
+  header_item_t *accept_encoding =
+      get_header_item(request->header, "ACCEPT-ENCODING");
+  bool gzip =
+      accept_encoding && accepts_encoding(accept_encoding->value, "gzip");
+  const embedded_asset_t *asset =
+      find_embedded_asset(request->header->request_line->target);
+  if (asset) {
+    send_embedded_asset(asset, conn, gzip, head);
+    return;
+  }
   document_t *response_document =
-      create_response(response_body ? OK : NOT_FOUND, response_body);
-  char *file_type = NULL;
-  if (is_image_file(translated_target, &file_type)) {
-    if (!file_type) {
+      create_file_response(request->header->request_line->target, gzip, head);
+  if (!response_document) {
+    return;
+  }
+  header_item_t *links = get_header_item(response_document->header, "link");
+  if (links && !head &&
+      strcmp(request->header->request_line->version, "HTTP/1.1") == 0) {
+    send_early_hints(conn, links->value);
+  }
+  send_document(response_document, conn);
+  destroy_document(response_document);
+}
+
+/**
+ * @brief Handle a GET request
+ *
+ * @param request The request document
+ * @param conn The connection to respond on
+ * @param data Unused
+ */
+void handle_GET(document_t *request, connection_t *conn, void *data) {
+  (void)data;
+  send_file_response(request, conn, false);
+}
+
+/**
+ * @brief Handle a HEAD request
+ *
+ * @param request The request document
+ * @param conn The connection to respond on
+ * @param data Unused
+ */
+void handle_HEAD(document_t *request, connection_t *conn, void *data) {
+  (void)data;
+  send_file_response(request, conn, true);
+}
+
+/**
+ * @brief Builds the response for the file a GET or HEAD request names.
+ *
+ * This is the responder counterpart of handle_GET() and handle_HEAD(), for
+ * protocols that send responses as documents.
+ *
+ * @param request The request document
+ * @param data Unused
+ * @return The response document, or NULL if an error occurred.
+ */
+document_t *respond_file(document_t *request, void *data) {
+  (void)data;
+  header_item_t *accept_encoding =
+      get_header_item(request->header, "ACCEPT-ENCODING");
+  bool gzip =
+      accept_encoding && accepts_encoding(accept_encoding->value, "gzip");
+  return create_file_response(request->header->request_line->target, gzip,
+                              request->header->request_line->method == HEAD);
+}
+
+/**
+ * @brief Writes the CPU and NUMA node of every worker and its connections.
+ *
+ * A connection counts as local when its packets were received on the CPU its
+ * worker accepted it on.
+ */
+static void write_worker_stats(FILE *out) {
+  for (int i = 0; i < worker_count; i++) {
+    fprintf(out, "worker_cpu %d %d\n", i, atomic_load(&workers[i].cpu));
+    fprintf(out, "worker_node %d %d\n", i, atomic_load(&workers[i].node));
+    fprintf(out, "worker_connections %d %lu\n", i,
+            atomic_load(&workers[i].connections));
+    fprintf(out, "worker_local_connections %d %lu\n", i,
+            atomic_load(&workers[i].local_connections));
+  }
+}
+
+typedef void (*stats_writer_t)(FILE *out);
+
+static const stats_writer_t STATS_WRITERS[] = {
+    write_admission_stats, write_rate_limit_stats,  write_flight_stats,
+    write_io_stats,        write_cache_stats,       write_shared_cache_stats,
+    write_prewarm_stats,   write_fingerprint_stats, write_prefork_stats,
+    write_worker_stats,    write_route_stats,
+};
+
+#define STATS_WRITER_COUNT (sizeof(STATS_WRITERS) / sizeof(STATS_WRITERS[0]))
+
+/**
+ * @brief Sends the stats as a chunked body, one chunk per group of counters.
+ *
+ * Each group is formatted into the same buffer and sent before the next one
+ * is written, so the whole body is never held at once.
+ *
+ * @param response The response document, without a body.
+ * @param conn The connection to respond on
+ * @param out A memory stream writing to `output`.
+ * @param output The buffer of `out`.
+ * @param output_size The size of `output`, as of the last flush.
+ * @return 0 on success, or -1 on error.
+ */
+static int send_stats_chunks(document_t *response, connection_t *conn,
+                             FILE *out, char **output, size_t *output_size) {
+  int result = send_chunked_response(response, conn);
+  for (size_t i = 0; result == 0 && i < STATS_WRITER_COUNT; i++) {
+    fseeko(out, 0, SEEK_SET);
+    STATS_WRITERS[i](out);
+    if (fflush(out) != 0) {
+      return -1;
+    }
+    result = write_chunk(conn, (unsigned char *)*output, *output_size);
+  }
+  return result == 0 ? write_last_chunk(conn) : -1;
+}
+
+static document_t *create_stats_document(body_t *body) {
+  document_t *response_document = create_response(OK, body);
+  if (!response_document) {
+    destroy_body(body);
+    return NULL;
+  }
+  attach_header(response_document->header,
+                create_header_item("content-type", "text/plain"));
+  attach_header(response_document->header,
+                create_header_item("cache-control", "no-store"));
+  return response_document;
+}
+
+/**
+ * @brief Builds the stats response with the whole body and a
+ * `content-length`.
+ *
+ * HEAD requests get the same headers without the body.
+ *
+ * @param request The request document
+ * @param data Unused
+ * @return The response document, or NULL if an error occurred.
+ */
+document_t *respond_stats(document_t *request, void *data) {
+  (void)data;
+  char *output = NULL;
+  size_t output_size = 0;
+  FILE *out = open_memstream(&output, &output_size);
+  if (!out) {
+    return NULL;
+  }
+  for (size_t i = 0; i < STATS_WRITER_COUNT; i++) {
+    STATS_WRITERS[i](out);
+  }
+  fclose(out);
+  body_t *body = parse_body((unsigned char *)output, output_size);
+  free(output);
+  if (!body) {
+    return NULL;
+  }
+  document_t *response_document = create_stats_document(body);
+  if (response_document && request->header->request_line->method == HEAD) {
+    destroy_body(response_document->body);
+    response_document->body = NULL;
+  }
+  return response_document;
+}
+
+/**
+ * @brief Handle a request for the stats endpoint
+ *
+ * Answers with the admission, file load and cache counters, the placement of
+ * every worker and the number of requests dispatched to every route, one
+ * `name value` pair per line. In prefork mode, the shared cache and restart
+ * counters cover all worker processes and the others the one that answers.
+ * HTTP/1.1 clients get the body with chunked encoding as it is formatted;
+ * HTTP/1.0 clients and HEAD requests get the response of respond_stats().
+ *
+ * @param request The request document
+ * @param conn The connection to respond on
+ * @param data Unused
+ */
+void handle_stats(document_t *request, connection_t *conn, void *data) {
+  header_request_line_t *request_line = request->header->request_line;
+  bool chunked = request_line->method != HEAD &&
+                 strcmp(request_line->version, "HTTP/1.1") == 0;
+  if (!chunked) {
+    document_t *response_document = respond_stats(request, data);
+    if (response_document) {
+      send_document(response_document, conn);
       destroy_document(response_document);
-      return;
     }
-    attach_header(
-        response_document->header,
-        create_header_item("content-type", str_join("image/", file_type)));
-  } else if (file_type && strcmp(file_type, "html") == 0 ||
-             strcmp(file_type, "htm") == 0) {
-    attach_header(response_document->header,
-                  create_header_item("content-type", "text/html"));
-  } else if (file_type && strcmp(file_type, "css") == 0) {
-    attach_header(response_document->header,
-                  create_header_item("content-type", "text/css"));
-  } else if (file_type && strcmp(file_type, "js") == 0) {
-    attach_header(response_document->header,
-                  create_header_item("content-type", "application/javascript"));
-  }
-  size_t size = 0;
-  unsigned char *response = serialize_document(response_document, &size);
-  write_to_conn(connfd, response, size);
+    return;
+  }
+  char *output = NULL;
+  size_t output_size = 0;
+  FILE *out = open_memstream(&output, &output_size);
+  document_t *response_document = out ? create_stats_document(NULL) : NULL;
+  if (response_document && send_stats_chunks(response_document, conn, out,
+                                             &output, &output_size) < 0) {
+    conn->keep_alive = false;
+  }
+  if (out) {
+    fclose(out);
+  }
+  free(output);
   destroy_document(response_document);
 }
 
 /**
- * @brief Handles HTTP POST requests
- *
- * Handles HTTP POST requests by creating a new document and writing it to the
- * connection. The document contains the response body, which is generated based
- * on the target of the request. If the target is an image file, the content
- * type is set to `image/<file_type>`. If the target is an HTML or CSS file, the
- * content type is set to `text/html` and `text/css`, respectively. If the
- * target is a JavaScript file, the content type is set to
- * `application/javascript`.
- *
- * @param request The HTTP POST request document
- * @param connfd The connection file descriptor
+ * @brief Rejects a request without reading its body.
+ *
+ * Used for a `Content-Length` that is not a single length (`400 Bad
+ * Request`), for bodies declared larger than `max_body_size` (`413 Content Too
+ * Large`) and for transfer-encodings other than chunked (`501 Not
+ * Implemented`). The body is never read and the connection is closed, so no
+ * memory is committed to the upload.
+ *
+ * @param conn The connection to respond on
+ * @param code The response code to reject the request with
  */
-void handle_POST(document_t *request, int connfd) {
-  char *translated_target =
-      translate_target(request->header->request_line->target);
-  unsigned char *target = fetch_body(translated_target);
-  body_t *response_body = create_body(translated_target);
-  document_t *response_document =
-      create_response(response_body ? OK : NOT_FOUND, response_body);
-  char *file_type;
-  if (is_image_file(translated_target, &file_type)) {
-    attach_header(
-        response_document->header,
-        create_header_item("content-type", str_join("image/", file_type)));
-  } else if (strcmp(file_type, "html") == 0 || strcmp(file_type, "htm") == 0) {
-    attach_header(response_document->header,
-                  create_header_item("content-type", "text/html"));
-  } else if (strcmp(file_type, "css") == 0) {
-    attach_header(response_document->header,
-                  create_header_item("content-type", "text/css"));
-  } else if (strcmp(file_type, "js") == 0) {
-    attach_header(response_document->header,
-                  create_header_item("content-type", "application/javascript"));
-  }
-  size_t size = 0;
-  unsigned char *response = serialize_document(response_document, &size);
-  write_to_conn(connfd, response, size);
+void handle_rejected(connection_t *conn, RESPONSE_CODE_T code) {
+  document_t *response_document = create_response(code, NULL);
+  conn->keep_alive = false;
+  send_document(response_document, conn);
   destroy_document(response_document);
 }
 
+/**
+ * @brief Decides whether a connection may be reused after a request.
+ *
+ * HTTP/1.1 connections persist unless the client asks to close them, HTTP/1.0
+ * connections only if the client asks to keep them alive. A connection is also
+ * closed after `keepalive_max` requests, as advertised in the `keep-alive`
+ * header, and after requests whose client may still be waiting on `100
+ * Continue`, since it is unknown whether their body will follow. Nothing is
+ * kept open while the server drains.
+ *
+ * @param request The request document
+ * @param conn The connection the request arrived on
+ * @return True if the connection should be kept open after the response.
+ */
+static bool wants_keep_alive(document_t *request, connection_t *conn) {
+  if (conn->requests + 1 >= conn->settings->keepalive_max || is_draining()) {
+    return false;
+  }
+  body_stream_t *body_stream = request->body_stream;
+  if (body_stream && body_stream->expect_continue) {
+    return false;
+  }
+  header_item_t *connection = get_header_item(request->header, "CONNECTION");
+  if (strcmp(request->header->request_line->version, "HTTP/1.1") == 0) {
+    return !connection || strcasecmp(connection->value, "close") != 0;
+  }
+  return connection && strcasecmp(connection->value, "keep-alive") == 0;
+}
+
+/**
+ * @brief Handles a single request on a connection.
+ *
+ * Dispatches the request to the handler its route has for its method, then
+ * drains whatever part of the body the handler did not read, so the next
+ * request on the connection starts at the right byte. A `Content-Length` that
+ * is not a single length gets `400 Bad Request`, and a request carrying both
+ * a `Content-Length` and a `Transfer-Encoding` is answered and the connection
+ * closed, since an intermediary may have framed it differently. Every request
+ * after the first on a connection takes a token from the client's rate limit,
+ * the first having taken one when the connection was accepted. At most
+ * `max_inflight_requests` requests are dispatched at a time, and a request
+ * that waited longer than `max_queue_ms` milliseconds for its turn is answered
+ * with `503 Service Unavailable` instead.
+ *
+ * @param request The request document
+ * @param conn The connection the request arrived on
+ */
+static void handle_request(document_t *request, connection_t *conn) {
+  body_stream_t *body_stream = request->body_stream;
+  header_item_t *content_length =
+      get_header_item(request->header, "CONTENT-LENGTH");
+  header_item_t *transfer_encoding =
+      get_header_item(request->header, "TRANSFER-ENCODING");
+  size_t length = 0;
+  if (content_length && !transfer_encoding &&
+      !parse_content_length(content_length->value, &length)) {
+    handle_rejected(conn, BAD_REQUEST);
+    return;
+  }
+  if (body_stream && body_stream->size > conn->settings->max_body_size) {
+    handle_rejected(conn, CONTENT_TOO_LARGE);
+    return;
+  }
+  if (transfer_encoding && !(body_stream && body_stream->chunked)) {
+    handle_rejected(conn, NOT_IMPLEMENTED);
+    return;
+  }
+  if (conn->requests > 0 && !acquire_token(conn->peer)) {
+    send_too_many_requests(conn);
+    return;
+  }
+  if (!acquire_request_slot(&conn->received)) {
+    send_unavailable(conn);
+    return;
+  }
+  conn->keep_alive =
+      wants_keep_alive(request, conn) && !(content_length && transfer_encoding);
+  dispatch_request(request, conn);
+  if (conn->keep_alive && body_stream && drain_body_stream(body_stream) < 0) {
+    conn->keep_alive = false;
+  }
+  release_request_slot();
+}
+
+/**
+ * @brief Adds the routes served by the server itself.
+ *
+ * The site is mounted at `/` for GET and HEAD, and the stats endpoint at
+ * `stats_path` if one is set. Proxy routes are added by init_proxy().
+ *
+ * @return 0 on success, or -1 on error.
+ */
+static int init_routes() {
+  const settings_t *settings = get_settings();
+  if (add_route("/", GET, handle_GET, respond_file, NULL) < 0 ||
+      add_route("/", HEAD, handle_HEAD, respond_file, NULL) < 0) {
+    return -1;
+  }
+  if (settings->stats_path[0] != '\0' &&
+      (add_route(settings->stats_path, GET, handle_stats, respond_stats,
+                 NULL) < 0 ||
+       add_route(settings->stats_path, HEAD, handle_stats, respond_stats,
+                 NULL) < 0)) {
+    return -1;
+  }
+  return 0;
+}
+
 /**
  * @brief Handles a connection request from a client.
  *
  * This function accepts an incoming connection from a client and processes it
-accordingly. It reads the request document fro from the socket, determines the
-request method, and calls the appropriate handler function to handle the
-request. Once the re response has been sent back to the client, the function
-closes the socket and returns.
+accordingly. It reads request documents from the socket one after another,
+handles each of them, and keeps the connection open between requests for as
+long as both sides want it to persist. Once the connection is done, or a
+timeout on the timer wheel shuts it down, the function closes the socket and
+returns.
  *
- * @param arg A pointer to an integer representing the connection file
-descriptor.
+ * @param arg A pointer to the client: the connection file descriptor and the
+index of the worker that accepted it.
  * @return NULL
  */
 void *handle_conn(void *arg) {
-  int connfd = *(int *)arg;
-  free(arg);
+  client_t *client = arg;
+  int connfd = client->fd;
+  int worker = client->worker;
+  uint32_t peer = client->peer;
+  free(client);
   printf("client (id:%d) connected\n", connfd);
-  document_t *request_document = document_from_stream(connfd);
-  if (!request_document || !request_document->header ||
-      !request_document->header->request_line) {
-    destroy_document(request_document);
+  connection_t *conn = create_connection(connfd);
+  if (!conn) {
+    close(connfd);
+    release_connection();
     return NULL;
   }
-  switch (request_document->header->request_line->method) {
-  case GET:
-    handle_GET(request_document, connfd);
-    break;
-  case POST:
-    handle_POST(request_document, connfd);
-    break;
-  case OPTIONS:
-    handle_POST(request_document, connfd);
-    break;
-  case HEAD:
-    handle_POST(request_document, connfd);
-    break;
-  case PUT:
-    handle_POST(request_document, connfd);
-    break;
-  case DELETE:
-    handle_POST(request_document, connfd);
-    break;
-  case TRACE:
-    handle_POST(request_document, connfd);
-    break;
-  case CONNECT:
-    handle_POST(request_document, connfd);
-    break;
-  }
-  destroy_document(request_document);
-  close(connfd);
+  conn->worker = worker;
+  conn->peer = peer;
+  if (is_http2_preface(conn)) {
+    serve_http2(conn, NULL);
+  }
+  while (conn->keep_alive) {
+    document_t *request_document = document_from_stream(conn);
+    if (!request_document || !request_document->header ||
+        !request_document->header->request_line) {
+      destroy_document(request_document);
+      break;
+    }
+    if (wants_h2c_upgrade(request_document)) {
+      serve_http2(conn, request_document);
+      destroy_document(request_document);
+      break;
+    }
+    handle_request(request_document, conn);
+    destroy_document(request_document);
+    conn->requests++;
+  }
+  destroy_connection(conn);
+  release_connection();
   printf("client(id:%d) disconnected\n", connfd);
   return NULL;
 }
 
 /**
- * @brief Sets up a server socket and listens on a specific port
+ * @brief Runs an accept loop on a listening socket.
+ *
+ * Accepts connections in batches and handles each of them in a separate
+thread. Connections beyond `max_connections`, and connections from clients
+over their `rate_limit`, are turned away from the accept loop itself, without
+starting a thread for them.
+ *
+ * A worker with a CPU assigned pins itself to it first. Connection threads
+ * inherit the pinning, so a connection is served on the CPU that accepted it
+ * and its buffers are first touched, and therefore allocated, on that CPU's
+ * NUMA node.
+ *
+ * The loop returns once the server starts draining. The listening socket is
+ * left open, as it may have been handed over to a new server.
+ *
+ * @param arg A pointer to the worker: its index, listening socket and CPU.
+ * @return NULL
+ */
+static void *run_worker(void *arg) {
+  worker_t *worker = arg;
+  int sockfd = worker->sockfd;
+  if (worker->pinned_cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->pinned_cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0) {
+      fprintf(stderr, "worker %d: cpu %d: %s\n", worker->index,
+              worker->pinned_cpu, strerror(error));
+    }
+  }
+  int stopfd = get_drain_fd();
+  int fds[ACCEPT_BATCH];
+  struct sockaddr_in addrs[ACCEPT_BATCH];
+  while (1) {
+    int count = accept_connections(sockfd, stopfd, fds, addrs, ACCEPT_BATCH);
+    if (count < 0) {
+      break;
+    }
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if (count > 0 && getcpu(&cpu, &node) == 0) {
+      atomic_store(&worker->cpu, cpu);
+      atomic_store(&worker->node, node);
+    }
+    for (int i = 0; i < count; i++) {
+      int connfd = fds[i];
+      if (!admit_client(connfd, addrs[i].sin_addr.s_addr) ||
+          !admit_connection(connfd)) {
+        continue;
+      }
+      int incoming_cpu = -1;
+      socklen_t length = sizeof(incoming_cpu);
+      getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &length);
+      atomic_fetch_add(&worker->connections, 1);
+      if (incoming_cpu == (int)cpu) {
+        atomic_fetch_add(&worker->local_connections, 1);
+      }
+      char ipstr[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &addrs[i].sin_addr, ipstr, sizeof(ipstr));
+      printf("accepted connection from %s:%d\n", ipstr,
+             ntohs(addrs[i].sin_port));
+      pthread_t tid;
+      client_t *client = malloc(sizeof(client_t));
+      if (!client) {
+        close(connfd);
+        release_connection();
+        continue;
+      }
+      client->fd = connfd;
+      client->worker = worker->index;
+      client->peer = addrs[i].sin_addr.s_addr;
+      if (pthread_create(&tid, NULL, handle_conn, client) != 0) {
+        free(client);
+        close(connfd);
+        release_connection();
+        continue;
+      }
+      pthread_detach(tid);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Warms the cache with the paths handed over by an upgrade, if any,
+ * or as configured by the `prewarm` settings.
+ */
+static int warm_cache() {
+  char **keys = NULL;
+  size_t count = take_handoff_keys(&keys);
+  return prewarm_cache(keys, count);
+}
+
+/**
+ * @brief Sets up the server sockets and listens on the configured port
  *
- * This function creates a server socket and binds it to a specific port. It
-then enters a loop where it waits for incoming c connections and handles them in
-a separate thread.
+ * This function creates one listening socket per worker, all bound to the
+configured port with `SO_REUSEPORT` when there is more than one, so the kernel
+spreads incoming connections across the accept loops. With `cpu_affinity`, the
+workers are assigned the CPUs the process may run on in turn, and each
+listener is steered to its worker's CPU. With `processes`, the listeners are
+shared by that many forked worker processes, each running all the accept
+loops, and a supervising master that restarts any of them that dies. The
+calling thread runs the first accept loop itself. `SIGHUP` reloads the settings
+without touching open connections.
+
+`SIGUSR2` upgrades the server without closing the listening sockets: a new
+server is started from the same binary path, takes the sockets over and warms
+its cache with the paths that were hot in this one, while this one stops
+accepting and returns once its open connections are drained. `SIGQUIT` only
+drains.
+
+With `prewarm`, the cache is filled before the files are first requested,
+either in the background or, with `prewarm_wait`, before any connection is
+accepted. The paths in the cache are saved to `prewarm_file` after draining,
+to be warmed first on the next start.
  *
- * @param PORT The port number to listen on
  * @return EXIT_SUCCESS if the server was successfully set up, or EXIT_FAILURE
 if an error occurred
  */
 int server() {
+  const settings_t *settings = get_settings();
   printf("Starting server...\n");
-  printf("Listening to port %d\n", PORT);
-  int sockfd, connfd;
-  struct sockaddr_in addr;
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0) {
+  printf("Listening to port %d\n", settings->port);
+  signal(SIGPIPE, SIG_IGN);
+  if (init_admission() < 0 || init_rate_limits() < 0 || init_routes() < 0 ||
+      init_proxy() < 0 || init_bundle() < 0) {
     return EXIT_FAILURE;
   }
-  int opt = 1;
-  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons(PORT);
-  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+  printf("connections: nodelay %s, cork %s, buffer %zu\n",
+         settings->nodelay ? "on" : "off", settings->cork ? "on" : "off",
+         settings->connection_buffer_size);
+  int inherited[UPGRADE_MAX_LISTENERS];
+  int received = receive_listeners(inherited, UPGRADE_MAX_LISTENERS);
+  if (received < 0) {
     return EXIT_FAILURE;
   }
-  if (listen(sockfd, 10) < 0) {
+  worker_count = settings->workers > received ? settings->workers : received;
+  workers = calloc(worker_count, sizeof(worker_t));
+  if (!workers) {
     return EXIT_FAILURE;
   }
-  while (1) {
-    struct sockaddr_in conn_addr;
-    socklen_t addr_len = sizeof(conn_addr);
-    connfd = accept(sockfd, (struct sockaddr *)&addr, &addr_len);
-    if (connfd < 0) {
-      continue;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (settings->cpu_affinity &&
+      sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    perror("sched_getaffinity");
+  }
+  int cpu = -1;
+  for (int i = 0; i < worker_count; i++) {
+    workers[i].index = i;
+    workers[i].pinned_cpu = -1;
+    atomic_init(&workers[i].cpu, -1);
+    atomic_init(&workers[i].node, -1);
+    workers[i].sockfd =
+        received > 0 ? inherited[i % received]
+                     : create_listener(settings->port, &settings->listener);
+    if (workers[i].sockfd < 0) {
+      return EXIT_FAILURE;
+    }
+    if (CPU_COUNT(&allowed) > 0) {
+      do {
+        cpu = (cpu + 1) % CPU_SETSIZE;
+      } while (!CPU_ISSET(cpu, &allowed));
+      workers[i].pinned_cpu = cpu;
+      steer_listener(workers[i].sockfd, cpu);
+      printf("worker %d: cpu %d\n", i, cpu);
     }
-    char ipstr[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &conn_addr.sin_addr, ipstr, sizeof(ipstr));
-    printf("accepted connection from %s:%d\n", ipstr,
-           ntohs(conn_addr.sin_port));
+  }
+  if (received == 0) {
+    for (int i = 0; i < worker_count && i < UPGRADE_MAX_LISTENERS; i++) {
+      inherited[received++] = workers[i].sockfd;
+    }
+  }
+  set_upgrade_listeners(inherited, received);
+  confirm_upgrade();
+  if (settings->processes > 0 &&
+      init_shared_cache(settings->shared_cache_size) < 0) {
+    return EXIT_FAILURE;
+  }
+  if (settings->prewarm_wait && warm_cache() < 0) {
+    return EXIT_FAILURE;
+  }
+  if (settings->processes > 0 && run_prefork(settings->processes) < 0) {
+    return EXIT_FAILURE;
+  }
+  if (start_upgrader(settings->processes == 0) < 0 ||
+      start_settings_reloader() < 0 || start_timer_wheel() < 0 ||
+      start_io_pool() < 0) {
+    return EXIT_FAILURE;
+  }
+  if (settings->capture_file[0] != '\0') {
+    capture_open(settings->capture_file);
+  }
+  for (int i = 1; i < worker_count; i++) {
     pthread_t tid;
-    int *pconn = malloc(sizeof(int));
-    *pconn = connfd;
-    pthread_create(&tid, NULL, handle_conn, pconn);
+    if (pthread_create(&tid, NULL, run_worker, &workers[i]) != 0) {
+      perror("worker");
+      return EXIT_FAILURE;
+    }
     pthread_detach(tid);
   }
+  if (!settings->prewarm_wait && get_process_index() <= 0 &&
+      warm_cache() < 0) {
+    return EXIT_FAILURE;
+  }
+  run_worker(&workers[0]);
+  drain_connections();
+  capture_close();
+  if (get_process_index() <= 0) {
+    save_hot_paths();
+  }
   return EXIT_SUCCESS;
 }
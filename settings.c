@@ -0,0 +1,533 @@
+#include "settings.h"
+#include "config.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef enum SETTING_TYPE {
+  SETTING_INT,
+  SETTING_SIZE,
+  SETTING_BOOL,
+  SETTING_STRING
+} SETTING_TYPE_T;
+
+typedef struct setting {
+  const char *name;
+  SETTING_TYPE_T type;
+  size_t offset;
+  bool restart;
+} setting_t;
+
+static const setting_t SETTINGS_TABLE[] = {
+    {"port", SETTING_INT, offsetof(settings_t, port), true},
+    {"workers", SETTING_INT, offsetof(settings_t, workers), true},
+    {"processes", SETTING_INT, offsetof(settings_t, processes), true},
+    {"cpu_affinity", SETTING_BOOL, offsetof(settings_t, cpu_affinity), true},
+    {"backlog", SETTING_INT, offsetof(settings_t, listener.backlog), true},
+    {"defer_accept", SETTING_INT, offsetof(settings_t, listener.defer_accept),
+     true},
+    {"fastopen_queue", SETTING_INT,
+     offsetof(settings_t, listener.fastopen_queue), true},
+    {"sndbuf", SETTING_INT, offsetof(settings_t, listener.sndbuf), true},
+    {"rcvbuf", SETTING_INT, offsetof(settings_t, listener.rcvbuf), true},
+    {"nodelay", SETTING_BOOL, offsetof(settings_t, nodelay), false},
+    {"cork", SETTING_BOOL, offsetof(settings_t, cork), false},
+    {"early_hints", SETTING_BOOL, offsetof(settings_t, early_hints), false},
+    {"fingerprint", SETTING_BOOL, offsetof(settings_t, fingerprint), true},
+    {"connection_buffer_size", SETTING_SIZE,
+     offsetof(settings_t, connection_buffer_size), false},
+    {"max_header_size", SETTING_SIZE, offsetof(settings_t, max_header_size),
+     false},
+    {"max_body_size", SETTING_SIZE, offsetof(settings_t, max_body_size), false},
+    {"stream_threshold", SETTING_SIZE, offsetof(settings_t, stream_threshold),
+     false},
+    {"cache_size", SETTING_SIZE, offsetof(settings_t, cache_size), true},
+    {"shared_cache_size", SETTING_SIZE, offsetof(settings_t, shared_cache_size),
+     true},
+    {"prewarm", SETTING_BOOL, offsetof(settings_t, prewarm), true},
+    {"prewarm_wait", SETTING_BOOL, offsetof(settings_t, prewarm_wait), true},
+    {"prewarm_threads", SETTING_INT, offsetof(settings_t, prewarm_threads),
+     true},
+    {"io_threads", SETTING_INT, offsetof(settings_t, io_threads), true},
+    {"prewarm_file", SETTING_STRING, offsetof(settings_t, prewarm_file), false},
+    {"target_directory", SETTING_STRING,
+     offsetof(settings_t, target_directory), false},
+    {"default_index", SETTING_STRING, offsetof(settings_t, default_index),
+     false},
+    {"page_404", SETTING_STRING, offsetof(settings_t, page_404), false},
+    {"bundle_file", SETTING_STRING, offsetof(settings_t, bundle_file), false},
+    {"capture_file", SETTING_STRING, offsetof(settings_t, capture_file), true},
+    {"proxy_routes", SETTING_STRING, offsetof(settings_t, proxy_routes), true},
+    {"stats_path", SETTING_STRING, offsetof(settings_t, stats_path), true},
+    {"upstream_pool_size", SETTING_INT,
+     offsetof(settings_t, upstream_pool_size), true},
+    {"upstream_timeout", SETTING_INT, offsetof(settings_t, upstream_timeout),
+     false},
+    {"upstream_idle_timeout", SETTING_INT,
+     offsetof(settings_t, upstream_idle_timeout), false},
+    {"upstream_cooldown", SETTING_INT, offsetof(settings_t, upstream_cooldown),
+     false},
+    {"header_timeout", SETTING_INT, offsetof(settings_t, header_timeout),
+     false},
+    {"body_timeout", SETTING_INT, offsetof(settings_t, body_timeout), false},
+    {"write_timeout", SETTING_INT, offsetof(settings_t, write_timeout), false},
+    {"keepalive_timeout", SETTING_INT, offsetof(settings_t, keepalive_timeout),
+     false},
+    {"keepalive_max", SETTING_INT, offsetof(settings_t, keepalive_max), false},
+    {"drain_timeout", SETTING_INT, offsetof(settings_t, drain_timeout), false},
+    {"io_timeout", SETTING_INT, offsetof(settings_t, io_timeout), false},
+    {"max_connections", SETTING_INT, offsetof(settings_t, max_connections),
+     false},
+    {"hard_max_connections", SETTING_INT,
+     offsetof(settings_t, hard_max_connections), false},
+    {"max_inflight_requests", SETTING_INT,
+     offsetof(settings_t, max_inflight_requests), false},
+    {"max_queue_ms", SETTING_INT, offsetof(settings_t, max_queue_ms), false},
+    {"rate_limit", SETTING_INT, offsetof(settings_t, rate_limit), false},
+    {"rate_limit_burst", SETTING_INT, offsetof(settings_t, rate_limit_burst),
+     false},
+};
+
+#define SETTINGS_COUNT (sizeof(SETTINGS_TABLE) / sizeof(SETTINGS_TABLE[0]))
+
+static _Atomic(const settings_t *) current_settings = NULL;
+static int settings_argc = 0;
+static char **settings_argv = NULL;
+
+static void default_settings(settings_t *settings) {
+  settings->port = PORT;
+  settings->workers = WORKERS;
+  settings->processes = PROCESSES;
+  settings->cpu_affinity = CPU_AFFINITY;
+  settings->listener.backlog = LISTEN_BACKLOG;
+  settings->listener.defer_accept = SOCKET_DEFER_ACCEPT;
+  settings->listener.fastopen_queue = SOCKET_FASTOPEN_QUEUE;
+  settings->listener.sndbuf = SOCKET_SNDBUF;
+  settings->listener.rcvbuf = SOCKET_RCVBUF;
+  settings->listener.reuseport = false;
+  settings->nodelay = SOCKET_NODELAY;
+  settings->cork = SOCKET_CORK;
+  settings->early_hints = PRELOAD_HINTS;
+  settings->fingerprint = FINGERPRINT_ASSETS;
+  settings->connection_buffer_size = CONNECTION_BUFFER_SIZE;
+  settings->max_header_size = MAX_HEADER_SIZE;
+  settings->max_body_size = MAX_BODY_SIZE;
+  settings->stream_threshold = STREAM_THRESHOLD;
+  settings->cache_size = CACHE_SIZE;
+  settings->shared_cache_size = SHARED_CACHE_SIZE;
+  settings->prewarm = PREWARM;
+  settings->prewarm_wait = PREWARM_WAIT;
+  settings->prewarm_threads = PREWARM_THREADS;
+  settings->io_threads = IO_THREADS;
+  settings->target_directory = strdup(TARGET_DIRECTORY);
+  settings->default_index = strdup(DEFAULT_INDEX);
+  settings->page_404 = strdup(PAGE_404);
+  settings->bundle_file = strdup(BUNDLE_FILE);
+  settings->capture_file = strdup(CAPTURE_FILE);
+  settings->proxy_routes = strdup(PROXY_ROUTES);
+  settings->stats_path = strdup(STATS_PATH);
+  settings->prewarm_file = strdup(PREWARM_FILE);
+  settings->upstream_pool_size = UPSTREAM_POOL_SIZE;
+  settings->upstream_timeout = UPSTREAM_TIMEOUT;
+  settings->upstream_idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+  settings->upstream_cooldown = UPSTREAM_COOLDOWN;
+  settings->header_timeout = HEADER_TIMEOUT;
+  settings->body_timeout = BODY_TIMEOUT;
+  settings->write_timeout = WRITE_TIMEOUT;
+  settings->keepalive_timeout = KEEPALIVE_TIMEOUT;
+  settings->keepalive_max = KEEPALIVE_MAX;
+  settings->drain_timeout = DRAIN_TIMEOUT;
+  settings->io_timeout = IO_TIMEOUT;
+  settings->max_connections = MAX_CONNECTIONS;
+  settings->hard_max_connections = HARD_MAX_CONNECTIONS;
+  settings->max_inflight_requests = MAX_INFLIGHT_REQUESTS;
+  settings->max_queue_ms = MAX_QUEUE_MS;
+  settings->rate_limit = RATE_LIMIT;
+  settings->rate_limit_burst = RATE_LIMIT_BURST;
+}
+
+static size_t field_size(SETTING_TYPE_T type) {
+  switch (type) {
+  case SETTING_INT:
+    return sizeof(int);
+  case SETTING_SIZE:
+    return sizeof(size_t);
+  case SETTING_BOOL:
+    return sizeof(bool);
+  case SETTING_STRING:
+    return sizeof(char *);
+  }
+  return 0;
+}
+
+static void free_settings(settings_t *settings) {
+  for (size_t i = 0; i < SETTINGS_COUNT; i++) {
+    if (SETTINGS_TABLE[i].type == SETTING_STRING) {
+      free(*(char **)((char *)settings + SETTINGS_TABLE[i].offset));
+    }
+  }
+  free(settings);
+}
+
+static const setting_t *find_setting(const char *name, size_t length) {
+  for (size_t i = 0; i < SETTINGS_COUNT; i++) {
+    const char *candidate = SETTINGS_TABLE[i].name;
+    if (strlen(candidate) != length) {
+      continue;
+    }
+    size_t j = 0;
+    while (j < length && (name[j] == candidate[j] ||
+                          (name[j] == '-' && candidate[j] == '_'))) {
+      j++;
+    }
+    if (j == length) {
+      return &SETTINGS_TABLE[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Parses `value` into the field of `settings` described by `setting`.
+ *
+ * @return 0 on success, or -1 if the value is not valid for the setting.
+ */
+static int apply_setting(settings_t *settings, const setting_t *setting,
+                         const char *value) {
+  void *field = (char *)settings + setting->offset;
+  char *end = NULL;
+  errno = 0;
+  switch (setting->type) {
+  case SETTING_INT: {
+    long number = strtol(value, &end, 10);
+    if (errno || end == value || *end || number < 0 || number > INT_MAX) {
+      break;
+    }
+    *(int *)field = (int)number;
+    return 0;
+  }
+  case SETTING_SIZE: {
+    unsigned long long number = strtoull(value, &end, 10);
+    if (errno || end == value || *end || value[0] == '-') {
+      break;
+    }
+    *(size_t *)field = (size_t)number;
+    return 0;
+  }
+  case SETTING_BOOL:
+    if (strcasecmp(value, "on") == 0 || strcasecmp(value, "true") == 0 ||
+        strcasecmp(value, "yes") == 0 || strcmp(value, "1") == 0) {
+      *(bool *)field = true;
+      return 0;
+    }
+    if (strcasecmp(value, "off") == 0 || strcasecmp(value, "false") == 0 ||
+        strcasecmp(value, "no") == 0 || strcmp(value, "0") == 0) {
+      *(bool *)field = false;
+      return 0;
+    }
+    break;
+  case SETTING_STRING: {
+    char *copy = strdup(value);
+    if (!copy) {
+      break;
+    }
+    free(*(char **)field);
+    *(char **)field = copy;
+    return 0;
+  }
+  }
+  fprintf(stderr, "settings: invalid value '%s' for %s\n", value,
+          setting->name);
+  return -1;
+}
+
+static char *trim(char *s) {
+  while (*s == ' ' || *s == '\t') {
+    s++;
+  }
+  size_t length = strlen(s);
+  while (length > 0 && (s[length - 1] == ' ' || s[length - 1] == '\t' ||
+                        s[length - 1] == '\r' || s[length - 1] == '\n')) {
+    s[--length] = '\0';
+  }
+  return s;
+}
+
+/**
+ * @brief Reads a settings file into `settings`.
+ *
+ * Every line holds one `name = value` pair. Blank lines and lines starting
+ * with `#` are ignored.
+ *
+ * @return 0 on success, or -1 if the file cannot be read or has an error.
+ */
+static int read_settings_file(settings_t *settings, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "settings: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  char line[1024];
+  int line_number = 0;
+  int result = 0;
+  while (fgets(line, sizeof(line), file)) {
+    line_number++;
+    char *start = trim(line);
+    if (*start == '\0' || *start == '#') {
+      continue;
+    }
+    char *separator = strchr(start, '=');
+    if (!separator) {
+      fprintf(stderr, "settings: %s:%d: expected name = value\n", path,
+              line_number);
+      result = -1;
+      continue;
+    }
+    *separator = '\0';
+    char *name = trim(start);
+    const setting_t *setting = find_setting(name, strlen(name));
+    if (!setting) {
+      fprintf(stderr, "settings: %s:%d: unknown setting %s\n", path,
+              line_number, name);
+      result = -1;
+      continue;
+    }
+    if (apply_setting(settings, setting, trim(separator + 1)) < 0) {
+      result = -1;
+    }
+  }
+  fclose(file);
+  return result;
+}
+
+/**
+ * @brief Applies the command line to `settings`.
+ *
+ * `--config FILE` (or `-c FILE`) reads a settings file first; every other
+ * `--name=value` or `--name value` argument overrides the setting of that
+ * name, with dashes and underscores treated alike.
+ *
+ * @return 0 on success, or -1 on an unknown argument or invalid value.
+ */
+static int apply_arguments(settings_t *settings, int argc, char *argv[]) {
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) {
+      if (i + 1 >= argc || read_settings_file(settings, argv[++i]) < 0) {
+        return -1;
+      }
+    } else if (strncmp(argv[i], "--config=", 9) == 0) {
+      if (read_settings_file(settings, argv[i] + 9) < 0) {
+        return -1;
+      }
+    }
+  }
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) {
+      i++;
+      continue;
+    }
+    if (strncmp(argv[i], "--config=", 9) == 0) {
+      continue;
+    }
+    if (strncmp(argv[i], "--", 2) != 0) {
+      fprintf(stderr, "settings: unexpected argument %s\n", argv[i]);
+      return -1;
+    }
+    const char *name = argv[i] + 2;
+    const char *value = strchr(name, '=');
+    size_t length = value ? (size_t)(value - name) : strlen(name);
+    const setting_t *setting = find_setting(name, length);
+    if (!setting) {
+      fprintf(stderr, "settings: unknown setting %.*s\n", (int)length, name);
+      return -1;
+    }
+    if (value) {
+      value++;
+    } else if (i + 1 < argc) {
+      value = argv[++i];
+    } else {
+      fprintf(stderr, "settings: missing value for %s\n", setting->name);
+      return -1;
+    }
+    if (apply_setting(settings, setting, value) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int validate_settings(const settings_t *settings) {
+  const char *error = NULL;
+  if (settings->port < 1 || settings->port > 65535) {
+    error = "port must be between 1 and 65535";
+  } else if (settings->workers < 1) {
+    error = "workers must be at least 1";
+  } else if (settings->processes < 0) {
+    error = "processes must not be negative";
+  } else if (settings->prewarm_threads < 1) {
+    error = "prewarm_threads must be at least 1";
+  } else if (settings->io_threads < 0) {
+    error = "io_threads must not be negative";
+  } else if (settings->listener.backlog < 1) {
+    error = "backlog must be at least 1";
+  } else if (settings->connection_buffer_size < 1024) {
+    error = "connection_buffer_size must be at least 1024";
+  } else if (settings->max_connections < 1 ||
+             settings->hard_max_connections < settings->max_connections) {
+    error = "hard_max_connections must be at least max_connections";
+  } else if (settings->max_inflight_requests < 1) {
+    error = "max_inflight_requests must be at least 1";
+  } else if (settings->rate_limit < 0) {
+    error = "rate_limit must not be negative";
+  } else if (settings->rate_limit_burst < 1 ||
+             settings->rate_limit_burst > RATE_LIMIT_MAX_BURST) {
+    error = "rate_limit_burst must be between 1 and 1000000";
+  } else if (settings->header_timeout < 1 || settings->body_timeout < 1 ||
+             settings->write_timeout < 1 || settings->keepalive_timeout < 1 ||
+             settings->upstream_timeout < 1 || settings->drain_timeout < 1 ||
+             settings->io_timeout < 1) {
+    error = "timeouts must be at least 1 ms";
+  } else if (settings->target_directory[0] == '\0') {
+    error = "target_directory must not be empty";
+  }
+  if (error) {
+    fprintf(stderr, "settings: %s\n", error);
+    return -1;
+  }
+  return 0;
+}
+
+static settings_t *build_settings() {
+  settings_t *settings = calloc(1, sizeof(settings_t));
+  if (!settings) {
+    return NULL;
+  }
+  default_settings(settings);
+  if (apply_arguments(settings, settings_argc, settings_argv) < 0 ||
+      validate_settings(settings) < 0) {
+    free_settings(settings);
+    return NULL;
+  }
+  settings->listener.reuseport = settings->workers > 1;
+  return settings;
+}
+
+/**
+ * @brief Loads the settings from the defaults in config.h, an optional
+ * settings file and the command line.
+ *
+ * The arguments are kept, so a reload reads the same file and applies the same
+ * overrides again.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments, without the program name.
+ * @return 0 on success, or -1 if the settings are invalid.
+ */
+int load_settings(int argc, char *argv[]) {
+  settings_argc = argc;
+  settings_argv = argv;
+  settings_t *settings = build_settings();
+  if (!settings) {
+    return -1;
+  }
+  atomic_store(&current_settings, settings);
+  return 0;
+}
+
+/**
+ * @brief Returns the settings currently in effect.
+ *
+ * The settings are immutable. A reload publishes a new snapshot and never
+ * frees the old one, so a pointer returned here stays valid for the lifetime
+ * of the process and a connection can keep using the snapshot it started with.
+ *
+ * @return The current settings.
+ */
+const settings_t *get_settings() { return atomic_load(&current_settings); }
+
+/**
+ * @brief Builds a new settings snapshot and publishes it.
+ *
+ * Settings flagged `restart` are read once at startup, or describe state that
+ * cannot change while the server runs, so all of their old values are carried
+ * over and a change is reported as taking effect on restart. If the new
+ * settings are invalid, the old ones stay in effect.
+ */
+static void reload_settings() {
+  const settings_t *old = get_settings();
+  settings_t *settings = build_settings();
+  if (!settings) {
+    fprintf(stderr, "settings: reload failed, keeping current settings\n");
+    return;
+  }
+  for (size_t i = 0; i < SETTINGS_COUNT; i++) {
+    const setting_t *setting = &SETTINGS_TABLE[i];
+    if (!setting->restart) {
+      continue;
+    }
+    void *field = (char *)settings + setting->offset;
+    const void *old_field = (const char *)old + setting->offset;
+    bool changed;
+    if (setting->type == SETTING_STRING) {
+      changed = strcmp(*(char **)field, *(char *const *)old_field) != 0;
+    } else {
+      changed = memcmp(field, old_field, field_size(setting->type)) != 0;
+    }
+    if (changed) {
+      fprintf(stderr, "settings: %s takes effect on restart\n", setting->name);
+    }
+    if (setting->type == SETTING_STRING) {
+      char *copy = strdup(*(char *const *)old_field);
+      if (!copy) {
+        fprintf(stderr, "settings: reload failed, keeping current settings\n");
+        free_settings(settings);
+        return;
+      }
+      free(*(char **)field);
+      *(char **)field = copy;
+    } else {
+      memcpy(field, old_field, field_size(setting->type));
+    }
+  }
+  settings->listener.reuseport = old->listener.reuseport;
+  atomic_store(&current_settings, settings);
+  printf("settings: reloaded\n");
+}
+
+static void *run_settings_reloader(void *arg) {
+  sigset_t *signals = arg;
+  int received;
+  while (sigwait(signals, &received) == 0) {
+    reload_settings();
+  }
+  return NULL;
+}
+
+/**
+ * @brief Starts the thread that reloads the settings on `SIGHUP`.
+ *
+ * `SIGHUP` is blocked in the calling thread, and thus in every thread it
+ * starts afterwards, so it is only ever received by the reloader. Must be
+ * called before any other thread is started.
+ *
+ * @return 0 on success, or -1 if the thread could not be started.
+ */
+int start_settings_reloader() {
+  static sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, run_settings_reloader, &signals) != 0) {
+    perror("settings reloader");
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef SETTINGS
+#define SETTINGS
+#include "listener.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct settings {
+  int port;
+  int workers;
+  int processes;
+  bool cpu_affinity;
+  listener_options_t listener;
+  bool nodelay;
+  bool cork;
+  bool early_hints;
+  bool fingerprint;
+  size_t connection_buffer_size;
+  size_t max_header_size;
+  size_t max_body_size;
+  size_t stream_threshold;
+  size_t cache_size;
+  size_t shared_cache_size;
+  bool prewarm;
+  bool prewarm_wait;
+  int prewarm_threads;
+  int io_threads;
+  char *target_directory;
+  char *default_index;
+  char *page_404;
+  char *bundle_file;
+  char *capture_file;
+  char *proxy_routes;
+  char *stats_path;
+  char *prewarm_file;
+  int upstream_pool_size;
+  int upstream_timeout;
+  int upstream_idle_timeout;
+  int upstream_cooldown;
+  int header_timeout;
+  int body_timeout;
+  int write_timeout;
+  int keepalive_timeout;
+  int keepalive_max;
+  int drain_timeout;
+  int io_timeout;
+  int max_connections;
+  int hard_max_connections;
+  int max_inflight_requests;
+  int max_queue_ms;
+  int rate_limit;
+  int rate_limit_burst;
+} settings_t;
+
+int load_settings(int argc, char *argv[]);
+const settings_t *get_settings();
+int start_settings_reloader();
+#endif // !SETTINGS
@@ -0,0 +1,429 @@
+#include "shmcache.h"
+#include "config.h"
+#include "fingerprint.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+typedef struct shm_slot {
+  atomic_uint seq;
+  uint64_t hash;
+  int64_t mtime;
+  size_t size;
+  size_t source_size;
+  size_t offset;
+  size_t links_size;
+  size_t assets_size;
+  size_t asset_count;
+  uint64_t version;
+  char path[SHARED_CACHE_PATH_SIZE];
+} shm_slot_t;
+
+typedef struct shm_cache {
+  pthread_mutex_t lock;
+  size_t capacity;
+  size_t head;
+  atomic_ulong hits;
+  atomic_ulong misses;
+  atomic_ulong stores;
+  atomic_ulong evictions;
+  atomic_size_t bytes;
+  shm_slot_t slots[SHARED_CACHE_SLOTS];
+  unsigned char data[];
+} shm_cache_t;
+
+static shm_cache_t *cache = NULL;
+
+static uint64_t hash_path(const char *path) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+    hash = (hash ^ *p) * 0x100000001b3ULL;
+  }
+  return hash | 1;
+}
+
+/**
+ * @brief Creates the shared cache in memory that survives `fork`.
+ *
+ * Must be called before the worker processes are forked; they all map the
+ * same pages. The index and the data arena are only touched when used, so an
+ * unused cache costs address space but no memory.
+ *
+ * @param size The size of the data arena in bytes.
+ * @return 0 on success, or -1 on error.
+ */
+int init_shared_cache(size_t size) {
+  shm_cache_t *tmp = mmap(NULL, sizeof(shm_cache_t) + size,
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                          -1, 0);
+  if (tmp == MAP_FAILED) {
+    perror("shared cache");
+    return -1;
+  }
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&tmp->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  tmp->capacity = size;
+  cache = tmp;
+  printf("shared cache: %zu bytes, %d slots\n", size, SHARED_CACHE_SLOTS);
+  return 0;
+}
+
+static void begin_write(shm_slot_t *slot) {
+  atomic_fetch_add_explicit(&slot->seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void end_write(shm_slot_t *slot) {
+  atomic_fetch_add_explicit(&slot->seq, 1, memory_order_release);
+}
+
+/**
+ * @brief Returns the number of arena bytes a slot's entry spans: the file,
+ * then its preload links and the assets it was fingerprinted with.
+ */
+static size_t get_entry_size(const shm_slot_t *slot) {
+  return slot->size + slot->links_size + slot->assets_size;
+}
+
+static void clear_slot(shm_slot_t *slot) {
+  begin_write(slot);
+  atomic_fetch_sub(&cache->bytes, get_entry_size(slot));
+  slot->hash = 0;
+  slot->size = 0;
+  slot->links_size = 0;
+  slot->assets_size = 0;
+  end_write(slot);
+}
+
+/**
+ * @brief Returns the number of arena bytes the assets of a file take: each
+ * is its digest followed by its path and a terminating NUL.
+ */
+static size_t get_assets_size(const shared_file_t *file) {
+  size_t size = 0;
+  for (size_t i = 0; i < file->asset_count; i++) {
+    size += sizeof(uint64_t) + strlen(file->assets[i].path) + 1;
+  }
+  return size;
+}
+
+/**
+ * @brief Rebuilds the asset list of a file from its copy out of the arena.
+ *
+ * @return True on success, false if an allocation failed or the copy is
+ * malformed.
+ */
+static bool read_assets(shared_file_t *file, const unsigned char *data,
+                        size_t size, size_t count) {
+  if (count == 0) {
+    return true;
+  }
+  file->assets = calloc(count, sizeof(fingerprint_asset_t));
+  if (!file->assets) {
+    return false;
+  }
+  const unsigned char *end = data + size;
+  for (size_t i = 0; i < count; i++) {
+    const unsigned char *path = data + sizeof(uint64_t);
+    const unsigned char *nul =
+        end - data > (ptrdiff_t)sizeof(uint64_t)
+            ? memchr(path, '\0', end - path)
+            : NULL;
+    if (!nul) {
+      return false;
+    }
+    fingerprint_asset_t *asset = &file->assets[file->asset_count];
+    memcpy(&asset->digest, data, sizeof(uint64_t));
+    asset->path = strdup((const char *)path);
+    if (!asset->path) {
+      return false;
+    }
+    file->asset_count++;
+    data = nul + 1;
+  }
+  return true;
+}
+
+/**
+ * @brief Takes the writer lock, repairing the index if its holder died.
+ *
+ * The lock is robust, so a worker that crashes while storing a file does not
+ * block the others. The slot it was writing is left with an odd sequence
+ * number and is cleared here.
+ */
+static void lock_cache() {
+  if (pthread_mutex_lock(&cache->lock) != EOWNERDEAD) {
+    return;
+  }
+  for (int i = 0; i < SHARED_CACHE_SLOTS; i++) {
+    shm_slot_t *slot = &cache->slots[i];
+    if (atomic_load(&slot->seq) & 1) {
+      slot->hash = 0;
+      slot->size = 0;
+      slot->links_size = 0;
+      slot->assets_size = 0;
+      end_write(slot);
+    }
+  }
+  pthread_mutex_consistent(&cache->lock);
+}
+
+/**
+ * @brief Copies a slot's entry out of the arena into a new shared file.
+ *
+ * The entry is copied optimistically and the copy is thrown away if a writer
+ * changed the slot, or overwrote its data, in the meantime. Without
+ * `with_data` the file's contents are left out and only its size, links and
+ * assets are copied.
+ *
+ * @return A new reference to the copy, or NULL if the slot changed or an
+ * allocation failed, with `errno` set to EAGAIN in the first case.
+ */
+static shared_file_t *copy_entry(shm_slot_t *slot, unsigned int seq,
+                                 bool with_data) {
+  size_t offset = slot->offset;
+  size_t length = slot->size;
+  size_t links_size = slot->links_size;
+  size_t assets_size = slot->assets_size;
+  size_t asset_count = slot->asset_count;
+  size_t source_size = slot->source_size;
+  uint64_t version = slot->version;
+  if (offset > cache->capacity || length > cache->capacity - offset ||
+      links_size > cache->capacity - offset - length ||
+      assets_size > cache->capacity - offset - length - links_size) {
+    errno = EAGAIN;
+    return NULL;
+  }
+  shared_file_t *file = calloc(1, sizeof(shared_file_t));
+  unsigned char *data = with_data ? malloc(length + 1) : NULL;
+  char *links = links_size > 0 ? malloc(links_size) : NULL;
+  unsigned char *assets = assets_size > 0 ? malloc(assets_size) : NULL;
+  if (!file || (with_data && !data) || (links_size > 0 && !links) ||
+      (assets_size > 0 && !assets)) {
+    free(file);
+    free(data);
+    free(links);
+    free(assets);
+    errno = ENOMEM;
+    return NULL;
+  }
+  const unsigned char *entry = cache->data + offset;
+  if (data) {
+    memcpy(data, entry, length);
+    data[length] = '\0';
+  }
+  if (links) {
+    memcpy(links, entry + length, links_size);
+  }
+  if (assets) {
+    memcpy(assets, entry + length + links_size, assets_size);
+  }
+  atomic_thread_fence(memory_order_acquire);
+  bool changed =
+      atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq;
+  file->data = data;
+  file->size = length;
+  file->source_size = source_size;
+  file->links = links;
+  file->version = version;
+  atomic_init(&file->refs, 1);
+  bool valid = !changed && (!links || links[links_size - 1] == '\0') &&
+               read_assets(file, assets, assets_size, asset_count);
+  free(assets);
+  if (!valid) {
+    release_shared_file(file);
+    errno = changed ? EAGAIN : ENOMEM;
+    return NULL;
+  }
+  return file;
+}
+
+/**
+ * @brief Looks up a file in the cache shared by the worker processes.
+ *
+ * Readers take no lock. Every slot is guarded by a sequence lock and copied
+ * out with copy_entry(), since the arena may be reused once the lookup
+ * returns. The preload links and fingerprinted assets of a file are stored
+ * with it, so a hit never scans the document again. A rewritten HTML file is
+ * matched by the size of the file on disk, and is a miss if any asset it was
+ * fingerprinted with has changed since.
+ *
+ * @param path The path of the file.
+ * @param mtime The current modification time of the file.
+ * @param size The current size of the file.
+ * @param with_data Whether to copy the contents of the file, or only what
+ * describes it, for a response that carries no body.
+ * @return A new reference to a copy of the file, or NULL on a miss.
+ */
+shared_file_t *lookup_shared_cache(const char *path, time_t mtime,
+                                   size_t size, bool with_data) {
+  if (!cache) {
+    return NULL;
+  }
+  uint64_t hash = hash_path(path);
+  for (int probe = 0; probe < SHARED_CACHE_PROBES; probe++) {
+    shm_slot_t *slot = &cache->slots[(hash + probe) % SHARED_CACHE_SLOTS];
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq & 1 || slot->hash != hash || slot->mtime != mtime ||
+        slot->source_size != size ||
+        strncmp(slot->path, path, SHARED_CACHE_PATH_SIZE) != 0) {
+      continue;
+    }
+    shared_file_t *file = copy_entry(slot, seq, with_data);
+    if (!file && errno == EAGAIN) {
+      continue;
+    }
+    if (!file) {
+      break;
+    }
+    if (!check_fingerprints(file)) {
+      release_shared_file(file);
+      break;
+    }
+    atomic_fetch_add(&cache->hits, 1);
+    return file;
+  }
+  atomic_fetch_add(&cache->misses, 1);
+  return NULL;
+}
+
+/**
+ * @brief Stores a freshly loaded file in the cache shared by the workers.
+ *
+ * The data arena is filled like a ring: each file is written after the
+ * previous one, wrapping around at the end, and the entries whose data it
+ * overwrites are evicted first. The index is open addressed with
+ * SHARED_CACHE_PROBES slots per path. Files larger than a
+ * SHARED_CACHE_MAX_SHARE of the arena, or with paths longer than
+ * SHARED_CACHE_PATH_SIZE, are not stored.
+ *
+ * @param path The path of the file.
+ * @param mtime The modification time the file was loaded at.
+ * @param file The loaded file.
+ */
+void store_shared_cache(const char *path, time_t mtime,
+                        const shared_file_t *file) {
+  size_t links_size = file->links ? strlen(file->links) + 1 : 0;
+  size_t assets_size = get_assets_size(file);
+  size_t size = file->size + links_size + assets_size;
+  if (!cache || strlen(path) >= SHARED_CACHE_PATH_SIZE ||
+      size > cache->capacity / SHARED_CACHE_MAX_SHARE) {
+    return;
+  }
+  uint64_t hash = hash_path(path);
+  lock_cache();
+  shm_slot_t *target = NULL;
+  for (int probe = 0; probe < SHARED_CACHE_PROBES; probe++) {
+    shm_slot_t *slot = &cache->slots[(hash + probe) % SHARED_CACHE_SLOTS];
+    if (slot->hash == hash && strcmp(slot->path, path) == 0) {
+      target = slot;
+      break;
+    }
+    if (!target && slot->hash == 0) {
+      target = slot;
+    }
+  }
+  if (!target) {
+    target = &cache->slots[hash % SHARED_CACHE_SLOTS];
+    atomic_fetch_add(&cache->evictions, 1);
+  }
+  size_t length = (size + 63) & ~(size_t)63;
+  if (cache->head + length > cache->capacity) {
+    cache->head = 0;
+  }
+  size_t start = cache->head;
+  size_t end = start + length;
+  for (int i = 0; i < SHARED_CACHE_SLOTS; i++) {
+    shm_slot_t *slot = &cache->slots[i];
+    if (slot != target && slot->hash != 0 && slot->offset < end &&
+        start < slot->offset + get_entry_size(slot)) {
+      clear_slot(slot);
+      atomic_fetch_add(&cache->evictions, 1);
+    }
+  }
+  begin_write(target);
+  atomic_fetch_sub(&cache->bytes, get_entry_size(target));
+  unsigned char *entry = cache->data + start;
+  memcpy(entry, file->data, file->size);
+  entry += file->size;
+  if (file->links) {
+    memcpy(entry, file->links, links_size);
+    entry += links_size;
+  }
+  for (size_t i = 0; i < file->asset_count; i++) {
+    size_t path_size = strlen(file->assets[i].path) + 1;
+    memcpy(entry, &file->assets[i].digest, sizeof(uint64_t));
+    memcpy(entry + sizeof(uint64_t), file->assets[i].path, path_size);
+    entry += sizeof(uint64_t) + path_size;
+  }
+  target->hash = hash;
+  target->mtime = mtime;
+  target->size = file->size;
+  target->source_size = file->source_size;
+  target->offset = start;
+  target->links_size = links_size;
+  target->assets_size = assets_size;
+  target->asset_count = file->asset_count;
+  target->version = file->version;
+  strcpy(target->path, path);
+  end_write(target);
+  atomic_fetch_add(&cache->bytes, size);
+  atomic_fetch_add(&cache->stores, 1);
+  cache->head = end;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * @brief Lists the paths held by the shared cache.
+ *
+ * @param keys The array receiving copies of the paths, which the caller frees.
+ * @param max The capacity of `keys`.
+ * @return The number of paths listed.
+ */
+size_t list_shared_cache_keys(char **keys, size_t max) {
+  size_t count = 0;
+  for (int i = 0; cache && i < SHARED_CACHE_SLOTS && count < max; i++) {
+    shm_slot_t *slot = &cache->slots[i];
+    char path[SHARED_CACHE_PATH_SIZE];
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq & 1 || slot->hash == 0) {
+      continue;
+    }
+    memcpy(path, slot->path, sizeof(path));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+      continue;
+    }
+    path[sizeof(path) - 1] = '\0';
+    keys[count] = strdup(path);
+    count += keys[count] != NULL;
+  }
+  return count;
+}
+
+/**
+ * @brief Writes the shared cache counters, summed over all workers.
+ *
+ * @param out The stream to write to.
+ */
+void write_shared_cache_stats(FILE *out) {
+  if (!cache) {
+    return;
+  }
+  fprintf(out, "shared_cache_hits %lu\n", atomic_load(&cache->hits));
+  fprintf(out, "shared_cache_misses %lu\n", atomic_load(&cache->misses));
+  fprintf(out, "shared_cache_stores %lu\n", atomic_load(&cache->stores));
+  fprintf(out, "shared_cache_evictions %lu\n",
+          atomic_load(&cache->evictions));
+  fprintf(out, "shared_cache_bytes %zu\n", atomic_load(&cache->bytes));
+}
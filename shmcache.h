@@ -0,0 +1,15 @@
+#ifndef SHMCACHE
+#define SHMCACHE
+#include "flight.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+int init_shared_cache(size_t size);
+shared_file_t *lookup_shared_cache(const char *path, time_t mtime,
+                                   size_t size, bool with_data);
+void store_shared_cache(const char *path, time_t mtime,
+                        const shared_file_t *file);
+size_t list_shared_cache_keys(char **keys, size_t max);
+void write_shared_cache_stats(FILE *out);
+#endif // !SHMCACHE
@@ -0,0 +1,160 @@
+#include "slab.h"
+#include "config.h"
+#include "document.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+typedef struct slab_object {
+  struct slab_object *next;
+} slab_object_t;
+
+typedef struct slab_list {
+  slab_object_t *head;
+  int count;
+} slab_list_t;
+
+typedef struct slab_depot {
+  pthread_mutex_t lock;
+  slab_list_t free;
+} slab_depot_t;
+
+static const size_t SLAB_SIZES[SLAB_TYPES] = {
+    [SLAB_DOCUMENT] = sizeof(document_t),
+    [SLAB_HEADER] = sizeof(header_t),
+    [SLAB_HEADER_ITEM] = sizeof(header_item_t),
+    [SLAB_REQUEST_LINE] = sizeof(header_request_line_t),
+    [SLAB_RESPONSE_LINE] = sizeof(header_response_line_t),
+    [SLAB_BODY] = sizeof(body_t),
+};
+
+static slab_depot_t depots[SLAB_TYPES];
+static __thread slab_list_t thread_lists[SLAB_TYPES];
+static __thread bool thread_registered = false;
+static pthread_key_t thread_key;
+static pthread_once_t slabs_once = PTHREAD_ONCE_INIT;
+
+static void push_object(slab_list_t *list, slab_object_t *object) {
+  object->next = list->head;
+  list->head = object;
+  list->count++;
+}
+
+static slab_object_t *pop_object(slab_list_t *list) {
+  slab_object_t *object = list->head;
+  list->head = object->next;
+  list->count--;
+  return object;
+}
+
+/**
+ * @brief Moves up to `count` objects from one free list to another.
+ */
+static void move_objects(slab_list_t *from, slab_list_t *to, int count) {
+  while (count-- > 0 && from->head) {
+    push_object(to, pop_object(from));
+  }
+}
+
+/**
+ * @brief Gives a thread's free objects back to the depot when it exits.
+ *
+ * Connections run on their own threads, so the objects a connection has
+ * recycled are handed to the next connection through the depot instead of
+ * being lost with the thread.
+ */
+static void flush_thread_lists(void *arg) {
+  slab_list_t *lists = arg;
+  for (int type = 0; type < SLAB_TYPES; type++) {
+    pthread_mutex_lock(&depots[type].lock);
+    move_objects(&lists[type], &depots[type].free, lists[type].count);
+    pthread_mutex_unlock(&depots[type].lock);
+  }
+}
+
+static void init_slabs() {
+  for (int type = 0; type < SLAB_TYPES; type++) {
+    pthread_mutex_init(&depots[type].lock, NULL);
+  }
+  pthread_key_create(&thread_key, flush_thread_lists);
+}
+
+static void register_thread() {
+  pthread_once(&slabs_once, init_slabs);
+  pthread_setspecific(thread_key, thread_lists);
+  thread_registered = true;
+}
+
+/**
+ * @brief Carves a new slab of SLAB_BATCH objects into a free list.
+ *
+ * The objects are laid out next to each other, so the structs of one request
+ * share cache lines. Slabs are never returned to the system allocator; their
+ * objects stay on the free lists for reuse.
+ */
+static int carve_slab(SLAB_TYPE_T type, slab_list_t *list) {
+  size_t size = (SLAB_SIZES[type] + _Alignof(max_align_t) - 1) &
+                ~(_Alignof(max_align_t) - 1);
+  unsigned char *slab = malloc(size * SLAB_BATCH);
+  if (!slab) {
+    return -1;
+  }
+  for (int i = SLAB_BATCH - 1; i >= 0; i--) {
+    push_object(list, (slab_object_t *)(slab + i * size));
+  }
+  return 0;
+}
+
+/**
+ * @brief Allocates an object of the given type from the calling thread's slab
+ * cache.
+ *
+ * Objects come from a free list local to the thread, so the common case takes
+ * no lock and returns memory that was used by the previous request. When the
+ * list is empty, a batch of objects is taken from the shared depot, and a new
+ * slab is carved only when the depot is empty too. The object is not zeroed.
+ *
+ * @param type The type of the object.
+ * @return The object, or NULL if no memory is available.
+ */
+void *allocate_object(SLAB_TYPE_T type) {
+  if (!thread_registered) {
+    register_thread();
+  }
+  slab_list_t *list = &thread_lists[type];
+  if (!list->head) {
+    pthread_mutex_lock(&depots[type].lock);
+    move_objects(&depots[type].free, list, SLAB_BATCH);
+    pthread_mutex_unlock(&depots[type].lock);
+  }
+  if (!list->head && carve_slab(type, list) < 0) {
+    return NULL;
+  }
+  return pop_object(list);
+}
+
+/**
+ * @brief Returns an object to the calling thread's slab cache.
+ *
+ * A thread keeps at most SLAB_THREAD_OBJECTS free objects of each type and
+ * hands a batch to the depot when it has more.
+ *
+ * @param type The type the object was allocated as.
+ * @param object The object. If NULL, the function does nothing.
+ */
+void free_object(SLAB_TYPE_T type, void *object) {
+  if (!object) {
+    return;
+  }
+  if (!thread_registered) {
+    register_thread();
+  }
+  slab_list_t *list = &thread_lists[type];
+  push_object(list, object);
+  if (list->count > SLAB_THREAD_OBJECTS) {
+    pthread_mutex_lock(&depots[type].lock);
+    move_objects(list, &depots[type].free, SLAB_BATCH);
+    pthread_mutex_unlock(&depots[type].lock);
+  }
+}
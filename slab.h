@@ -0,0 +1,16 @@
+#ifndef SLAB
+#define SLAB
+
+typedef enum SLAB_TYPE {
+  SLAB_DOCUMENT,
+  SLAB_HEADER,
+  SLAB_HEADER_ITEM,
+  SLAB_REQUEST_LINE,
+  SLAB_RESPONSE_LINE,
+  SLAB_BODY,
+  SLAB_TYPES
+} SLAB_TYPE_T;
+
+void *allocate_object(SLAB_TYPE_T type);
+void free_object(SLAB_TYPE_T type, void *object);
+#endif // !SLAB
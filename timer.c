@@ -0,0 +1,192 @@
+#include "timer.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+static wheel_timer_t wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t wheel_tick = 0;
+static struct timespec wheel_start;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t current_tick() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t ms = (uint64_t)(now.tv_sec - wheel_start.tv_sec) * 1000 +
+                (now.tv_nsec - wheel_start.tv_nsec) / 1000000;
+  return ms / TIMER_TICK_MS;
+}
+
+static void unlink_timer(wheel_timer_t *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->armed = false;
+}
+
+/**
+ * @brief Puts a timer into the slot matching its expiry.
+ *
+ * Level 0 holds the timers due within the next WHEEL_SLOTS ticks, one slot
+ * per tick. Every further level covers WHEEL_SLOTS times the range of the one
+ * below it, and its timers are cascaded down when the lower level wraps around.
+ * Must be called with the wheel lock held.
+ */
+static void link_timer(wheel_timer_t *timer) {
+  if (timer->expires <= wheel_tick) {
+    timer->expires = wheel_tick + 1;
+  }
+  uint64_t delta = timer->expires - wheel_tick;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+  uint64_t max_delta = (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS);
+  if (delta >= max_delta) {
+    timer->expires = wheel_tick + max_delta - 1;
+  }
+  wheel_timer_t *head =
+      &wheel[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+  timer->armed = true;
+}
+
+static void cascade(int level) {
+  wheel_timer_t *head =
+      &wheel[level][(wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  while (head->next != head) {
+    wheel_timer_t *timer = head->next;
+    unlink_timer(timer);
+    link_timer(timer);
+  }
+}
+
+/**
+ * @brief Expires every timer that is due up to the current tick.
+ *
+ * An expired connection is shut down rather than closed: the worker thread
+ * blocked in `read`, `write` or `sendfile` on it wakes up with an error and
+ * releases the connection itself. The shutdown happens under the wheel lock,
+ * so a connection that cancels its timer before closing its socket can never
+ * have a reused descriptor shut down.
+ */
+static void advance_wheel(uint64_t target) {
+  while (wheel_tick < target) {
+    wheel_tick++;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+      if (wheel_tick & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) {
+        break;
+      }
+      cascade(level);
+    }
+    wheel_timer_t *head = &wheel[0][wheel_tick & WHEEL_MASK];
+    while (head->next != head) {
+      wheel_timer_t *timer = head->next;
+      unlink_timer(timer);
+      timer->expired = true;
+      shutdown(timer->fd, SHUT_RDWR);
+    }
+  }
+}
+
+static void *run_timer_wheel(void *arg) {
+  (void)arg;
+  struct timespec due = wheel_start;
+  while (1) {
+    due.tv_nsec += TIMER_TICK_MS * 1000000L;
+    while (due.tv_nsec >= 1000000000L) {
+      due.tv_nsec -= 1000000000L;
+      due.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+    pthread_mutex_lock(&wheel_lock);
+    advance_wheel(current_tick());
+    pthread_mutex_unlock(&wheel_lock);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Starts the timer wheel that reaps timed out connections.
+ *
+ * A single thread advances a hierarchical timing wheel every TIMER_TICK_MS
+ * milliseconds. Arming and cancelling a timer is a constant time list
+ * operation, so per-connection deadlines cost no system call of their own.
+ *
+ * @return 0 on success, or -1 if the wheel thread could not be started.
+ */
+int start_timer_wheel() {
+  clock_gettime(CLOCK_MONOTONIC, &wheel_start);
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+      wheel[level][slot].next = &wheel[level][slot];
+      wheel[level][slot].prev = &wheel[level][slot];
+    }
+  }
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, run_timer_wheel, NULL) != 0) {
+    perror("timer wheel");
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+/**
+ * @brief Initializes a timer for the connection on `fd`.
+ *
+ * @param timer The timer to initialize.
+ * @param fd The socket to shut down when the timer expires.
+ */
+void init_timer(wheel_timer_t *timer, int fd) {
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expires = 0;
+  timer->fd = fd;
+  timer->armed = false;
+  timer->expired = false;
+}
+
+/**
+ * @brief Arms a timer to expire `timeout_ms` milliseconds from now.
+ *
+ * A timer that is already armed is moved to its new deadline.
+ *
+ * @param timer The timer to arm.
+ * @param timeout_ms The timeout in milliseconds.
+ */
+void arm_timer(wheel_timer_t *timer, unsigned int timeout_ms) {
+  uint64_t ticks = (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  pthread_mutex_lock(&wheel_lock);
+  if (timer->armed) {
+    unlink_timer(timer);
+  }
+  timer->expires = current_tick() + ticks;
+  link_timer(timer);
+  pthread_mutex_unlock(&wheel_lock);
+}
+
+/**
+ * @brief Cancels a timer if it is armed.
+ *
+ * @param timer The timer to cancel.
+ */
+void cancel_timer(wheel_timer_t *timer) {
+  pthread_mutex_lock(&wheel_lock);
+  if (timer->armed) {
+    unlink_timer(timer);
+  }
+  pthread_mutex_unlock(&wheel_lock);
+}
@@ -0,0 +1,19 @@
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct wheel_timer {
+  struct wheel_timer *next;
+  struct wheel_timer *prev;
+  uint64_t expires;
+  int fd;
+  bool armed;
+  bool expired;
+} wheel_timer_t;
+
+int start_timer_wheel();
+void init_timer(wheel_timer_t *timer, int fd);
+void arm_timer(wheel_timer_t *timer, unsigned int timeout_ms);
+void cancel_timer(wheel_timer_t *timer);
+#endif // !TIMER_WHEEL
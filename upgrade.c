@@ -0,0 +1,432 @@
+#define _GNU_SOURCE
+#include "upgrade.h"
+#include "admission.h"
+#include "cache.h"
+#include "config.h"
+#include "settings.h"
+#include "shmcache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static char exe_path[PATH_MAX];
+static char **command_line = NULL;
+static int listeners[UPGRADE_MAX_LISTENERS];
+static int listener_count = 0;
+static int channel = -1;
+static char **handoff_keys = NULL;
+static size_t handoff_key_count = 0;
+static atomic_bool draining = false;
+static int drain_pipe[2] = {-1, -1};
+static pthread_once_t drain_pipe_once = PTHREAD_ONCE_INIT;
+
+static long elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/**
+ * @brief Remembers how the server was started, so an upgrade can start the
+ * new binary the same way.
+ *
+ * The binary is the file at the path this process was started from, so an
+ * upgrade renames the new binary over the old one and sends `SIGUSR2`.
+ *
+ * @param argv The arguments of `main`.
+ */
+void save_command_line(char **argv) {
+  ssize_t length = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+  exe_path[length > 0 ? length : 0] = '\0';
+  command_line = argv;
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return -1;
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/**
+ * @brief Sends the listening sockets and the hot paths to the new process.
+ *
+ * The sockets go first, as `SCM_RIGHTS` on a 4-byte count, followed by the
+ * paths, one per line, up to the end of the stream.
+ */
+static int send_handoff(int fd, char **keys, size_t count) {
+  uint32_t sockets = listener_count;
+  struct iovec iov = {.iov_base = &sockets, .iov_len = sizeof(sockets)};
+  char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen =
+                           CMSG_SPACE(sizeof(int) * listener_count)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * listener_count);
+  memcpy(CMSG_DATA(cmsg), listeners, sizeof(int) * listener_count);
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(sockets)) {
+    perror("upgrade: sendmsg");
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (write_all(fd, keys[i], strlen(keys[i])) < 0 ||
+        write_all(fd, "\n", 1) < 0) {
+      return -1;
+    }
+  }
+  shutdown(fd, SHUT_WR);
+  return 0;
+}
+
+static void read_handoff_keys(int fd) {
+  size_t capacity = 0;
+  size_t size = 0;
+  char *buffer = NULL;
+  while (1) {
+    if (size + 4096 > capacity) {
+      capacity = capacity ? capacity * 2 : 65536;
+      char *tmp = realloc(buffer, capacity);
+      if (!tmp) {
+        break;
+      }
+      buffer = tmp;
+    }
+    ssize_t received = read(fd, buffer + size, capacity - size - 1);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      break;
+    }
+    size += received;
+  }
+  if (!buffer) {
+    return;
+  }
+  buffer[size] = '\0';
+  handoff_keys = calloc(UPGRADE_SNAPSHOT_KEYS, sizeof(char *));
+  char *saveptr = NULL;
+  for (char *key = strtok_r(buffer, "\n", &saveptr);
+       key && handoff_keys && handoff_key_count < UPGRADE_SNAPSHOT_KEYS;
+       key = strtok_r(NULL, "\n", &saveptr)) {
+    handoff_keys[handoff_key_count] = strdup(key);
+    handoff_key_count += handoff_keys[handoff_key_count] != NULL;
+  }
+  free(buffer);
+}
+
+/**
+ * @brief Takes over the listening sockets of the process being upgraded.
+ *
+ * A process started by an upgrade finds the channel to the old process in
+ * UPGRADE_ENV and receives the old process's listening sockets and the paths
+ * that were hot in its cache. Connections waiting in the listen queues are
+ * not lost: the sockets stay open the whole time, only the process accepting
+ * from them changes.
+ *
+ * @param fds The array receiving the listening sockets.
+ * @param max The capacity of `fds`.
+ * @return The number of sockets received, 0 if this process was not started
+ * by an upgrade, or -1 on error.
+ */
+int receive_listeners(int *fds, int max) {
+  const char *value = getenv(UPGRADE_ENV);
+  if (!value) {
+    return 0;
+  }
+  int fd = atoi(value);
+  unsetenv(UPGRADE_ENV);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  uint32_t sockets = 0;
+  struct iovec iov = {.iov_base = &sockets, .iov_len = sizeof(sockets)};
+  char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen = sizeof(control)};
+  struct cmsghdr *cmsg = NULL;
+  if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(sockets) ||
+      !(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "upgrade: no listening sockets received\n");
+    close(fd);
+    return -1;
+  }
+  int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  count = count < max ? count : max;
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+  read_handoff_keys(fd);
+  channel = fd;
+  printf("upgrade: received %d listeners and %zu hot paths\n", count,
+         handoff_key_count);
+  return count;
+}
+
+/**
+ * @brief Sets the listening sockets handed over on the next upgrade.
+ *
+ * @param fds The listening sockets.
+ * @param count The number of sockets, at most UPGRADE_MAX_LISTENERS.
+ */
+void set_upgrade_listeners(const int *fds, int count) {
+  listener_count =
+      count < UPGRADE_MAX_LISTENERS ? count : UPGRADE_MAX_LISTENERS;
+  memcpy(listeners, fds, sizeof(int) * listener_count);
+}
+
+/**
+ * @brief Tells the process being upgraded to stop accepting and drain.
+ *
+ * Does nothing unless this process was started by an upgrade.
+ */
+void confirm_upgrade() {
+  if (channel < 0) {
+    return;
+  }
+  if (write_all(channel, "1", 1) < 0) {
+    perror("upgrade: confirm");
+  }
+  close(channel);
+  channel = -1;
+}
+
+/**
+ * @brief Takes the paths that were hot in the process being upgraded.
+ *
+ * @param keys Set to the array of paths, which the caller frees with its
+ * elements.
+ * @return The number of paths, 0 if this process was not started by an
+ * upgrade.
+ */
+size_t take_handoff_keys(char ***keys) {
+  size_t count = handoff_key_count;
+  *keys = handoff_keys;
+  handoff_keys = NULL;
+  handoff_key_count = 0;
+  return count;
+}
+
+/**
+ * @brief Copies the environment with `variable` in place of any UPGRADE_ENV.
+ *
+ * Built before `fork`, since the child of a threaded process may only make
+ * async-signal-safe calls before `execve`.
+ */
+static char **build_environment(char *variable) {
+  size_t count = 0;
+  while (environ[count]) {
+    count++;
+  }
+  char **env = calloc(count + 2, sizeof(char *));
+  if (!env) {
+    return NULL;
+  }
+  size_t length = strlen(UPGRADE_ENV);
+  size_t used = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (strncmp(environ[i], UPGRADE_ENV, length) != 0 ||
+        environ[i][length] != '=') {
+      env[used++] = environ[i];
+    }
+  }
+  env[used] = variable;
+  return env;
+}
+
+/**
+ * @brief Starts the new binary and hands the listening sockets over to it.
+ *
+ * The new process is started with the same arguments, gets the listening
+ * sockets and up to UPGRADE_SNAPSHOT_KEYS paths from the caches over a Unix
+ * socket, and confirms once it has taken over the sockets. If it does not
+ * confirm within UPGRADE_TIMEOUT milliseconds, it is stopped and this process
+ * carries on as before.
+ *
+ * @return 0 once the new process has taken over, or -1 on error.
+ */
+int upgrade_server() {
+  if (listener_count == 0 || exe_path[0] == '\0') {
+    return -1;
+  }
+  char **keys = calloc(UPGRADE_SNAPSHOT_KEYS, sizeof(char *));
+  size_t count = 0;
+  if (keys) {
+    count = list_cache_keys(keys, UPGRADE_SNAPSHOT_KEYS);
+    count += list_shared_cache_keys(keys + count,
+                                    UPGRADE_SNAPSHOT_KEYS - count);
+  }
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+    perror("upgrade: socketpair");
+    return -1;
+  }
+  struct timeval timeout = {.tv_sec = UPGRADE_TIMEOUT / 1000,
+                            .tv_usec = UPGRADE_TIMEOUT % 1000 * 1000};
+  setsockopt(pair[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  char variable[sizeof(UPGRADE_ENV) + 16];
+  snprintf(variable, sizeof(variable), "%s=%d", UPGRADE_ENV, pair[1]);
+  char **env = build_environment(variable);
+  sigset_t none;
+  sigemptyset(&none);
+  pid_t pid = env ? fork() : -1;
+  if (pid == 0) {
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    fcntl(pair[1], F_SETFD, 0);
+    execve(exe_path, command_line, env);
+    _exit(127);
+  }
+  close(pair[1]);
+  free(env);
+  int result = pid < 0 ? -1 : send_handoff(pair[0], keys, count);
+  for (size_t i = 0; i < count; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+  char confirmed = 0;
+  struct pollfd pfd = {.fd = pair[0], .events = POLLIN};
+  if (result == 0 && (poll(&pfd, 1, UPGRADE_TIMEOUT) <= 0 ||
+                      read(pair[0], &confirmed, 1) != 1)) {
+    result = -1;
+  }
+  close(pair[0]);
+  if (result < 0 && pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+  fprintf(stderr, "upgrade: %s (pid %d)\n",
+          result == 0 ? "handed over" : "failed", pid);
+  return result;
+}
+
+static void *run_upgrader(void *arg) {
+  bool standalone = *(bool *)arg;
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR2);
+  sigaddset(&signals, SIGQUIT);
+  int received;
+  while (sigwait(&signals, &received) == 0) {
+    if (received == SIGQUIT || (standalone && upgrade_server() == 0)) {
+      begin_drain();
+      break;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Starts the thread that upgrades or drains the server on a signal.
+ *
+ * `SIGUSR2` hands the listening sockets to a new process started from the
+ * same binary path and then drains this one; `SIGQUIT` only drains. The
+ * signals are blocked in the calling thread, and thus in every thread it
+ * starts afterwards, so this must be called before any other thread is
+ * started. The upgrader itself starts with every signal blocked, so it never
+ * receives a signal meant for another thread, such as `SIGHUP`.
+ *
+ * @param standalone False in a prefork worker process, where the master
+ * upgrades the server and the worker only drains.
+ * @return 0 on success, or -1 if the thread could not be started.
+ */
+int start_upgrader(bool standalone) {
+  static bool mode;
+  mode = standalone;
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR2);
+  sigaddset(&signals, SIGQUIT);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  sigset_t all;
+  sigset_t previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  pthread_t tid;
+  int error = pthread_create(&tid, NULL, run_upgrader, &mode);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  if (error != 0) {
+    fprintf(stderr, "upgrader: %s\n", strerror(error));
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+static void create_drain_pipe() {
+  if (pipe2(drain_pipe, O_CLOEXEC) < 0) {
+    perror("drain pipe");
+  }
+}
+
+/**
+ * @brief Returns a descriptor that becomes readable once draining starts.
+ */
+int get_drain_fd() {
+  pthread_once(&drain_pipe_once, create_drain_pipe);
+  return drain_pipe[0];
+}
+
+/**
+ * @brief Returns whether the server is draining.
+ *
+ * A draining server accepts no new connections and closes every connection
+ * after its current response.
+ */
+bool is_draining() { return atomic_load(&draining); }
+
+/**
+ * @brief Stops the accept loops and starts draining the open connections.
+ */
+void begin_drain() {
+  if (atomic_exchange(&draining, true)) {
+    return;
+  }
+  get_drain_fd();
+  if (write(drain_pipe[1], "1", 1) < 0) {
+    perror("drain");
+  }
+}
+
+/**
+ * @brief Waits for the open connections to close.
+ *
+ * Gives up after `drain_timeout` milliseconds, so a connection kept idle by
+ * its client cannot hold the old process forever.
+ */
+void drain_connections() {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int timeout = get_settings()->drain_timeout;
+  printf("draining %d connections\n", count_connections());
+  while (count_connections() > 0 && elapsed_ms(&start) < timeout) {
+    poll(NULL, 0, DRAIN_POLL_INTERVAL);
+  }
+  printf("drained in %ld ms, %d connections left\n", elapsed_ms(&start),
+         count_connections());
+}
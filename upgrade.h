@@ -0,0 +1,17 @@
+#ifndef UPGRADE
+#define UPGRADE
+#include <stdbool.h>
+#include <stddef.h>
+
+void save_command_line(char **argv);
+int receive_listeners(int *fds, int max);
+void set_upgrade_listeners(const int *fds, int count);
+void confirm_upgrade();
+size_t take_handoff_keys(char ***keys);
+int upgrade_server();
+int start_upgrader(bool standalone);
+int get_drain_fd();
+bool is_draining();
+void begin_drain();
+void drain_connections();
+#endif // !UPGRADE
@@ -1,6 +1,9 @@
+#include "utils.h"
 #include "config.h"
+#include "settings.h"
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,26 +46,36 @@ needed.
  * @return A string representing the current time in UTC/GMT format.
  */
 char *get_time() {
-  time_t now = time(NULL);
-  struct tm gmt;
-  gmtime_r(&now, &gmt); // convert to UTC / GMT
-  char *buf = calloc(100, 1);
+  char *buf = calloc(HTTP_DATE_SIZE, 1);
   if (!buf) {
-    return "";
+    return NULL;
   }
-  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
-
+  format_http_date(time(NULL), buf, HTTP_DATE_SIZE);
   return buf;
 }
 
+/**
+ * @brief Formats a time as an HTTP date, such as `Sun, 06 Nov 1994 08:49:37
+ * GMT`.
+ *
+ * @param time The time to format.
+ * @param buf The buffer to write to, at least HTTP_DATE_SIZE bytes.
+ * @param size The size of the buffer.
+ */
+void format_http_date(time_t time, char *buf, size_t size) {
+  struct tm gmt;
+  gmtime_r(&time, &gmt); // convert to UTC / GMT
+  strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+}
+
 /**
  * @brief Translates a target name into its corresponding path in the target
 directory.
  *
  * This function takes a target name as input and returns its corresponding path
 in the target directory.
- * The target directory is defined by the TARGET_DIRECTORY constant, which
-should be set to the desired directory where targe targets are stored.
+ * The target directory is the `target_directory` setting, which should be set
+to the desired directory where targe targets are stored.
  *
  * @param target Name of the target to be translated.
  * @return Translated path of the target in the target directory.
@@ -71,13 +84,14 @@ char *translate_target(const char *target) {
   if (!target) {
     return NULL;
   }
-  size_t len = strlen(TARGET_DIRECTORY) + strlen(target) + 1;
+  const char *directory = get_settings()->target_directory;
+  size_t len = strlen(directory) + strlen(target) + 1;
   char *translated_target = malloc(len);
   if (!translated_target) {
     return NULL;
   }
   translated_target[0] = '\0';
-  strncat(translated_target, TARGET_DIRECTORY, len - 1);
+  strncat(translated_target, directory, len - 1);
   strncat(translated_target, target, len - strlen(translated_target) - 1);
   return translated_target;
 }
@@ -105,42 +119,33 @@ static bool starts_with(const unsigned char *buf, const char *str, size_t n) {
 }
 
 static char *get_file_extension(char *path) {
-  char *out = calloc(BUFFER_SIZE, 1);
   for (int idx = strlen(path); idx > 0; idx--) {
     if (path[idx] == '.') {
       if (idx == strlen(path)) {
         break;
       }
-      out = strdup(path + idx + 1);
-      break;
+      return strdup(path + idx + 1);
     }
     if (path[idx] == '/') {
-      out = "html";
-      break;
+      return strdup("html");
     }
   }
-  return out;
+  return calloc(1, 1);
 }
 
 /**
- * @brief Determine if a file is an image file
+ * @brief Determine if the start of a file is that of an image file
  *
- * This function checks if a given file is an image file by looking at its magic
- * number. The function returns true if the file is an image file, false
- * otherwise.
+ * Looks at the magic number in the first bytes of the file. Sets `out` to the
+ * image type if it is an image, and to the extension of `path` otherwise.
  *
  * @param path The path to the file
+ * @param buf The first bytes of the file
+ * @param n The number of bytes in `buf`
  * @return True if the file is an image file, false otherwise
  */
-bool is_image_file(char *path, char **out) {
-  unsigned char buf[BUFFER_SIZE];
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    *out = get_file_extension(path);
-    return false;
-  }
-  size_t n = fread(buf, 1, sizeof(buf), f);
-  fclose(f);
+static bool is_image_data(char *path, const unsigned char *buf, size_t n,
+                          char **out) {
   if (n < 12) {
     *out = get_file_extension(path);
     return false;
@@ -176,9 +181,10 @@ bool is_image_file(char *path, char **out) {
     const char *brands[] = {"avif", "avis", "mif1", "heic",
                             "heix", "hevc", "hevx"};
     for (size_t i = 0; i < sizeof(brands) / sizeof(brands[0]); i++) {
-      if (starts_with(buf + 8, brands[i], 4))
+      if (starts_with(buf + 8, brands[i], 4)) {
         *out = strdup("avif");
-      return true;
+        return true;
+      }
     }
   }
   /* --- SVG: text-based, starts with '<svg' or '<?xml ... <svg' ---
@@ -194,20 +200,128 @@ bool is_image_file(char *path, char **out) {
       const char *needle2 = "<?xml";
 
       if (n - i >= strlen(needle1) &&
-          strncasecmp((char *)&buf[i], needle1, strlen(needle1)) == 0)
+          strncasecmp((char *)&buf[i], needle1, strlen(needle1)) == 0) {
         *out = strdup("svg");
-      return true;
-
+        return true;
+      }
       if (n - i >= strlen(needle2) &&
-          strncasecmp((char *)&buf[i], needle2, strlen(needle2)) == 0)
+          strncasecmp((char *)&buf[i], needle2, strlen(needle2)) == 0) {
         *out = strdup("svg");
-      return true;
+        return true;
+      }
     }
   }
   *out = get_file_extension(path);
   return false;
 }
 
+/**
+ * @brief Determine if a file is an image file
+ *
+ * This function checks if a given file is an image file by looking at its magic
+ * number. The function returns true if the file is an image file, false
+ * otherwise.
+ *
+ * @param path The path to the file
+ * @return True if the file is an image file, false otherwise
+ */
+bool is_image_file(char *path, char **out) {
+  unsigned char buf[BUFFER_SIZE];
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    *out = get_file_extension(path);
+    return false;
+  }
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  return is_image_data(path, buf, n, out);
+}
+
+static char *map_content_type(bool image, char *file_type) {
+  char *content_type = NULL;
+  if (image) {
+    content_type = file_type ? str_join("image/", file_type) : NULL;
+  } else if (file_type && (strcmp(file_type, "html") == 0 ||
+                           strcmp(file_type, "htm") == 0)) {
+    content_type = strdup("text/html");
+  } else if (file_type && strcmp(file_type, "css") == 0) {
+    content_type = strdup("text/css");
+  } else if (file_type && strcmp(file_type, "js") == 0) {
+    content_type = strdup("application/javascript");
+  }
+  free(file_type);
+  return content_type;
+}
+
+/**
+ * @brief Determines the content type of a file.
+ *
+ * Images are recognized by their magic bytes, HTML, CSS and JavaScript by
+ * their extension. Paths ending in a slash are treated as HTML.
+ *
+ * @param path The path to the file.
+ * @return The content type, newly allocated, or NULL if it is not known.
+ */
+char *get_content_type(char *path) {
+  char *file_type = NULL;
+  bool image = is_image_file(path, &file_type);
+  return map_content_type(image, file_type);
+}
+
+/**
+ * @brief Determines the content type of a file already in memory.
+ *
+ * Like get_content_type(), but the magic bytes are taken from the data, so
+ * the file is not opened again.
+ *
+ * @param path The path to the file.
+ * @param data The contents of the file.
+ * @param size The size of the contents.
+ * @return The content type, newly allocated, or NULL if it is not known.
+ */
+char *get_data_content_type(char *path, const unsigned char *data,
+                            size_t size) {
+  char *file_type = NULL;
+  size_t length = size < BUFFER_SIZE ? size : BUFFER_SIZE;
+  bool image = is_image_data(path, data, length, &file_type);
+  return map_content_type(image, file_type);
+}
+
+/**
+ * @brief Checks whether an `accept-encoding` value accepts a content coding.
+ *
+ * The coding is accepted if it, or `*`, is listed without a zero `q` weight.
+ *
+ * @param accept_encoding The header value, or NULL if there is none.
+ * @param coding The content coding, such as `gzip`.
+ * @return True if the coding is accepted.
+ */
+bool accepts_encoding(const char *accept_encoding, const char *coding) {
+  size_t length = strlen(coding);
+  const char *p = accept_encoding;
+  while (p && *p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') {
+      p++;
+    }
+    const char *end = p;
+    while (*end && *end != ',' && *end != ';' && *end != ' ' && *end != '\t') {
+      end++;
+    }
+    bool match = ((size_t)(end - p) == length &&
+                  strncasecmp(p, coding, length) == 0) ||
+                 (end - p == 1 && *p == '*');
+    while (*end && *end != ',') {
+      end++;
+    }
+    const char *q = match ? strstr(p, "q=") : NULL;
+    if (match && (!q || q > end || strtod(q + 2, NULL) > 0)) {
+      return true;
+    }
+    p = end;
+  }
+  return false;
+}
+
 /**
  * @brief Loads the contents of a file into memory.
  *
@@ -216,9 +330,10 @@ bool is_image_file(char *path, char **out) {
  * `free()` function.
  *
  * @param filepath The path to the file to load.
+ * @param size Set to the size of the file in bytes, if not NULL.
  * @return A pointer to the data in memory, or NULL if there was an error.
  */
-unsigned char *load_file(const char *filepath) {
+unsigned char *load_file(const char *filepath, size_t *size) {
   FILE *file = fopen(filepath, "rb");
   if (!file)
     return NULL;
@@ -241,9 +356,30 @@ unsigned char *load_file(const char *filepath) {
     return NULL;
   }
   content[file_size] = '\0';
+  if (size) {
+    *size = file_size;
+  }
   return content;
 }
 
+/**
+ * @brief Resolves a translated target to the file that should be served.
+ *
+ * Targets that end in a slash name a directory and resolve to its
+ * `default_index` file. The returned path is newly allocated and must be freed
+ * by the caller.
+ *
+ * @param target The translated target path.
+ * @return The path of the file to serve, or NULL if an error occurred.
+ */
+char *resolve_file_path(const char *target) {
+  size_t len = strlen(target);
+  if (len > 0 && target[len - 1] == '/') {
+    return str_join(target, get_settings()->default_index);
+  }
+  return strdup(target);
+}
+
 /**
  * @brief Convert a string to a size_t value.
  *
@@ -269,6 +405,33 @@ size_t str_to_size_t(const char *s) {
   return (size_t)val;
 }
 
+/**
+ * @brief Parses the value of a `Content-Length` header.
+ *
+ * Unlike str_to_size_t(), only a non-empty run of digits is accepted, so a
+ * value that is empty, signed, padded, a comma-separated list of merged
+ * duplicates or too large to represent is rejected instead of being read as
+ * some length that would desynchronize the framing of the connection.
+ *
+ * @param s The header value.
+ * @param length Receives the length.
+ * @return True if the value is a valid length.
+ */
+bool parse_content_length(const char *s, size_t *length) {
+  size_t value = 0;
+  if (*s == '\0') {
+    return false;
+  }
+  for (; *s; s++) {
+    if (*s < '0' || *s > '9' || value > (SIZE_MAX - (*s - '0')) / 10) {
+      return false;
+    }
+    value = value * 10 + (*s - '0');
+  }
+  *length = value;
+  return true;
+}
+
 /**
  * @brief Joins two strings together.
  *
@@ -2,13 +2,23 @@
 #define UTILS
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
+
+#define HTTP_DATE_SIZE 32
 
 char *size_t_to_string(size_t value);
 char *get_time();
-char *translate_target(char *target);
+void format_http_date(time_t time, char *buf, size_t size);
+char *translate_target(const char *target);
 size_t file_size(char *filepath);
 bool is_image_file(char *path, char **out);
-unsigned char *load_file(const char *filepath);
+char *get_content_type(char *path);
+char *get_data_content_type(char *path, const unsigned char *data,
+                            size_t size);
+bool accepts_encoding(const char *accept_encoding, const char *coding);
+unsigned char *load_file(const char *filepath, size_t *size);
 size_t str_to_size_t(const char *s);
+bool parse_content_length(const char *s, size_t *length);
 char *str_join(const char *a, const char *b);
+char *resolve_file_path(const char *target);
 #endif // !UTILS
@@ -0,0 +1,371 @@
+#include "warm.h"
+#include "body.h"
+#include "cache.h"
+#include "config.h"
+#include "settings.h"
+#include "shmcache.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+typedef struct prewarm {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char **directories;
+  size_t directory_count;
+  size_t directory_capacity;
+  int busy;
+  char **paths;
+  size_t path_count;
+  atomic_size_t next_path;
+  size_t budget;
+  int threads;
+  struct timespec start;
+} prewarm_t;
+
+static atomic_bool prewarm_started = false;
+static atomic_bool prewarm_done = false;
+static atomic_ulong prewarm_files = 0;
+static atomic_size_t prewarm_bytes = 0;
+static atomic_long prewarm_ms = 0;
+
+static long elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static bool within_budget(const prewarm_t *warm) {
+  return atomic_load(&prewarm_bytes) < warm->budget;
+}
+
+/**
+ * @brief Loads a file into the caches the way a request for it would.
+ *
+ * Files above `stream_threshold` are streamed rather than cached, so they are
+ * opened but not counted.
+ */
+static void warm_file(const char *path) {
+  body_t *body = create_body(path);
+  if (body && body->shared) {
+    atomic_fetch_add(&prewarm_files, 1);
+    atomic_fetch_add(&prewarm_bytes, body->size);
+  }
+  destroy_body(body);
+}
+
+static void push_directory(prewarm_t *warm, char *path) {
+  pthread_mutex_lock(&warm->lock);
+  if (warm->directory_count == warm->directory_capacity) {
+    size_t capacity =
+        warm->directory_capacity ? warm->directory_capacity * 2 : 16;
+    char **tmp = realloc(warm->directories, capacity * sizeof(char *));
+    if (!tmp) {
+      pthread_mutex_unlock(&warm->lock);
+      free(path);
+      return;
+    }
+    warm->directories = tmp;
+    warm->directory_capacity = capacity;
+  }
+  warm->directories[warm->directory_count++] = path;
+  pthread_cond_signal(&warm->cond);
+  pthread_mutex_unlock(&warm->lock);
+}
+
+/**
+ * @brief Takes the next directory to walk.
+ *
+ * Waits while other threads are still walking directories that may contain
+ * more. Returns NULL once the walk is complete or the budget is spent.
+ */
+static char *pop_directory(prewarm_t *warm) {
+  pthread_mutex_lock(&warm->lock);
+  while (warm->directory_count == 0 && warm->busy > 0) {
+    pthread_cond_wait(&warm->cond, &warm->lock);
+  }
+  char *path = NULL;
+  if (warm->directory_count > 0 && within_budget(warm)) {
+    path = warm->directories[--warm->directory_count];
+    warm->busy++;
+  }
+  pthread_mutex_unlock(&warm->lock);
+  return path;
+}
+
+static void finish_directory(prewarm_t *warm) {
+  pthread_mutex_lock(&warm->lock);
+  if (--warm->busy == 0) {
+    pthread_cond_broadcast(&warm->cond);
+  }
+  pthread_mutex_unlock(&warm->lock);
+}
+
+/**
+ * @brief Warms the files of one directory and queues its subdirectories.
+ *
+ * Paths are built as `translate_target` builds them, the directory followed by
+ * `/` and the name, so they match the cache keys of requests for the files.
+ */
+static void walk_directory(prewarm_t *warm, const char *directory) {
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) && within_budget(warm)) {
+    if (entry->d_name[0] == '.' &&
+        (entry->d_name[1] == '\0' ||
+         (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+      continue;
+    }
+    size_t size = strlen(directory) + strlen(entry->d_name) + 2;
+    char *path = malloc(size);
+    if (!path) {
+      break;
+    }
+    snprintf(path, size, "%s/%s", directory, entry->d_name);
+    unsigned char type = entry->d_type;
+    struct stat st;
+    if (type == DT_UNKNOWN && lstat(path, &st) == 0) {
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+    }
+    if (type == DT_DIR) {
+      push_directory(warm, path);
+      continue;
+    }
+    if (type == DT_REG) {
+      warm_file(path);
+    }
+    free(path);
+  }
+  closedir(dir);
+}
+
+static void *run_prewarm_thread(void *arg) {
+  prewarm_t *warm = arg;
+  if (warm->paths) {
+    size_t i;
+    while ((i = atomic_fetch_add(&warm->next_path, 1)) < warm->path_count &&
+           within_budget(warm)) {
+      warm_file(warm->paths[i]);
+    }
+    return NULL;
+  }
+  char *directory;
+  while ((directory = pop_directory(warm))) {
+    walk_directory(warm, directory);
+    free(directory);
+    finish_directory(warm);
+  }
+  return NULL;
+}
+
+static void destroy_prewarm(prewarm_t *warm) {
+  for (size_t i = 0; i < warm->directory_count; i++) {
+    free(warm->directories[i]);
+  }
+  free(warm->directories);
+  for (size_t i = 0; i < warm->path_count; i++) {
+    free(warm->paths[i]);
+  }
+  free(warm->paths);
+  pthread_mutex_destroy(&warm->lock);
+  pthread_cond_destroy(&warm->cond);
+  free(warm);
+}
+
+static void *run_prewarm(void *arg) {
+  prewarm_t *warm = arg;
+  pthread_t *tids = calloc(warm->threads, sizeof(pthread_t));
+  int started = 0;
+  while (tids && started < warm->threads &&
+         pthread_create(&tids[started], NULL, run_prewarm_thread, warm) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    run_prewarm_thread(warm);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  free(tids);
+  atomic_store(&prewarm_ms, elapsed_ms(&warm->start));
+  atomic_store(&prewarm_done, true);
+  printf("prewarm: %lu files, %zu bytes in %ld ms\n",
+         atomic_load(&prewarm_files), atomic_load(&prewarm_bytes),
+         atomic_load(&prewarm_ms));
+  destroy_prewarm(warm);
+  return NULL;
+}
+
+/**
+ * @brief Reads the hot paths saved by save_hot_paths().
+ *
+ * @return The number of paths read, or 0 if the file cannot be read.
+ */
+static size_t read_hot_paths(const char *file, char ***paths) {
+  FILE *in = fopen(file, "r");
+  if (!in) {
+    return 0;
+  }
+  char **list = calloc(PREWARM_MAX_PATHS, sizeof(char *));
+  size_t count = 0;
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  while (list && count < PREWARM_MAX_PATHS &&
+         (length = getline(&line, &capacity, in)) > 0) {
+    if (line[length - 1] == '\n') {
+      line[--length] = '\0';
+    }
+    if (length > 0) {
+      list[count] = strdup(line);
+      count += list[count] != NULL;
+    }
+  }
+  free(line);
+  fclose(in);
+  if (count == 0) {
+    free(list);
+    return 0;
+  }
+  *paths = list;
+  return count;
+}
+
+/**
+ * @brief Loads files into the caches before they are first requested.
+ *
+ * Without a warm cache, the first request for every file after a restart pays
+ * for loading it. The files warmed are the given paths or, with `prewarm`,
+ * the hot paths saved in `prewarm_file` by the previous run, or else every
+ * file under `target_directory`, walked by `prewarm_threads` threads at once.
+ * Warming stops once the files loaded fill the cache budget:
+ * `shared_cache_size` in prefork mode, `cache_size` otherwise. With
+ * `prewarm_wait` this returns once the cache is warm; otherwise the files are
+ * loaded in the background while requests are served.
+ *
+ * @param paths Cache keys to warm, or NULL. Freed by this function.
+ * @param count The number of paths.
+ * @return 0 on success, or -1 if warming could not be started.
+ */
+int prewarm_cache(char **paths, size_t count) {
+  const settings_t *settings = get_settings();
+  if (count == 0 && settings->prewarm && settings->prewarm_file[0]) {
+    count = read_hot_paths(settings->prewarm_file, &paths);
+  }
+  size_t budget = settings->processes > 0 ? settings->shared_cache_size
+                                          : settings->cache_size;
+  if ((count == 0 && !settings->prewarm) || budget == 0 ||
+      atomic_exchange(&prewarm_started, true)) {
+    for (size_t i = 0; i < count; i++) {
+      free(paths[i]);
+    }
+    free(paths);
+    return 0;
+  }
+  prewarm_t *warm = calloc(1, sizeof(prewarm_t));
+  char *root = count == 0 ? strdup(settings->target_directory) : NULL;
+  if (!warm || (count == 0 && !root)) {
+    free(warm);
+    free(root);
+    return -1;
+  }
+  pthread_mutex_init(&warm->lock, NULL);
+  pthread_cond_init(&warm->cond, NULL);
+  warm->paths = count > 0 ? paths : NULL;
+  warm->path_count = count;
+  atomic_init(&warm->next_path, 0);
+  warm->budget = budget;
+  warm->threads = settings->prewarm_threads;
+  clock_gettime(CLOCK_MONOTONIC, &warm->start);
+  if (root) {
+    push_directory(warm, root);
+  }
+  printf("prewarm: %s, %zu byte budget, %d threads%s\n",
+         count > 0 ? "hot paths" : settings->target_directory, budget,
+         warm->threads, settings->prewarm_wait ? ", waiting" : "");
+  if (settings->prewarm_wait) {
+    run_prewarm(warm);
+    return 0;
+  }
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, run_prewarm, warm) != 0) {
+    perror("prewarm");
+    destroy_prewarm(warm);
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+/**
+ * @brief Saves the paths in the caches to `prewarm_file` for the next run.
+ *
+ * The file is replaced atomically, so a run that stops while saving leaves
+ * the previous list in place.
+ *
+ * @return 0 on success or without a `prewarm_file`, or -1 on error.
+ */
+int save_hot_paths() {
+  const char *file = get_settings()->prewarm_file;
+  if (file[0] == '\0') {
+    return 0;
+  }
+  char **keys = calloc(PREWARM_MAX_PATHS, sizeof(char *));
+  if (!keys) {
+    return -1;
+  }
+  size_t count = list_cache_keys(keys, PREWARM_MAX_PATHS);
+  count += list_shared_cache_keys(keys + count, PREWARM_MAX_PATHS - count);
+  size_t length = strlen(file) + sizeof(".tmp");
+  char *tmp = malloc(length);
+  FILE *out = NULL;
+  if (tmp) {
+    snprintf(tmp, length, "%s.tmp", file);
+    out = fopen(tmp, "w");
+  }
+  int result = out ? 0 : -1;
+  for (size_t i = 0; i < count; i++) {
+    if (out && fprintf(out, "%s\n", keys[i]) < 0) {
+      result = -1;
+    }
+    free(keys[i]);
+  }
+  free(keys);
+  if (out && (fclose(out) != 0 || result < 0 || rename(tmp, file) < 0)) {
+    result = -1;
+  }
+  if (result < 0) {
+    perror("prewarm: save");
+  } else {
+    printf("prewarm: saved %zu hot paths to %s\n", count, file);
+  }
+  free(tmp);
+  return result;
+}
+
+/**
+ * @brief Writes how far warming got and how long it took.
+ *
+ * Nothing is written unless warming was started. `prewarm_ms` stays 0 until
+ * warming is done.
+ *
+ * @param out The stream to write to.
+ */
+void write_prewarm_stats(FILE *out) {
+  if (!atomic_load(&prewarm_started)) {
+    return;
+  }
+  fprintf(out, "prewarm_done %d\n", atomic_load(&prewarm_done));
+  fprintf(out, "prewarm_files %lu\n", atomic_load(&prewarm_files));
+  fprintf(out, "prewarm_bytes %zu\n", atomic_load(&prewarm_bytes));
+  fprintf(out, "prewarm_ms %ld\n", atomic_load(&prewarm_ms));
+}
@@ -0,0 +1,8 @@
+#ifndef WARM
+#define WARM
+#include <stdio.h>
+
+int prewarm_cache(char **paths, size_t count);
+int save_hot_paths();
+void write_prewarm_stats(FILE *out);
+#endif // !WARM